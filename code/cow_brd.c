@@ -598,7 +598,7 @@ static struct brd_device *brd_alloc(int i)
   } else {
     sprintf(disk->disk_name, "cow_ram%d", i);
   }
-  set_capacity(disk, disk_size * 2);
+  set_capacity(disk, (sector_t) disk_size * 2);
 
   return brd;
 
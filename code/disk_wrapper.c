@@ -5,9 +5,13 @@
 #include <linux/ioctl.h>
 #include <linux/kernel.h>
 #include <linux/ktime.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/ratelimit.h>
 #include <linux/slab.h>
 
 #include "disk_wrapper_ioctl.h"
@@ -19,12 +23,21 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("ashmrtn");
 MODULE_DESCRIPTION("test hello world");
 
+// If both paths are given, instance 0 wraps target_device_path when the module
+// is loaded. Other instances are added through the control node.
 static char* target_device_path = "";
 module_param(target_device_path, charp, 0);
 
 static char* flags_device_path = "";
 module_param(flags_device_path, charp, 0);
 
+// Print every logged bio to dmesg, rate-limited so it doesn't slow down the
+// workload being recorded. Can be changed at runtime through
+// /sys/module/disk_wrapper/parameters/verbose.
+static bool verbose = false;
+module_param(verbose, bool, 0644);
+static DEFINE_RATELIMIT_STATE(trace_ratelimit, 5 * HZ, 20);
+
 const char* const flag_names[] = {
   "write", "fail fast dev", "fail fast transport", "fail fast driver", "sync",
   "meta", "prio", "discard", "secure", "write same", "no idle", "fua", "flush",
@@ -40,9 +53,31 @@ struct disk_write_op {
   struct disk_write_op* next;
 };
 
+/*
+ * Bios are logged to a list for the CPU they are submitted on, so CPUs don't
+ * contend for one lock and each list stays sorted by time_ns. The lists are
+ * merged by time_ns as they are sent to user-land.
+ */
+struct hwm_cpu_log {
+  spinlock_t lock;
+  // Pointer to first write op in the chain.
+  struct disk_write_op* writes;
+  // Pointer to last write op in the chain.
+  struct disk_write_op* current_write;
+  // Pointer to the last log entry sent to user-land, NULL if none have been.
+  struct disk_write_op* last_read;
+  struct disk_wrapper_stats stats;
+};
+
 static int major_num = 0;
 
-static struct hwm_device {
+struct hwm_device {
+  int id;
+  // Number of times the device is open, which it can't be to be removed. Only
+  // raised with devices_lock held, so hwm_remove sees every open.
+  atomic_t open_count;
+  // Added through the control node and holding a reference to the module.
+  bool holds_module;
   unsigned long size;
   spinlock_t lock;
   u8* data;
@@ -66,45 +101,142 @@ static struct hwm_device {
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
-  // Pointer to first write op in the chain.
-  struct disk_write_op* writes;
-  // Pointer to last write op in the chain.
-  struct disk_write_op* current_write;
-  // Pointer to log entry to be sent to user-land next.
+  struct hwm_cpu_log __percpu* logs;
+  // Pointer to log entry to be sent to user-land next, and the log it is in.
+  // NULL if it hasn't been looked up yet.
   struct disk_write_op* current_log_write;
+  struct hwm_cpu_log* current_log_cpu;
+  // Protected by lock.
   unsigned long current_checkpoint;
-} Device;
+};
+
+// Instances by id, protected by devices_lock.
+static struct hwm_device* devices[HWM_MAX_DEVICES];
+static DEFINE_MUTEX(devices_lock);
 
 static bool should_log(struct bio *bio);
 
-static void free_logs(void) {
+static void append_write(struct hwm_cpu_log* log,
+    struct disk_write_op* write) {
+  if (log->current_write == NULL) {
+    log->writes = write;
+  } else {
+    log->current_write->next = write;
+  }
+  log->current_write = write;
+}
+
+static void free_logs(struct hwm_device* hwm) {
   // Remove all writes.
-  ktime_t curr_time;
-  struct disk_write_op *first = NULL;
-  struct disk_write_op* w = Device.writes;
+  int cpu;
+  struct hwm_cpu_log* log;
+  struct disk_write_op* w;
   struct disk_write_op* tmp_w;
-  while (w != NULL) {
-    kfree(w->data);
-    tmp_w = w;
-    w = w->next;
-    kfree(tmp_w);
+
+  for_each_possible_cpu(cpu) {
+    log = per_cpu_ptr(hwm->logs, cpu);
+    spin_lock(&log->lock);
+    w = log->writes;
+    log->writes = NULL;
+    log->current_write = NULL;
+    log->last_read = NULL;
+    memset(&log->stats, 0, sizeof(struct disk_wrapper_stats));
+    spin_unlock(&log->lock);
+
+    while (w != NULL) {
+      kfree(w->data);
+      tmp_w = w;
+      w = w->next;
+      kfree(tmp_w);
+    }
   }
+  hwm->current_log_write = NULL;
+  hwm->current_log_cpu = NULL;
+  spin_lock(&hwm->lock);
+  hwm->current_checkpoint = 0;
+  spin_unlock(&hwm->lock);
+}
 
-  // Create default first checkpoint at start of log.
-  first = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-  if (first == NULL) {
-    printk(KERN_WARNING "hwm: error allocating default checkpoint\n");
-    return;
+/*
+ * Add a checkpoint to the log. They are numbered in the order they are made,
+ * starting from 0 for the one made when the log is cleared.
+ */
+static int add_checkpoint(struct hwm_device* hwm) {
+  struct disk_write_op* checkpoint;
+  struct hwm_cpu_log* log;
+
+  // Create a new log entry that just says we got a checkpoint.
+  checkpoint = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
+  if (checkpoint == NULL) {
+    printk(KERN_WARNING "hwm: error allocating checkpoint\n");
+    return -ENOMEM;
   }
-  curr_time = ktime_get();
+  checkpoint->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
+  checkpoint->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
 
-  first->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
-  first->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
-  first->metadata.time_ns = ktime_to_ns(curr_time);
-  Device.current_write = first;
-  Device.writes = first;
-  Device.current_log_write = first;
-  Device.current_checkpoint = 1;
+  // Holding hwm->lock while the checkpoint is timed keeps checkpoint numbers
+  // in time order even if they are made on different CPUs.
+  spin_lock(&hwm->lock);
+  log = get_cpu_ptr(hwm->logs);
+  spin_lock(&log->lock);
+  checkpoint->metadata.write_sector = hwm->current_checkpoint;
+  ++hwm->current_checkpoint;
+  checkpoint->metadata.time_ns = ktime_to_ns(ktime_get());
+  append_write(log, checkpoint);
+  spin_unlock(&log->lock);
+  put_cpu_ptr(hwm->logs);
+  spin_unlock(&hwm->lock);
+  return 0;
+}
+
+/*
+ * Find the oldest log entry that hasn't been sent to user-land. Each CPU's list
+ * is sorted by time_ns, so it is the oldest of the first unsent entries in
+ * each list.
+ */
+static void find_log_entry(struct hwm_device* hwm) {
+  int cpu;
+  struct hwm_cpu_log* log;
+  struct disk_write_op* next;
+
+  hwm->current_log_write = NULL;
+  hwm->current_log_cpu = NULL;
+  for_each_possible_cpu(cpu) {
+    log = per_cpu_ptr(hwm->logs, cpu);
+    spin_lock(&log->lock);
+    next = (log->last_read == NULL) ? log->writes : log->last_read->next;
+    spin_unlock(&log->lock);
+    if (next != NULL && (hwm->current_log_write == NULL ||
+          next->metadata.time_ns <
+          hwm->current_log_write->metadata.time_ns)) {
+      hwm->current_log_write = next;
+      hwm->current_log_cpu = log;
+    }
+  }
+}
+
+static void get_stats(struct hwm_device* hwm,
+    struct disk_wrapper_stats* stats) {
+  int cpu;
+  int i;
+  struct hwm_cpu_log* log;
+
+  memset(stats, 0, sizeof(struct disk_wrapper_stats));
+  for_each_possible_cpu(cpu) {
+    log = per_cpu_ptr(hwm->logs, cpu);
+    spin_lock(&log->lock);
+    stats->bios += log->stats.bios;
+    stats->bytes += log->stats.bytes;
+    stats->alloc_failures += log->stats.alloc_failures;
+    stats->latency_total_ns += log->stats.latency_total_ns;
+    if (log->stats.latency_max_ns > stats->latency_max_ns) {
+      stats->latency_max_ns = log->stats.latency_max_ns;
+    }
+    for (i = 0; i < HWM_STATS_LATENCY_BUCKETS; ++i) {
+      stats->latency_buckets[i] += log->stats.latency_buckets[i];
+    }
+    spin_unlock(&log->lock);
+  }
 }
 
 // TODO(ashmrtn): Add mutexes/locking to make thread-safe.
@@ -112,21 +244,24 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
     unsigned int cmd, unsigned long arg) {
   int ret = 0;
   unsigned int not_copied;
-  struct disk_write_op *checkpoint = NULL;
-  ktime_t curr_time;
+  struct disk_wrapper_stats stats;
+  struct hwm_device* hwm = bdev->bd_disk->private_data;
 
   switch (cmd) {
     case HWM_LOG_OFF:
       printk(KERN_INFO "hwm: turning off data logging\n");
-      Device.log_on = false;
+      hwm->log_on = false;
       break;
     case HWM_LOG_ON:
       printk(KERN_INFO "hwm: turning on data logging\n");
-      Device.log_on = true;
+      hwm->log_on = true;
       break;
     case HWM_GET_LOG_META:
       //printk(KERN_INFO "hwm: getting next log entry meta\n");
-      if (Device.current_log_write == NULL) {
+      if (hwm->current_log_write == NULL) {
+        find_log_entry(hwm);
+      }
+      if (hwm->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no log entry here \n");
         return -ENODATA;
       }
@@ -142,65 +277,65 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
       while (not_copied != 0) {
         unsigned int offset = sizeof(struct disk_write_op_meta) - not_copied;
         not_copied = copy_to_user((void*) (arg + offset),
-            &(Device.current_log_write->metadata) + offset, not_copied);
+            &(hwm->current_log_write->metadata) + offset, not_copied);
       }
       break;
     case HWM_GET_LOG_DATA:
       //printk(KERN_INFO "hwm: getting log entry data\n");
-      if (Device.current_log_write == NULL) {
+      if (hwm->current_log_write == NULL) {
+        find_log_entry(hwm);
+      }
+      if (hwm->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no log entries to report data for\n");
         return -ENODATA;
       }
       if (!access_ok(VERIFY_WRITE, (void*) arg,
-            Device.current_log_write->metadata.size)) {
+            hwm->current_log_write->metadata.size)) {
         // TODO(ashmrtn): Find right error code.
         return -EFAULT;
       }
 
       // Copy written data.
-      not_copied = Device.current_log_write->metadata.size;
+      not_copied = hwm->current_log_write->metadata.size;
       while (not_copied != 0) {
         unsigned int offset =
-          Device.current_log_write->metadata.size - not_copied;
+          hwm->current_log_write->metadata.size - not_copied;
         not_copied = copy_to_user((void*) (arg + offset),
-            Device.current_log_write->data + offset, not_copied);
+            hwm->current_log_write->data + offset, not_copied);
       }
       break;
     case HWM_NEXT_ENT:
       //printk(KERN_INFO "hwm: moving to next log entry\n");
-      if (Device.current_log_write == NULL) {
+      if (hwm->current_log_write == NULL) {
+        find_log_entry(hwm);
+      }
+      if (hwm->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no next log entry\n");
         return -ENODATA;
       }
-      Device.current_log_write = Device.current_log_write->next;
+      spin_lock(&hwm->current_log_cpu->lock);
+      hwm->current_log_cpu->last_read = hwm->current_log_write;
+      spin_unlock(&hwm->current_log_cpu->lock);
+      // Looked up when it's asked for so entries logged in the meantime are
+      // picked up.
+      hwm->current_log_write = NULL;
       break;
     case HWM_CLR_LOG:
       printk(KERN_INFO "hwm: clearing data logs\n");
-      free_logs();
+      free_logs(hwm);
+      // Create default first checkpoint at start of log.
+      ret = add_checkpoint(hwm);
       break;
     case HWM_CHECKPOINT:
-      curr_time = ktime_get();
       printk(KERN_INFO "hwm: making checkpoint in log\n");
-      // Create a new log entry that just says we got a checkpoint.
-      checkpoint = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-      if (checkpoint == NULL) {
-        printk(KERN_WARNING "hwm: error allocating checkpoint\n");
-        return -ENOMEM;
+      ret = add_checkpoint(hwm);
+      break;
+    case HWM_GET_STATS:
+      get_stats(hwm, &stats);
+      if (copy_to_user((void*) arg, &stats,
+            sizeof(struct disk_wrapper_stats)) != 0) {
+        return -EFAULT;
       }
-
-      checkpoint->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
-      checkpoint->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
-      checkpoint->metadata.time_ns = ktime_to_ns(curr_time);
-      // Aquire lock and add the new entry to the end of the list.
-      spin_lock(&Device.lock);
-      // Assuming spinlock keeps the compiler from reordering this before the
-      // lock is aquired...
-      checkpoint->metadata.write_sector = Device.current_checkpoint;
-      ++Device.current_checkpoint;
-      Device.current_write->next = checkpoint;
-      Device.current_write = checkpoint;
-      // Drop lock and return success.
-      spin_unlock(&Device.lock);
       break;
     default:
       ret = -EINVAL;
@@ -208,9 +343,33 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
   return ret;
 }
 
+static int disk_wrapper_open(struct block_device* bdev, fmode_t mode) {
+  struct hwm_device* hwm;
+  int ret = 0;
+
+  // Look the instance up by id rather than through private_data, which is
+  // freed as soon as hwm_remove takes the instance out of devices.
+  mutex_lock(&devices_lock);
+  hwm = devices[bdev->bd_disk->first_minor];
+  if (hwm == NULL || hwm->gd != bdev->bd_disk) {
+    ret = -ENODEV;
+  } else {
+    atomic_inc(&hwm->open_count);
+  }
+  mutex_unlock(&devices_lock);
+  return ret;
+}
+
+static void disk_wrapper_release(struct gendisk* gd, fmode_t mode) {
+  struct hwm_device* hwm = gd->private_data;
+  atomic_dec(&hwm->open_count);
+}
+
 // The device operations structure.
 static const struct block_device_operations disk_wrapper_ops = {
   .owner   = THIS_MODULE,
+  .open    = disk_wrapper_open,
+  .release = disk_wrapper_release,
   .ioctl   = disk_wrapper_ioctl,
 };
 
@@ -459,7 +618,112 @@ static void print_rw_flags(unsigned long rw, unsigned long flags) {
 #endif
 }
 
-// TODO(ashmrtn): Currently not thread safe/reentrant. Make it so.
+static void record_capture(struct disk_wrapper_stats* stats,
+    const unsigned int size, const u64 latency_ns) {
+  unsigned int bucket = (latency_ns == 0) ? 0 : fls64(latency_ns) - 1;
+
+  ++stats->bios;
+  stats->bytes += size;
+  stats->latency_total_ns += latency_ns;
+  if (latency_ns > stats->latency_max_ns) {
+    stats->latency_max_ns = latency_ns;
+  }
+  bucket = min_t(unsigned int, bucket, HWM_STATS_LATENCY_BUCKETS - 1);
+  ++stats->latency_buckets[bucket];
+}
+
+/*
+ * Copy a bio into the log of the CPU it's submitted on. Everything is set up
+ * before the log is locked, and the entry is timed once it's locked so the log
+ * stays sorted by time_ns.
+ */
+static void log_bio(struct hwm_device* hwm, struct bio* bio) {
+  int copied_data;
+  struct disk_write_op *write;
+  struct hwm_cpu_log* log;
+  ktime_t start_time;
+  ktime_t curr_time;
+
+  start_time = ktime_get();
+  if (verbose && __ratelimit(&trace_ratelimit)) {
+    printk(KERN_INFO "hwm%d: bio rw of size %u headed for 0x%lx (sector "
+                     "0x%lx) has flags:\n", hwm->id, bio->BI_SIZE,
+           bio->BI_SECTOR * 512, bio->BI_SECTOR);
+    print_rw_flags(bio->BI_RW, bio->bi_flags);
+  }
+
+  // Log data to disk logs.
+  write = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
+  if (write == NULL) {
+    goto alloc_failed;
+  }
+
+  write->metadata.bi_flags = convert_flags(bio->bi_flags);
+  write->metadata.bi_rw = convert_flags(bio->BI_RW);
+  write->metadata.write_sector = bio->BI_SECTOR;
+  write->metadata.size = bio->BI_SIZE;
+
+  write->data = kmalloc(write->metadata.size, GFP_NOIO);
+  if (write->data == NULL) {
+    kfree(write);
+    goto alloc_failed;
+  }
+  copied_data = 0;
+
+  #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+  struct bio_vec *vec;
+  int iter;
+  bio_for_each_segment(vec, bio, iter) {
+    //printk(KERN_INFO "hwm: making new page for segment of data\n");
+
+    void *bio_data = kmap(vec->bv_page);
+    memcpy((void*) (write->data + copied_data), bio_data + vec->bv_offset,
+           vec->bv_len);
+    kunmap(bio_data);
+    copied_data += vec->bv_len;
+  }
+  #else
+  struct bio_vec vec;
+  struct bvec_iter iter;
+  bio_for_each_segment(vec, bio, iter) {
+    //printk(KERN_INFO "hwm: making new page for segment of data\n");
+
+    void *bio_data = kmap(vec.bv_page);
+    memcpy((void*) (write->data + copied_data), bio_data + vec.bv_offset,
+           vec.bv_len);
+    kunmap(bio_data);
+    copied_data += vec.bv_len;
+  }
+  #endif
+  // Sanity check which prints data copied to the log.
+  /*
+  printk(KERN_INFO "hwm: copied %u bytes of from %llx data:"
+      "\n~~~\n%s\n~~~\n",
+      write->metadata.size, write->metadata.write_sector * 512,
+      write->data);
+  */
+
+  // Protect playing around with our list of logged bios.
+  log = get_cpu_ptr(hwm->logs);
+  spin_lock(&log->lock);
+  curr_time = ktime_get();
+  write->metadata.time_ns = ktime_to_ns(curr_time);
+  append_write(log, write);
+  record_capture(&log->stats, write->metadata.size,
+      ktime_to_ns(ktime_sub(curr_time, start_time)));
+  spin_unlock(&log->lock);
+  put_cpu_ptr(hwm->logs);
+  return;
+
+ alloc_failed:
+  printk_ratelimited(KERN_WARNING "hwm: unable to get memory for logging\n");
+  log = get_cpu_ptr(hwm->logs);
+  spin_lock(&log->lock);
+  ++log->stats.alloc_failures;
+  spin_unlock(&log->lock);
+  put_cpu_ptr(hwm->logs);
+}
+
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
     (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -476,102 +740,15 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
-  int copied_data;
-  struct disk_write_op *write;
-  struct hwm_device* hwm;
-  ktime_t curr_time;
+  struct hwm_device* hwm = (struct hwm_device*) q->queuedata;
 
-  /*
-  printk(KERN_INFO "hwm: bio rw of size %u headed for 0x%lx (sector 0x%lx)"
-      " has flags:\n", bio->BI_SIZE, bio->BI_SECTOR * 512, bio->BI_SECTOR);
-  print_rw_flags(bio->BI_RW, bio->bi_flags);
-  */
   // Log information about writes, fua, and flush/flush_seq events in kernel
   // memory.
-  if (Device.log_on && should_log(bio)) {
-    curr_time = ktime_get();
-
-    printk(KERN_INFO "hwm: bio rw of size %u headed for 0x%lx (sector 0x%lx)"
-                     " has flags:\n", bio->BI_SIZE, bio->BI_SECTOR * 512,
-           bio->BI_SECTOR);
-    print_rw_flags(bio->BI_RW, bio->bi_flags);
-
-    // Log data to disk logs.
-    write = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-    if (write == NULL) {
-      printk(KERN_WARNING "hwm: unable to make new write node\n");
-      goto passthrough;
-    }
-
-    write->metadata.bi_flags = convert_flags(bio->bi_flags);
-    write->metadata.bi_rw = convert_flags(bio->BI_RW);
-    write->metadata.write_sector = bio->BI_SECTOR;
-    write->metadata.size = bio->BI_SIZE;
-    write->metadata.time_ns = ktime_to_ns(curr_time);
-
-    // Protect playing around with our list of logged bios.
-    spin_lock(&Device.lock);
-    if (Device.current_write == NULL) {
-      // With the default first checkpoint, this case should never happen.
-      printk(KERN_WARNING "hwm: found empty list of previous disk ops\n");
-
-      // This is the first write in the log.
-      Device.writes = write;
-      // Set the first write in the log so that it's picked up later.
-      Device.current_log_write = write;
-    } else {
-      // Some write(s) was/were already made so add this to the back of the
-      // chain and update pointers.
-      Device.current_write->next = write;
-    }
-    Device.current_write = write;
-    spin_unlock(&Device.lock);
-
-    write->data = kmalloc(write->metadata.size, GFP_NOIO);
-    if (write->data == NULL) {
-      printk(KERN_WARNING "hwm: unable to get memory for data logging\n");
-      kfree(write);
-      goto passthrough;
-    }
-    copied_data = 0;
-
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
-    struct bio_vec *vec;
-    int iter;
-    bio_for_each_segment(vec, bio, iter) {
-      //printk(KERN_INFO "hwm: making new page for segment of data\n");
-
-      void *bio_data = kmap(vec->bv_page);
-      memcpy((void*) (write->data + copied_data), bio_data + vec->bv_offset,
-             vec->bv_len);
-      kunmap(bio_data);
-      copied_data += vec->bv_len;
-    }
-    #else
-    struct bio_vec vec;
-    struct bvec_iter iter;
-    bio_for_each_segment(vec, bio, iter) {
-      //printk(KERN_INFO "hwm: making new page for segment of data\n");
-
-      void *bio_data = kmap(vec.bv_page);
-      memcpy((void*) (write->data + copied_data), bio_data + vec.bv_offset,
-             vec.bv_len);
-      kunmap(bio_data);
-      copied_data += vec.bv_len;
-    }
-    #endif
-    // Sanity check which prints data copied to the log.
-    /*
-    printk(KERN_INFO "hwm: copied %ld bytes of from %lx data:"
-        "\n~~~\n%s\n~~~\n",
-        write->metadata.size, write->metadata.write_sector * 512,
-        write->data);
-    */
+  if (hwm->log_on && should_log(bio)) {
+    log_bio(hwm, bio);
   }
 
- passthrough:
   // Pass request off to normal device driver.
-  hwm = (struct hwm_device*) q->queuedata;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
     (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -594,66 +771,78 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
 #endif
 }
 
-// TODO(ashmrtn): Fix error when wrong device path is passed.
-static int __init disk_wrapper_init(void) {
+static void put_target(struct hwm_device* hwm) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
+  LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
+   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
+  LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0) && \
+   LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
+   LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
+  blkdev_put(hwm->target_dev, FMODE_READ);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0) && \
+  LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
+  blkdev_put(hwm->target_bd, FMODE_READ);
+#else
+#error "Unsupported kernel version: CrashMonkey has not been tested with " \
+  "your kernel version."
+#endif
+}
+
+/*
+ * Add instance id at /dev/hwm<id>, wrapping the device at target_path with a
+ * request queue that has the flags of the device at flags_path. Must be called
+ * with devices_lock held.
+ */
+static int hwm_add(const int id, const char* target_path,
+    const char* flags_path) {
   unsigned int flush_flags;
   unsigned long queue_flags;
   struct block_device *flags_device, *target_device;
-  struct disk_write_op *first = NULL;
-  ktime_t curr_time;
-  printk(KERN_INFO "hwm: Hello World from module\n");
-  if (strlen(target_device_path) == 0) {
-    return -ENOTTY;
+  struct hwm_device* hwm;
+  int cpu;
+  int ret = -ENOMEM;
+
+  if (id < 0 || id >= HWM_MAX_DEVICES) {
+    return -EINVAL;
+  }
+  if (devices[id] != NULL) {
+    return -EEXIST;
+  }
+  printk(KERN_INFO "hwm: Wrapping device %s with flags device %s as hwm%d\n",
+      target_path, flags_path, id);
+  hwm = kzalloc(sizeof(struct hwm_device), GFP_KERNEL);
+  if (hwm == NULL) {
+    return -ENOMEM;
+  }
+  hwm->id = id;
+  atomic_set(&hwm->open_count, 0);
+  hwm->log_on = false;
+  spin_lock_init(&hwm->lock);
+  // Get memory for the per-CPU logs.
+  hwm->logs = alloc_percpu(struct hwm_cpu_log);
+  if (hwm->logs == NULL) {
+    printk(KERN_WARNING "hwm: error allocating logs\n");
+    goto out_free_device;
   }
-  if (strlen(flags_device_path) == 0) {
-    return -ENOTTY;
+  for_each_possible_cpu(cpu) {
+    spin_lock_init(&per_cpu_ptr(hwm->logs, cpu)->lock);
   }
-  printk(KERN_INFO "hwm: Wrapping device %s with flags device %s\n",
-      target_device_path, flags_device_path);
-  // Get memory for our starting disk epoch node.
-  Device.log_on = false;
   // Make a checkpoint marking the beginning of the log. This will be useful
   // when watches are implemented and people begin a watch at the very start of
   // a test.
-  Device.current_checkpoint = 1;
-  first = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-  if (first == NULL) {
+  if (add_checkpoint(hwm) != 0) {
     printk(KERN_WARNING "hwm: error allocating default checkpoint\n");
-    goto out;
-  }
-
-  curr_time = ktime_get();
-
-  first->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
-  first->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
-  first->metadata.time_ns = ktime_to_ns(curr_time);
-  Device.writes = first;
-  Device.current_write = first;
-  Device.current_log_write = Device.current_write;
-
-  // Get registered.
-  major_num = register_blkdev(major_num, "hwm");
-  if (major_num <= 0) {
-    printk(KERN_WARNING "hwm: unable to get major number\n");
-    goto out;
+    goto out_free_logs;
   }
 
-  target_device = blkdev_get_by_path(target_device_path,
-      FMODE_READ, &Device);
+  target_device = blkdev_get_by_path(target_path, FMODE_READ, hwm);
   if (!target_device || IS_ERR(target_device)) {
     printk(KERN_WARNING "hwm: unable to grab underlying device\n");
-    goto out;
+    ret = -ENODEV;
+    goto out_free_logs;
   }
-  if (!target_device->bd_queue) {
-    printk(KERN_WARNING "hwm: attempt to wrap device with no request queue\n");
-    goto out;
-  }
-  if (!target_device->bd_queue->make_request_fn) {
-    printk(KERN_WARNING "hwm: attempt to wrap device with no "
-        "make_request_fn\n");
-    goto out;
-  }
-
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
     (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -662,26 +851,38 @@ static int __init disk_wrapper_init(void) {
    LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
    LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
-  Device.target_dev = target_device;
+  hwm->target_dev = target_device;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
-  Device.target_dev = target_device->bd_disk;
-  Device.target_partno = target_device->bd_partno;
-  Device.target_bd = target_device;
+  hwm->target_dev = target_device->bd_disk;
+  hwm->target_partno = target_device->bd_partno;
+  hwm->target_bd = target_device;
 #else
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
+  ret = -EINVAL;
+  if (!target_device->bd_queue) {
+    printk(KERN_WARNING "hwm: attempt to wrap device with no request queue\n");
+    goto out_put_target;
+  }
+  if (!target_device->bd_queue->make_request_fn) {
+    printk(KERN_WARNING "hwm: attempt to wrap device with no "
+        "make_request_fn\n");
+    goto out_put_target;
+  }
 
   // Get the device we should copy flags from and copy those flags into locals.
-  flags_device = blkdev_get_by_path(flags_device_path, FMODE_READ, &Device);
+  flags_device = blkdev_get_by_path(flags_path, FMODE_READ, hwm);
   if (!flags_device || IS_ERR(flags_device)) {
     printk(KERN_WARNING "hwm: unable to grab device to clone flags\n");
-    goto out;
+    ret = -ENODEV;
+    goto out_put_target;
   }
   if (!flags_device->bd_queue) {
     printk(KERN_WARNING "hwm: attempt to wrap device with no request queue\n");
-    goto out;
+    blkdev_put(flags_device, FMODE_READ);
+    goto out_put_target;
   }
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
@@ -697,29 +898,27 @@ static int __init disk_wrapper_init(void) {
   queue_flags = flags_device->bd_queue->queue_flags;
   blkdev_put(flags_device, FMODE_READ);
 
-  // Set up our internal device.
-  spin_lock_init(&Device.lock);
-
   // And the gendisk structure.
-  Device.gd = alloc_disk(1);
-  if (!Device.gd) {
-    goto out;
+  ret = -ENOMEM;
+  hwm->gd = alloc_disk(1);
+  if (!hwm->gd) {
+    goto out_put_target;
   }
 
-  Device.gd->private_data = &Device;
-  Device.gd->major = major_num;
-  Device.gd->first_minor = target_device->bd_disk->first_minor;
-  Device.gd->minors = target_device->bd_disk->minors;
-  set_capacity(Device.gd, get_capacity(target_device->bd_disk));
-  strcpy(Device.gd->disk_name, "hwm");
-  Device.gd->fops = &disk_wrapper_ops;
+  hwm->gd->private_data = hwm;
+  hwm->gd->major = major_num;
+  hwm->gd->first_minor = id;
+  hwm->gd->minors = 1;
+  set_capacity(hwm->gd, get_capacity(target_device->bd_disk));
+  snprintf(hwm->gd->disk_name, DISK_NAME_LEN, "hwm%d", id);
+  hwm->gd->fops = &disk_wrapper_ops;
 
   // Get a request queue.
-  Device.gd->queue = blk_alloc_queue(GFP_KERNEL);
-  if (Device.gd->queue == NULL) {
-    goto out;
+  hwm->gd->queue = blk_alloc_queue(GFP_KERNEL);
+  if (hwm->gd->queue == NULL) {
+    goto out_put_disk;
   }
-  blk_queue_make_request(Device.gd->queue, disk_wrapper_bio);
+  blk_queue_make_request(hwm->gd->queue, disk_wrapper_bio);
   // Make this queue have the same flags as the queue we're feeding into.
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
@@ -729,12 +928,12 @@ static int __init disk_wrapper_init(void) {
    LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
     (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
    LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)) 
-  Device.gd->queue->flush_flags = flush_flags;
+  hwm->gd->queue->flush_flags = flush_flags;
 #endif
-  Device.gd->queue->queue_flags = queue_flags;
-  Device.gd->queue->queuedata = &Device;
+  hwm->gd->queue->queue_flags = queue_flags;
+  hwm->gd->queue->queuedata = hwm;
   printk(KERN_INFO "hwm: working with queue with:\n\tflags 0x%lx\n",
-      Device.gd->queue->queue_flags);
+      hwm->gd->queue->queue_flags);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -744,40 +943,170 @@ static int __init disk_wrapper_init(void) {
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
    LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
   printk(KERN_INFO "hwm: working with queue with:\n\tflush flags 0x%lx\n",
-      Device.gd->queue->flush_flags);
+      hwm->gd->queue->flush_flags);
 #endif
 
-  add_disk(Device.gd);
+  devices[id] = hwm;
+  add_disk(hwm->gd);
+
+  printk(KERN_NOTICE "hwm: hwm%d initialized\n", id);
+  return 0;
+
+  out_put_disk:
+    put_disk(hwm->gd);
+  out_put_target:
+    put_target(hwm);
+  out_free_logs:
+    free_logs(hwm);
+    free_percpu(hwm->logs);
+  out_free_device:
+    kfree(hwm);
+    return ret;
+}
+
+/*
+ * Remove an instance. It can't be open, since the file system on it may still
+ * be mounted. Must be called with devices_lock held.
+ */
+static int hwm_remove(struct hwm_device* hwm) {
+  if (atomic_read(&hwm->open_count) > 0) {
+    return -EBUSY;
+  }
+  devices[hwm->id] = NULL;
+  del_gendisk(hwm->gd);
+  blk_cleanup_queue(hwm->gd->queue);
+  put_disk(hwm->gd);
+  put_target(hwm);
+  // No more bios can be logged once the queue is gone.
+  free_logs(hwm);
+  free_percpu(hwm->logs);
+  printk(KERN_INFO "hwm: removed hwm%d\n", hwm->id);
+  kfree(hwm);
+  return 0;
+}
+
+static long hwm_ctl_ioctl(struct file* file, unsigned int cmd,
+    unsigned long arg) {
+  int ret = 0;
+  int id;
+  bool holds_module;
+  struct disk_wrapper_add add;
+
+  mutex_lock(&devices_lock);
+  switch (cmd) {
+    case HWM_CTL_ADD:
+      if (copy_from_user(&add, (void*) arg, sizeof(add)) != 0) {
+        ret = -EFAULT;
+        break;
+      }
+      add.target_device_path[HWM_PATH_LEN - 1] = '\0';
+      add.flags_device_path[HWM_PATH_LEN - 1] = '\0';
+      if (add.id < 0) {
+        // Pick the first free instance.
+        for (id = 0; id < HWM_MAX_DEVICES && devices[id] != NULL; ++id) {
+        }
+        if (id == HWM_MAX_DEVICES) {
+          ret = -ENOSPC;
+          break;
+        }
+        add.id = id;
+      }
+      ret = hwm_add(add.id, add.target_device_path, add.flags_device_path);
+      if (ret != 0) {
+        break;
+      }
+      // Instances hold the module so it isn't removed out from under them.
+      __module_get(THIS_MODULE);
+      devices[add.id]->holds_module = true;
+      if (copy_to_user(&((struct disk_wrapper_add*) arg)->id, &add.id,
+            sizeof(add.id)) != 0) {
+        ret = -EFAULT;
+        // The caller doesn't know which instance it got, so take it back out.
+        // If something already has it open, it is left for HWM_CTL_REMOVE.
+        if (hwm_remove(devices[add.id]) == 0) {
+          module_put(THIS_MODULE);
+        }
+      }
+      break;
+    case HWM_CTL_REMOVE:
+      id = (int) arg;
+      if (id < 0 || id >= HWM_MAX_DEVICES || devices[id] == NULL) {
+        ret = -ENODEV;
+        break;
+      }
+      holds_module = devices[id]->holds_module;
+      ret = hwm_remove(devices[id]);
+      if (ret == 0 && holds_module) {
+        module_put(THIS_MODULE);
+      }
+      break;
+    default:
+      ret = -EINVAL;
+  }
+  mutex_unlock(&devices_lock);
+  return ret;
+}
+
+static const struct file_operations hwm_ctl_fops = {
+  .owner          = THIS_MODULE,
+  .unlocked_ioctl = hwm_ctl_ioctl,
+};
+
+// Control node that instances are added and removed through.
+static struct miscdevice hwm_ctl = {
+  .minor = MISC_DYNAMIC_MINOR,
+  .name  = HWM_CTL_NAME,
+  .fops  = &hwm_ctl_fops,
+};
+
+// TODO(ashmrtn): Fix error when wrong device path is passed.
+static int __init disk_wrapper_init(void) {
+  int ret;
+  printk(KERN_INFO "hwm: Hello World from module\n");
+
+  // Get registered.
+  major_num = register_blkdev(major_num, "hwm");
+  if (major_num <= 0) {
+    printk(KERN_WARNING "hwm: unable to get major number\n");
+    return -ENOMEM;
+  }
+  ret = misc_register(&hwm_ctl);
+  if (ret != 0) {
+    printk(KERN_WARNING "hwm: unable to make control device\n");
+    goto out;
+  }
+
+  if (strlen(target_device_path) != 0 && strlen(flags_device_path) != 0) {
+    mutex_lock(&devices_lock);
+    ret = hwm_add(0, target_device_path, flags_device_path);
+    mutex_unlock(&devices_lock);
+    if (ret != 0) {
+      misc_deregister(&hwm_ctl);
+      goto out;
+    }
+  }
 
   printk(KERN_NOTICE "hwm: initialized\n");
   return 0;
 
   out:
     unregister_blkdev(major_num, "hwm");
-    return -ENOMEM;
+    return ret;
 }
 
 static void __exit hello_cleanup(void) {
-  free_logs();
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
-  LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
-   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
-  LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0) && \
-   LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
-   LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
-  blkdev_put(Device.target_dev, FMODE_READ);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0) && \
-  LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)
-  blkdev_put(Device.target_bd, FMODE_READ);
-#else
-#error "Unsupported kernel version: CrashMonkey has not been tested with " \
-  "your kernel version."
-#endif
-  blk_cleanup_queue(Device.gd->queue);
-  del_gendisk(Device.gd);
-  put_disk(Device.gd);
+  int id;
+
+  // Instances added through the control node hold the module, so only the one
+  // added when it was loaded can be left.
+  mutex_lock(&devices_lock);
+  for (id = 0; id < HWM_MAX_DEVICES; ++id) {
+    if (devices[id] != NULL) {
+      hwm_remove(devices[id]);
+    }
+  }
+  mutex_unlock(&devices_lock);
+  misc_deregister(&hwm_ctl);
   unregister_blkdev(major_num, "hwm");
 
   printk(KERN_INFO "hwm: Cleaning up bye!\n");
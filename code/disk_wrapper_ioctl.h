@@ -8,6 +8,17 @@
 #define HWM_NEXT_ENT              0xff04
 #define HWM_CLR_LOG               0xff05
 #define HWM_CHECKPOINT            0xff06
+// Numbered past the cow_brd ioctls so the two can't be mixed up.
+#define HWM_GET_STATS             0xff0a
+
+// ioctls on the control node, /dev/HWM_CTL_NAME, which adds and removes
+// instances of the wrapper. Instance id is at /dev/hwm<id>.
+#define HWM_CTL_ADD               0xff0c
+#define HWM_CTL_REMOVE            0xff0d
+
+#define HWM_CTL_NAME              "hwm_ctl"
+#define HWM_MAX_DEVICES           64
+#define HWM_PATH_LEN              256
 
 #define COW_BRD_SNAPSHOT          0xff06
 #define COW_BRD_UNSNAPSHOT        0xff07
@@ -130,9 +141,35 @@ enum flag_shifts {
 struct disk_write_op_meta {
   unsigned long long bi_flags;
   unsigned long long bi_rw;
-  unsigned long write_sector;
+  unsigned long long write_sector;
   unsigned int size;
   unsigned long long time_ns;
 };
 
+// Argument to HWM_CTL_ADD.
+struct disk_wrapper_add {
+  // Instance to add, or -1 for the first free one. Set to the one added.
+  int id;
+  // Device to pass bios through to.
+  char target_device_path[HWM_PATH_LEN];
+  // Device whose request queue flags the instance copies.
+  char flags_device_path[HWM_PATH_LEN];
+};
+
+#define HWM_STATS_LATENCY_BUCKETS 32
+
+// Counters for the bios logged since the log was last cleared.
+struct disk_wrapper_stats {
+  unsigned long long bios;
+  unsigned long long bytes;
+  // Bios that weren't logged because there was no memory for them.
+  unsigned long long alloc_failures;
+  // Time from a bio reaching disk_wrapper to it being in the log. Bucket i
+  // counts bios that took [2^i, 2^(i + 1)) ns, except that bucket 0 also counts
+  // 0 ns and the last bucket counts everything slower than it.
+  unsigned long long latency_total_ns;
+  unsigned long long latency_max_ns;
+  unsigned long long latency_buckets[HWM_STATS_LATENCY_BUCKETS];
+};
+
 #endif
@@ -0,0 +1,602 @@
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/dm-ioctl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "CaptureBackend.h"
+#include "../utils/LatencyHistogram.h"
+
+#define SILENT " > /dev/null 2>&1"
+
+#define WRAPPER_PATH        "/dev/hwm"
+#define WRAPPER_CTL_PATH    "/dev/" HWM_CTL_NAME
+#define WRAPPER_MODULE_NAME "../build/disk_wrapper.ko"
+#define WRAPPER_INSMOD      "insmod " WRAPPER_MODULE_NAME
+#define WRAPPER_RMMOD       "rmmod " WRAPPER_MODULE_NAME
+#define WRAPPER_VERBOSE_PATH "/sys/module/disk_wrapper/parameters/verbose"
+
+#define DM_CONTROL_PATH     "/dev/mapper/control"
+#define DM_LOG_WRITES_NAME  "crashmonkey_log"
+#define DM_LOG_WRITES_PATH  "/dev/mapper/" DM_LOG_WRITES_NAME
+
+// Marks the harness puts in the dm-log-writes log.
+#define MARK_BEGIN      "crashmonkey_begin"
+#define MARK_END        "crashmonkey_end"
+#define MARK_CHECKPOINT "crashmonkey_checkpoint"
+
+// On-disk format of the log, from drivers/md/dm-log-writes.c. Everything is
+// little endian. The superblock is at the start of the log device and the
+// entries follow one sector (of the super's sectorsize) in. Each entry is a
+// header sector, holding the mark's text for marks, and then the data written.
+#define LOG_WRITES_MAGIC   0x6a736677736872ULL
+#define LOG_WRITES_VERSION 1ULL
+#define LOG_FLUSH_FLAG     (1ULL << 0)
+#define LOG_FUA_FLAG       (1ULL << 1)
+#define LOG_DISCARD_FLAG   (1ULL << 2)
+#define LOG_MARK_FLAG      (1ULL << 3)
+#define LOG_METADATA_FLAG  (1ULL << 4)
+#define LOG_ENTRY_SIZE     32
+
+#define SECTOR_SIZE 512
+
+// How long FetchLog waits for the last mark to reach the log device.
+#define FETCH_TIMEOUT_MS 10000
+#define FETCH_POLL_US    10000
+
+namespace fs_testing {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using fs_testing::utils::LatencyHistogram;
+using std::cout;
+using std::endl;
+using std::ostream;
+using std::string;
+using std::to_string;
+using std::vector;
+
+constexpr char DiskWrapperBackend::kName[];
+constexpr char DmLogWritesBackend::kName[];
+
+namespace {
+
+unsigned long long ReadLe64(const char *buf) {
+  unsigned long long val;
+  memcpy(&val, buf, sizeof(val));
+  return le64toh(val);
+}
+
+unsigned int ReadLe32(const char *buf) {
+  unsigned int val;
+  memcpy(&val, buf, sizeof(val));
+  return le32toh(val);
+}
+
+// Send an ioctl to disk_wrapper's control node. Returns -1 and sets errno on
+// failure.
+int ControlIoctl(const unsigned long request, const unsigned long arg) {
+  const int fd = open(WRAPPER_CTL_PATH, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  const int res = ioctl(fd, request, arg);
+  const int err = errno;
+  close(fd);
+  errno = err;
+  return res;
+}
+
+// The closest disk_wrapper flags to the ones dm-log-writes keeps.
+unsigned long long ConvertFlags(const unsigned long long flags) {
+  unsigned long long res = HWM_WRITE_FLAG;
+  if (flags & LOG_FLUSH_FLAG) {
+    res |= HWM_FLUSH_FLAG;
+  }
+  if (flags & LOG_FUA_FLAG) {
+    res |= HWM_FUA_FLAG;
+  }
+  if (flags & LOG_DISCARD_FLAG) {
+    res |= HWM_DISCARD_FLAG;
+  }
+  if (flags & LOG_METADATA_FLAG) {
+    res |= HWM_META_FLAG;
+  }
+  return res;
+}
+
+}  // namespace
+
+/******************************* CaptureBackend *******************************/
+CaptureBackend::CaptureBackend(const bool verbose) : verbose_(verbose) { }
+
+bool CaptureBackend::RunCommand(string command) {
+  if (!verbose_) {
+    command += SILENT;
+  }
+  return system(command.c_str()) == 0;
+}
+
+CaptureBackend* GetCaptureBackend(const string &name, const bool verbose,
+    const string &log_device) {
+  if (name.compare(DiskWrapperBackend::kName) == 0) {
+    return new DiskWrapperBackend(verbose);
+  } else if (name.compare(DmLogWritesBackend::kName) == 0) {
+    return new DmLogWritesBackend(verbose, log_device);
+  }
+  return NULL;
+}
+
+/***************************** DiskWrapperBackend *****************************/
+DiskWrapperBackend::DiskWrapperBackend(const bool verbose)
+  : CaptureBackend(verbose) { }
+
+DiskWrapperBackend::~DiskWrapperBackend() {
+  Close();
+}
+
+string DiskWrapperBackend::GetName() {
+  return kName;
+}
+
+void DiskWrapperBackend::SetInstance(const unsigned int instance) {
+  instance_ = instance;
+}
+
+bool DiskWrapperBackend::Insert(const string &target_path,
+    const string &flags_device) {
+  if (inserted_) {
+    return true;
+  }
+  disk_wrapper_add add;
+  memset(&add, 0, sizeof(add));
+  if (target_path.size() >= sizeof(add.target_device_path) ||
+      flags_device.size() >= sizeof(add.flags_device_path)) {
+    return false;
+  }
+  add.id = instance_;
+  strcpy(add.target_device_path, target_path.c_str());
+  strcpy(add.flags_device_path, flags_device.c_str());
+
+  // The module is only loaded if no other recording has loaded it already,
+  // which also covers another recording unloading it just before this.
+  int res = ControlIoctl(HWM_CTL_ADD, (unsigned long) &add);
+  if (res != 0 && (errno == ENOENT || errno == ENODEV)) {
+    RunCommand(WRAPPER_INSMOD);
+    res = ControlIoctl(HWM_CTL_ADD, (unsigned long) &add);
+  }
+  if (res != 0) {
+    return false;
+  }
+  if (verbose_) {
+    std::ofstream param(WRAPPER_VERBOSE_PATH);
+    param << "1" << endl;
+  }
+  inserted_ = true;
+  return true;
+}
+
+bool DiskWrapperBackend::Remove() {
+  if (!inserted_) {
+    return true;
+  }
+  bool res;
+  int err;
+  int num_tries = 0;
+  milliseconds elapsed;
+  const steady_clock::time_point remove_start_time = steady_clock::now();
+  // The instance can't be removed until the file system on it is gone, which
+  // may take a moment after it's unmounted.
+  do {
+    res = ControlIoctl(HWM_CTL_REMOVE, instance_) == 0;
+    err = errno;
+    elapsed = duration_cast<milliseconds>(steady_clock::now() -
+        remove_start_time);
+    if (!res) {
+      usleep(500);
+      ++num_tries;
+    }
+  } while (!res && err == EBUSY && elapsed.count() < 1000);
+  if (!res) {
+    return false;
+  }
+  cout << "Time to remove " << GetDevicePath() << " " << elapsed.count() <<
+    " num tries = " << num_tries << endl;
+  inserted_ = false;
+
+  // Only works once no other recording has an instance.
+  system(WRAPPER_RMMOD SILENT);
+  return true;
+}
+
+string DiskWrapperBackend::GetDevicePath() {
+  return WRAPPER_PATH + to_string(instance_);
+}
+
+bool DiskWrapperBackend::Open() {
+  ioctl_fd_ = open(GetDevicePath().c_str(), O_RDONLY | O_CLOEXEC);
+  return ioctl_fd_ >= 0;
+}
+
+void DiskWrapperBackend::Close() {
+  if (ioctl_fd_ >= 0) {
+    close(ioctl_fd_);
+    ioctl_fd_ = -1;
+  }
+}
+
+bool DiskWrapperBackend::BeginLogging() {
+  return ioctl_fd_ >= 0 && ioctl(ioctl_fd_, HWM_LOG_ON) == 0;
+}
+
+bool DiskWrapperBackend::EndLogging() {
+  return ioctl_fd_ >= 0 && ioctl(ioctl_fd_, HWM_LOG_OFF) == 0;
+}
+
+bool DiskWrapperBackend::ClearLog() {
+  return ioctl_fd_ >= 0 && ioctl(ioctl_fd_, HWM_CLR_LOG) == 0;
+}
+
+bool DiskWrapperBackend::Checkpoint() {
+  return ioctl_fd_ >= 0 && ioctl(ioctl_fd_, HWM_CHECKPOINT) == 0;
+}
+
+bool DiskWrapperBackend::FetchLog(const LogCallback &callback) {
+  if (ioctl_fd_ < 0) {
+    return true;
+  }
+  while (true) {
+    disk_write_op_meta meta;
+    if (ioctl(ioctl_fd_, HWM_GET_LOG_META, &meta) == -1) {
+      if (errno == ENODATA) {
+        break;
+      }
+      std::cerr << "Error getting log entry metadata" << endl;
+      return false;
+    }
+
+    vector<char> data(meta.size);
+    if (ioctl(ioctl_fd_, HWM_GET_LOG_DATA, data.data()) == -1) {
+      std::cerr << "Error getting log entry data" << endl;
+      return false;
+    }
+    callback(meta, data.data());
+
+    if (ioctl(ioctl_fd_, HWM_NEXT_ENT) == -1) {
+      if (errno == ENODATA) {
+        break;
+      }
+      std::cerr << "Error getting next log entry" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void DiskWrapperBackend::PrintStats(ostream &os) {
+  disk_wrapper_stats stats;
+  if (ioctl_fd_ >= 0 && ioctl(ioctl_fd_, HWM_GET_STATS, &stats) == 0) {
+    WriteStats(os, stats);
+  }
+}
+
+void DiskWrapperBackend::WriteStats(ostream &os,
+    const disk_wrapper_stats &stats) {
+  os << "captured " << stats.bios << " bios, " << stats.bytes << " bytes, " <<
+    stats.alloc_failures << " allocation failures";
+  if (stats.bios == 0) {
+    os << endl;
+    return;
+  }
+  // Bounds on the percentiles from the buckets they fall in.
+  const unsigned long long p50_count = (stats.bios + 1) / 2;
+  const unsigned long long p99_count = stats.bios - stats.bios / 100;
+  unsigned long long p50_ns = 0;
+  unsigned long long p99_ns = 0;
+  unsigned long long seen = 0;
+  for (unsigned int i = 0; i < HWM_STATS_LATENCY_BUCKETS; ++i) {
+    seen += stats.latency_buckets[i];
+    const unsigned long long bound =
+      std::min(2ULL << i, stats.latency_max_ns);
+    if (p50_ns == 0 && seen >= p50_count) {
+      p50_ns = bound;
+    }
+    if (p99_ns == 0 && seen >= p99_count) {
+      p99_ns = bound;
+    }
+  }
+  os << ", capture latency mean " <<
+    LatencyHistogram::Format(
+        nanoseconds(stats.latency_total_ns / stats.bios)) <<
+    ", p50 " << LatencyHistogram::Format(nanoseconds(p50_ns)) <<
+    ", p99 " << LatencyHistogram::Format(nanoseconds(p99_ns)) <<
+    ", max " << LatencyHistogram::Format(nanoseconds(stats.latency_max_ns)) <<
+    endl;
+}
+
+/***************************** DmLogWritesBackend *****************************/
+DmLogWritesBackend::DmLogWritesBackend(const bool verbose,
+    const string &log_device)
+  : CaptureBackend(verbose), log_device_(log_device) { }
+
+DmLogWritesBackend::~DmLogWritesBackend() {
+  Close();
+}
+
+string DmLogWritesBackend::GetName() {
+  return kName;
+}
+
+bool DmLogWritesBackend::ZeroSuper() {
+  const int fd = open(log_device_.c_str(), O_WRONLY | O_SYNC | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  // Large enough for any logical block size.
+  const vector<char> zeros(4096, 0);
+  const bool res = pwrite(fd, zeros.data(), zeros.size(), 0) ==
+    (ssize_t) zeros.size();
+  close(fd);
+  return res;
+}
+
+bool DmLogWritesBackend::Insert(const string &target_path, const string &) {
+  if (inserted_) {
+    return true;
+  }
+  if (log_device_.empty()) {
+    return false;
+  }
+  const int fd = open(target_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  unsigned long long bytes = 0;
+  const bool size_res = ioctl(fd, BLKGETSIZE64, &bytes) == 0;
+  close(fd);
+  if (!size_res || !ZeroSuper()) {
+    return false;
+  }
+  // Writes are logged from when the target is made, but FetchLog only keeps
+  // the ones after the BeginLogging mark.
+  table_ = "0 " + to_string(bytes / SECTOR_SIZE) + " log-writes " +
+    target_path + " " + log_device_;
+  if (!RunCommand("dmsetup create " DM_LOG_WRITES_NAME " --table \"" +
+        table_ + "\"")) {
+    return false;
+  }
+  inserted_ = true;
+  marks_sent_ = 0;
+  return true;
+}
+
+bool DmLogWritesBackend::Remove() {
+  if (!inserted_) {
+    return true;
+  }
+  Close();
+  if (!RunCommand("dmsetup remove --retry " DM_LOG_WRITES_NAME)) {
+    return false;
+  }
+  inserted_ = false;
+  return true;
+}
+
+string DmLogWritesBackend::GetDevicePath() {
+  return DM_LOG_WRITES_PATH;
+}
+
+bool DmLogWritesBackend::Open() {
+  control_fd_ = open(DM_CONTROL_PATH, O_RDWR | O_CLOEXEC);
+  return control_fd_ >= 0;
+}
+
+void DmLogWritesBackend::Close() {
+  if (control_fd_ >= 0) {
+    close(control_fd_);
+    control_fd_ = -1;
+  }
+}
+
+bool DmLogWritesBackend::Message(const string &message) {
+  if (control_fd_ < 0) {
+    return false;
+  }
+  // The same ioctl dmsetup message makes, without starting a process for every
+  // checkpoint.
+  vector<char> buf(sizeof(struct dm_ioctl) + sizeof(struct dm_target_msg) +
+      message.size() + 1, 0);
+  struct dm_ioctl *io = (struct dm_ioctl *) buf.data();
+  io->version[0] = DM_VERSION_MAJOR;
+  io->data_size = buf.size();
+  io->data_start = sizeof(struct dm_ioctl);
+  strncpy(io->name, DM_LOG_WRITES_NAME, sizeof(io->name) - 1);
+  struct dm_target_msg *msg =
+    (struct dm_target_msg *) (buf.data() + io->data_start);
+  msg->sector = 0;
+  memcpy(msg->message, message.c_str(), message.size() + 1);
+  if (ioctl(control_fd_, DM_TARGET_MSG, io) < 0) {
+    return false;
+  }
+  ++marks_sent_;
+  return true;
+}
+
+bool DmLogWritesBackend::BeginLogging() {
+  return Message("mark " MARK_BEGIN);
+}
+
+bool DmLogWritesBackend::EndLogging() {
+  return Message("mark " MARK_END);
+}
+
+bool DmLogWritesBackend::ClearLog() {
+  if (!inserted_) {
+    return false;
+  }
+  // Loading the table again starts a new log at the front of the log device.
+  if (!RunCommand("dmsetup suspend " DM_LOG_WRITES_NAME)) {
+    return false;
+  }
+  const bool res = ZeroSuper() &&
+    RunCommand("dmsetup reload " DM_LOG_WRITES_NAME " --table \"" + table_ +
+        "\"");
+  if (!RunCommand("dmsetup resume " DM_LOG_WRITES_NAME) || !res) {
+    return false;
+  }
+  marks_sent_ = 0;
+  return true;
+}
+
+bool DmLogWritesBackend::Checkpoint() {
+  return Message("mark " MARK_CHECKPOINT);
+}
+
+bool DmLogWritesBackend::FetchLog(const LogCallback &callback) {
+  const unsigned long long base_time_ns = duration_cast<nanoseconds>(
+      steady_clock::now().time_since_epoch()).count();
+  // Entries reach the log device some time after they complete, and the
+  // superblock only counts them once a later mark or FUA write is logged.
+  // Every mark sent has to be on the log device before it can be read.
+  const steady_clock::time_point start = steady_clock::now();
+  while (true) {
+    const int fd = open(log_device_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    // The target writes below the page cache, so drop what is cached.
+    const bool flushed = ioctl(fd, BLKFLSBUF, 0) == 0;
+    close(fd);
+    if (!flushed) {
+      return false;
+    }
+
+    std::ifstream log(log_device_, std::ios::binary);
+    unsigned int marks = 0;
+    if (ReadLog(log, base_time_ns, LogCallback(), marks) &&
+        marks >= marks_sent_) {
+      break;
+    }
+    if (duration_cast<milliseconds>(steady_clock::now() - start).count() >
+        FETCH_TIMEOUT_MS) {
+      std::cerr << "Timed out waiting for the dm-log-writes log" << endl;
+      return false;
+    }
+    usleep(FETCH_POLL_US);
+  }
+
+  std::ifstream log(log_device_, std::ios::binary);
+  unsigned int marks = 0;
+  return ReadLog(log, base_time_ns, callback, marks);
+}
+
+bool DmLogWritesBackend::ReadLog(std::istream &log,
+    const unsigned long long base_time_ns, const LogCallback &callback,
+    unsigned int &marks) {
+  marks = 0;
+  char super[LOG_ENTRY_SIZE];
+  if (!log.read(super, sizeof(super)) ||
+      ReadLe64(super) != LOG_WRITES_MAGIC ||
+      ReadLe64(super + 8) != LOG_WRITES_VERSION) {
+    return false;
+  }
+  const unsigned long long nr_entries = ReadLe64(super + 16);
+  const unsigned int sector_size = ReadLe32(super + 24);
+  if (sector_size < LOG_ENTRY_SIZE || sector_size % SECTOR_SIZE != 0) {
+    return false;
+  }
+  if (!log.seekg(sector_size, std::ios::beg)) {
+    return false;
+  }
+  // Entries give their range in sectors of sector_size bytes, while the
+  // profile is in 512 byte sectors.
+  const unsigned long long sector_scale = sector_size / SECTOR_SIZE;
+
+  disk_write_op_meta meta = {};
+  meta.bi_flags = HWM_CHECKPOINT_FLAG;
+  meta.bi_rw = HWM_CHECKPOINT_FLAG;
+  meta.time_ns = base_time_ns;
+  if (callback) {
+    callback(meta, NULL);
+  }
+
+  bool logging = false;
+  unsigned int checkpoint = 0;
+  vector<char> header(sector_size);
+  vector<char> data;
+  for (unsigned long long i = 0; i < nr_entries; ++i) {
+    if (!log.read(header.data(), header.size())) {
+      return false;
+    }
+    const unsigned long long sector = ReadLe64(header.data()) * sector_scale;
+    const unsigned long long nr_sectors =
+      ReadLe64(header.data() + 8) * sector_scale;
+    const unsigned long long flags = ReadLe64(header.data() + 16);
+    const unsigned long long data_len = ReadLe64(header.data() + 24);
+
+    meta = {};
+    meta.time_ns = base_time_ns + i + 1;
+    if (flags & LOG_MARK_FLAG) {
+      if (data_len > sector_size - LOG_ENTRY_SIZE) {
+        return false;
+      }
+      ++marks;
+      const string mark(header.data() + LOG_ENTRY_SIZE, data_len);
+      if (mark == MARK_BEGIN) {
+        logging = true;
+      } else if (mark == MARK_END) {
+        logging = false;
+      } else if (mark == MARK_CHECKPOINT && callback) {
+        meta.bi_flags = HWM_CHECKPOINT_FLAG;
+        meta.bi_rw = HWM_CHECKPOINT_FLAG;
+        meta.write_sector = ++checkpoint;
+        callback(meta, NULL);
+      }
+      continue;
+    }
+
+    // Discards only have a range. Anything else has its data right after the
+    // header, except for DAX writes, which only log data_len bytes.
+    unsigned long long log_bytes = 0;
+    if (!(flags & LOG_DISCARD_FLAG)) {
+      log_bytes = (data_len > 0) ? data_len : nr_sectors * SECTOR_SIZE;
+    }
+    const unsigned long long padded_bytes =
+      (log_bytes + sector_size - 1) / sector_size * sector_size;
+    if (!logging || !callback) {
+      if (!log.seekg(padded_bytes, std::ios::cur)) {
+        return false;
+      }
+      continue;
+    }
+
+    meta.bi_rw = ConvertFlags(flags);
+    meta.write_sector = sector;
+    // Discarded sectors are replayed as zeros.
+    meta.size = (flags & LOG_DISCARD_FLAG) ? nr_sectors * SECTOR_SIZE :
+      log_bytes;
+    data.assign(padded_bytes, 0);
+    if (!log.read(data.data(), padded_bytes)) {
+      return false;
+    }
+    if (meta.size > data.size()) {
+      data.resize(meta.size, 0);
+    }
+    callback(meta, (meta.size > 0) ? data.data() : NULL);
+  }
+  return true;
+}
+
+}  // namespace fs_testing
@@ -0,0 +1,194 @@
+#ifndef HARNESS_CAPTURE_BACKEND_H
+#define HARNESS_CAPTURE_BACKEND_H
+
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "../disk_wrapper_ioctl.h"
+
+namespace fs_testing {
+
+/*
+ * Records the bios a workload sends to the disk it runs on so they can be
+ * replayed into crash states. The workload's file system is mounted from the
+ * device at GetDevicePath, which passes everything through to the disk.
+ *
+ * The log always starts with a checkpoint numbered 0. Bios are only logged
+ * between BeginLogging and EndLogging, while Checkpoint adds a checkpoint to
+ * the log whether logging is on or not, numbering them from 1. ClearLog drops
+ * everything and starts the numbering over.
+ */
+class CaptureBackend {
+ public:
+  typedef std::function<void(const disk_write_op_meta &meta,
+      const char *data)> LogCallback;
+
+  virtual ~CaptureBackend() {}
+
+  /*
+   * Returns the name the backend is picked by (ex. "disk_wrapper").
+   */
+  virtual std::string GetName() = 0;
+
+  /*
+   * Record on instance instead of the default, 0, so workloads on different
+   * disks can be recorded at the same time. Has to be called before Insert.
+   * Backends that can only record one workload at a time ignore it.
+   */
+  virtual void SetInstance(const unsigned int) { }
+
+  /*
+   * Start passing bios through to the device at target_path. flags_device is a
+   * device whose request queue flags the capture device copies, for backends
+   * that set up their own queue. Does nothing if already inserted.
+   */
+  virtual bool Insert(const std::string &target_path,
+      const std::string &flags_device) = 0;
+
+  /*
+   * Tear down everything Insert set up.
+   */
+  virtual bool Remove() = 0;
+
+  /*
+   * Path of the device the workload's file system is mounted from.
+   */
+  virtual std::string GetDevicePath() = 0;
+
+  /*
+   * Open and close the handle the logging calls below go through.
+   */
+  virtual bool Open() = 0;
+  virtual void Close() = 0;
+
+  virtual bool BeginLogging() = 0;
+  virtual bool EndLogging() = 0;
+  virtual bool ClearLog() = 0;
+  virtual bool Checkpoint() = 0;
+
+  /*
+   * Hand every entry in the log to callback in order. data is NULL for
+   * entries without data and is only valid during the call.
+   */
+  virtual bool FetchLog(const LogCallback &callback) = 0;
+
+  /*
+   * Print what it cost to record the workload, for backends that keep track.
+   * Others print nothing.
+   */
+  virtual void PrintStats(std::ostream &) { }
+
+ protected:
+  CaptureBackend(const bool verbose);
+
+  // Run a shell command, hiding its output unless verbose.
+  bool RunCommand(std::string command);
+
+  const bool verbose_;
+};
+
+/*
+ * CrashMonkey's disk_wrapper kernel module, which keeps the log in kernel
+ * memory until it is fetched. The module is shared by everything recording on
+ * the machine, and each recording adds its own instance of the wrapper to it.
+ */
+class DiskWrapperBackend : public CaptureBackend {
+ public:
+  static constexpr char kName[] = "disk_wrapper";
+
+  DiskWrapperBackend(const bool verbose);
+  virtual ~DiskWrapperBackend();
+  virtual std::string GetName();
+  virtual void SetInstance(const unsigned int instance);
+  virtual bool Insert(const std::string &target_path,
+      const std::string &flags_device);
+  virtual bool Remove();
+  virtual std::string GetDevicePath();
+  virtual bool Open();
+  virtual void Close();
+  virtual bool BeginLogging();
+  virtual bool EndLogging();
+  virtual bool ClearLog();
+  virtual bool Checkpoint();
+  virtual bool FetchLog(const LogCallback &callback);
+  virtual void PrintStats(std::ostream &os);
+
+  // One line summary of stats, as printed by PrintStats.
+  static void WriteStats(std::ostream &os, const disk_wrapper_stats &stats);
+
+ private:
+  unsigned int instance_ = 0;
+  bool inserted_ = false;
+  int ioctl_fd_ = -1;
+};
+
+/*
+ * The kernel's dm-log-writes target, which writes every bio it passes through,
+ * flushes and FUA writes included, to the end of a separate log device as it
+ * completes. Nothing is held in kernel memory, and the log device only has to
+ * be large enough for the workload. BeginLogging, EndLogging and Checkpoint
+ * add marks to the log, and FetchLog reads it back from the log device one
+ * entry at a time.
+ */
+class DmLogWritesBackend : public CaptureBackend {
+ public:
+  static constexpr char kName[] = "dm-log-writes";
+
+  DmLogWritesBackend(const bool verbose, const std::string &log_device);
+  virtual ~DmLogWritesBackend();
+  virtual std::string GetName();
+  virtual bool Insert(const std::string &target_path,
+      const std::string &flags_device);
+  virtual bool Remove();
+  virtual std::string GetDevicePath();
+  virtual bool Open();
+  virtual void Close();
+  virtual bool BeginLogging();
+  virtual bool EndLogging();
+  virtual bool ClearLog();
+  virtual bool Checkpoint();
+  virtual bool FetchLog(const LogCallback &callback);
+
+  /*
+   * Parse the contents of a log device from log, handing entries to callback
+   * the way FetchLog does. Entries are timed base_time_ns plus their index in
+   * the log since dm-log-writes doesn't record when they happened. marks is
+   * set to the number of marks read. With an empty callback only the marks are
+   * counted and data is skipped over. Ranges in the log, which are in the
+   * log's sectors, are handed over in 512 byte sectors. Returns false if log
+   * doesn't hold a dm-log-writes log or ends early.
+   */
+  static bool ReadLog(std::istream &log,
+      const unsigned long long base_time_ns, const LogCallback &callback,
+      unsigned int &marks);
+
+ private:
+  // Send message to the target, as with dmsetup message.
+  bool Message(const std::string &message);
+  // Zero the log device's superblock so an old log on it isn't read back.
+  bool ZeroSuper();
+
+  const std::string log_device_;
+  bool inserted_ = false;
+  std::string table_;
+  int control_fd_ = -1;
+  // Marks sent since the log was last started, which FetchLog waits to see on
+  // the log device.
+  unsigned int marks_sent_ = 0;
+};
+
+/*
+ * Return a subclass of CaptureBackend corresponding to the given name.
+ * log_device is the device backends that stream their log keep it on. The
+ * caller is responsible for destroying the object returned by this method.
+ *
+ * Supported names include: disk_wrapper, dm-log-writes.
+ */
+CaptureBackend* GetCaptureBackend(const std::string &name, const bool verbose,
+    const std::string &log_device);
+
+}  // namespace fs_testing
+
+#endif  // HARNESS_CAPTURE_BACKEND_H
@@ -18,6 +18,11 @@
 #include <map>
 
 namespace fs_testing {
+#ifdef TEST_CASE
+namespace test {
+  class TestDiskContents;
+}  // namespace test
+#endif
 
 class fileAttributes {
 public:
@@ -38,6 +43,10 @@ public:
 };
 
 class DiskContents {
+  #ifdef TEST_CASE
+  friend class fs_testing::test::TestDiskContents;
+  #endif
+
 public:
   // Constructor and Destructor
   DiskContents(std::string path, std::string type);
@@ -0,0 +1,34 @@
+#ifndef HARNESS_IMAGE_CHECKER_H
+#define HARNESS_IMAGE_CHECKER_H
+
+#include <string>
+
+#include "SnapshotBackend.h"
+#include "../results/SingleTestInfo.h"
+
+namespace fs_testing {
+
+/*
+ * Checks the disk image of a crash state in place of mounting it, running fsck
+ * and the test case's check. Lets Tester test crash states on backends without
+ * block devices (see EmulatedBackend), or skip the file system entirely when
+ * only the harness itself is being measured.
+ */
+class ImageChecker {
+ public:
+  virtual ~ImageChecker() {}
+
+  /*
+   * Check the image on the snapshot at snapshot_path, which can be read with
+   * backend's DeviceOpen and DeviceRead. Problems are recorded in
+   * test_info.fs_test and test_info.data_test the way fsck and check_test
+   * would record them.
+   */
+  virtual void Check(SnapshotBackend &backend,
+      const std::string &snapshot_path, const unsigned int last_checkpoint,
+      SingleTestInfo &test_info) = 0;
+};
+
+}  // namespace fs_testing
+
+#endif  // HARNESS_IMAGE_CHECKER_H
@@ -0,0 +1,865 @@
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "SnapshotBackend.h"
+#include "../disk_wrapper_ioctl.h"
+
+// Only in linux/fs.h, which doesn't mix with sys/mount.h on older libcs.
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#define SILENT " > /dev/null 2>&1"
+
+#define COW_BRD_MODULE_NAME "../build/cow_brd.ko"
+#define COW_BRD_INSMOD      "insmod " COW_BRD_MODULE_NAME " num_disks="
+#define COW_BRD_INSMOD2      " num_snapshots="
+#define COW_BRD_INSMOD3      " disk_size="
+#define COW_BRD_RMMOD       "rmmod " COW_BRD_MODULE_NAME
+#define COW_BRD_PATH        "/dev/cow_ram"
+#define COW_BRD_SNAPSHOT_PATH "/dev/cow_ram_snapshot"
+
+#define DM_PATH             "/dev/mapper/"
+#define DM_THIN_POOL        "crashmonkey_pool"
+#define DM_THIN_DISK        "crashmonkey_thin"
+#define DM_THIN_SNAPSHOT    "crashmonkey_thin_snapshot"
+// 64 KB pool blocks. Crash states mostly rewrite a few blocks here and there,
+// so smaller blocks would only grow the metadata.
+#define DM_THIN_BLOCK_SECTORS "128"
+
+#define REFLINK_DISK_IMAGE     "crashmonkey"
+#define REFLINK_SNAPSHOT_IMAGE "crashmonkey_snapshot"
+
+#define EMULATED_DISK     "emulated"
+#define EMULATED_SNAPSHOT "emulated_snapshot"
+
+namespace fs_testing {
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::string;
+using std::to_string;
+using fs_testing::utils::MemoryUsage;
+
+constexpr unsigned int SnapshotBackend::kNumSnapshots;
+constexpr char CowBrdBackend::kName[];
+constexpr char DmThinBackend::kName[];
+constexpr char ReflinkLoopBackend::kName[];
+constexpr char EmulatedBackend::kName[];
+constexpr unsigned int EmulatedBackend::kPageSize;
+
+namespace {
+
+// First line a shell command prints, without the newline.
+string ReadCommand(const string &command) {
+  FILE *output = popen(command.c_str(), "r");
+  if (output == NULL) {
+    return "";
+  }
+  char buf[512];
+  string res;
+  if (fgets(buf, sizeof(buf), output) != NULL) {
+    res = buf;
+  }
+  pclose(output);
+  const size_t end = res.find('\n');
+  return (end == string::npos) ? res : res.substr(0, end);
+}
+
+// Attach path to a free loop device and return the device, or "" on failure.
+string AttachLoop(const string &path) {
+  return ReadCommand("losetup --find --show " + path);
+}
+
+// Loop device path is attached to, or "" if there isn't one.
+string FindLoop(const string &path) {
+  // Lines look like "/dev/loop0: [2049]:1234 (/path)".
+  const string line = ReadCommand("losetup -j " + path);
+  const size_t end = line.find(':');
+  return (end == string::npos) ? "" : line.substr(0, end);
+}
+
+// Make an empty sparse file of the given size.
+bool MakeSparseFile(const string &path, const unsigned long long bytes) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return false;
+  }
+  const bool res = ftruncate(fd, bytes) == 0;
+  close(fd);
+  return res;
+}
+
+// Drop anything cached for a block device so it is read again from below.
+bool FlushDevice(const string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  const bool res = ioctl(fd, BLKFLSBUF, 0) == 0;
+  close(fd);
+  return res;
+}
+
+}  // namespace
+
+/******************************* SnapshotBackend ******************************/
+SnapshotBackend::SnapshotBackend(const unsigned long long disk_size,
+    const bool verbose) : disk_size_(disk_size), verbose_(verbose) { }
+
+void SnapshotBackend::SetDisk(const unsigned int disk,
+    const unsigned int num_disks) {
+  disk_ = disk;
+  num_disks_ = num_disks;
+}
+
+bool SnapshotBackend::RunCommand(string command) {
+  if (!verbose_) {
+    command += SILENT;
+  }
+  return system(command.c_str()) == 0;
+}
+
+unsigned int SnapshotBackend::SnapshotNumber(const string &snapshot_path) {
+  for (unsigned int i = 1; i <= kNumSnapshots; ++i) {
+    if (GetSnapshotPath(i) == snapshot_path) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+int SnapshotBackend::DeviceOpen(const string &path, const int flags) {
+  return open(path.c_str(), flags);
+}
+
+bool SnapshotBackend::DeviceWrite(const int fd,
+    const unsigned long long offset, const char *data,
+    const unsigned int size) {
+  unsigned int bytes_written = 0;
+  while (bytes_written < size) {
+    const int res = pwrite(fd, data + bytes_written, size - bytes_written,
+        offset + bytes_written);
+    if (res < 0) {
+      return false;
+    }
+    bytes_written += res;
+  }
+  return true;
+}
+
+bool SnapshotBackend::DeviceRead(const int fd,
+    const unsigned long long offset, char *buf, const unsigned int size) {
+  unsigned int bytes_read = 0;
+  while (bytes_read < size) {
+    const int res = pread(fd, buf + bytes_read, size - bytes_read,
+        offset + bytes_read);
+    if (res <= 0) {
+      return false;
+    }
+    bytes_read += res;
+  }
+  return true;
+}
+
+void SnapshotBackend::DeviceClose(const int fd) {
+  close(fd);
+}
+
+MemoryUsage SnapshotBackend::GetMemoryUsage() {
+  return MemoryUsage();
+}
+
+SnapshotBackend* GetSnapshotBackend(const string &name,
+    const unsigned long long disk_size, const bool verbose,
+    const string &image_dir) {
+  if (name.compare(CowBrdBackend::kName) == 0) {
+    return new CowBrdBackend(disk_size, verbose);
+  } else if (name.compare(DmThinBackend::kName) == 0) {
+    return new DmThinBackend(disk_size, verbose, image_dir);
+  } else if (name.compare(ReflinkLoopBackend::kName) == 0) {
+    return new ReflinkLoopBackend(disk_size, verbose, image_dir);
+  } else if (name.compare(EmulatedBackend::kName) == 0) {
+    return new EmulatedBackend(disk_size, verbose);
+  }
+  return NULL;
+}
+
+/******************************** CowBrdBackend *******************************/
+CowBrdBackend::CowBrdBackend(const unsigned long long disk_size,
+    const bool verbose) : SnapshotBackend(disk_size, verbose) { }
+
+CowBrdBackend::~CowBrdBackend() {
+  if (disk_fd_ >= 0) {
+    close(disk_fd_);
+  }
+}
+
+string CowBrdBackend::GetName() {
+  return kName;
+}
+
+bool CowBrdBackend::Insert() {
+  if (disk_fd_ < 0) {
+    string command(COW_BRD_INSMOD);
+    command += to_string(num_disks_);
+    command += COW_BRD_INSMOD2;
+    command += to_string(kNumSnapshots);
+    command += COW_BRD_INSMOD3;
+    command += to_string(disk_size_);
+    if (!RunCommand(command)) {
+      return false;
+    }
+  }
+  inserted_ = true;
+  if (!Open()) {
+    if (system(COW_BRD_RMMOD) == 0) {
+      inserted_ = false;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool CowBrdBackend::Open() {
+  disk_fd_ = open(GetBasePath().c_str(), O_RDONLY);
+  return disk_fd_ >= 0;
+}
+
+bool CowBrdBackend::Remove() {
+  if (!inserted_ && disk_fd_ != -1) {
+    // Opened with Open, so whoever inserted the module removes it.
+    close(disk_fd_);
+    disk_fd_ = -1;
+    return true;
+  }
+  if (!inserted_) {
+    return true;
+  }
+  if (disk_fd_ != -1) {
+    close(disk_fd_);
+    disk_fd_ = -1;
+  }
+  // Sometimes the disk wrapper module takes time to unload.
+  // So retry cow-brd unload for upto a second.
+  bool res;
+  milliseconds elapsed;
+  const steady_clock::time_point rmmod_start_time = steady_clock::now();
+  do {
+    res = system(COW_BRD_RMMOD SILENT) == 0;
+    elapsed = duration_cast<milliseconds>(steady_clock::now() -
+        rmmod_start_time);
+    if (!res) {
+      usleep(500);
+    }
+  } while (!res && elapsed.count() < 1000);
+  inserted_ = !res;
+  return res;
+}
+
+bool CowBrdBackend::Wipe() {
+  if (disk_fd_ < 0) {
+    return false;
+  }
+  // The base disk is read-only once it has been snapshotted and can't be wiped
+  // while the snapshots still hold pages copied from it.
+  if (ioctl(disk_fd_, COW_BRD_UNSNAPSHOT) < 0) {
+    return false;
+  }
+  for (unsigned int i = 1; i <= kNumSnapshots; ++i) {
+    const string snapshot = GetSnapshotPath(i);
+    const int snapshot_fd = open(snapshot.c_str(), O_RDONLY);
+    if (snapshot_fd < 0) {
+      return false;
+    }
+    // Also drop anything cached for the snapshot so nothing from the last test
+    // is read back.
+    if (ioctl(snapshot_fd, COW_BRD_RESTORE_SNAPSHOT) < 0 ||
+        ioctl(snapshot_fd, BLKFLSBUF, 0) < 0) {
+      close(snapshot_fd);
+      return false;
+    }
+    close(snapshot_fd);
+  }
+  return ioctl(disk_fd_, COW_BRD_WIPE) == 0 &&
+    ioctl(disk_fd_, BLKFLSBUF, 0) == 0;
+}
+
+bool CowBrdBackend::Snapshot() {
+  return fsync(disk_fd_) == 0 && ioctl(disk_fd_, COW_BRD_SNAPSHOT) == 0;
+}
+
+bool CowBrdBackend::Restore(const string &, const int snapshot_fd) {
+  return ioctl(snapshot_fd, COW_BRD_RESTORE_SNAPSHOT) == 0;
+}
+
+string CowBrdBackend::GetBasePath() {
+  return COW_BRD_PATH + to_string(disk_);
+}
+
+string CowBrdBackend::GetSnapshotPath(const unsigned int snapshot) {
+  return COW_BRD_SNAPSHOT_PATH + to_string(snapshot) + "_" + to_string(disk_);
+}
+
+/******************************** DmThinBackend *******************************/
+DmThinBackend::DmThinBackend(const unsigned long long disk_size,
+    const bool verbose, const string &image_dir)
+  : SnapshotBackend(disk_size, verbose), image_dir_(image_dir),
+    generations_(kNumSnapshots + 1, -1) { }
+
+DmThinBackend::~DmThinBackend() {
+  if (disk_fd_ >= 0) {
+    close(disk_fd_);
+  }
+}
+
+string DmThinBackend::GetName() {
+  return kName;
+}
+
+string DmThinBackend::DeviceName(const unsigned int disk,
+    const unsigned int snapshot) {
+  if (snapshot == 0) {
+    return DM_THIN_DISK + to_string(disk);
+  }
+  return DM_THIN_SNAPSHOT + to_string(snapshot) + "_" + to_string(disk);
+}
+
+unsigned int DmThinBackend::ThinId(const unsigned int disk,
+    const unsigned int snapshot, const unsigned int generation) {
+  // Per disk: the disk, the frozen copy of it that snapshots are made from,
+  // then two ids for each snapshot.
+  const unsigned int ids_per_disk = 2 * kNumSnapshots + 2;
+  if (snapshot == 0) {
+    return disk * ids_per_disk + generation;
+  }
+  return disk * ids_per_disk + 2 * snapshot + generation;
+}
+
+string DmThinBackend::ThinTable(const unsigned int thin_id) {
+  return "0 " + to_string(disk_size_ * 2) + " thin " DM_PATH DM_THIN_POOL " " +
+    to_string(thin_id);
+}
+
+bool DmThinBackend::PoolMessage(const string &message) {
+  return RunCommand("dmsetup message " DM_THIN_POOL " 0 \"" + message + "\"");
+}
+
+bool DmThinBackend::CreateDisk() {
+  return PoolMessage("create_thin " + to_string(ThinId(disk_, 0, 0))) &&
+    RunCommand("dmsetup create " + DeviceName(disk_, 0) + " --table \"" +
+        ThinTable(ThinId(disk_, 0, 0)) + "\"");
+}
+
+bool DmThinBackend::Insert() {
+  // Snapshots share the disk's blocks, so the pool only needs room for what
+  // the workload and crash states change. The files are sparse, so be
+  // generous.
+  const unsigned long long data_bytes =
+    disk_size_ * 1024 * num_disks_ * (kNumSnapshots + 1);
+  const unsigned long long meta_bytes = 64ULL * 1024 * 1024;
+  const string data_path = image_dir_ + "/" DM_THIN_POOL "_data";
+  const string meta_path = image_dir_ + "/" DM_THIN_POOL "_meta";
+  if (!MakeSparseFile(data_path, data_bytes) ||
+      !MakeSparseFile(meta_path, meta_bytes)) {
+    return false;
+  }
+  inserted_ = true;
+  pool_loops_.push_back(AttachLoop(meta_path));
+  pool_loops_.push_back(AttachLoop(data_path));
+  if (pool_loops_.at(0).empty() || pool_loops_.at(1).empty()) {
+    Remove();
+    return false;
+  }
+  if (!RunCommand("dmsetup create " DM_THIN_POOL " --table \"0 " +
+        to_string(data_bytes / 512) + " thin-pool " + pool_loops_.at(0) +
+        " " + pool_loops_.at(1) + " " DM_THIN_BLOCK_SECTORS " 0\"")) {
+    Remove();
+    return false;
+  }
+  const unsigned int disk = disk_;
+  for (disk_ = 0; disk_ < num_disks_; ++disk_) {
+    if (!CreateDisk()) {
+      disk_ = disk;
+      Remove();
+      return false;
+    }
+  }
+  disk_ = disk;
+  if (!Open()) {
+    Remove();
+    return false;
+  }
+  return true;
+}
+
+bool DmThinBackend::Open() {
+  disk_fd_ = open(GetBasePath().c_str(), O_RDONLY);
+  return disk_fd_ >= 0;
+}
+
+bool DmThinBackend::RemoveSnapshots() {
+  bool res = true;
+  for (unsigned int i = 1; i <= kNumSnapshots; ++i) {
+    if (generations_.at(i) < 0) {
+      continue;
+    }
+    if (!RunCommand("dmsetup remove " + DeviceName(disk_, i)) ||
+        !PoolMessage("delete " +
+          to_string(ThinId(disk_, i, generations_.at(i))))) {
+      res = false;
+    }
+    generations_.at(i) = -1;
+  }
+  if (generations_.at(0) >= 0) {
+    res = PoolMessage("delete " + to_string(ThinId(disk_, 0, 1))) && res;
+    generations_.at(0) = -1;
+  }
+  return res;
+}
+
+bool DmThinBackend::Remove() {
+  if (disk_fd_ >= 0) {
+    close(disk_fd_);
+    disk_fd_ = -1;
+  }
+  if (!inserted_) {
+    // Opened with Open, so whoever made the pool removes it.
+    return RemoveSnapshots();
+  }
+  // Fan-out workers clean up their own snapshots, but they may not have gotten
+  // the chance to.
+  for (unsigned int disk = 0; disk < num_disks_; ++disk) {
+    for (unsigned int i = 0; i <= kNumSnapshots; ++i) {
+      RunCommand("dmsetup remove --retry " + DeviceName(disk, i));
+    }
+  }
+  bool res = RunCommand("dmsetup remove --retry " DM_THIN_POOL);
+  for (const string &loop : pool_loops_) {
+    if (!loop.empty()) {
+      res = RunCommand("losetup -d " + loop) && res;
+    }
+  }
+  pool_loops_.clear();
+  unlink((image_dir_ + "/" DM_THIN_POOL "_data").c_str());
+  unlink((image_dir_ + "/" DM_THIN_POOL "_meta").c_str());
+  generations_.assign(kNumSnapshots + 1, -1);
+  inserted_ = !res;
+  return res;
+}
+
+bool DmThinBackend::Wipe() {
+  if (!RemoveSnapshots()) {
+    return false;
+  }
+  if (disk_fd_ >= 0) {
+    close(disk_fd_);
+    disk_fd_ = -1;
+  }
+  return RunCommand("dmsetup remove --retry " + DeviceName(disk_, 0)) &&
+    PoolMessage("delete " + to_string(ThinId(disk_, 0, 0))) &&
+    CreateDisk() && Open();
+}
+
+bool DmThinBackend::RenewSnapshot(const unsigned int snapshot) {
+  const int old_generation = generations_.at(snapshot);
+  const int generation = (old_generation == 0) ? 1 : 0;
+  const string name = DeviceName(disk_, snapshot);
+  const string table = ThinTable(ThinId(disk_, snapshot, generation));
+  if (!PoolMessage("create_snap " +
+        to_string(ThinId(disk_, snapshot, generation)) + " " +
+        to_string(ThinId(disk_, 0, 1)))) {
+    return false;
+  }
+  if (old_generation < 0) {
+    if (!RunCommand("dmsetup create " + name + " --table \"" + table + "\"")) {
+      return false;
+    }
+  } else {
+    // Swapping the table under an open device is fine, so whoever has the
+    // snapshot open keeps using it.
+    if (!RunCommand("dmsetup reload " + name + " --table \"" + table +
+          "\"") ||
+        !RunCommand("dmsetup resume " + name) ||
+        !PoolMessage("delete " +
+          to_string(ThinId(disk_, snapshot, old_generation)))) {
+      return false;
+    }
+  }
+  generations_.at(snapshot) = generation;
+  return true;
+}
+
+bool DmThinBackend::Snapshot() {
+  // Snapshots are made from a frozen copy of the disk rather than the disk
+  // itself, since the disk would have to be suspended for each one.
+  if (fsync(disk_fd_) < 0 ||
+      !RunCommand("dmsetup suspend " + DeviceName(disk_, 0))) {
+    return false;
+  }
+  const bool frozen = PoolMessage("create_snap " +
+      to_string(ThinId(disk_, 0, 1)) + " " + to_string(ThinId(disk_, 0, 0)));
+  if (!RunCommand("dmsetup resume " + DeviceName(disk_, 0)) || !frozen) {
+    return false;
+  }
+  generations_.at(0) = 1;
+  for (unsigned int i = 1; i <= kNumSnapshots; ++i) {
+    if (!RenewSnapshot(i) || !FlushDevice(GetSnapshotPath(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool DmThinBackend::Restore(const string &snapshot_path,
+    const int snapshot_fd) {
+  const unsigned int snapshot = SnapshotNumber(snapshot_path);
+  if (snapshot == 0 || !RenewSnapshot(snapshot)) {
+    return false;
+  }
+  // Pages cached from the old volume are still in the page cache.
+  return ioctl(snapshot_fd, BLKFLSBUF, 0) == 0;
+}
+
+string DmThinBackend::GetBasePath() {
+  return DM_PATH + DeviceName(disk_, 0);
+}
+
+string DmThinBackend::GetSnapshotPath(const unsigned int snapshot) {
+  return DM_PATH + DeviceName(disk_, snapshot);
+}
+
+/***************************** ReflinkLoopBackend *****************************/
+ReflinkLoopBackend::ReflinkLoopBackend(const unsigned long long disk_size,
+    const bool verbose, const string &image_dir)
+  : SnapshotBackend(disk_size, verbose), image_dir_(image_dir) { }
+
+ReflinkLoopBackend::~ReflinkLoopBackend() {
+  CloseImages();
+}
+
+string ReflinkLoopBackend::GetName() {
+  return kName;
+}
+
+string ReflinkLoopBackend::ImagePath(const unsigned int disk,
+    const unsigned int snapshot) {
+  if (snapshot == 0) {
+    return image_dir_ + "/" REFLINK_DISK_IMAGE + to_string(disk) + ".img";
+  }
+  return image_dir_ + "/" REFLINK_SNAPSHOT_IMAGE + to_string(snapshot) + "_" +
+    to_string(disk) + ".img";
+}
+
+bool ReflinkLoopBackend::OpenImages() {
+  CloseImages();
+  for (unsigned int i = 0; i <= kNumSnapshots; ++i) {
+    const string path = ImagePath(disk_, i);
+    image_fds_.push_back(open(path.c_str(), O_RDWR));
+    loops_.push_back(FindLoop(path));
+    if (image_fds_.back() < 0 || loops_.back().empty()) {
+      CloseImages();
+      return false;
+    }
+  }
+  return true;
+}
+
+void ReflinkLoopBackend::CloseImages() {
+  for (const int fd : image_fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  image_fds_.clear();
+  loops_.clear();
+}
+
+bool ReflinkLoopBackend::Insert() {
+  inserted_ = true;
+  const unsigned long long bytes = disk_size_ * 1024;
+  for (unsigned int disk = 0; disk < num_disks_; ++disk) {
+    for (unsigned int i = 0; i <= kNumSnapshots; ++i) {
+      const string path = ImagePath(disk, i);
+      if (!MakeSparseFile(path, bytes) || AttachLoop(path).empty()) {
+        Remove();
+        return false;
+      }
+    }
+  }
+  if (!Open()) {
+    Remove();
+    return false;
+  }
+  return true;
+}
+
+bool ReflinkLoopBackend::Open() {
+  return OpenImages();
+}
+
+bool ReflinkLoopBackend::Remove() {
+  CloseImages();
+  if (!inserted_) {
+    // Opened with Open, so whoever made the images removes them.
+    return true;
+  }
+  bool res = true;
+  for (unsigned int disk = 0; disk < num_disks_; ++disk) {
+    for (unsigned int i = 0; i <= kNumSnapshots; ++i) {
+      const string path = ImagePath(disk, i);
+      const string loop = FindLoop(path);
+      if (!loop.empty() && !RunCommand("losetup -d " + loop)) {
+        res = false;
+      }
+      unlink(path.c_str());
+    }
+  }
+  inserted_ = !res;
+  return res;
+}
+
+bool ReflinkLoopBackend::Wipe() {
+  // Truncating drops the extents, so the images read back as zeros.
+  const unsigned long long bytes = disk_size_ * 1024;
+  for (unsigned int i = 0; i < image_fds_.size(); ++i) {
+    if (ftruncate(image_fds_.at(i), 0) < 0 ||
+        ftruncate(image_fds_.at(i), bytes) < 0 ||
+        !FlushDevice(loops_.at(i))) {
+      return false;
+    }
+  }
+  return !image_fds_.empty();
+}
+
+bool ReflinkLoopBackend::Snapshot() {
+  // Push everything written to the disk's loop device into its image before
+  // cloning the image.
+  const int disk_fd = open(GetBasePath().c_str(), O_RDONLY);
+  if (disk_fd < 0) {
+    return false;
+  }
+  const bool synced = fsync(disk_fd) == 0 && fsync(image_fds_.at(0)) == 0;
+  close(disk_fd);
+  if (!synced) {
+    return false;
+  }
+  for (unsigned int i = 1; i <= kNumSnapshots; ++i) {
+    if (ioctl(image_fds_.at(i), FICLONE, image_fds_.at(0)) < 0 ||
+        !FlushDevice(loops_.at(i))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ReflinkLoopBackend::Restore(const string &snapshot_path,
+    const int snapshot_fd) {
+  const unsigned int snapshot = SnapshotNumber(snapshot_path);
+  if (snapshot == 0 ||
+      ioctl(image_fds_.at(snapshot), FICLONE, image_fds_.at(0)) < 0) {
+    return false;
+  }
+  // The clone drops the image's cached pages but not the loop device's.
+  return ioctl(snapshot_fd, BLKFLSBUF, 0) == 0;
+}
+
+string ReflinkLoopBackend::GetBasePath() {
+  return (loops_.empty()) ? "" : loops_.at(0);
+}
+
+string ReflinkLoopBackend::GetSnapshotPath(const unsigned int snapshot) {
+  return (snapshot < loops_.size()) ? loops_.at(snapshot) : "";
+}
+
+/******************************* EmulatedBackend ******************************/
+EmulatedBackend::EmulatedBackend(const unsigned long long disk_size,
+    const bool verbose) : SnapshotBackend(disk_size, verbose) { }
+
+string EmulatedBackend::GetName() {
+  return kName;
+}
+
+bool EmulatedBackend::Insert() {
+  return Open();
+}
+
+bool EmulatedBackend::Open() {
+  snapshot_pages_.resize(kNumSnapshots + 1);
+  return true;
+}
+
+bool EmulatedBackend::Remove() {
+  Wipe();
+  snapshot_pages_.clear();
+  free_pages_.clear();
+  return true;
+}
+
+bool EmulatedBackend::Wipe() {
+  for (PageMap &pages : snapshot_pages_) {
+    FreePages(pages);
+  }
+  FreePages(disk_pages_);
+  frozen_ = false;
+  return true;
+}
+
+bool EmulatedBackend::Snapshot() {
+  frozen_ = true;
+  for (PageMap &pages : snapshot_pages_) {
+    FreePages(pages);
+  }
+  return true;
+}
+
+bool EmulatedBackend::Restore(const string &, const int snapshot_fd) {
+  if (!frozen_ || snapshot_fd <= 0 ||
+      (unsigned int) snapshot_fd >= snapshot_pages_.size()) {
+    return false;
+  }
+  FreePages(snapshot_pages_.at(snapshot_fd));
+  return true;
+}
+
+string EmulatedBackend::GetBasePath() {
+  return EMULATED_DISK + to_string(disk_);
+}
+
+string EmulatedBackend::GetSnapshotPath(const unsigned int snapshot) {
+  return EMULATED_SNAPSHOT + to_string(snapshot) + "_" + to_string(disk_);
+}
+
+int EmulatedBackend::DeviceOpen(const string &path, const int) {
+  if (path == GetBasePath()) {
+    return 0;
+  }
+  const unsigned int snapshot = SnapshotNumber(path);
+  if (snapshot == 0 || snapshot >= snapshot_pages_.size()) {
+    return -1;
+  }
+  return snapshot;
+}
+
+bool EmulatedBackend::DeviceWrite(const int fd,
+    const unsigned long long offset, const char *data,
+    const unsigned int size) {
+  if (offset + size > disk_size_ * 1024 ||
+      (unsigned int) fd >= snapshot_pages_.size() || (fd == 0 && frozen_)) {
+    return false;
+  }
+  PageMap &pages = (fd == 0) ? disk_pages_ : snapshot_pages_.at(fd);
+  unsigned int done = 0;
+  while (done < size) {
+    const unsigned long long page = (offset + done) / kPageSize;
+    const unsigned int page_offset = (offset + done) % kPageSize;
+    const unsigned int amount = std::min(kPageSize - page_offset, size - done);
+    auto entry = pages.find(page);
+    if (entry == pages.end()) {
+      auto base = (fd == 0) ? disk_pages_.end() : disk_pages_.find(page);
+      // Zeros over a page that already reads as zeros, as most of a loaded
+      // disk image is, don't need a page.
+      if (amount == kPageSize && base == disk_pages_.end() &&
+          std::all_of(data + done, data + done + amount,
+            [](const char c) { return c == 0; })) {
+        done += amount;
+        continue;
+      }
+      Page copy = NewPage();
+      // Pages written over in full don't need the old data.
+      if (amount < kPageSize) {
+        if (base != disk_pages_.end()) {
+          memcpy(copy.get(), base->second.get(), kPageSize);
+        } else {
+          memset(copy.get(), 0, kPageSize);
+        }
+      }
+      entry = pages.emplace(page, std::move(copy)).first;
+    }
+    memcpy(entry->second.get() + page_offset, data + done, amount);
+    done += amount;
+  }
+  return true;
+}
+
+bool EmulatedBackend::DeviceRead(const int fd,
+    const unsigned long long offset, char *buf, const unsigned int size) {
+  if (offset + size > disk_size_ * 1024 ||
+      (unsigned int) fd >= snapshot_pages_.size()) {
+    return false;
+  }
+  unsigned int done = 0;
+  while (done < size) {
+    const unsigned long long page = (offset + done) / kPageSize;
+    const unsigned int page_offset = (offset + done) % kPageSize;
+    const unsigned int amount = std::min(kPageSize - page_offset, size - done);
+    const char *src = NULL;
+    if (fd != 0) {
+      auto entry = snapshot_pages_.at(fd).find(page);
+      if (entry != snapshot_pages_.at(fd).end()) {
+        src = entry->second.get();
+      }
+    }
+    if (src == NULL) {
+      auto entry = disk_pages_.find(page);
+      if (entry != disk_pages_.end()) {
+        src = entry->second.get();
+      }
+    }
+    if (src == NULL) {
+      memset(buf + done, 0, amount);
+    } else {
+      memcpy(buf + done, src + page_offset, amount);
+    }
+    done += amount;
+  }
+  return true;
+}
+
+void EmulatedBackend::DeviceClose(const int) { }
+
+MemoryUsage EmulatedBackend::GetMemoryUsage() {
+  MemoryUsage res;
+  unsigned long long num_pages = disk_pages_.size();
+  // A node per page with the key, the pointer, and the next pointer.
+  res.overhead += disk_pages_.size() * 3 * sizeof(void *) +
+    disk_pages_.bucket_count() * sizeof(void *);
+  for (const PageMap &pages : snapshot_pages_) {
+    num_pages += pages.size();
+    res.overhead += pages.size() * 3 * sizeof(void *) +
+      pages.bucket_count() * sizeof(void *);
+  }
+  res.payload = num_pages * kPageSize;
+  res.overhead += free_pages_.size() * kPageSize;
+  res.AddVector(free_pages_);
+  return res;
+}
+
+EmulatedBackend::Page EmulatedBackend::NewPage() {
+  if (free_pages_.empty()) {
+    return Page(new char[kPageSize]);
+  }
+  Page res = std::move(free_pages_.back());
+  free_pages_.pop_back();
+  return res;
+}
+
+void EmulatedBackend::FreePages(PageMap &pages) {
+  for (auto &entry : pages) {
+    free_pages_.push_back(std::move(entry.second));
+  }
+  // Keeps the buckets, so a snapshot restored over and over doesn't allocate
+  // them again.
+  pages.clear();
+}
+
+}  // namespace fs_testing
@@ -0,0 +1,291 @@
+#ifndef HARNESS_SNAPSHOT_BACKEND_H
+#define HARNESS_SNAPSHOT_BACKEND_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../utils/MemoryUsage.h"
+
+namespace fs_testing {
+
+/*
+ * Provides the disk a test runs on and the snapshots of it that the workload
+ * is recorded on and crash states are written to. The disk is set up, then
+ * frozen with Snapshot, after which every snapshot starts out as a copy of it
+ * and can be brought back to that copy with Restore.
+ *
+ * A backend can hold several disks, one for each fan-out worker. The process
+ * that calls Insert sets up all of them, and each worker attaches to its own
+ * with Open.
+ */
+class SnapshotBackend {
+ public:
+  static constexpr unsigned int kNumSnapshots = 20;
+
+  virtual ~SnapshotBackend() {}
+
+  /*
+   * Returns the name the backend is picked by (ex. "cow_brd").
+   */
+  virtual std::string GetName() = 0;
+
+  /*
+   * Use disk number disk out of num_disks. Must be called before Insert or
+   * Open.
+   */
+  void SetDisk(const unsigned int disk, const unsigned int num_disks);
+
+  /*
+   * Set up num_disks disks and their snapshots, and open this backend's disk.
+   */
+  virtual bool Insert() = 0;
+
+  /*
+   * Open this backend's disk on devices another backend set up with Insert.
+   */
+  virtual bool Open() = 0;
+
+  /*
+   * Tear down everything made by Insert, or only close the disk if it was
+   * opened with Open.
+   */
+  virtual bool Remove() = 0;
+
+  /*
+   * Drop the data on the disk and all of its snapshots and make the disk
+   * writable again so it can be reused for another test.
+   */
+  virtual bool Wipe() = 0;
+
+  /*
+   * Freeze the disk as it is now as the image every snapshot starts from.
+   */
+  virtual bool Snapshot() = 0;
+
+  /*
+   * Bring the snapshot at snapshot_path back to the frozen disk image.
+   * snapshot_fd is open on snapshot_path and stays usable afterwards.
+   */
+  virtual bool Restore(const std::string &snapshot_path,
+      const int snapshot_fd) = 0;
+
+  /*
+   * Path of the disk to format and set up before it is frozen.
+   */
+  virtual std::string GetBasePath() = 0;
+
+  /*
+   * Path of snapshot number snapshot, counting from 1. Only valid once Insert
+   * or Open has been called.
+   */
+  virtual std::string GetSnapshotPath(const unsigned int snapshot) = 0;
+
+  /*
+   * Open the disk or one of its snapshots by path for DeviceWrite and
+   * DeviceRead, with flags as for open(2). Returns -1 on failure. The default
+   * versions work on the block devices themselves.
+   */
+  virtual int DeviceOpen(const std::string &path, const int flags);
+  virtual bool DeviceWrite(const int fd, const unsigned long long offset,
+      const char *data, const unsigned int size);
+  virtual bool DeviceRead(const int fd, const unsigned long long offset,
+      char *buf, const unsigned int size);
+  virtual void DeviceClose(const int fd);
+
+  /*
+   * Bytes of disk data the backend holds in this process. Nothing for backends
+   * that keep the data in the kernel or on disk.
+   */
+  virtual fs_testing::utils::MemoryUsage GetMemoryUsage();
+
+ protected:
+  // disk_size is in 1 KB blocks.
+  SnapshotBackend(const unsigned long long disk_size, const bool verbose);
+
+  // Run a shell command, hiding its output unless verbose.
+  bool RunCommand(std::string command);
+  // The number of the snapshot at snapshot_path, or 0 if it isn't one.
+  unsigned int SnapshotNumber(const std::string &snapshot_path);
+
+  const unsigned long long disk_size_;
+  const bool verbose_;
+  unsigned int disk_ = 0;
+  unsigned int num_disks_ = 1;
+};
+
+/*
+ * Snapshots kept in RAM by CrashMonkey's cow_brd kernel module.
+ */
+class CowBrdBackend : public SnapshotBackend {
+ public:
+  static constexpr char kName[] = "cow_brd";
+
+  CowBrdBackend(const unsigned long long disk_size, const bool verbose);
+  virtual ~CowBrdBackend();
+  virtual std::string GetName();
+  virtual bool Insert();
+  virtual bool Open();
+  virtual bool Remove();
+  virtual bool Wipe();
+  virtual bool Snapshot();
+  virtual bool Restore(const std::string &snapshot_path,
+      const int snapshot_fd);
+  virtual std::string GetBasePath();
+  virtual std::string GetSnapshotPath(const unsigned int snapshot);
+
+ private:
+  bool inserted_ = false;
+  int disk_fd_ = -1;
+};
+
+/*
+ * Device-mapper thin volumes in one thin pool. The disk is a thin volume and
+ * each snapshot is a thin snapshot of it, so taking one doesn't copy any data.
+ * Restoring a snapshot swaps in a new thin snapshot of the disk and deletes the
+ * old one. The pool lives in sparse files in image_dir, so disks don't have to
+ * fit in RAM.
+ */
+class DmThinBackend : public SnapshotBackend {
+ public:
+  static constexpr char kName[] = "dm-thin";
+
+  DmThinBackend(const unsigned long long disk_size, const bool verbose,
+      const std::string &image_dir);
+  virtual ~DmThinBackend();
+  virtual std::string GetName();
+  virtual bool Insert();
+  virtual bool Open();
+  virtual bool Remove();
+  virtual bool Wipe();
+  virtual bool Snapshot();
+  virtual bool Restore(const std::string &snapshot_path,
+      const int snapshot_fd);
+  virtual std::string GetBasePath();
+  virtual std::string GetSnapshotPath(const unsigned int snapshot);
+
+ private:
+  std::string DeviceName(const unsigned int disk, const unsigned int snapshot);
+  // Each snapshot switches between two thin ids so that the new volume can be
+  // made before the old one is deleted.
+  unsigned int ThinId(const unsigned int disk, const unsigned int snapshot,
+      const unsigned int generation);
+  std::string ThinTable(const unsigned int thin_id);
+  bool PoolMessage(const std::string &message);
+  bool CreateDisk();
+  // Point snapshot at a new thin snapshot of the disk.
+  bool RenewSnapshot(const unsigned int snapshot);
+  bool RemoveSnapshots();
+
+  const std::string image_dir_;
+  bool inserted_ = false;
+  int disk_fd_ = -1;
+  std::vector<std::string> pool_loops_;
+  // Generation of each snapshot's current thin id, or -1 if it hasn't been
+  // made yet. Index 0 is unused.
+  std::vector<int> generations_;
+};
+
+/*
+ * Image files on a file system with reflink support (ex. xfs or btrfs),
+ * attached as loop devices. Snapshots are reflink copies (FICLONE) of the
+ * disk's image, so making or restoring one shares the disk's extents instead
+ * of copying them.
+ */
+class ReflinkLoopBackend : public SnapshotBackend {
+ public:
+  static constexpr char kName[] = "reflink";
+
+  ReflinkLoopBackend(const unsigned long long disk_size, const bool verbose,
+      const std::string &image_dir);
+  virtual ~ReflinkLoopBackend();
+  virtual std::string GetName();
+  virtual bool Insert();
+  virtual bool Open();
+  virtual bool Remove();
+  virtual bool Wipe();
+  virtual bool Snapshot();
+  virtual bool Restore(const std::string &snapshot_path,
+      const int snapshot_fd);
+  virtual std::string GetBasePath();
+  virtual std::string GetSnapshotPath(const unsigned int snapshot);
+
+ private:
+  // Image file of snapshot on disk, where snapshot 0 is the disk itself.
+  std::string ImagePath(const unsigned int disk, const unsigned int snapshot);
+  // Open the images of this backend's disk and find their loop devices.
+  bool OpenImages();
+  void CloseImages();
+
+  const std::string image_dir_;
+  bool inserted_ = false;
+  // Loop devices and open image files of the disk and its snapshots, indexed
+  // like ImagePath.
+  std::vector<std::string> loops_;
+  std::vector<int> image_fds_;
+};
+
+/*
+ * The disk and its snapshots as pages in this process's memory, so nothing
+ * needs root or a kernel module. Each snapshot only holds the pages written to
+ * it since it was last restored and reads anything else from the disk. There
+ * are no block devices, so file systems on it can't be mounted or checked with
+ * fsck; Tester needs an ImageChecker to test crash states on it.
+ */
+class EmulatedBackend : public SnapshotBackend {
+ public:
+  static constexpr char kName[] = "emulated";
+  static constexpr unsigned int kPageSize = 4096;
+
+  EmulatedBackend(const unsigned long long disk_size, const bool verbose);
+  virtual std::string GetName();
+  virtual bool Insert();
+  virtual bool Open();
+  virtual bool Remove();
+  virtual bool Wipe();
+  virtual bool Snapshot();
+  virtual bool Restore(const std::string &snapshot_path,
+      const int snapshot_fd);
+  virtual std::string GetBasePath();
+  virtual std::string GetSnapshotPath(const unsigned int snapshot);
+  // The fd is 0 for the disk and the snapshot number for a snapshot.
+  virtual int DeviceOpen(const std::string &path, const int flags);
+  virtual bool DeviceWrite(const int fd, const unsigned long long offset,
+      const char *data, const unsigned int size);
+  virtual bool DeviceRead(const int fd, const unsigned long long offset,
+      char *buf, const unsigned int size);
+  virtual void DeviceClose(const int fd);
+  virtual fs_testing::utils::MemoryUsage GetMemoryUsage();
+
+ private:
+  typedef std::unique_ptr<char[]> Page;
+  typedef std::unordered_map<unsigned long long, Page> PageMap;
+
+  // A page for writing to, reusing one freed by Restore if there is one.
+  Page NewPage();
+  // Drop every page in pages, keeping them around for NewPage.
+  void FreePages(PageMap &pages);
+
+  // Once frozen the disk can't be written and snapshots read through to it.
+  bool frozen_ = false;
+  PageMap disk_pages_;
+  // Pages written to each snapshot, indexed by snapshot number.
+  std::vector<PageMap> snapshot_pages_;
+  std::vector<Page> free_pages_;
+};
+
+/*
+ * Return a subclass of SnapshotBackend corresponding to the given name.
+ * image_dir is where backends that aren't in RAM keep their data. The caller
+ * is responsible for destroying the object returned by this method.
+ *
+ * Supported names include: cow_brd, dm-thin, reflink, emulated.
+ */
+SnapshotBackend* GetSnapshotBackend(const std::string &name,
+    const unsigned long long disk_size, const bool verbose,
+    const std::string &image_dir);
+
+}  // namespace fs_testing
+
+#endif  // HARNESS_SNAPSHOT_BACKEND_H
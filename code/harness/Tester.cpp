@@ -18,13 +18,21 @@
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <set>
+#include <sstream>
 #include <string>
+#include <tuple>
+#include <unordered_set>
 #include <utility>
 
 #include "FsSpecific.h"
 #include "Tester.h"
 #include "../disk_wrapper_ioctl.h"
 #include "DiskContents.h"
+#include "../results/ProgressJournal.h"
+#include "../utils/DeltaDebug.h"
+#include "../utils/MemoryUsage.h"
+#include "../utils/Trace.h"
 
 #define TEST_CLASS_FACTORY        "test_case_get_instance"
 #define TEST_CLASS_DEFACTORY      "test_case_delete_instance"
@@ -34,13 +42,10 @@
 #define DIRTY_EXPIRE_TIME_PATH "/proc/sys/vm/dirty_expire_centisecs"
 #define DROP_CACHES_PATH       "/proc/sys/vm/drop_caches"
 
-#define FULL_WRAPPER_PATH "/dev/hwm"
-
 // TODO(ashmrtn): Make a quiet and regular version of commands.
 // TODO(ashmrtn): Make so that commands work with user given device path.
 #define SILENT              " > /dev/null 2>&1"
 
-#define MNT_WRAPPER_DEV_PATH FULL_WRAPPER_PATH
 #define MNT_MNT_POINT        "/mnt/snapshot"
 
 #define PART_PART_DRIVE   "fdisk "
@@ -48,25 +53,22 @@
 #define PART_DEL_PART_DRIVE   "fdisk "
 #define PART_DEL_PART_DRIVE_2 " << EOF\no\nw\nEOF\n"
 
-#define WRAPPER_MODULE_NAME "../build/disk_wrapper.ko"
-#define WRAPPER_INSMOD      "insmod " WRAPPER_MODULE_NAME " target_device_path="
-#define WRAPPER_INSMOD2      " flags_device_path="
-#define WRAPPER_RMMOD       "rmmod " WRAPPER_MODULE_NAME
-
-#define COW_BRD_MODULE_NAME "../build/cow_brd.ko"
-#define COW_BRD_INSMOD      "insmod " COW_BRD_MODULE_NAME " num_disks="
-#define COW_BRD_INSMOD2      " num_snapshots="
-#define COW_BRD_INSMOD3      " disk_size="
-#define COW_BRD_RMMOD       "rmmod " COW_BRD_MODULE_NAME
-#define NUM_DISKS           "1"
-#define NUM_SNAPSHOTS       "20"
-#define COW_BRD_PATH        "/dev/cow_ram0"
-
 #define DEV_SECTORS_PATH    "/sys/block/"
 #define DEV_SECTORS_PATH_2  "/size"
 
 #define SECTOR_SIZE 512
 
+// Upper bound on how many crash states are checked while minimizing a single
+// failing crash state.
+#define MINIMIZE_MAX_CHECKS 512U
+
+// The adaptive budget looks at windows of this many crash states (or 1/20th of
+// the requested rounds, if larger) and stops after a window with no new kinds
+// of failure where fewer than this percent of crash states were new disk
+// images.
+#define ADAPTIVE_MIN_WINDOW       256
+#define ADAPTIVE_NEW_IMAGE_PERCENT 1
+
 namespace fs_testing {
 
 using std::calloc;
@@ -74,7 +76,9 @@ using std::cerr;
 using std::chrono::steady_clock;
 using std::chrono::duration;
 using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
 using std::chrono::time_point;
 using std::cout;
 using std::endl;
@@ -83,6 +87,7 @@ using std::ifstream;
 using std::ios;
 using std::ostream;
 using std::ofstream;
+using std::ostringstream;
 using std::pair;
 using std::shared_ptr;
 using std::string;
@@ -91,23 +96,35 @@ using std::vector;
 
 using fs_testing::tests::test_create_t;
 using fs_testing::tests::test_destroy_t;
+using fs_testing::permuter::epoch_op;
+using fs_testing::permuter::EpochOpSector;
 using fs_testing::permuter::Permuter;
+using fs_testing::permuter::WriteIndex;
 using fs_testing::permuter::permuter_create_t;
 using fs_testing::permuter::permuter_destroy_t;
+using fs_testing::utils::DeltaDebug;
 using fs_testing::utils::disk_write;
 using fs_testing::utils::DiskMod;
 using fs_testing::utils::DiskWriteData;
+using fs_testing::utils::MemoryReport;
+using fs_testing::utils::MemoryUsage;
+using fs_testing::utils::Tracer;
+using fs_testing::utils::TraceSpan;
 
-Tester::Tester(const unsigned int dev_size, const unsigned int sector_size,
+Tester::Tester(const unsigned long long dev_size, const unsigned int sector_size,
     const bool verbosity)
   : device_size(dev_size), sector_size_(sector_size), verbose(verbosity) {
-  snapshot_path_ = "/dev/cow_ram_snapshot1_0";
+  snapshot_backend_ = new CowBrdBackend(dev_size, verbosity);
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
+  capture_backend_ = new DiskWrapperBackend(verbosity);
 }
 
 Tester::~Tester() {
   if (fs_specific_ops_ != NULL) {
     delete fs_specific_ops_;
   }
+  delete snapshot_backend_;
+  delete capture_backend_;
 }
 
 void Tester::set_fs_type(const string type) {
@@ -125,23 +142,92 @@ void Tester::set_flag_device(const std::string device_path) {
   flags_device = device_path;
 }
 
-void Tester::StartTestSuite() {
+void Tester::set_permuter_seed(const unsigned long long seed) {
+  permuter_seed_ = seed;
+}
+
+void Tester::set_crash_state_log(const string path) {
+  crash_state_log_ = path;
+}
+
+void Tester::set_minimize_failures(const bool minimize) {
+  minimize_failures_ = minimize;
+}
+
+void Tester::set_adaptive_budget(const bool adaptive) {
+  adaptive_budget_ = adaptive;
+}
+
+void Tester::set_memory_limit(const unsigned long long limit) {
+  memory_limit_ = limit;
+}
+
+void Tester::set_progress_journal(const string path, const bool resume) {
+  progress_journal_ = path;
+  resume_journal_ = resume;
+}
+
+void Tester::set_diff_prefix(const string prefix) {
+  diff_prefix_ = prefix;
+}
+
+void Tester::set_state_range(const unsigned long long first_state,
+    const unsigned long long end_state) {
+  first_state_ = first_state;
+  end_state_ = end_state;
+}
+
+void Tester::StartTestSuite(const string &name) {
   // Construct a new element at the end of our vector.
   test_results_.emplace_back();
   current_test_suite_ = &test_results_.back();
+  current_test_suite_->SetName(name);
 }
 
 void Tester::EndTestSuite() {
   current_test_suite_ = NULL;
 }
 
+void Tester::reset_test_state() {
+  log_data.clear();
+  mods_.clear();
+  checkpointToSnapshot_.clear();
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
+  for (unsigned int i = 0; i < NUM_TIME; ++i) {
+    timing_stats[i] = nanoseconds(0);
+    timing_histograms_[i].Reset();
+  }
+  checkpoint_latencies_.clear();
+  memory_report_.Clear();
+  fingerprint_usage_ = MemoryUsage();
+}
+
+void Tester::AddCheckpointLatency(microseconds latency) {
+  checkpoint_latencies_.push_back(latency);
+}
+
+void Tester::PrintCheckpointLatency(ostream& os) {
+  if (checkpoint_latencies_.empty()) {
+    return;
+  }
+  microseconds total(0);
+  microseconds max(0);
+  for (const microseconds &latency : checkpoint_latencies_) {
+    total += latency;
+    max = std::max(max, latency);
+  }
+  os << "Checkpoint round trip over " << checkpoint_latencies_.size() <<
+    " checkpoints: mean " << total.count() / checkpoint_latencies_.size() <<
+    " us, max " << max.count() << " us" << endl;
+}
+
 unsigned int Tester::GetPostRunDelay() {
   return fs_specific_ops_->GetPostRunDelaySeconds();
 }
 
 int Tester::clone_device() {
   std::cout << "cloning device " << device_raw << std::endl;
-  if (ioctl(cow_brd_fd, COW_BRD_SNAPSHOT) < 0) {
+  if (!snapshot_backend_->Snapshot()) {
     return DRIVE_CLONE_ERR;
   }
 
@@ -149,7 +235,7 @@ int Tester::clone_device() {
 }
 
 int Tester::clone_device_restore(int snapshot_fd, bool reread) {
-  if (ioctl(snapshot_fd, COW_BRD_RESTORE_SNAPSHOT) < 0) {
+  if (!snapshot_backend_->Restore(snapshot_path_, snapshot_fd)) {
     return DRIVE_CLONE_RESTORE_ERR;
   }
   int res;
@@ -177,7 +263,7 @@ int Tester::mount_device_raw(const char* opts) {
 int Tester::mount_wrapper_device(const char* opts) {
   // TODO(ashmrtn): Make some sort of boolean that tracks if we should use the
   // first parition or not?
-  string dev(MNT_WRAPPER_DEV_PATH);
+  string dev(capture_backend_->GetDevicePath());
   //dev += "1";
   return mount_device(dev.c_str(), opts);
 }
@@ -226,13 +312,9 @@ int Tester::mapCheckpointToSnapshot(int checkpoint) {
 }
 
 int Tester::getNewDiskClone(int checkpoint) {
-  string new_snapshot_path;
-  string path(snapshot_path_);
-  string device_number = path.substr(path.rfind('_'));
-  string snapshot_number = to_string(checkpoint + 2);
-  new_snapshot_path = "/dev/cow_ram_snapshot";
-  new_snapshot_path += snapshot_number;
-  new_snapshot_path += device_number;
+  // Snapshot 1 is the one the workload runs on.
+  const string new_snapshot_path =
+    snapshot_backend_->GetSnapshotPath(checkpoint + 2);
   // Finally set snapshot_path_ to the new snapshot path
   snapshot_path_ = new_snapshot_path;
   string command = fs_specific_ops_->GetNewUUIDCommand(new_snapshot_path);
@@ -244,196 +326,134 @@ void Tester::getCompleteRunDiskClone() {
   snapshot_path_ = checkpointToSnapshot_[0];
 }
 
-int Tester::insert_cow_brd() {
-  if (cow_brd_fd < 0) {
-    string command(COW_BRD_INSMOD);
-    command += NUM_DISKS;
-    command += COW_BRD_INSMOD2;
-    command += NUM_SNAPSHOTS;
-    command += COW_BRD_INSMOD3;
-    command += std::to_string(device_size);
-    if (!verbose) {
-      command += SILENT;
-    }
-    if (system(command.c_str()) != 0) {
-      cow_brd_fd = -1;
-      return WRAPPER_INSERT_ERR;
-    }
+bool Tester::set_snapshot_backend(const string &name,
+    const string &image_dir) {
+  SnapshotBackend *backend =
+    GetSnapshotBackend(name, device_size, verbose, image_dir);
+  if (backend == NULL) {
+    return false;
   }
-  cow_brd_inserted = true;
-  cow_brd_fd = open("/dev/cow_ram0", O_RDONLY);
-  if (cow_brd_fd < 0) {
-    if (system(COW_BRD_RMMOD) != 0) {
-      cow_brd_fd = -1;
-      cow_brd_inserted = false;
-      return WRAPPER_REMOVE_ERR;
-    }
+  delete snapshot_backend_;
+  snapshot_backend_ = backend;
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
+  return true;
+}
+
+void Tester::set_snapshot_disk(const unsigned int disk,
+    const unsigned int num_disks) {
+  snapshot_backend_->SetDisk(disk, num_disks);
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
+}
+
+string Tester::get_snapshot_base_path() {
+  return snapshot_backend_->GetBasePath();
+}
+
+void Tester::set_image_checker(ImageChecker *checker) {
+  image_checker_ = checker;
+}
+
+int Tester::insert_snapshot_devices() {
+  TraceSpan span("insert snapshot devices", "module");
+  if (!snapshot_backend_->Insert()) {
+    return WRAPPER_INSERT_ERR;
   }
+  // Some backends only know their device paths once they are set up.
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
   return SUCCESS;
 }
 
-int Tester::remove_cow_brd() {
-  // Sometimes the disk wrapper module takes time to unload.
-  // So retry cow-brd unload for upto a second.
-  milliseconds elapsed;
-  if (cow_brd_inserted) {
-    if (cow_brd_fd != -1) {
-      close(cow_brd_fd);
-      cow_brd_fd = -1;
-      cow_brd_inserted = false;
-    }
-    int res, num_tries = 0;
-    string command = COW_BRD_RMMOD SILENT;
-    time_point<steady_clock> rmmod_start_time = steady_clock::now();
-    do {
-      res = system(command.c_str());
-      time_point<steady_clock> rmmod_end_time = steady_clock::now();
-      elapsed = duration_cast<milliseconds>(rmmod_end_time - rmmod_start_time);
-      if (res != 0) {
-	usleep(500);
-        num_tries ++;
-      }
-    } while (res != 0 && elapsed.count() < 1000);
-      
-     if (res != 0) {
-        cow_brd_inserted = true;
-        return WRAPPER_REMOVE_ERR;
-      }
-     
-     //cout << "Time to rmmod " << elapsed.count() << " num tries = " << num_tries << endl;
+int Tester::open_snapshot_devices() {
+  if (!snapshot_backend_->Open()) {
+    return DRIVE_CLONE_ERR;
   }
+  snapshot_path_ = snapshot_backend_->GetSnapshotPath(1);
   return SUCCESS;
 }
 
-int Tester::insert_wrapper() {
-  if (!wrapper_inserted) {
-    string command(WRAPPER_INSMOD);
-    // TODO(ashmrtn): Make this much MUCH cleaner...
-    command += "/dev/cow_ram_snapshot1_0";
-    command += WRAPPER_INSMOD2;
-    command += flags_device;
-    if (!verbose) {
-      command += SILENT;
-    }
-    if (system(command.c_str()) != 0) {
-      wrapper_inserted = false;
-      return WRAPPER_INSERT_ERR;
-    }
+int Tester::remove_snapshot_devices() {
+  TraceSpan span("remove snapshot devices", "module");
+  if (!snapshot_backend_->Remove()) {
+    return WRAPPER_REMOVE_ERR;
   }
-  wrapper_inserted = true;
   return SUCCESS;
 }
 
-int Tester::remove_wrapper() {
-  milliseconds elapsed;
-  if (wrapper_inserted) {
-    int res, num_tries = 0;
-    string command = WRAPPER_RMMOD SILENT;
-    time_point<steady_clock> rmmod_start_time = steady_clock::now();
-    do {
-      res = system(command.c_str());
-      time_point<steady_clock> rmmod_end_time = steady_clock::now();
-      elapsed = duration_cast<milliseconds>(rmmod_end_time - rmmod_start_time);
-      if (res != 0) {
-        usleep(500);
-        num_tries ++;
-      }
-    } while (res != 0 && elapsed.count() < 1000);
+int Tester::wipe_snapshot_devices() {
+  if (!snapshot_backend_->Wipe()) {
+    return DRIVE_CLONE_ERR;
+  }
+  return SUCCESS;
+}
 
-     if (res != 0) {
-        wrapper_inserted = true;
-        return WRAPPER_REMOVE_ERR;
-      }
+bool Tester::set_capture_backend(const string &name,
+    const string &log_device) {
+  CaptureBackend *backend = GetCaptureBackend(name, verbose, log_device);
+  if (backend == NULL) {
+    return false;
+  }
+  delete capture_backend_;
+  capture_backend_ = backend;
+  return true;
+}
+
+void Tester::set_wrapper_instance(const unsigned int instance) {
+  capture_backend_->SetInstance(instance);
+}
+
+int Tester::insert_wrapper() {
+  TraceSpan span("insert wrapper", "module");
+  if (!capture_backend_->Insert(snapshot_backend_->GetSnapshotPath(1),
+        flags_device)) {
+    return WRAPPER_INSERT_ERR;
+  }
+  return SUCCESS;
+}
 
-     cout << "Time to rmmod " << elapsed.count() << " num tries = " << num_tries << endl;
+int Tester::remove_wrapper() {
+  TraceSpan span("remove wrapper", "module");
+  if (!capture_backend_->Remove()) {
+    return WRAPPER_REMOVE_ERR;
   }
-  wrapper_inserted = false;
   return SUCCESS;
 }
 
 int Tester::get_wrapper_ioctl() {
-  ioctl_fd = open(FULL_WRAPPER_PATH, O_RDONLY | O_CLOEXEC);
-  if (ioctl_fd == -1) {
+  if (!capture_backend_->Open()) {
     return WRAPPER_OPEN_DEV_ERR;
   }
   return SUCCESS;
 }
 
 void Tester::put_wrapper_ioctl() {
-  if (ioctl_fd != -1) {
-    close(ioctl_fd);
-    ioctl_fd = -1;
-  }
+  capture_backend_->Close();
 }
 
 void Tester::begin_wrapper_logging() {
-  if (ioctl_fd != -1) {
-    ioctl(ioctl_fd, HWM_LOG_ON);
-  }
+  capture_backend_->BeginLogging();
 }
 
 void Tester::end_wrapper_logging() {
-  if (ioctl_fd != -1) {
-    ioctl(ioctl_fd, HWM_LOG_OFF);
-  }
+  capture_backend_->EndLogging();
 }
 
 int Tester::get_wrapper_log() {
-  if (ioctl_fd != -1) {
-    while (1) {
-      disk_write_op_meta meta;
-
-      int result = ioctl(ioctl_fd, HWM_GET_LOG_META, &meta);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          break;
-        } else if (errno == EFAULT) {
-          cerr << "efault occurred\n";
-          log_data.clear();
-          return WRAPPER_DATA_ERR;
-        }
-      }
-
-      char* data = new char[meta.size];
-      result = ioctl(ioctl_fd, HWM_GET_LOG_DATA, data);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          // Should never reach here as loop will break when getting the size
-          // above.
-          break;
-        } else if (errno == EFAULT) {
-          cerr << "efault occurred\n";
-          delete[] data;
-          log_data.clear();
-          return WRAPPER_MEM_ERR;
-        }
-      }
-      log_data.emplace_back(meta, data);
-      delete[] data;
-
-      result = ioctl(ioctl_fd, HWM_NEXT_ENT);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          // Should never reach here as loop will break when getting the size
-          // above.
-          break;
-        } else {
-          cerr << "Error getting next log entry\n";
-          log_data.clear();
-          break;
-        }
-      }
-    }
+  const bool res = capture_backend_->FetchLog(
+      [this](const disk_write_op_meta &meta, const char *data) {
+        log_data.emplace_back(meta, data);
+      });
+  if (!res) {
+    log_data.clear();
+    return WRAPPER_DATA_ERR;
   }
   std::cout << "fetched " << log_data.size() << " log data entries"
       << std::endl;
+  capture_backend_->PrintStats(std::cout);
   return SUCCESS;
 }
 
 void Tester::clear_wrapper_log() {
-  if (ioctl_fd != -1) {
-    ioctl(ioctl_fd, HWM_CLR_LOG);
-  }
+  capture_backend_->ClearLog();
 }
 
 int Tester::GetChangeData(const int fd) {
@@ -490,13 +510,10 @@ int Tester::GetChangeData(const int fd) {
 }
 
 int Tester::CreateCheckpoint() {
-  if (ioctl_fd == -1) {
+  if (!capture_backend_->Checkpoint()) {
     return WRAPPER_DATA_ERR;
   }
-  if (ioctl(ioctl_fd, HWM_CHECKPOINT) == 0) {
-    return SUCCESS;
-  }
-  return WRAPPER_DATA_ERR;
+  return SUCCESS;
 }
 
 int Tester::test_load_class(const char* path) {
@@ -509,6 +526,9 @@ void Tester::test_unload_class() {
 }
 
 int Tester::permuter_load_class(const char* path) {
+  // Journals only need to tell permuters apart, not find them again.
+  const string library(path);
+  permuter_name_ = library.substr(library.find_last_of('/') + 1);
   return permuter_loader.load_class<permuter_create_t *>(path,
       PERMUTER_CLASS_FACTORY, PERMUTER_CLASS_DEFACTORY);
 }
@@ -637,10 +657,21 @@ int Tester::test_run(const int change_fd, const int checkpoint) {
  * SingleTestInfo object is modified to reflect the results of fsck and the user
  * test case.
  */
-vector<milliseconds> Tester::test_fsck_and_user_test(
+vector<nanoseconds> Tester::test_fsck_and_user_test(
     const string device_path, const unsigned int last_checkpoint,
     SingleTestInfo &test_info, bool automate_check_test) {
-  vector<milliseconds> res(3, duration<int, std::milli>(-1));
+  vector<nanoseconds> res(3, nanoseconds(-1));
+  if (image_checker_ != NULL) {
+    time_point<steady_clock> check_start_time = steady_clock::now();
+    image_checker_->Check(*snapshot_backend_, device_path, last_checkpoint,
+        test_info);
+    time_point<steady_clock> check_end_time = steady_clock::now();
+    res.at(1) = duration_cast<nanoseconds>(check_end_time - check_start_time);
+    Tracer::Complete("check", "crash state", check_start_time, check_end_time,
+        test_info.test_num);
+    return res;
+  }
+
   // Try mounting the file system so that the kernel can clean up orphan lists
   // and anything else it may need to so that fsck does a better job later if
   // we run it.
@@ -650,7 +681,9 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
     test_info.fs_test.SetError(FileSystemTestResult::kKernelMount);
   }
   time_point<steady_clock> mount_end_time = steady_clock::now();
-  res.at(2) = duration_cast<milliseconds>(mount_end_time - mount_start_time);
+  res.at(2) = duration_cast<nanoseconds>(mount_end_time - mount_start_time);
+  Tracer::Complete("mount", "crash state", mount_start_time, mount_end_time,
+      test_info.test_num);
 
   // Only run fsck if we failed when mounting the file system above.
   if (test_info.fs_test.GetError() & FileSystemTestResult::kKernelMount) {
@@ -670,7 +703,7 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
       test_info.fs_test.SetError(FileSystemTestResult::kOther);
       test_info.fs_test.error_description = "error running fsck";
       time_point<steady_clock> fsck_end_time = steady_clock::now();
-      res.at(0) = duration_cast<milliseconds>(fsck_end_time - fsck_start_time);
+      res.at(0) = duration_cast<nanoseconds>(fsck_end_time - fsck_start_time);
       return res;
     }
     while (!feof(pipe)) {
@@ -682,7 +715,9 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
     }
     test_info.fs_test.fs_check_return = pclose(pipe);
     time_point<steady_clock> fsck_end_time = steady_clock::now();
-    res.at(0) = duration_cast<milliseconds>(fsck_end_time - fsck_start_time);
+    res.at(0) = duration_cast<nanoseconds>(fsck_end_time - fsck_start_time);
+    Tracer::Complete("fsck", "crash state", fsck_start_time, fsck_end_time,
+        test_info.test_num);
     // End fsck timing.
 
     if (!WIFEXITED(test_info.fs_test.fs_check_return)) {
@@ -709,7 +744,9 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
       return res;
     }
     mount_end_time = steady_clock::now();
-    res.at(2) += duration_cast<milliseconds>(mount_end_time - mount_start_time);
+    res.at(2) += duration_cast<nanoseconds>(mount_end_time - mount_start_time);
+    Tracer::Complete("mount", "crash state", mount_start_time, mount_end_time,
+        test_info.test_num);
   }
 
   // Begin test case timing.
@@ -726,8 +763,10 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
                                             &test_info.data_test);
   }
   time_point<steady_clock> test_case_end_time = steady_clock::now();
-  res.at(1) = duration_cast<milliseconds>(
+  res.at(1) = duration_cast<nanoseconds>(
       test_case_end_time - test_case_start_time);
+  Tracer::Complete("check", "crash state", test_case_start_time,
+      test_case_end_time, test_info.test_num);
   // End test case timing.
 
   // File system was either mounted at the very start of this segment or after
@@ -745,7 +784,9 @@ vector<milliseconds> Tester::test_fsck_and_user_test(
     }
   } while (umount_res < 0 && err == EBUSY);
   mount_end_time = steady_clock::now();
-  res.at(2) += duration_cast<milliseconds>(mount_end_time - mount_start_time);
+  res.at(2) += duration_cast<nanoseconds>(mount_end_time - mount_start_time);
+  Tracer::Complete("umount", "crash state", mount_start_time, mount_end_time,
+      test_info.test_num);
 
   return res;
 }
@@ -760,7 +801,7 @@ bool Tester::check_disk_and_snapshot_contents(string disk_path, int last_checkpo
   string snapshot_path;
   snapshot_path = checkpointToSnapshot_[last_checkpoint];
   ofstream diff_file;
-  diff_file.open("diff-at-check" + to_string(last_checkpoint),
+  diff_file.open(diff_prefix_ + "diff-at-check" + to_string(last_checkpoint),
     std::fstream::out | std::fstream::app);
 
   DiskContents disk1(disk_path, fs_type), disk2(snapshot_path, fs_type);
@@ -809,19 +850,516 @@ bool Tester::check_disk_and_snapshot_contents(string disk_path, int last_checkpo
   return false;
 }
 
+int Tester::test_check_crash_states(const vector<string> &descriptor_files,
+    const std::set<unsigned int> &test_nums, ofstream& log) {
+  assert(current_test_suite_ != NULL);
+  time_point<steady_clock> start_time = steady_clock::now();
+  const unsigned long long profile_id = get_profile_id();
+
+  for (const string &file : descriptor_files) {
+    ifstream descriptors(file, ios::binary);
+    if (!descriptors.is_open()) {
+      cerr << "Unable to open crash state file " << file << endl;
+      return TEST_CASE_FILE_ERR;
+    }
+
+    while (descriptors.peek() != EOF) {
+      SingleTestInfo test_info;
+      unsigned long long descriptor_profile;
+      unsigned int sector_size;
+      if (!test_info.permute_data.ReadDescriptor(descriptors,
+            descriptor_profile, test_info.test_num, sector_size)) {
+        cerr << "Malformed crash state in " << file << endl;
+        return TEST_CASE_FILE_ERR;
+      }
+      if (!test_nums.empty() && test_nums.count(test_info.test_num) == 0) {
+        continue;
+      }
+      if (descriptor_profile != profile_id) {
+        cerr << "Crash state for test #" << test_info.test_num << " in " <<
+          file << " was generated from a different profile" << endl;
+        log << "Crash state for test #" << test_info.test_num << " in " <<
+          file << " was generated from a different profile" << endl;
+        continue;
+      }
+      if (!rebuild_crash_state(test_info.permute_data, sector_size)) {
+        cerr << "Crash state for test #" << test_info.test_num << " in " <<
+          file << " does not match the loaded profile" << endl;
+        continue;
+      }
+
+      test_crash_state(test_info.permute_data.crash_state, test_info, log);
+      if (minimize_failures_ &&
+          test_info.GetTestResult() != SingleTestInfo::kPassed) {
+        minimize_crash_state(test_info, profile_id, log);
+      }
+    }
+  }
+
+  time_point<steady_clock> end_time = steady_clock::now();
+  timing_stats[TOTAL_TIME] = end_time - start_time;
+  return SUCCESS;
+}
+
+bool Tester::rebuild_crash_state(PermuteTestResult &state,
+    unsigned int sector_size) {
+  for (DiskWriteData &dwd : state.crash_state) {
+    if (dwd.bio_index >= log_data.size()) {
+      return false;
+    }
+    epoch_op op = {dwd.bio_index, log_data.at(dwd.bio_index)};
+    if (dwd.full_bio) {
+      if (dwd.bio_sector_index == PermuteTestResult::kNoDataSector) {
+        // Flush half of a split flush, which only ever carries the flags.
+        op.op.metadata.size = 0;
+        op.op.clear_data();
+      }
+      dwd = op.ToWriteData();
+      continue;
+    }
+
+    if (sector_size == 0) {
+      return false;
+    }
+    vector<EpochOpSector> sectors = op.ToSectors(sector_size);
+    if (dwd.bio_sector_index >= sectors.size()) {
+      return false;
+    }
+    dwd = sectors.at(dwd.bio_sector_index).ToWriteData();
+  }
+  return true;
+}
+
+unsigned long long Tester::get_image_fingerprint(
+    const vector<DiskWriteData> &crash_state) {
+  WriteIndex image;
+  vector<unsigned int> overwritten;
+  for (unsigned int i = 0; i < crash_state.size(); ++i) {
+    const DiskWriteData &dwd = crash_state.at(i);
+    if (dwd.size == 0) {
+      continue;
+    }
+    image.Insert(dwd.disk_offset,
+        (unsigned long long) dwd.disk_offset + dwd.size, i, 0, overwritten);
+    overwritten.clear();
+  }
+
+  // FNV-1a over which bytes of which bio end up at each disk location.
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  auto mix = [&hash](unsigned long long val) {
+    for (unsigned int i = 0; i < sizeof(val); ++i) {
+      hash ^= (val >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+  };
+  for (const auto &segment : image.GetSegments()) {
+    const DiskWriteData &owner = crash_state.at(segment.second.owner);
+    unsigned long long bio_offset = segment.first - owner.disk_offset;
+    if (!owner.full_bio) {
+      bio_offset += (unsigned long long) owner.bio_sector_index * sector_size_;
+    }
+    mix(segment.first);
+    mix(segment.second.end);
+    mix(owner.bio_index);
+    mix(bio_offset);
+  }
+  return hash;
+}
+
+unsigned long long Tester::get_profile_id() {
+  // FNV-1a over the metadata of every logged operation. The timestamps make
+  // this unique to a single profiling run.
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+  auto mix = [&hash](unsigned long long val) {
+    for (unsigned int i = 0; i < sizeof(val); ++i) {
+      hash ^= (val >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+  };
+  mix(log_data.size());
+  for (const disk_write &dw : log_data) {
+    mix(dw.metadata.bi_flags);
+    mix(dw.metadata.bi_rw);
+    mix(dw.metadata.write_sector);
+    mix(dw.metadata.size);
+    mix(dw.metadata.time_ns);
+  }
+  return hash;
+}
+
+/*
+ * Restore the snapshot, write out the given crash state, and run fsck and the
+ * user test on it. Results are logged and tallied in the current test suite.
+ */
+void Tester::test_crash_state(vector<DiskWriteData> &crash_state,
+    SingleTestInfo &test_info, ofstream &log) {
+  run_crash_state(crash_state, test_info, true);
+  test_info.PrintResults(log);
+  current_test_suite_->TallyReorderingResult(test_info);
+}
+
+/*
+ * Same as test_crash_state, but only fills in test_info. Timing stats are only
+ * recorded if timed is set.
+ */
+void Tester::run_crash_state(vector<DiskWriteData> &crash_state,
+    SingleTestInfo &test_info, const bool timed) {
+  TraceSpan state_span("crash state", "crash state", test_info.test_num);
+  // Restore disk clone.
+  int snapshot_fd = snapshot_backend_->DeviceOpen(snapshot_path_, O_WRONLY);
+  if (snapshot_fd < 0) {
+    test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
+    return;
+  }
+  // Begin snapshot timing.
+  time_point<steady_clock> snapshot_start_time = steady_clock::now();
+  if (clone_device_restore(snapshot_fd, false) != SUCCESS) {
+    test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
+    snapshot_backend_->DeviceClose(snapshot_fd);
+    return;
+  }
+  time_point<steady_clock> snapshot_end_time = steady_clock::now();
+  if (timed) {
+    record_timing(SNAPSHOT_TIME, snapshot_end_time - snapshot_start_time);
+  }
+  Tracer::Complete("restore snapshot", "crash state", snapshot_start_time,
+      snapshot_end_time, test_info.test_num);
+  // End snapshot timing.
+
+  // Write recorded data out to block device in different orders so that we
+  // can if they are all valid or not.
+  time_point<steady_clock> bio_write_start_time = steady_clock::now();
+  const int write_data_res =
+    test_write_data(snapshot_fd, crash_state.begin(),
+        crash_state.end());
+  time_point<steady_clock> bio_write_end_time = steady_clock::now();
+  if (timed) {
+    record_timing(BIO_WRITE_TIME, bio_write_end_time - bio_write_start_time);
+  }
+  Tracer::Complete("write bios", "crash state", bio_write_start_time,
+      bio_write_end_time, test_info.test_num);
+  if (!write_data_res) {
+    test_info.fs_test.SetError(FileSystemTestResult::kBioWrite);
+    snapshot_backend_->DeviceClose(snapshot_fd);
+    return;
+  }
+  snapshot_backend_->DeviceClose(snapshot_fd);
+
+  // Test the crash state that was just written out.
+  vector<nanoseconds> check_res = test_fsck_and_user_test(snapshot_path_,
+      test_info.permute_data.last_checkpoint, test_info, false);
+
+  // Accounting for time it took to run the test.
+  if (!timed) {
+    return;
+  }
+  if (check_res.at(0).count() > -1) {
+    record_timing(FSCK_TIME, check_res.at(0));
+  }
+  if (check_res.at(1).count() > -1) {
+    record_timing(TEST_CASE_TIME, check_res.at(1));
+  }
+  if (check_res.at(2).count() > -1) {
+    record_timing(MOUNT_TIME, check_res.at(2));
+  }
+  record_timing(CRASH_STATE_TIME, steady_clock::now() - snapshot_start_time);
+}
+
+int Tester::minimize_crash_state(const SingleTestInfo &failed,
+    const unsigned long long profile_id, ofstream &log) {
+  const vector<DiskWriteData> &state = failed.permute_data.crash_state;
+  if (state.empty()) {
+    return SUCCESS;
+  }
+
+  // Rebuild every write up to the last bio in the crash state so we know what
+  // was dropped. Bios that show up whole in the crash state stay whole, and the
+  // rest are split into sectors if the crash state uses sectors at all.
+  bool sector_state = false;
+  unsigned int last_bio = 0;
+  std::set<pair<unsigned int, unsigned int>> kept;
+  std::set<unsigned int> full_bios;
+  for (const DiskWriteData &dwd : state) {
+    last_bio = std::max(last_bio, dwd.bio_index);
+    if (dwd.size == 0) {
+      continue;
+    }
+    if (dwd.full_bio) {
+      full_bios.insert(dwd.bio_index);
+    } else {
+      sector_state = true;
+    }
+    kept.insert({dwd.bio_index, dwd.full_bio ? 0 : dwd.bio_sector_index});
+  }
+
+  // Everything before the barrier that ended the epoch before the crash was
+  // persisted, so no real crash state can drop any of it. The data half of a
+  // flush with data starts the next epoch instead.
+  unsigned int persisted_end = 0;
+  for (unsigned int i = 0; i <= last_bio && i < log_data.size(); ++i) {
+    disk_write &dw = log_data.at(i);
+    if (!dw.is_barrier()) {
+      continue;
+    }
+    if ((dw.has_flush_flag() || dw.has_flush_seq_flag()) &&
+        dw.has_write_flag() && !dw.has_FUA_flag() && dw.metadata.size > 0) {
+      persisted_end = i;
+    } else if (i < last_bio) {
+      persisted_end = i + 1;
+    }
+  }
+
+  vector<DiskWriteData> complete;
+  vector<unsigned int> dropped;
+  vector<unsigned int> persisted;
+  vector<unsigned int> final_epoch;
+  for (unsigned int i = 0; i <= last_bio && i < log_data.size(); ++i) {
+    if (log_data.at(i).is_checkpoint() || log_data.at(i).metadata.size == 0) {
+      continue;
+    }
+    epoch_op op = {i, log_data.at(i)};
+    vector<DiskWriteData> writes;
+    if (!sector_state || full_bios.count(i)) {
+      writes.push_back(op.ToWriteData());
+    } else {
+      for (EpochOpSector &sector : op.ToSectors(sector_size_)) {
+        writes.push_back(sector.ToWriteData());
+      }
+    }
+    for (const DiskWriteData &dwd : writes) {
+      if (!kept.count({dwd.bio_index,
+            dwd.full_bio ? 0 : dwd.bio_sector_index})) {
+        dropped.push_back(complete.size());
+      }
+      if (i < persisted_end) {
+        persisted.push_back(complete.size());
+      } else {
+        final_epoch.push_back(complete.size());
+      }
+      complete.push_back(dwd);
+    }
+  }
+
+  // A candidate reproduces the failure if it fails in the same way.
+  auto same_failure = [&failed](const SingleTestInfo &other) {
+    return other.GetTestResult() == failed.GetTestResult() &&
+      other.fs_test.GetError() == failed.fs_test.GetError() &&
+      other.data_test.GetError() == failed.data_test.GetError();
+  };
+  auto run_writes = [&](const vector<unsigned int> &indices) {
+    SingleTestInfo test_info;
+    test_info.test_num = failed.test_num;
+    test_info.permute_data.last_checkpoint =
+      failed.permute_data.last_checkpoint;
+    test_info.permute_data.state_index = failed.permute_data.state_index;
+    for (const unsigned int index : indices) {
+      test_info.permute_data.crash_state.push_back(complete.at(index));
+    }
+    // Candidates would skew the per crash state timings, so they are only
+    // counted as part of the time spent minimizing.
+    run_crash_state(test_info.permute_data.crash_state, test_info, false);
+    return same_failure(test_info);
+  };
+
+  cout << "Minimizing test #" << failed.test_num << endl;
+  log << "Minimizing test #" << failed.test_num << endl;
+  time_point<steady_clock> minimize_start_time = steady_clock::now();
+
+  // First try to find the fewest dropped writes that still cause the failure,
+  // keeping everything else.
+  unsigned int num_checks = 0;
+  vector<unsigned int> culprits = DeltaDebug(dropped,
+      [&](const vector<unsigned int> &drop) {
+        vector<unsigned int> keep;
+        auto next_drop = drop.begin();
+        for (unsigned int i = 0; i < complete.size(); ++i) {
+          if (next_drop != drop.end() && *next_drop == i) {
+            ++next_drop;
+            continue;
+          }
+          keep.push_back(i);
+        }
+        return run_writes(keep);
+      }, MINIMIZE_MAX_CHECKS, &num_checks);
+
+  // If nothing needs to be dropped, the failure is caused by writes that were
+  // persisted, so find the fewest of those from the crash epoch that still
+  // cause it instead. Earlier epochs are always kept whole.
+  const bool minimized_kept = culprits.empty();
+  vector<unsigned int> minimal;
+  if (minimized_kept) {
+    unsigned int kept_checks = 0;
+    culprits = DeltaDebug(final_epoch,
+        [&](const vector<unsigned int> &keep) {
+          vector<unsigned int> writes(persisted);
+          writes.insert(writes.end(), keep.begin(), keep.end());
+          return run_writes(writes);
+        }, MINIMIZE_MAX_CHECKS - std::min(num_checks, MINIMIZE_MAX_CHECKS),
+        &kept_checks);
+    num_checks += kept_checks;
+    minimal = persisted;
+    minimal.insert(minimal.end(), culprits.begin(), culprits.end());
+  } else {
+    std::set<unsigned int> drop(culprits.begin(), culprits.end());
+    for (unsigned int i = 0; i < complete.size(); ++i) {
+      if (!drop.count(i)) {
+        minimal.push_back(i);
+      }
+    }
+  }
+
+  record_timing(MINIMIZE_TIME, steady_clock::now() - minimize_start_time);
+
+  std::ostringstream summary;
+  summary << "Minimized test #" << failed.test_num << " with " << num_checks <<
+    " checks: " << culprits.size() << " of " <<
+    (minimized_kept ? final_epoch.size() : dropped.size()) <<
+    (minimized_kept ? " persisted" : " dropped") <<
+    " writes needed to reproduce" << endl;
+  for (const unsigned int index : culprits) {
+    const DiskWriteData &dwd = complete.at(index);
+    summary << "\t(" << dwd.bio_index;
+    if (!dwd.full_bio) {
+      summary << ", " << dwd.bio_sector_index;
+    }
+    summary << ") disk offset " << dwd.disk_offset << ", " << dwd.size <<
+      " bytes" << endl;
+  }
+  cout << summary.str();
+  log << summary.str();
+
+  if (!crash_state_log_.empty()) {
+    PermuteTestResult minimal_state(failed.permute_data);
+    minimal_state.crash_state.clear();
+    for (const unsigned int index : minimal) {
+      minimal_state.crash_state.push_back(complete.at(index));
+    }
+    ofstream descriptors(crash_state_log_ + ".min", ios::binary | ios::app);
+    if (!descriptors.is_open() ||
+        !minimal_state.WriteDescriptor(descriptors, profile_id,
+          failed.test_num, sector_size_)) {
+      cerr << "Unable to save minimized crash state" << endl;
+      return LOG_CLONE_ERR;
+    }
+  }
+
+  return SUCCESS;
+}
+
 int Tester::test_check_random_permutations(bool full_bio_replay,
     const int num_rounds, ofstream& log) {
   assert(current_test_suite_ != NULL);
   time_point<steady_clock> start_time = steady_clock::now();
   Permuter *p = permuter_loader.get_instance();
   p->InitDataVector(sector_size_, log_data);
+  // Hashes the whole profile, so only do it once.
+  const unsigned long long profile_id = get_profile_id();
+
+  const permuter::CrashStateEstimate estimate =
+    p->EstimateCrashStates(full_bio_replay);
+  ostringstream estimate_msg;
+  estimate_msg << (estimate.exact ? "" : "At most ") <<
+    permuter::CrashStateEstimate::Format(estimate.log2_total) <<
+    " distinct " << (full_bio_replay ? "bio" : "sector") <<
+    " crash states across " << estimate.log2_epoch_states.size() << " epochs";
+  cout << estimate_msg.str() << endl;
+  log << estimate_msg.str() << endl;
+  for (unsigned int i = 0; i < estimate.log2_epoch_states.size(); ++i) {
+    log << "\tepoch " << i << ": " <<
+      permuter::CrashStateEstimate::Format(estimate.log2_epoch_states.at(i)) <<
+      endl;
+  }
+  // Only an exact count can say when there is nothing left to test.
+  const double state_space = (estimate.exact) ? estimate.Total() : 0;
+
+  // Track what each window of crash states turned up that hadn't been seen
+  // before.
+  const unsigned int window =
+    std::max(ADAPTIVE_MIN_WINDOW, num_rounds / 20);
+  std::unordered_set<unsigned long long> images;
+  std::set<std::tuple<int, unsigned int, int>> failures;
+  unsigned int window_tests = 0;
+  unsigned int window_images = 0;
+  unsigned int window_failures = 0;
+  string stop_reason;
+
+  // Pick up where an earlier run with the same journal stopped: skip the crash
+  // states it already tested and count their results as our own.
+  ProgressJournal journal;
+  vector<SingleTestInfo> done;
+  unsigned long long seed = permuter_seed_;
+  bool journaling = false;
+  if (!progress_journal_.empty()) {
+    journaling = journal.Open(progress_journal_, profile_id, permuter_name_,
+        full_bio_replay, sector_size_, seed, done);
+    if (!journaling && resume_journal_) {
+      cerr << "Unable to resume from progress journal " << progress_journal_ <<
+        endl;
+      log << "Unable to resume from progress journal " << progress_journal_ <<
+        endl;
+      return JOURNAL_OPEN_ERR;
+    } else if (!journaling) {
+      cerr << "Unable to open progress journal " << progress_journal_ <<
+        ", this run can't be resumed" << endl;
+      log << "Unable to open progress journal " << progress_journal_ <<
+        ", this run can't be resumed" << endl;
+    }
+  }
+  unsigned long long next_state = first_state_;
+  for (SingleTestInfo &test_info : done) {
+    p->MarkCompleted(test_info.permute_data.crash_state, full_bio_replay);
+    next_state = std::max(next_state, test_info.permute_data.state_index + 1);
+    current_test_suite_->TallyReorderingResult(test_info);
+    if (test_info.GetTestResult() != SingleTestInfo::kPassed) {
+      failures.insert(std::make_tuple((int) test_info.GetTestResult(),
+            test_info.fs_test.GetError(),
+            (int) test_info.data_test.GetError()));
+    }
+    if (rebuild_crash_state(test_info.permute_data, sector_size_)) {
+      images.insert(get_image_fingerprint(test_info.permute_data.crash_state));
+    }
+  }
+  const unsigned int num_done = done.size();
+  if (num_done > 0) {
+    cout << "Resuming after " << num_done <<
+      " crash states from progress journal with permuter seed " << seed <<
+      endl;
+    log << "Resuming after " << num_done <<
+      " crash states from progress journal with permuter seed " << seed <<
+      endl;
+  }
+  // Everything needed from the old results has been tallied, and they are
+  // still in the journal, so don't hold on to them for the rest of the run.
+  vector<SingleTestInfo>().swap(done);
+  p->SetSeed(seed, next_state);
+  p->SetStateLimit(end_state_);
+
   vector<DiskWriteData> permutes;
-  for (int rounds = 0; rounds < num_rounds; ++rounds) {
+  ofstream descriptors;
+  if (!crash_state_log_.empty()) {
+    descriptors.open(crash_state_log_, ios::binary | ios::app);
+    if (!descriptors.is_open()) {
+      cerr << "Unable to open crash state log " << crash_state_log_ << endl;
+    }
+  }
+  for (int rounds = num_done; rounds < num_rounds; ++rounds) {
     // Print status every 1024 iterations.
     if (rounds & (~((1 << 10) - 1)) && !(rounds & ((1 << 10) - 1))) {
       cout << rounds << std::endl;
     }
 
+    // Stop before the kernel kills the run. The journal has every crash state
+    // tested so far, so the run can be continued with --resume.
+    if (memory_limit_ > 0) {
+      const unsigned long long rss = MemoryReport::CurrentRss();
+      if (rss > memory_limit_) {
+        stop_reason = "Using " + MemoryReport::Format(rss) +
+          " of memory, over the limit of " +
+          MemoryReport::Format(memory_limit_);
+        break;
+      }
+    }
+
     /***************************************************************************
      * Generate and write out a crash state.
      **************************************************************************/
@@ -839,74 +1377,96 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
     }
 
     time_point<steady_clock> permute_end_time = steady_clock::now();
-    timing_stats[PERMUTE_TIME] +=
-        duration_cast<milliseconds>(permute_end_time - permute_start_time);
+    record_timing(PERMUTE_TIME, permute_end_time - permute_start_time);
+    Tracer::Complete("permute", "crash state", permute_start_time,
+        permute_end_time, test_info.test_num);
     // End permute timing.
 
     if (!new_state) {
+      if (p->GetNextState() >= end_state_) {
+        stop_reason = "Tried every crash state in [" +
+          to_string(first_state_) + ", " + to_string(end_state_) + ")";
+      }
       break;
     }
 
-    // Restore disk clone.
-    int cow_brd_snapshot_fd = open(snapshot_path_.c_str(), O_WRONLY);
-    if (cow_brd_snapshot_fd < 0) {
-      test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
-      test_info.PrintResults(log);
-      current_test_suite_->TallyReorderingResult(test_info);
-      continue;
+    // Descriptors are tiny compared to the fsck run, so save every one.
+    if (descriptors.is_open()) {
+      test_info.permute_data.WriteDescriptor(descriptors, profile_id,
+          test_info.test_num, sector_size_);
     }
-    // Begin snapshot timing.
-    time_point<steady_clock> snapshot_start_time = steady_clock::now();
-    if (clone_device_restore(cow_brd_snapshot_fd, false) != SUCCESS) {
-      test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
-      test_info.PrintResults(log);
-      current_test_suite_->TallyReorderingResult(test_info);
-      continue;
+
+    test_crash_state(permutes, test_info, log);
+    if (journaling && !journal.Append(test_info)) {
+      // Records already in the journal are still good, so a resumed run only
+      // has to redo the crash states after them.
+      journaling = false;
+      cerr << "Unable to write progress journal " << progress_journal_ <<
+        ", no longer journaling after crash state " << test_info.test_num <<
+        endl;
+      log << "Unable to write progress journal " << progress_journal_ <<
+        ", no longer journaling after crash state " << test_info.test_num <<
+        endl;
+    }
+    if (minimize_failures_ &&
+        test_info.GetTestResult() != SingleTestInfo::kPassed) {
+      minimize_crash_state(test_info, profile_id, log);
     }
-    time_point<steady_clock> snapshot_end_time = steady_clock::now();
-    timing_stats[SNAPSHOT_TIME] +=
-        duration_cast<milliseconds>(snapshot_end_time - snapshot_start_time);
-    // End snapshot timing.
 
-    // Write recorded data out to block device in different orders so that we
-    // can if they are all valid or not.
-    time_point<steady_clock> bio_write_start_time = steady_clock::now();
-    const int write_data_res =
-      test_write_data(cow_brd_snapshot_fd, permutes.begin(), permutes.end());
-    time_point<steady_clock> bio_write_end_time = steady_clock::now();
-    timing_stats[BIO_WRITE_TIME] +=
-        duration_cast<milliseconds>(bio_write_end_time - bio_write_start_time);
-    if (!write_data_res) {
-      test_info.fs_test.SetError(FileSystemTestResult::kBioWrite);
-      close(cow_brd_snapshot_fd);
-      test_info.PrintResults(log);
-      current_test_suite_->TallyReorderingResult(test_info);
+    if (!adaptive_budget_) {
       continue;
     }
-    close(cow_brd_snapshot_fd);
-
-    // Test the crash state that was just written out.
-    vector<milliseconds> check_res = test_fsck_and_user_test(snapshot_path_,
-        test_info.permute_data.last_checkpoint, test_info, false);
-    test_info.PrintResults(log);
-    current_test_suite_->TallyReorderingResult(test_info);
-
-    // Accounting for time it took to run the test.
-    if (check_res.at(0).count() > -1) {
-      timing_stats[FSCK_TIME] += check_res.at(0);
+    if (state_space > 0 && rounds + 1 >= state_space) {
+      stop_reason = "Tested every crash state";
+      break;
+    }
+    if (images.insert(get_image_fingerprint(permutes)).second) {
+      ++window_images;
     }
-    if (check_res.at(1).count() > -1) {
-      timing_stats[TEST_CASE_TIME] += check_res.at(1);
+    if (test_info.GetTestResult() != SingleTestInfo::kPassed &&
+        failures.insert(std::make_tuple((int) test_info.GetTestResult(),
+            test_info.fs_test.GetError(),
+            (int) test_info.data_test.GetError())).second) {
+      ++window_failures;
+    }
+    if (++window_tests < window) {
+      continue;
     }
-    if (check_res.at(2).count() > -1) {
-      timing_stats[MOUNT_TIME] += check_res.at(2);
+    if (window_failures == 0 &&
+        window_images * 100 < window_tests * ADAPTIVE_NEW_IMAGE_PERCENT) {
+      stop_reason = "No new failures or disk images in the last " +
+        to_string(window_tests) + " crash states";
+      break;
     }
+    window_tests = 0;
+    window_images = 0;
+    window_failures = 0;
+  }
+
+  if (journaling && !journal.Sync()) {
+    cerr << "Unable to write the last records of progress journal " <<
+      progress_journal_ << endl;
+    log << "Unable to write the last records of progress journal " <<
+      progress_journal_ << endl;
   }
 
   time_point<steady_clock> end_time = steady_clock::now();
-  timing_stats[TOTAL_TIME] = duration_cast<milliseconds>(end_time - start_time);
+  timing_stats[TOTAL_TIME] = end_time - start_time;
 
-  if (current_test_suite_->GetReorderingCompleted() < num_rounds) {
+  // A node per fingerprint holding it, the next pointer, and the cached hash.
+  fingerprint_usage_ = MemoryUsage();
+  fingerprint_usage_.payload = images.size() * sizeof(unsigned long long);
+  fingerprint_usage_.overhead = images.size() * 2 * sizeof(void *) +
+    images.bucket_count() * sizeof(void *);
+
+  if (!stop_reason.empty()) {
+    cout << "=============== " << stop_reason << ", stopping at " <<
+      current_test_suite_->GetReorderingCompleted() <<
+      " tests ===============" << endl << endl;
+    log << "=============== " << stop_reason << ", stopping at " <<
+      current_test_suite_->GetReorderingCompleted() <<
+      " tests ===============" << endl << endl;
+  } else if (current_test_suite_->GetReorderingCompleted() < num_rounds) {
     cout << "=============== Unable to find new unique state, stopping at " <<
       current_test_suite_->GetReorderingCompleted() <<
       " tests ===============" << endl << endl;
@@ -914,6 +1474,14 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
       current_test_suite_->GetReorderingCompleted() <<
       " tests ===============" << endl << endl;
   }
+  // Only permuters that fold equivalent crash states together report anything
+  // here.
+  if (p->GetNumPrunedStates() > 0) {
+    cout << "Skipped " << p->GetNumPrunedStates() <<
+      " crash states equivalent to ones already tested" << endl;
+    log << "Skipped " << p->GetNumPrunedStates() <<
+      " crash states equivalent to ones already tested" << endl;
+  }
   return SUCCESS;
 }
 
@@ -945,6 +1513,12 @@ int Tester::test_check_log_replay(std::ofstream& log, bool automate_check_test)
   unsigned int test_num = 1;
   unsigned int op_index = 1;
   vector<DiskWriteData> crash_state;
+  // The disk image the log up to the current point produces, tracked as which
+  // bio last wrote each range of sectors. Only the bios between checkpoints
+  // are added to it each time around, and writing it out touches every sector
+  // at most once no matter how many times the log rewrote it.
+  WriteIndex image;
+  vector<unsigned int> overwritten;
 
   while (log_iter != log_data.end()) {
     // Keep going through the workload data log until we reach a Checkpoint.
@@ -955,82 +1529,89 @@ int Tester::test_check_log_replay(std::ofstream& log, bool automate_check_test)
           log_iter->metadata.write_sector * SECTOR_SIZE,
           log_iter->metadata.size, log_iter->get_data(), 0);
       crash_state.push_back(wd);
+      if (log_iter->metadata.size > 0) {
+        const unsigned long long start = log_iter->metadata.write_sector;
+        image.Insert(start,
+            start + (log_iter->metadata.size + SECTOR_SIZE - 1) / SECTOR_SIZE,
+            op_index, 0, overwritten);
+        overwritten.clear();
+      }
       ++log_iter;
       ++op_index;
     }
 
+    // There is nothing to test past the final checkpoint.
+    if (log_iter == log_data.end()) {
+      break;
+    }
+
     // When we see a Checkpoint, we need to do several things:
     // 0. Setup the test result struct with info about this test
     // 1. Restore the disk so that we start from a clean state
-    // 2. Write out the data in the log from the start until the checkpoint we
-    //    found
+    // 2. Write out the image the log produces up to the checkpoint we found
     // 3. Test the resulting disk state with fsck and the user test case
 
     // 0.
-
-    // Update checkpoint. It's not always the log_iter's value as log_iter may
-    // point to the end of the recorded workload, not a checkpoint.
-    if (log_iter->is_checkpoint()) {
-      last_checkpoint = log_iter->metadata.write_sector;
-    }
+    last_checkpoint = log_iter->metadata.write_sector;
     SingleTestInfo test_info;
     test_info.permute_data.crash_state = crash_state;
-    // We reached the checkpoint, so it is indeed the last one we saw, unless we
-    // have replayed the entire log.
     test_info.permute_data.last_checkpoint = last_checkpoint;
     // Tests for this portion will be numbered starting from 1.
     test_info.test_num = test_num++;
 
+    // Increment our end pointer iterater passed the Checkpoint we just stopped
+    // at.
+    ++log_iter;
+    ++op_index;
+
     // 1. Restore disk clone.
-    int cow_brd_snapshot_fd = open(snapshot_path_.c_str(), O_WRONLY);
-    if (cow_brd_snapshot_fd < 0) {
+    int snapshot_fd = snapshot_backend_->DeviceOpen(snapshot_path_, O_WRONLY);
+    if (snapshot_fd < 0) {
       test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
       test_info.PrintResults(log);
       current_test_suite_->TallyTimingResult(test_info);
       continue;
     }
-    if (clone_device_restore(cow_brd_snapshot_fd, false) != SUCCESS) {
+    if (clone_device_restore(snapshot_fd, false) != SUCCESS) {
       test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
+      snapshot_backend_->DeviceClose(snapshot_fd);
       test_info.PrintResults(log);
       current_test_suite_->TallyTimingResult(test_info);
       continue;
     }
 
-    // 2. Write recorded data out to block device. If the iterator points to the
-    // end of the log, we are alright because the function is [begin, end) and
-    // the end iterator is a sentinal value. The same logic applies for
-    // checkpoints (which we don't really want to replay).
+    // 2. Write out the current contents of every sector the log has touched.
+    vector<DiskWriteData> image_writes;
+    image_writes.reserve(image.GetSegments().size());
+    for (const auto &segment : image.GetSegments()) {
+      disk_write &owner = log_data.at(segment.second.owner);
+      const unsigned int data_offset =
+        (segment.first - owner.metadata.write_sector) * SECTOR_SIZE;
+      const unsigned int size = std::min<unsigned long long>(
+          (segment.second.end - segment.first) * SECTOR_SIZE,
+          owner.metadata.size - data_offset);
+      image_writes.emplace_back(true, segment.second.owner, 0,
+          segment.first * SECTOR_SIZE, size, owner.get_data(), data_offset);
+    }
     const int write_data_res =
-      test_write_data(cow_brd_snapshot_fd, crash_state.begin(),
-          crash_state.end());
+      test_write_data(snapshot_fd, image_writes.begin(),
+          image_writes.end());
     if (!write_data_res) {
       test_info.fs_test.SetError(FileSystemTestResult::kBioWrite);
-      close(cow_brd_snapshot_fd);
+      snapshot_backend_->DeviceClose(snapshot_fd);
       test_info.PrintResults(log);
       current_test_suite_->TallyTimingResult(test_info);
       continue;
     }
-    close(cow_brd_snapshot_fd);
+    snapshot_backend_->DeviceClose(snapshot_fd);
 
     // 3. Check the resulting disk image with fsck and the user test. For now,
     // just ignore the timing data that we can get from this function.
-    if (log_iter->is_checkpoint()) {
-      test_fsck_and_user_test(snapshot_path_,
-          test_info.permute_data.last_checkpoint, test_info, automate_check_test);
-
-      test_info.PrintResults(log);
-      current_test_suite_->TallyTimingResult(test_info);
-    }
-
-    // Exit loop after doing final test.
-    if (log_iter == log_data.end()) {
-      break;
-    }
+    test_fsck_and_user_test(snapshot_path_,
+        test_info.permute_data.last_checkpoint, test_info, automate_check_test);
 
-    // Increment our end pointer iterater passed the Checkpoint we just stopped
-    // at.
-    ++log_iter;
-    ++op_index;
+    test_info.PrintResults(log);
+    current_test_suite_->TallyTimingResult(test_info);
   }
   return SUCCESS;
 }
@@ -1102,7 +1683,7 @@ bool Tester::test_write_data_dw(const int disk_fd,
       continue;
     }
 
-    const unsigned long int byte_addr =
+    const unsigned long long byte_addr =
       current->metadata.write_sector * SECTOR_SIZE;
     if (lseek(disk_fd, byte_addr, SEEK_SET) < 0) {
       return false;
@@ -1131,20 +1712,10 @@ bool Tester::test_write_data(const int disk_fd,
       // disk_offset (I have not tested/confirmed).
       continue;
     }
-    if (lseek(disk_fd, current->disk_offset, SEEK_SET) < 0) {
+    if (!snapshot_backend_->DeviceWrite(disk_fd, current->disk_offset,
+          (const char *) current->GetData(), current->size)) {
       return false;
     }
-    unsigned int bytes_written = 0;
-    void *data_base_addr = current->GetData();
-    while (bytes_written < current->size) {
-      int res = write(disk_fd,
-          (void*) ((unsigned long) data_base_addr + bytes_written),
-          current->size - bytes_written);
-      if (res < 0) {
-        return false;
-      }
-      bytes_written += res;
-    }
   }
   return true;
 }
@@ -1173,8 +1744,8 @@ void Tester::cleanup_harness() {
     return;
   }
 
-  if (remove_cow_brd() != SUCCESS) {
-    cerr << "Unable to remove cow_brd device" << endl;
+  if (remove_snapshot_devices() != SUCCESS) {
+    cerr << "Unable to remove snapshot devices" << endl;
     permuter_unload_class();
     test_unload_class();
     return;
@@ -1241,12 +1812,12 @@ int Tester::log_snapshot_save(string log_file) {
   // TODO(ashmrtn): What happens if this fails?
   // TODO(ashmrtn): Change device_clone to be an mmap of the disk we need to get
   // stuff on.
-  // device_size happens to be the number of 1k blocks on cow_brd (from original
-  // brd behavior...), so convert it to a number of bytes.
-  unsigned int dev_bytes = device_size * 2 * 512;
-  unsigned int bytes_done = 0;
+  // device_size happens to be the number of 1k blocks on the disk (from
+  // original brd behavior...), so convert it to a number of bytes.
+  const unsigned long long dev_bytes = device_size * 2 * 512;
+  unsigned long long bytes_done = 0;
   const unsigned int buf_size = 4096;
-  unsigned int buf[buf_size];
+  char buf[buf_size];
   int log_fd =
     open(log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
   if (log_fd < 0) {
@@ -1254,28 +1825,25 @@ int Tester::log_snapshot_save(string log_file) {
     return LOG_CLONE_ERR;
   }
 
-  int res = lseek(cow_brd_fd, 0, SEEK_SET);
-  if (res < 0) {
-    cerr << "error seeking to start of test device" << endl;
+  const int disk_fd =
+    snapshot_backend_->DeviceOpen(get_snapshot_base_path(), O_RDONLY);
+  if (disk_fd < 0) {
+    cerr << "error opening test device" << endl;
     return LOG_CLONE_ERR;
   }
   while (bytes_done < dev_bytes) {
     // Read a block of data from the base disk image.
-    unsigned int bytes = 0;
-    unsigned int new_amount = (dev_bytes < bytes_done + buf_size)
+    const unsigned int new_amount = (dev_bytes < bytes_done + buf_size)
                             ? dev_bytes - bytes_done
                             : buf_size;
-    do {
-      int res = read(cow_brd_fd, buf + bytes, new_amount - bytes);
-      if (res < 0) {
-        cerr << "error reading from raw device to log disk snapshot" << endl;
-        return LOG_CLONE_ERR;
-      }
-      bytes += res;
-    } while (bytes < new_amount);
+    if (!snapshot_backend_->DeviceRead(disk_fd, bytes_done, buf,
+          new_amount)) {
+      cerr << "error reading from raw device to log disk snapshot" << endl;
+      return LOG_CLONE_ERR;
+    }
 
     // Write a block of data to the log file.
-    bytes = 0;
+    unsigned int bytes = 0;
     do {
       int res = write(log_fd, buf + bytes, new_amount - bytes);
       if (res < 0) {
@@ -1287,6 +1855,7 @@ int Tester::log_snapshot_save(string log_file) {
     bytes_done += new_amount;
   }
 
+  snapshot_backend_->DeviceClose(disk_fd);
   fsync(log_fd);
   return SUCCESS;
 }
@@ -1295,45 +1864,35 @@ int Tester::log_snapshot_load(string log_file) {
   // TODO(ashmrtn): What happens if this fails?
   // TODO(ashmrtn): Change device_clone to be an mmap of the disk we need to get
   // stuff on.
-  int res = ioctl(cow_brd_fd, COW_BRD_WIPE);
-  if (res < 0) {
-    cerr << "error wiping old disk snapshot" << endl;
-    return LOG_CLONE_ERR;
-  }
-
-  // device_size happens to be the number of 1k blocks on cow_brd (from original
-  // brd behavior...), so convert it to a number of bytes.
-  unsigned int dev_bytes = device_size * 2 * 512;
-  unsigned int bytes_done = 0;
+  // Nothing has been snapshotted yet and every byte of the disk is rewritten
+  // below, so there is no need to wipe it first.
+  // device_size happens to be the number of 1k blocks on the disk (from
+  // original brd behavior...), so convert it to a number of bytes.
+  const unsigned long long dev_bytes = device_size * 2 * 512;
+  unsigned long long bytes_done = 0;
   const unsigned int buf_size = 4096;
-  unsigned int buf[buf_size];
+  char buf[buf_size];
   int log_fd = open(log_file.c_str(), O_RDONLY);
   if (log_fd < 0) {
     cerr << "error opening log file" << endl;
     return LOG_CLONE_ERR;
   }
 
-  // cow_brd_fd is RDONLY.
-  int device_path = open(COW_BRD_PATH, O_WRONLY);
+  int device_path =
+    snapshot_backend_->DeviceOpen(get_snapshot_base_path(), O_WRONLY);
   if (device_path < 0) {
     cerr << "error opening log file" << endl;
     return LOG_CLONE_ERR;
   }
 
-  res = lseek(device_path, 0, SEEK_SET);
-  if (res < 0) {
-    cerr << "error seeking to start of test device" << endl;
-    return LOG_CLONE_ERR;
-  }
-  res = lseek(log_fd, 0, SEEK_SET);
-  if (res < 0) {
+  if (lseek(log_fd, 0, SEEK_SET) < 0) {
     cerr << "error seeking to start of log file" << endl;
     return LOG_CLONE_ERR;
   }
   while (bytes_done < dev_bytes) {
     // Read a block of data from the base disk image.
     unsigned int bytes = 0;
-    unsigned int new_amount = (dev_bytes < bytes_done + buf_size)
+    const unsigned int new_amount = (dev_bytes < bytes_done + buf_size)
                             ? dev_bytes - bytes_done
                             : buf_size;
     do {
@@ -1346,22 +1905,16 @@ int Tester::log_snapshot_load(string log_file) {
     } while (bytes < new_amount);
 
     // Write a block of data to the log file.
-    bytes = 0;
-    do {
-      int res = write(device_path, buf + bytes, new_amount - bytes);
-      if (res < 0) {
-        cerr << "error reading from raw device to log disk snapshot" << endl;
-        return LOG_CLONE_ERR;
-      }
-      bytes += res;
-    } while (bytes < new_amount);
+    if (!snapshot_backend_->DeviceWrite(device_path, bytes_done, buf,
+          new_amount)) {
+      cerr << "error reading from raw device to log disk snapshot" << endl;
+      return LOG_CLONE_ERR;
+    }
     bytes_done += new_amount;
   }
-  close(device_path);
+  snapshot_backend_->DeviceClose(device_path);
 
-  fsync(cow_brd_fd);
-  res = ioctl(cow_brd_fd, COW_BRD_SNAPSHOT);
-  if (res < 0) {
+  if (!snapshot_backend_->Snapshot()) {
     cerr << "error restoring snapshot from log" << endl;
     return LOG_CLONE_ERR;
   }
@@ -1389,7 +1942,82 @@ void Tester::PrintTestStats(std::ostream& os) {
 }
 
 std::chrono::milliseconds Tester::get_timing_stat(time_stats timing_stat) {
-  return timing_stats[timing_stat];
+  return duration_cast<milliseconds>(timing_stats[timing_stat]);
+}
+
+void Tester::record_timing(time_stats timing_stat, nanoseconds elapsed) {
+  timing_stats[timing_stat] += elapsed;
+  timing_histograms_[timing_stat].Record(elapsed);
+}
+
+void Tester::PrintTimingStats(std::ostream& os) {
+  for (unsigned int i = 0; i < NUM_TIME; ++i) {
+    os << "\t" << (time_stats) i << ": " <<
+      get_timing_stat((time_stats) i).count() << " ms";
+    // The total run time is a single sample, so it has no distribution.
+    if (timing_histograms_[i].Count() > 0) {
+      os << " (";
+      timing_histograms_[i].PrintSummary(os);
+      os << ")";
+    }
+    os << endl;
+  }
+}
+
+void Tester::SampleMemory(const string &phase) {
+  memory_report_.SamplePhase(phase);
+}
+
+void Tester::PrintMemoryUsage(ostream& os) {
+  MemoryReport report(memory_report_);
+
+  // Bio data is the payload; the disk_write structs around it are overhead.
+  MemoryUsage profile;
+  profile.AddVector(log_data);
+  for (const disk_write &dw : log_data) {
+    profile.payload += dw.metadata.size;
+  }
+  report.Add("profile bios", profile);
+
+  MemoryUsage mods;
+  mods.AddVector(mods_);
+  for (const vector<DiskMod> &checkpoint : mods_) {
+    mods.AddVector(checkpoint);
+    for (const DiskMod &mod : checkpoint) {
+      mods.payload += mod.path.size() + mod.directory_added_entry.size();
+      if (mod.file_mod_data) {
+        mods.payload += mod.file_mod_len;
+      }
+    }
+  }
+  report.Add("workload changes", mods);
+
+  Permuter *p = permuter_loader.get_instance();
+  if (p != NULL) {
+    report.Add("permuter epochs", p->GetEpochMemoryUsage());
+    report.Add("tested crash states", p->GetStateSetMemoryUsage());
+  }
+  report.Add("disk image fingerprints", fingerprint_usage_);
+  const MemoryUsage snapshot_pages = snapshot_backend_->GetMemoryUsage();
+  if (snapshot_pages.Total() > 0) {
+    report.Add("snapshot pages", snapshot_pages);
+  }
+  report.Print(os);
+}
+
+void Tester::WriteTimingHistograms(std::ostream& os) {
+  for (unsigned int i = 0; i < NUM_TIME; ++i) {
+    if (timing_histograms_[i].Count() == 0) {
+      continue;
+    }
+    // Names with spaces would make the dump harder to parse.
+    ostringstream name;
+    name << (time_stats) i;
+    string stat = name.str();
+    std::replace(stat.begin(), stat.end(), ' ', '_');
+    std::replace(stat.begin(), stat.end(), '/', '_');
+    timing_histograms_[i].Write(os, stat);
+  }
 }
 
 std::ostream& operator<<(std::ostream& os, Tester::time_stats time) {
@@ -1412,6 +2040,12 @@ std::ostream& operator<<(std::ostream& os, Tester::time_stats time) {
     case fs_testing::Tester::MOUNT_TIME:
       os << "mount/umount time";
       break;
+    case fs_testing::Tester::CRASH_STATE_TIME:
+      os << "crash state time";
+      break;
+    case fs_testing::Tester::MINIMIZE_TIME:
+      os << "minimize time";
+      break;
     case fs_testing::Tester::TOTAL_TIME:
       os << "total time";
       break;
@@ -8,13 +8,19 @@
 #include <utility>
 #include <vector>
 #include <map>
+#include <set>
 
+#include "CaptureBackend.h"
 #include "FsSpecific.h"
+#include "ImageChecker.h"
+#include "SnapshotBackend.h"
 #include "../permuter/Permuter.h"
 #include "../results/TestSuiteResult.h"
 #include "../tests/BaseTestCase.h"
 #include "../utils/ClassLoader.h"
 #include "../utils/DiskMod.h"
+#include "../utils/LatencyHistogram.h"
+#include "../utils/MemoryUsage.h"
 #include "../utils/utils.h"
 
 #define SUCCESS                  0
@@ -35,6 +41,7 @@
 #define WRAPPER_MEM_ERR          -20
 #define CLEAR_CACHE_ERR          -21
 #define PART_PART_ERR            -22
+#define JOURNAL_OPEN_ERR         -23
 
 #define FMT_EXT4               0
 
@@ -60,17 +67,51 @@ class Tester {
     FSCK_TIME,
     TEST_CASE_TIME,
     MOUNT_TIME,
+    // Everything done for a single crash state, from restoring the snapshot to
+    // the end of the checks.
+    CRASH_STATE_TIME,
+    // Rerunning candidates while minimizing failed crash states, which aren't
+    // counted in the stats above.
+    MINIMIZE_TIME,
     TOTAL_TIME,
     NUM_TIME,
   };
 
-  Tester(const unsigned int device_size, const unsigned int sector_size,
+  Tester(const unsigned long long device_size, const unsigned int sector_size,
       const bool verbosity);
   ~Tester();
   const bool verbose = false;
   void set_fs_type(const std::string type);
   void set_device(const std::string device_path);
   void set_flag_device(const std::string device_path);
+  void set_permuter_seed(const unsigned long long seed);
+  // Binary descriptors of every crash state tested by
+  // test_check_random_permutations are appended to this file if it is set.
+  void set_crash_state_log(const std::string path);
+  // Shrink each failing crash state to the fewest writes that still reproduce
+  // the failure. Minimized descriptors go to the crash state log plus ".min".
+  void set_minimize_failures(const bool minimize);
+  // Stop test_check_random_permutations before num_rounds once every crash
+  // state has been tested or new failures and disk images stop turning up.
+  void set_adaptive_budget(const bool adaptive);
+  // Every crash state test_check_random_permutations finishes is recorded in
+  // this journal. If it already holds crash states from an earlier run with
+  // the same profile, the run continues from where that one stopped. With
+  // resume set, the run fails if the journal can't be opened instead of
+  // starting over without one.
+  void set_progress_journal(const std::string path, const bool resume);
+  // Prepended to the diff-at-check files written when comparing a crash state
+  // with its snapshot, so workers sharing a directory each get their own.
+  void set_diff_prefix(const std::string prefix);
+  // Only test the crash states the permuter generates on attempts
+  // [first_state, end_state), so several runs can split up one profile.
+  void set_state_range(const unsigned long long first_state,
+      const unsigned long long end_state);
+  /*
+   * Stop test_check_random_permutations once the resident set size of the
+   * process goes over limit bytes. 0 means no limit.
+   */
+  void set_memory_limit(const unsigned long long limit);
 
   const char* update_dirty_expire_time(const char* time);
 
@@ -91,6 +132,13 @@ class Tester {
   int test_check_random_permutations(const bool full_bio_replay,
       const int num_rounds, std::ofstream& log);
   int test_check_log_replay(std::ofstream& log, bool automate_check_test);
+  /*
+   * Rerun the crash states saved in the given descriptor files against the
+   * currently loaded profile. If test_nums is not empty, only crash states
+   * with those test numbers are run.
+   */
+  int test_check_crash_states(const std::vector<std::string> &descriptor_files,
+      const std::set<unsigned int> &test_nums, std::ofstream& log);
   int test_restore_log();
   int test_check_current();
 
@@ -105,9 +153,46 @@ class Tester {
   int getNewDiskClone(int checkpoint);
   void getCompleteRunDiskClone();
 
-  int insert_cow_brd();
-  int remove_cow_brd();
-
+  /*
+   * Use the named SnapshotBackend (see GetSnapshotBackend) for the test disk
+   * and its snapshots instead of cow_brd. Backends that don't keep the disk in
+   * RAM keep it in image_dir. Must be called before the devices are inserted
+   * or opened. Returns false if there is no backend by that name.
+   */
+  bool set_snapshot_backend(const std::string &name,
+      const std::string &image_dir);
+  // Use disk number disk out of num_disks. Must be called before the devices
+  // are inserted or opened.
+  void set_snapshot_disk(const unsigned int disk, const unsigned int num_disks);
+  // Path of the disk the snapshots are taken from.
+  std::string get_snapshot_base_path();
+  /*
+   * Check crash states with checker instead of mounting them and running fsck
+   * and the test case's check. The Tester doesn't take ownership of checker.
+   * NULL goes back to the usual checks.
+   */
+  void set_image_checker(ImageChecker *checker);
+  int insert_snapshot_devices();
+  // Open this Tester's disk on devices some other Tester inserted.
+  int open_snapshot_devices();
+  int remove_snapshot_devices();
+  // Drop the data on the disk and all of its snapshots and make the disk
+  // writable again so it can be reused for another test.
+  int wipe_snapshot_devices();
+
+  /*
+   * Record the workload with the CaptureBackend called name (see
+   * GetCaptureBackend). log_device is where backends that stream their log
+   * write it. Returns false if there is no such backend.
+   */
+  bool set_capture_backend(const std::string &name,
+      const std::string &log_device);
+  /*
+   * Record on the capture backend's instance numbered instance, so several
+   * Testers on one machine can record at the same time. Applies to the
+   * backend picked by the last set_capture_backend.
+   */
+  void set_wrapper_instance(const unsigned int instance);
   int insert_wrapper();
   int remove_wrapper();
   int get_wrapper_ioctl();
@@ -131,17 +216,36 @@ class Tester {
   void log_disk_write_data(std::ostream &log);
 
   std::chrono::milliseconds get_timing_stat(time_stats timing_stat);
+  // Total time and p50/p90/p99/max of the samples for each timing stat.
   void PrintTimingStats(std::ostream& os);
+  // Bucket counts of every timing stat's histogram (see
+  // LatencyHistogram::Write), for comparing runs.
+  void WriteTimingHistograms(std::ostream& os);
+  // Note the resident set size at the end of phase for PrintMemoryUsage.
+  void SampleMemory(const std::string &phase);
+  /*
+   * Bytes held by the profile, the workload's changes, and the permuter, and
+   * the resident set size sampled at the end of each phase.
+   */
+  void PrintMemoryUsage(std::ostream& os);
   void PrintTestStats(std::ostream& os);
-  void StartTestSuite();
+  // name labels the suite's results when several tests share one Tester.
+  void StartTestSuite(const std::string &name = "");
+  // Time from a checkpoint request reaching the harness to the reply being
+  // sent back to the workload.
+  void AddCheckpointLatency(std::chrono::microseconds latency);
+  void PrintCheckpointLatency(std::ostream& os);
   void EndTestSuite();
+  // Forget the profile, checkpoint snapshots, and timing stats of the last test
+  // so another test can be run with the same Tester.
+  void reset_test_state();
 
   unsigned int GetPostRunDelay();
 
   // TODO(ashmrtn): Figure out why making these private slows things down a lot.
  private:
   FsSpecific *fs_specific_ops_ = NULL;
-  const unsigned long int device_size;
+  const unsigned long long device_size;
   fs_testing::utils::ClassLoader<fs_testing::tests::BaseTestCase> test_loader;
   fs_testing::utils::ClassLoader<fs_testing::permuter::Permuter>
     permuter_loader;
@@ -151,16 +255,27 @@ class Tester {
   std::string device_raw;
   std::string device_mount;
   std::string flags_device;
+  unsigned long long permuter_seed_ = 42;
+  std::string crash_state_log_;
+  bool minimize_failures_ = false;
+  bool adaptive_budget_ = true;
+  std::string progress_journal_;
+  // File name of the loaded permuter library, recorded in the journal.
+  std::string permuter_name_;
+  bool resume_journal_ = false;
+  std::string diff_prefix_;
+  unsigned long long first_state_ = 0;
+  unsigned long long end_state_ = ~0ULL;
+  unsigned long long memory_limit_ = 0;
 
   TestSuiteResult *current_test_suite_ = NULL;
 
-  bool wrapper_inserted = false;
-  bool cow_brd_inserted = false;
-  int cow_brd_fd = -1;
+  CaptureBackend *capture_backend_ = NULL;
+  SnapshotBackend *snapshot_backend_ = NULL;
+  ImageChecker *image_checker_ = NULL;
 
   bool disk_mounted = false;
 
-  int ioctl_fd = -1;
   const unsigned int sector_size_;
   std::vector<fs_testing::utils::disk_write> log_data;
   std::vector<std::vector<fs_testing::utils::DiskMod>> mods_;
@@ -177,15 +292,54 @@ class Tester {
       const std::vector<fs_testing::utils::DiskWriteData>::iterator &start,
       const std::vector<fs_testing::utils::DiskWriteData>::iterator &end);
 
-  std::vector<std::chrono::milliseconds> test_fsck_and_user_test(
+  void test_crash_state(
+      std::vector<fs_testing::utils::DiskWriteData> &crash_state,
+      SingleTestInfo &test_info, std::ofstream &log);
+  void run_crash_state(
+      std::vector<fs_testing::utils::DiskWriteData> &crash_state,
+      SingleTestInfo &test_info, const bool timed);
+  /*
+   * Use delta debugging to find the smallest set of dropped writes (or, if the
+   * failure happens with no writes dropped, persisted writes from the epoch
+   * the crash happened in) that still reproduce the failure seen in `failed`.
+   * profile_id is saved with the minimized crash state.
+   */
+  int minimize_crash_state(const SingleTestInfo &failed,
+      const unsigned long long profile_id, std::ofstream &log);
+  /*
+   * Fill in the data for a crash state read from a descriptor using the
+   * operations in log_data.
+   */
+  bool rebuild_crash_state(PermuteTestResult &state, unsigned int sector_size);
+  unsigned long long get_profile_id();
+  /*
+   * Hash of the disk image a crash state produces on top of the snapshot. Crash
+   * states that only differ in writes that are later overwritten get the same
+   * fingerprint.
+   */
+  unsigned long long get_image_fingerprint(
+      const std::vector<fs_testing::utils::DiskWriteData> &crash_state);
+
+  std::vector<std::chrono::nanoseconds> test_fsck_and_user_test(
       const std::string device_path, const unsigned int last_checkpoint,
       SingleTestInfo &test_info, bool automate_check_test);
 
   bool check_disk_and_snapshot_contents(std::string disk_path, int last_checkpoint);
 
   std::vector<TestSuiteResult> test_results_;
-  std::chrono::milliseconds timing_stats[NUM_TIME] =
-      {std::chrono::milliseconds(0)};
+  // Add one sample to a timing stat.
+  void record_timing(time_stats timing_stat, std::chrono::nanoseconds elapsed);
+
+  std::chrono::nanoseconds timing_stats[NUM_TIME] =
+      {std::chrono::nanoseconds(0)};
+  // Every sample added to timing_stats, one per crash state for most stats.
+  fs_testing::utils::LatencyHistogram timing_histograms_[NUM_TIME];
+
+  std::vector<std::chrono::microseconds> checkpoint_latencies_;
+
+  fs_testing::utils::MemoryReport memory_report_;
+  // Disk image fingerprints kept by the last adaptive budget run.
+  fs_testing::utils::MemoryUsage fingerprint_usage_;
 
   std::map<int, std::string> checkpointToSnapshot_;
   std::string snapshot_path_;
@@ -1,23 +1,40 @@
+#include <dirent.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <wait.h>
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <ctime>
 
 #include <fstream>
 #include <iostream>
 #include <locale>
+#include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 
+#include "../results/ProgressJournal.h"
 #include "../tests/BaseTestCase.h"
 #include "../utils/communication/ServerSocket.h"
 #include "../utils/communication/SocketUtils.h"
+#include "../utils/Trace.h"
 #include "../utils/utils.h"
 #include "Tester.h"
 
@@ -25,7 +42,19 @@
 #define TO_STRING(x) STRINGIFY(x)
 
 #define TEST_SO_PATH "tests/"
+// Test case that runs the j-lang workload named by J_LANG_FILE_ENV. Used for
+// any test given that isn't a .so.
+#define J_LANG_TEST_SO TEST_SO_PATH "j_lang_interpreter.so"
+#define J_LANG_FILE_ENV "J_LANG_FILE"
 #define PERMUTER_SO_PATH "permuter/"
+// Only one capture device (the disk_wrapper module or the dm-log-writes
+// target) can be set up at a time, so workers testing different file systems
+// at once take turns holding this lock while they record their workloads.
+#define WRAPPER_LOCK_PATH "/tmp/crash_monkey_wrapper.lock"
+// Files in a work bundle directory. The profile and snapshot are saved as with
+// -l, using BUNDLE_LOG as the log file name.
+#define BUNDLE_LOG "bundle"
+#define BUNDLE_MANIFEST "manifest"
 // TODO(ashmrtn): Find a good delay time to use for tests.
 #define TEST_DIRTY_EXPIRE_TIME_CENTISECS 3000
 #define TEST_DIRTY_EXPIRE_TIME_STRING \
@@ -40,21 +69,527 @@
 namespace {
 
 static const unsigned int kSocketQueueDepth = 2;
+// Values getopt_long returns for options that have no short form.
+static const int kSeedOpt = 256;
+static const int kReplayStateOpt = 257;
+static const int kReplayTestOpt = 258;
+static const int kMinimizeOpt = 259;
+static const int kNoAdaptiveOpt = 260;
+static const int kResumeOpt = 261;
+static const int kBatchOpt = 262;
+static const int kRunTimeoutOpt = 263;
+static const int kFanOutOpt = 264;
+static const int kExportBundleOpt = 265;
+static const int kBundleOpt = 266;
+static const int kStatesOpt = 267;
+static const int kShardsOpt = 268;
+static const int kTraceOpt = 269;
+static const int kMemoryLimitOpt = 270;
+static const int kSnapshotBackendOpt = 271;
+static const int kSnapshotDirOpt = 272;
+static const int kCaptureBackendOpt = 273;
+static const int kCaptureLogDevOpt = 274;
+static const int kWrapperIdOpt = 275;
 static constexpr char kChangePath[] = "run_changes";
 
 }  // namespace
 
 using std::cerr;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 using std::cout;
 using std::endl;
 using std::ofstream;
 using std::string;
 using std::to_string;
+using fs_testing::ProgressJournal;
+using fs_testing::SingleTestInfo;
 using fs_testing::Tester;
+using fs_testing::TestSuiteResult;
+using fs_testing::utils::communication::kCheckpointDoorbellEnv;
+using fs_testing::utils::communication::kDoorbellCheckpointDone;
+using fs_testing::utils::communication::kDoorbellCheckpointFailed;
 using fs_testing::utils::communication::kSocketNameOutbound;
+using fs_testing::utils::communication::kSocketPathEnv;
 using fs_testing::utils::communication::ServerSocket;
 using fs_testing::utils::communication::SocketError;
 using fs_testing::utils::communication::SocketMessage;
+using fs_testing::utils::Tracer;
+using fs_testing::utils::TraceSpan;
+
+namespace {
+
+bool IsTestSo(const string &path) {
+  return path.length() > 3 && path.compare(path.length() - 3, 3, ".so") == 0;
+}
+
+// Name a test is reported under: its file name without the ".so".
+string TestName(const string &path) {
+  const string test_name = path.substr(path.rfind('/') + 1);
+  return (IsTestSo(test_name)) ?
+    test_name.substr(0, test_name.length() - 3) : test_name;
+}
+
+/*
+ * Add the tests named by batch to tests. batch is either a directory, in which
+ * case every .so in it is added in name order (or every file, if it holds
+ * j-lang workloads and no .so files), or a file listing one test per line.
+ * Blank lines and lines starting with '#' in the file are skipped.
+ */
+bool AddBatchTests(const string &batch, std::vector<string> &tests) {
+  DIR *dir = opendir(batch.c_str());
+  if (dir != NULL) {
+    std::vector<string> test_sos;
+    std::vector<string> workloads;
+    for (struct dirent *entry = readdir(dir); entry != NULL;
+        entry = readdir(dir)) {
+      const string path = batch + "/" + entry->d_name;
+      struct stat info;
+      if (entry->d_name[0] == '.' || stat(path.c_str(), &info) < 0 ||
+          !S_ISREG(info.st_mode)) {
+        continue;
+      }
+      ((IsTestSo(path)) ? test_sos : workloads).push_back(path);
+    }
+    closedir(dir);
+    std::vector<string> &found = (test_sos.empty()) ? workloads : test_sos;
+    std::sort(found.begin(), found.end());
+    tests.insert(tests.end(), found.begin(), found.end());
+    return true;
+  }
+
+  std::ifstream list(batch);
+  if (!list.is_open()) {
+    return false;
+  }
+  string line;
+  while (std::getline(list, line)) {
+    if (!line.empty() && line[0] != '#') {
+      tests.push_back(line);
+    }
+  }
+  return true;
+}
+
+/*
+ * Pair of eventfds a forked workload process rings to ask for a checkpoint
+ * without going through the socket. They are made before the fork so the child
+ * inherits them, and the child learns about them from kCheckpointDoorbellEnv.
+ */
+struct CheckpointDoorbell {
+  int request_fd = -1;
+  int reply_fd = -1;
+
+  int Open() {
+    request_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    reply_fd = eventfd(0, EFD_CLOEXEC);
+    return (request_fd < 0 || reply_fd < 0) ? -1 : 0;
+  }
+
+  void Close() {
+    close(request_fd);
+    close(reply_fd);
+    request_fd = -1;
+    reply_fd = -1;
+  }
+
+  // Called in the child after the fork.
+  void Export() const {
+    const string doorbell = to_string(request_fd) + "," + to_string(reply_fd) +
+      "," + to_string(getpid());
+    setenv(kCheckpointDoorbellEnv, doorbell.c_str(), 1);
+  }
+};
+
+/*
+ * Answer one request from the workload on the open connection client, timing
+ * checkpoint requests. Returns 1 if the workload closed the connection.
+ */
+int ServeRequest(ServerSocket *com, const int client, Tester &test_harness) {
+  const steady_clock::time_point start = steady_clock::now();
+  SocketMessage m;
+  if (com->ReadFromClient(client, &m) != SocketError::kNone) {
+    return 1;
+  }
+
+  SocketMessage reply;
+  reply.type = SocketMessage::kInvalidCommand;
+  reply.size = 0;
+  reply.int_value = m.int_value;
+  if (m.type == SocketMessage::kCheckpoint) {
+    reply.type = (test_harness.CreateCheckpoint() == SUCCESS) ?
+      SocketMessage::kCheckpointDone : SocketMessage::kCheckpointFailed;
+  }
+  if (com->SendToClient(client, reply) != SocketError::kNone) {
+    // TODO(ashmrtn): Handle better.
+    cerr << "Error sending response to client" << endl;
+    return -1;
+  }
+  if (m.type == SocketMessage::kCheckpoint) {
+    test_harness.AddCheckpointLatency(
+        duration_cast<microseconds>(steady_clock::now() - start));
+  }
+  return 0;
+}
+
+// Answer a checkpoint request rung on doorbell.
+int ServeDoorbell(const CheckpointDoorbell &doorbell, Tester &test_harness) {
+  const steady_clock::time_point start = steady_clock::now();
+  uint64_t requests;
+  if (read(doorbell.request_fd, &requests, sizeof(requests)) !=
+      sizeof(requests)) {
+    // Nothing to read after all.
+    return 0;
+  }
+
+  // The workload waits for each reply before asking again, so there is only
+  // ever one request here.
+  const uint64_t reply = (test_harness.CreateCheckpoint() == SUCCESS) ?
+    kDoorbellCheckpointDone : kDoorbellCheckpointFailed;
+  if (write(doorbell.reply_fd, &reply, sizeof(reply)) != sizeof(reply)) {
+    cerr << "Error sending response to client" << endl;
+    return -1;
+  }
+  test_harness.AddCheckpointLatency(
+      duration_cast<microseconds>(steady_clock::now() - start));
+  return 0;
+}
+
+/*
+ * Serve checkpoint requests from child until it exits, then fill in status
+ * with its exit status. Blocks in epoll instead of polling, waking up only
+ * when a request arrives on doorbell or a connection to com, child exits
+ * (child_fd is a signalfd for SIGCHLD), or timer_fd fires. Connections to com
+ * stay open until the workload closes them. Returns -1 if child had to be
+ * killed or something went wrong.
+ */
+int WatchRun(const pid_t child, ServerSocket *com,
+    const CheckpointDoorbell &doorbell, Tester &test_harness,
+    const int epoll_fd, const int child_fd, const int timer_fd,
+    std::vector<int> &clients, int *status) {
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  const int fds[] = {com->GetFd(), doorbell.request_fd, child_fd, timer_fd};
+  for (const int fd : fds) {
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+      cerr << "Error setting up wait for test run" << endl;
+      return -1;
+    }
+  }
+
+  // The child may have exited before the signalfd existed, so check for that
+  // before the first wait.
+  while (waitpid(child, status, WNOHANG) == 0) {
+    struct epoll_event ready;
+    const int num_ready = epoll_wait(epoll_fd, &ready, 1, -1);
+    if (num_ready < 0 && errno == EINTR) {
+      continue;
+    } else if (num_ready < 0) {
+      cerr << "Error waiting on test run" << endl;
+      return -1;
+    }
+
+    if (ready.data.fd == com->GetFd()) {
+      const int client = com->AcceptClient();
+      if (client < 0) {
+        continue;
+      }
+      clients.push_back(client);
+      event.data.fd = client;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event) < 0) {
+        cerr << "Error setting up wait for test run" << endl;
+        return -1;
+      }
+    } else if (ready.data.fd == doorbell.request_fd) {
+      if (ServeDoorbell(doorbell, test_harness) < 0) {
+        return -1;
+      }
+    } else if (ready.data.fd == child_fd) {
+      // SIGCHLD may come from any child, so drain them all and let waitpid
+      // decide if it was ours.
+      struct signalfd_siginfo info;
+      while (read(child_fd, &info, sizeof(info)) == sizeof(info)) {
+      }
+    } else if (ready.data.fd == timer_fd) {
+      cerr << "Test run timed out, killing it" << endl;
+      kill(child, SIGKILL);
+      waitpid(child, status, 0);
+      return -1;
+    } else {
+      const int res = ServeRequest(com, ready.data.fd, test_harness);
+      if (res < 0) {
+        return -1;
+      } else if (res > 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, ready.data.fd, NULL);
+        close(ready.data.fd);
+        clients.erase(std::find(clients.begin(), clients.end(),
+              ready.data.fd));
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Wait for the forked workload process child to exit. If timeout_secs isn't 0,
+ * the child is killed after that long. The caller must have blocked SIGCHLD
+ * before forking child.
+ */
+int WaitForRun(const pid_t child, ServerSocket *com,
+    const CheckpointDoorbell &doorbell, Tester &test_harness,
+    const unsigned int timeout_secs, int *status) {
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  const int child_fd = signalfd(-1, &sigchld, SFD_NONBLOCK | SFD_CLOEXEC);
+  const int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct itimerspec timeout = {};
+  // A zero timeout leaves the timer disarmed.
+  timeout.it_value.tv_sec = timeout_secs;
+
+  int res = -1;
+  std::vector<int> clients;
+  if (child_fd < 0 || timer_fd < 0 || epoll_fd < 0 ||
+      timerfd_settime(timer_fd, 0, &timeout, NULL) < 0) {
+    cerr << "Error setting up wait for test run" << endl;
+  } else {
+    res = WatchRun(child, com, doorbell, test_harness, epoll_fd, child_fd,
+        timer_fd, clients, status);
+  }
+  for (const int client : clients) {
+    close(client);
+  }
+  close(epoll_fd);
+  close(timer_fd);
+  close(child_fd);
+  return res;
+}
+
+// Split a comma separated list of file system types.
+std::vector<string> SplitFsTypes(const string &list) {
+  std::vector<string> fs_types;
+  std::istringstream in(list);
+  string fs;
+  while (std::getline(in, fs, ',')) {
+    if (!fs.empty()) {
+      fs_types.push_back(fs);
+    }
+  }
+  return fs_types;
+}
+
+/*
+ * Settings that have to match between every run that checks crash states from
+ * one work bundle: a crash state index only means something with the same
+ * profile, permuter, seed, and replay mode.
+ */
+struct BundleManifest {
+  string test;
+  string fs_type;
+  string permuter;
+  unsigned int sector_size;
+  bool full_bio;
+  unsigned long long seed;
+};
+
+bool WriteBundleManifest(const string &dir, const BundleManifest &manifest) {
+  ofstream os(dir + "/" + BUNDLE_MANIFEST);
+  os << "test " << manifest.test << endl <<
+    "fs_type " << manifest.fs_type << endl <<
+    "permuter " << manifest.permuter << endl <<
+    "sector_size " << manifest.sector_size << endl <<
+    "full_bio " << manifest.full_bio << endl <<
+    "seed " << manifest.seed << endl;
+  return os.good();
+}
+
+bool ReadBundleManifest(const string &dir, BundleManifest &manifest) {
+  std::ifstream is(dir + "/" + BUNDLE_MANIFEST);
+  if (!is.is_open()) {
+    return false;
+  }
+  unsigned int found = 0;
+  string key;
+  while (is >> key) {
+    if (key == "test") {
+      is >> manifest.test;
+    } else if (key == "fs_type") {
+      is >> manifest.fs_type;
+    } else if (key == "permuter") {
+      is >> manifest.permuter;
+    } else if (key == "sector_size") {
+      is >> manifest.sector_size;
+    } else if (key == "full_bio") {
+      is >> manifest.full_bio;
+    } else if (key == "seed") {
+      is >> manifest.seed;
+    } else {
+      return false;
+    }
+    if (!is) {
+      return false;
+    }
+    ++found;
+  }
+  return found == 6;
+}
+
+// Parse a range of crash state indices written as FIRST-END.
+bool ParseStateRange(const string &range, unsigned long long &first,
+    unsigned long long &end) {
+  char *rest;
+  first = strtoull(range.c_str(), &rest, 0);
+  if (*rest != '-') {
+    return false;
+  }
+  end = strtoull(rest + 1, &rest, 0);
+  return *rest == '\0' && first < end;
+}
+
+// Returns a file descriptor that releases the lock when closed, or -1.
+int LockWrapper() {
+  const int fd = open(WRAPPER_LOCK_PATH, O_CREAT | O_RDWR | O_CLOEXEC,
+      S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return -1;
+  }
+  while (flock(fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/*
+ * Set up a forked fan-out worker called name: give it its own mount namespace
+ * so it can mount its disks at the usual mount point, send its output to
+ * log_base-name.out, and pick a socket for it that doesn't collide with the
+ * other workers.
+ */
+int StartFanOutWorker(const string &name, const string &log_base,
+    string *socket_path) {
+  if (unshare(CLONE_NEWNS) < 0 ||
+      mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) < 0) {
+    cerr << "Error making mount namespace for " << name << endl;
+    return -1;
+  }
+
+  const string out_path = log_base + "-" + name + ".out";
+  const int out_fd = open(out_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (out_fd < 0 || dup2(out_fd, STDOUT_FILENO) < 0 ||
+      dup2(out_fd, STDERR_FILENO) < 0) {
+    cerr << "Error redirecting output for " << name << endl;
+    return -1;
+  }
+  close(out_fd);
+
+  *socket_path = string(kSocketNameOutbound) + "-" + name;
+  if (setenv(kSocketPathEnv, socket_path->c_str(), 1) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Wait for the fan-out workers to finish, then print the results each sent
+ * back on its pipe along with how long it took. Returns -1 if any worker
+ * failed.
+ */
+int CollectFanOut(const std::vector<string> &names,
+    const std::vector<pid_t> &workers, std::vector<int> &pipes,
+    const steady_clock::time_point start, std::ostream &os) {
+  std::vector<string> results(names.size());
+  std::vector<steady_clock::duration> run_times(names.size());
+  unsigned int open_pipes = pipes.size();
+  while (open_pipes > 0) {
+    std::vector<struct pollfd> fds(pipes.size());
+    for (unsigned int i = 0; i < pipes.size(); ++i) {
+      fds.at(i).fd = pipes.at(i);
+      fds.at(i).events = POLLIN;
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "Error waiting on fan-out workers" << endl;
+      return -1;
+    }
+    for (unsigned int i = 0; i < pipes.size(); ++i) {
+      if (fds.at(i).revents == 0) {
+        continue;
+      }
+      char buf[4096];
+      const int res = read(pipes.at(i), buf, sizeof(buf));
+      if (res > 0) {
+        results.at(i).append(buf, res);
+        continue;
+      }
+      // Workers hold their pipe open until they exit.
+      run_times.at(i) = steady_clock::now() - start;
+      close(pipes.at(i));
+      pipes.at(i) = -1;
+      --open_pipes;
+    }
+  }
+
+  int ret = 0;
+  steady_clock::duration total(0);
+  os << endl << "========== Results for all workers ==========" << endl;
+  for (unsigned int i = 0; i < names.size(); ++i) {
+    int status = -1;
+    waitpid(workers.at(i), &status, 0);
+    const bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!ok) {
+      ret = -1;
+    }
+    total += run_times.at(i);
+    os << endl << "---------- " << names.at(i) << ": " <<
+      ((ok) ? "finished" : "failed, status " + to_string(status)) <<
+      " after " << duration_cast<std::chrono::seconds>(run_times.at(i)).count()
+      << " s ----------" << endl << results.at(i);
+  }
+  os << endl << "Wall time " <<
+    duration_cast<std::chrono::seconds>(steady_clock::now() - start).count() <<
+    " s, " << duration_cast<std::chrono::seconds>(total).count() <<
+    " s if run one after another" << endl;
+  return ret;
+}
+
+/*
+ * Merge the journals written by shards of one run into a journal at
+ * merged_path and print the combined results.
+ */
+int MergeShards(const std::vector<string> &journals, const string &merged_path,
+    const string &test_name, std::ostream &os) {
+  ProgressJournal::Header header;
+  std::vector<SingleTestInfo> merged;
+  if (!ProgressJournal::Merge(journals, header, merged)) {
+    cerr << "Error merging shard journals" << endl;
+    return -1;
+  }
+  if (!ProgressJournal::Write(merged_path, header, merged)) {
+    cerr << "Error writing merged journal " << merged_path << endl;
+    return -1;
+  }
+
+  TestSuiteResult suite;
+  suite.SetName(test_name);
+  for (SingleTestInfo &test_info : merged) {
+    suite.TallyReorderingResult(test_info);
+  }
+  os << endl << "========== Merged results of " << journals.size() <<
+    " shards, journal in " << merged_path << " ==========" << endl;
+  suite.PrintResults(os);
+  return 0;
+}
+
+}  // namespace
 
 static const option long_options[] = {
   {"background", no_argument, NULL, 'b'},
@@ -74,6 +609,26 @@ static const option long_options[] = {
   {"no-in-order-replay", no_argument, NULL, 'I'},
   {"no-permuted-order-replay", no_argument, NULL, 'P'},
   {"sector-size", required_argument, NULL, 'S'},
+  {"seed", required_argument, NULL, kSeedOpt},
+  {"replay-state", required_argument, NULL, kReplayStateOpt},
+  {"replay-test", required_argument, NULL, kReplayTestOpt},
+  {"minimize", no_argument, NULL, kMinimizeOpt},
+  {"no-adaptive", no_argument, NULL, kNoAdaptiveOpt},
+  {"resume", required_argument, NULL, kResumeOpt},
+  {"batch", required_argument, NULL, kBatchOpt},
+  {"run-timeout", required_argument, NULL, kRunTimeoutOpt},
+  {"fan-out", required_argument, NULL, kFanOutOpt},
+  {"export-bundle", required_argument, NULL, kExportBundleOpt},
+  {"bundle", required_argument, NULL, kBundleOpt},
+  {"states", required_argument, NULL, kStatesOpt},
+  {"shards", required_argument, NULL, kShardsOpt},
+  {"trace", required_argument, NULL, kTraceOpt},
+  {"memory-limit", required_argument, NULL, kMemoryLimitOpt},
+  {"snapshot-backend", required_argument, NULL, kSnapshotBackendOpt},
+  {"snapshot-dir", required_argument, NULL, kSnapshotDirOpt},
+  {"capture-backend", required_argument, NULL, kCaptureBackendOpt},
+  {"capture-log-dev", required_argument, NULL, kCaptureLogDevOpt},
+  {"wrapper-id", required_argument, NULL, kWrapperIdOpt},
   {0, 0, 0, 0},
 };
 
@@ -97,8 +652,32 @@ int main(int argc, char** argv) {
   bool permuted_order_replay = true;
   bool full_bio_replay = false;
   int iterations = 10000;
-  int disk_size = 10240;
+  long long disk_size = 10240;
   unsigned int sector_size = 512;
+  unsigned long long seed = 42;
+  std::vector<string> replay_states;
+  std::set<unsigned int> replay_tests;
+  bool minimize = false;
+  bool adaptive = true;
+  string resume_journal("");
+  string batch_tests("");
+  unsigned int run_timeout = 0;
+  std::vector<string> fan_out_fs;
+  string export_bundle("");
+  string bundle("");
+  string state_range("");
+  unsigned int shards = 0;
+  string trace_path("");
+  // Soft limit on resident memory in MB, 0 for none.
+  unsigned long long memory_limit = 0;
+  // Where the test disk and its snapshots come from, see SnapshotBackend.h.
+  string snapshot_backend(fs_testing::CowBrdBackend::kName);
+  string snapshot_dir("");
+  // How the workload's bios are recorded, see CaptureBackend.h.
+  string capture_backend(fs_testing::DiskWrapperBackend::kName);
+  string capture_log_dev("");
+  // disk_wrapper instance to record on. Fan-out workers use the ones after it.
+  unsigned int wrapper_id = 0;
   int option_idx = 0;
   ServerSocket* background_com = NULL;
 
@@ -120,7 +699,7 @@ int main(int argc, char** argv) {
         test_dev = string(optarg);
         break;
       case 'e':
-        disk_size = atoi(optarg);
+        disk_size = strtoll(optarg, NULL, 0);
         break;
       case 'l':
         log_file_save = string(optarg);
@@ -164,6 +743,66 @@ int main(int argc, char** argv) {
       case 'S':
         sector_size = atoi(optarg);
         break;
+      case kSeedOpt:
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case kReplayStateOpt:
+        replay_states.push_back(string(optarg));
+        break;
+      case kReplayTestOpt:
+        replay_tests.insert(atoi(optarg));
+        break;
+      case kMinimizeOpt:
+        minimize = true;
+        break;
+      case kNoAdaptiveOpt:
+        adaptive = false;
+        break;
+      case kResumeOpt:
+        resume_journal = string(optarg);
+        break;
+      case kBatchOpt:
+        batch_tests = string(optarg);
+        break;
+      case kRunTimeoutOpt:
+        run_timeout = strtoul(optarg, NULL, 0);
+        break;
+      case kFanOutOpt:
+        fan_out_fs = SplitFsTypes(optarg);
+        break;
+      case kExportBundleOpt:
+        export_bundle = string(optarg);
+        break;
+      case kBundleOpt:
+        bundle = string(optarg);
+        break;
+      case kStatesOpt:
+        state_range = string(optarg);
+        break;
+      case kShardsOpt:
+        shards = strtoul(optarg, NULL, 0);
+        break;
+      case kTraceOpt:
+        trace_path = string(optarg);
+        break;
+      case kMemoryLimitOpt:
+        memory_limit = strtoull(optarg, NULL, 0);
+        break;
+      case kSnapshotBackendOpt:
+        snapshot_backend = string(optarg);
+        break;
+      case kSnapshotDirOpt:
+        snapshot_dir = string(optarg);
+        break;
+      case kCaptureBackendOpt:
+        capture_backend = string(optarg);
+        break;
+      case kCaptureLogDevOpt:
+        capture_log_dev = string(optarg);
+        break;
+      case kWrapperIdOpt:
+        wrapper_id = strtoul(optarg, NULL, 0);
+        break;
       case '?':
       default:
         return -1;
@@ -177,23 +816,64 @@ int main(int argc, char** argv) {
    * 1. check arguments are sane
    * 2. load up socket connections if/when needed
    * 3. load basic kernel modules
-   * 4. load static objects for permuter and test case
+   * 4. load static objects for permuter
    ****************************************************************************/
-  const unsigned int test_case_idx = optind;
-  const string path = argv[test_case_idx];
-
-  // Get the name of the test being run.
-  int begin = path.rfind('/');
-  // Remove everything before the last /.
-  string test_name = path.substr(begin + 1);
-  // Remove the extension.
-  test_name = test_name.substr(0, test_name.length() - 3);
+  // Every test given is run in turn with the same kernel modules and devices,
+  // and the results of all of them go to one log.
+  std::vector<string> test_paths(argv + optind, argv + argc);
+  if (!batch_tests.empty() && !AddBatchTests(batch_tests, test_paths)) {
+    cerr << "Unable to read batch of tests from " << batch_tests << endl;
+    return -1;
+  }
+  if (test_paths.empty()) {
+    cerr << "Please give a .so test case to load" << endl;
+    return -1;
+  }
+  const bool batch = test_paths.size() > 1 || !batch_tests.empty();
+
+  // A work bundle fixes everything that decides which crash state an index
+  // stands for, so take those settings from it instead of the command line.
+  if (!bundle.empty()) {
+    BundleManifest manifest;
+    if (!ReadBundleManifest(bundle, manifest)) {
+      cerr << "Unable to read work bundle manifest in " << bundle << endl;
+      return -1;
+    }
+    if (batch || manifest.test != TestName(test_paths.front())) {
+      cerr << "Work bundle " << bundle << " was recorded for test " <<
+        manifest.test << endl;
+      return -1;
+    }
+    log_file_load = bundle + "/" BUNDLE_LOG;
+    fs_type = manifest.fs_type;
+    permuter = manifest.permuter;
+    sector_size = manifest.sector_size;
+    full_bio_replay = manifest.full_bio;
+    seed = manifest.seed;
+  }
+  if (!export_bundle.empty()) {
+    if (!log_file_load.empty()) {
+      cerr << "Can't export a work bundle from a loaded profile" << endl;
+      return -1;
+    }
+    if (mkdir(export_bundle.c_str(), DIRECTORY_PERMS) < 0 && errno != EEXIST) {
+      cerr << "Unable to make work bundle directory " << export_bundle <<
+        endl;
+      return -1;
+    }
+    log_file_save = export_bundle + "/" BUNDLE_LOG;
+    // Crash states are checked by whoever runs the bundle.
+    in_order_replay = false;
+    permuted_order_replay = false;
+  }
+
   // Get the date and time stamp and format.
   time_t now = time(0);
   char time_st[18];
   strftime(time_st, sizeof(time_st), "%Y%m%d_%H%M%S", localtime(&now));
-  string s = string(time_st) + "-" + test_name + ".log";
-  ofstream logfile(s);
+  const string log_base = string(time_st) + "-" +
+    ((batch) ? string("batch") : TestName(test_paths.front()));
+  ofstream logfile(log_base + ".log");
 
   // This should be changed in the option is added to mount tests in other
   // directories.
@@ -202,15 +882,16 @@ int main(int argc, char** argv) {
     cerr << "Error setting environment variable MOUNT_FS" << endl;
   }
   
+  // Every process of the run, fan-out workers included, adds to one trace.
+  if (!trace_path.empty() && !Tracer::Open(trace_path)) {
+    cerr << "Error opening trace file " << trace_path << endl;
+    return -1;
+  }
+
   cout << "========== PHASE 0: Setting up CrashMonkey basics =========="
     << endl;
   logfile << "========== PHASE 0: Setting up CrashMonkey basics =========="
     << endl;
-  if (test_case_idx == argc) {
-    cerr << "Please give a .so test case to load" << endl;
-    return -1;
-  }
-
   if (iterations < 0) {
     cerr << "Please give a positive number of iterations to run" << endl;
     return -1;
@@ -227,6 +908,228 @@ int main(int argc, char** argv) {
     return -1;
   }
 
+  if (!replay_states.empty()) {
+    if (log_file_load.empty()) {
+      cerr << "Replaying crash states requires a profile loaded with -r" <<
+        endl;
+      return -1;
+    }
+    // Only run the crash states we were given.
+    in_order_replay = false;
+    permuted_order_replay = false;
+  }
+
+  if (!resume_journal.empty() && log_file_load.empty()) {
+    cerr << "Resuming a run requires the profile it used loaded with -r" <<
+      endl;
+    return -1;
+  }
+
+  // Saved profiles, crash states, and journals each belong to a single test.
+  if (batch && (background || !log_file_save.empty() ||
+        !log_file_load.empty() || !replay_states.empty() ||
+        !resume_journal.empty())) {
+    cerr << "-b, -l, -r, --replay-state, and --resume can't be used with more "
+      "than one test" << endl;
+    return -1;
+  }
+
+  unsigned long long first_state = 0;
+  unsigned long long end_state = ~0ULL;
+  if (!state_range.empty() &&
+      !ParseStateRange(state_range, first_state, end_state)) {
+    cerr << "Please give crash states to test as FIRST-END with FIRST < END" <<
+      endl;
+    return -1;
+  }
+
+  // Shards split up the crash states of a single profile.
+  if (shards > 0 && (log_file_load.empty() || background ||
+        !log_file_save.empty() || !replay_states.empty() ||
+        !resume_journal.empty() || !fan_out_fs.empty())) {
+    cerr << "--shards needs a profile from --bundle or -r and can't be used "
+      "with -b, -l, --replay-state, --resume, or --fan-out" << endl;
+    return -1;
+  }
+  if (shards > 0 && state_range.empty()) {
+    end_state = iterations;
+  }
+
+  // The emulated disks only exist in this process, so there is nothing to run
+  // a workload on, mount, or fsck.
+  if (snapshot_backend == fs_testing::EmulatedBackend::kName) {
+    cerr << "--snapshot-backend " << snapshot_backend << " has no block "
+      "devices and can only be used with an image checker" << endl;
+    return -1;
+  }
+  // Only cow_brd keeps its disks in RAM.
+  const bool cow_brd = snapshot_backend == fs_testing::CowBrdBackend::kName;
+  if (!cow_brd && snapshot_dir.empty()) {
+    cerr << "--snapshot-backend " << snapshot_backend << " needs a directory "
+      "to keep disk images in from --snapshot-dir" << endl;
+    return -1;
+  }
+  // One instance for each fan-out worker, or just one.
+  const unsigned int wrapper_instances =
+    std::max(fan_out_fs.size() + shards, (size_t) 1);
+  if (wrapper_id + wrapper_instances > HWM_MAX_DEVICES) {
+    cerr << "--wrapper-id " << wrapper_id << " leaves too few disk_wrapper "
+      "instances, there are " << HWM_MAX_DEVICES << endl;
+    return -1;
+  }
+  if (capture_backend == fs_testing::DmLogWritesBackend::kName &&
+      capture_log_dev.empty()) {
+    cerr << "--capture-backend " << capture_backend << " needs a device to "
+      "write its log to from --capture-log-dev" << endl;
+    return -1;
+  }
+
+  // Each file system gets its own profile, crash states, and journal.
+  if (!fan_out_fs.empty() && (background || !log_file_save.empty() ||
+        !log_file_load.empty() || !replay_states.empty() ||
+        !resume_journal.empty())) {
+    cerr << "-b, -l, -r, --replay-state, and --resume can't be used with "
+      "--fan-out" << endl;
+    return -1;
+  }
+
+  /*****************************************************************************
+   * In fan-out mode this process only sets up snapshot devices with a disk for
+   * each worker, forks the workers, and reports what they found. Workers test
+   * either one file system each (--fan-out) or one slice of the crash states
+   * of a loaded profile each (--shards). Each worker runs the rest of main
+   * against its own disk, in its own mount namespace, with its own socket,
+   * and with its own disk_wrapper instance, so workers can record and check
+   * crash states at the same time.
+   ****************************************************************************/
+  std::vector<string> worker_names(fan_out_fs);
+  for (unsigned int i = 0; i < shards; ++i) {
+    worker_names.push_back("shard" + to_string(i));
+  }
+  int fan_out_idx = -1;
+  int fan_out_pipe = -1;
+  string socket_path(kSocketNameOutbound);
+  // Prefix for the files a run leaves behind.
+  string run_prefix(time_st);
+  if (!worker_names.empty()) {
+    Tester fan_out_harness(disk_size, sector_size, verbose);
+    if (!fan_out_harness.set_snapshot_backend(snapshot_backend,
+          snapshot_dir)) {
+      cerr << "Unknown snapshot backend " << snapshot_backend << endl;
+      return -1;
+    }
+    fan_out_harness.set_snapshot_disk(0, worker_names.size());
+    cout << "Inserting " << snapshot_backend << " devices with " <<
+      worker_names.size() << " disks" << endl;
+    logfile << "Inserting " << snapshot_backend << " devices with " <<
+      worker_names.size() << " disks" << endl;
+    if (fan_out_harness.insert_snapshot_devices() != SUCCESS) {
+      cerr << "Error inserting " << snapshot_backend << " devices" << endl;
+      return -1;
+    }
+
+    const steady_clock::time_point start = steady_clock::now();
+    std::vector<pid_t> workers;
+    std::vector<int> pipes;
+    bool fork_failed = false;
+    cout.flush();
+    logfile.flush();
+    for (unsigned int i = 0; i < worker_names.size(); ++i) {
+      cout << "Starting worker " << worker_names.at(i) << ", output in " <<
+        log_base << "-" << worker_names.at(i) << ".out" << endl;
+      int pipe_fds[2];
+      if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        cerr << "Error making pipe for fan-out worker" << endl;
+        fork_failed = true;
+        break;
+      }
+      const pid_t worker = fork();
+      if (worker < 0) {
+        cerr << "Error spinning off fan-out worker" << endl;
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        fork_failed = true;
+        break;
+      } else if (worker == 0) {
+        close(pipe_fds[0]);
+        for (const int fd : pipes) {
+          close(fd);
+        }
+        fan_out_idx = i;
+        fan_out_pipe = pipe_fds[1];
+        break;
+      }
+      close(pipe_fds[1]);
+      workers.push_back(worker);
+      pipes.push_back(pipe_fds[0]);
+    }
+
+    if (fan_out_idx < 0) {
+      TraceSpan fan_out_span("fan out", "phase");
+      std::ostringstream results;
+      const std::vector<string> started(worker_names.begin(),
+          worker_names.begin() + workers.size());
+      int res = CollectFanOut(started, workers, pipes, start, results);
+      if (shards > 0 && !fork_failed) {
+        // Fold the shards back into one run, the same way merge_journals
+        // would for shards run on different machines.
+        const string test_name = TestName(test_paths.front());
+        std::vector<string> journals;
+        for (const string &name : started) {
+          journals.push_back(string(time_st) + "-" + name + "-" + test_name +
+              ".journal");
+        }
+        if (MergeShards(journals, string(time_st) + "-" + test_name +
+              ".journal", test_name, results) < 0) {
+          res = -1;
+        }
+      }
+      fan_out_span.End();
+      cout << results.str();
+      logfile << results.str();
+      logfile.close();
+      if (fan_out_harness.remove_snapshot_devices() != SUCCESS) {
+        cerr << "Error removing " << snapshot_backend << " devices" << endl;
+        res = -1;
+      }
+      return (fork_failed) ? -1 : res;
+    }
+
+    const string &name = worker_names.at(fan_out_idx);
+    if (shards > 0) {
+      // Spread the remainder over the first shards, without multiplying the
+      // span, which can be most of the 64 bit range.
+      const unsigned long long span = end_state - first_state;
+      auto shard_start = [&](const unsigned long long i) {
+        return first_state + span / shards * i +
+          std::min(i, span % shards);
+      };
+      end_state = shard_start(fan_out_idx + 1);
+      first_state = shard_start(fan_out_idx);
+    } else {
+      fs_type = name;
+    }
+    Tracer::SetWorker(fan_out_idx + 1, name);
+    if (StartFanOutWorker(name, log_base, &socket_path) < 0) {
+      return -1;
+    }
+    logfile.close();
+    logfile.open(log_base + "-" + name + ".log");
+    run_prefix += "-" + name;
+  }
+  TraceSpan setup_span("phase 0: setup", "phase");
+  int wrapper_lock = -1;
+  const string change_path = (fan_out_idx < 0) ? string(kChangePath) :
+    string(kChangePath) + "-" + worker_names.at(fan_out_idx);
+
+  // A run over part of the crash states has to try every index in its range
+  // so that the runs together cover all of them.
+  if (end_state != ~0ULL) {
+    iterations = (int) std::min(end_state - first_state,
+        (unsigned long long) INT_MAX);
+    adaptive = false;
+  }
+
   // Create a socket to coordinate with the outside world.
   // TODO(ashmrtn): Fix permissions on the socket.
   /*
@@ -264,7 +1167,7 @@ int main(int argc, char** argv) {
   }
   */
 
-  background_com = new ServerSocket(kSocketNameOutbound);
+  background_com = new ServerSocket(socket_path);
   if (background_com->Init(kSocketQueueDepth) < 0) {
     int err_no = errno;
     cerr << "Error starting socket to listen on " << err_no << endl;
@@ -274,14 +1177,37 @@ int main(int argc, char** argv) {
 
 
   Tester test_harness(disk_size, sector_size, verbose);
-  test_harness.StartTestSuite();
-
-  cout << "Inserting RAM disk module" << endl;
-  logfile << "Inserting RAM disk module" << endl;
-  if (test_harness.insert_cow_brd() != SUCCESS) {
-    cerr << "Error inserting RAM disk module" << endl;
+  if (!test_harness.set_snapshot_backend(snapshot_backend, snapshot_dir)) {
+    cerr << "Unknown snapshot backend " << snapshot_backend << endl;
+    return -1;
+  }
+  if (!test_harness.set_capture_backend(capture_backend, capture_log_dev)) {
+    cerr << "Unknown capture backend " << capture_backend << endl;
     return -1;
   }
+  test_harness.set_wrapper_instance(wrapper_id +
+      ((fan_out_idx >= 0) ? fan_out_idx : 0));
+
+  if (fan_out_idx >= 0) {
+    test_harness.set_diff_prefix(worker_names.at(fan_out_idx) + "-");
+    test_harness.set_snapshot_disk(fan_out_idx, worker_names.size());
+    if (test_harness.open_snapshot_devices() != SUCCESS) {
+      cerr << "Error opening " << snapshot_backend << " disk " <<
+        fan_out_idx << endl;
+      return -1;
+    }
+  } else {
+    cout << "Inserting " << snapshot_backend << " devices" << endl;
+    logfile << "Inserting " << snapshot_backend << " devices" << endl;
+    if (test_harness.insert_snapshot_devices() != SUCCESS) {
+      cerr << "Error inserting " << snapshot_backend << " devices" << endl;
+      return -1;
+    }
+  }
+  if (fan_out_idx >= 0 || !cow_brd) {
+    // Test on the disk the backend made rather than whatever -d says.
+    test_dev = test_harness.get_snapshot_base_path();
+  }
   test_harness.set_fs_type(fs_type);
   test_harness.set_device(test_dev);
   FILE *input;
@@ -311,15 +1237,6 @@ int main(int argc, char** argv) {
     cerr << "Error setting environment variable FILESYS_SIZE" << endl;
   }
   
-  // Load the class being tested.
-  cout << "Loading test case" << endl;
-  if (test_harness.test_load_class(argv[test_case_idx]) != SUCCESS) {
-    test_harness.cleanup_harness();
-      return -1;
-  }
-  
-  test_harness.test_init_values(mount_dir, test_dev_size);
-  
   // Load the permuter to use for the test.
   // TODO(ashmrtn): Consider making a line in the test file which specifies the
   // permuter to use?
@@ -342,709 +1259,866 @@ int main(int argc, char** argv) {
     test_harness.cleanup_harness();
     return -1;
   }
-
-
-  /*****************************************************************************
-   * PHASE 1:
-   * Setup the base image of the disk for snapshots later. This could happen in
-   * one of several ways:
-   * 1. The -r flag specifies that there are log files which contain the disk
-   *    image. These will now be loaded from disk
-   * 2. The -b flag specifies that CrashMonkey is running as a "background"
-   *    process of sorts and should listen on its socket for commands from the
-   *    user telling it when to perform certain actions. The user is responsible
-   *    for running their own pre-test setup methods at the proper times
-   * 3. CrashMonkey is running as a standalone program. It will run the pre-test
-   *    setup methods defined in the test case static object it loaded
-   ****************************************************************************/
-
-  cout << endl << "========== PHASE 1: Creating base disk image =========="
-    << endl;
-  logfile << endl << "========== PHASE 1: Creating base disk image =========="
-    << endl;
-  // Run the normal test setup stuff if we don't have a log file.
-  if (log_file_load.empty()) {
-    /***************************************************************************
-     * Setup for both background operation and standalone mode operation.
-     **************************************************************************/
-    if (flags_dev.empty()) {
-      cerr << "No device to copy flags from given" << endl;
-      return -1;
+  setup_span.End();
+  test_harness.SampleMemory("phase 0: setup");
+
+
+  for (unsigned int test_idx = 0; test_idx < test_paths.size(); ++test_idx) {
+    const string &path = test_paths.at(test_idx);
+    const string test_name = TestName(path);
+    if (batch) {
+      cout << endl << "========== Test " << test_name << " (" <<
+        test_idx + 1 << "/" << test_paths.size() << ") ==========" << endl;
+      logfile << endl << "========== Test " << test_name << " (" <<
+        test_idx + 1 << "/" << test_paths.size() << ") ==========" << endl;
     }
 
-    // Device flags only need set if we are logging requests.
-    test_harness.set_flag_device(flags_dev);
-
-    // Format test drive to desired type.
-    cout << "Formatting test drive" << endl;
-    logfile << "Formatting test drive" << endl;
-    if (test_harness.format_drive() != SUCCESS) {
-      cerr << "Error formatting test drive" << endl;
-      test_harness.cleanup_harness();
-      return -1;
+    if (test_idx > 0) {
+      // Keep the kernel modules from the last test loaded and just clear out
+      // its devices and state.
+      cout << "Wiping test disk and snapshots" << endl;
+      logfile << "Wiping test disk and snapshots" << endl;
+      test_harness.test_unload_class();
+      test_harness.reset_test_state();
+      if (test_harness.wipe_snapshot_devices() != SUCCESS) {
+        cerr << "Error wiping test disk" << endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
+    }
+    test_harness.StartTestSuite((batch) ? test_name : "");
+
+    // Load the class being tested. Anything other than a .so is a j-lang
+    // workload, which is run by the interpreter test case.
+    string test_so = path;
+    if (!IsTestSo(path)) {
+      if (setenv(J_LANG_FILE_ENV, path.c_str(), 1) == -1) {
+        cerr << "Error setting environment variable " J_LANG_FILE_ENV << endl;
+      }
+      test_so = J_LANG_TEST_SO;
+    }
+    cout << "Loading test case" << endl;
+    logfile << "Loading test case" << endl;
+    if (test_harness.test_load_class(test_so.c_str()) != SUCCESS) {
+      test_harness.cleanup_harness();
+      return -1;
     }
 
-    // Mount test file system for pre-test setup.
-    cout << "Mounting test file system for pre-test setup" << endl;
-    logfile << "Mounting test file system for pre-test setup" << endl;
-    if (test_harness.mount_device_raw(mount_opts.c_str()) != SUCCESS) {
-      cerr << "Error mounting test device" << endl;
+    if (test_harness.test_init_values(mount_dir, test_dev_size) != SUCCESS) {
+      cerr << "Error initializing test case" << endl;
       test_harness.cleanup_harness();
       return -1;
     }
 
-    // TODO(ashmrtn): Close startup socket fd here.
+    /***************************************************************************
+     * PHASE 1:
+     * Setup the base image of the disk for snapshots later. This could happen
+     * in one of several ways:
+     * 1. The -r flag specifies that there are log files which contain the disk
+     *    image. These will now be loaded from disk
+     * 2. The -b flag specifies that CrashMonkey is running as a "background"
+     *    process of sorts and should listen on its socket for commands from the
+     *    user telling it when to perform certain actions. The user is
+     *    responsible for running their own pre-test setup methods at the proper
+     *    times
+     * 3. CrashMonkey is running as a standalone program. It will run the
+     *    pre-test setup methods defined in the test case static object it
+     *    loaded
+     **************************************************************************/
 
-    if (background) {
-      cout << "+++++ Please run any needed pre-test setup +++++" << endl;
-      logfile << "+++++ Please run any needed pre-test setup +++++" << endl;
+    cout << endl << "========== PHASE 1: Creating base disk image =========="
+      << endl;
+    logfile << endl << "========== PHASE 1: Creating base disk image =========="
+      << endl;
+    TraceSpan base_image_span("phase 1: base image", "phase");
+    // Run the normal test setup stuff if we don't have a log file.
+    if (log_file_load.empty()) {
       /*************************************************************************
-       * Background mode user setup. Wait for the user to tell use that they
-       * have finished the pre-test setup phase.
+       * Setup for both background operation and standalone mode operation.
        ************************************************************************/
-      SocketMessage command;
-      do {
-        if (background_com->WaitForMessage(&command) != SocketError::kNone) {
-          cerr << "Error getting message from socket" << endl;
-          delete background_com;
-          test_harness.cleanup_harness();
-          return -1;
-        }
+      if (flags_dev.empty()) {
+        cerr << "No device to copy flags from given" << endl;
+        return -1;
+      }
 
-        if (command.type != SocketMessage::kBeginLog) {
-          if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
-              SocketError::kNone) {
-            cerr << "Error sending response to client" << endl;
+      // Device flags only need set if we are logging requests.
+      test_harness.set_flag_device(flags_dev);
+
+      // Format test drive to desired type.
+      cout << "Formatting test drive" << endl;
+      logfile << "Formatting test drive" << endl;
+      TraceSpan format_span("format", "base image");
+      if (test_harness.format_drive() != SUCCESS) {
+        cerr << "Error formatting test drive" << endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
+      format_span.End();
+
+      // Mount test file system for pre-test setup.
+      cout << "Mounting test file system for pre-test setup" << endl;
+      logfile << "Mounting test file system for pre-test setup" << endl;
+      if (test_harness.mount_device_raw(mount_opts.c_str()) != SUCCESS) {
+        cerr << "Error mounting test device" << endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
+
+      // TODO(ashmrtn): Close startup socket fd here.
+
+      if (background) {
+        cout << "+++++ Please run any needed pre-test setup +++++" << endl;
+        logfile << "+++++ Please run any needed pre-test setup +++++" << endl;
+        /***********************************************************************
+         * Background mode user setup. Wait for the user to tell use that they
+         * have finished the pre-test setup phase.
+         **********************************************************************/
+        SocketMessage command;
+        do {
+          if (background_com->WaitForMessage(&command) != SocketError::kNone) {
+            cerr << "Error getting message from socket" << endl;
             delete background_com;
             test_harness.cleanup_harness();
             return -1;
           }
-          background_com->CloseClient();
-        }
-      } while (command.type != SocketMessage::kBeginLog);
-    } else {
-      /*************************************************************************
-       * Standalone mode user setup. Run the pre-test "setup()" method defined
-       * in the test case. Run as a separate process for the sake of
-       * cleanliness.
-       ************************************************************************/
-      cout << "Running pre-test setup" << endl;
-      logfile << "Running pre-test setup" << endl;
-      {
-        const pid_t child = fork();
-        if (child < 0) {
-          cerr << "Error creating child process to run pre-test setup" << endl;
-          test_harness.cleanup_harness();
-          return -1;
-        } else if (child != 0) {
-          // Parent process should wait for child to terminate before proceeding.
-          pid_t status;
-          wait(&status);
-          if (status != 0) {
-            cerr << "Error in pre-test setup" << endl;
+
+          if (command.type != SocketMessage::kBeginLog) {
+            if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
+                SocketError::kNone) {
+              cerr << "Error sending response to client" << endl;
+              delete background_com;
+              test_harness.cleanup_harness();
+              return -1;
+            }
+            background_com->CloseClient();
+          }
+        } while (command.type != SocketMessage::kBeginLog);
+      } else {
+        /***********************************************************************
+         * Standalone mode user setup. Run the pre-test "setup()" method defined
+         * in the test case. Run as a separate process for the sake of
+         * cleanliness.
+         **********************************************************************/
+        cout << "Running pre-test setup" << endl;
+        logfile << "Running pre-test setup" << endl;
+        {
+          TraceSpan test_setup_span("test setup", "base image");
+          const pid_t child = fork();
+          if (child < 0) {
+            cerr << "Error creating child process to run pre-test setup" << endl;
             test_harness.cleanup_harness();
             return -1;
+          } else if (child != 0) {
+            // Parent process should wait for child to terminate before
+            // proceeding.
+            pid_t status;
+            wait(&status);
+            if (status != 0) {
+              cerr << "Error in pre-test setup" << endl;
+              test_harness.cleanup_harness();
+              return -1;
+            }
+          } else {
+            Tracer::Close();
+            return test_harness.test_setup();
           }
-        } else {
-          return test_harness.test_setup();
         }
       }
-    }
 
-    /***************************************************************************
-     * Pre-test setup complete. Unmount the test file system and snapshot the
-     * disk for use in workload and tests.
-     **************************************************************************/
-    // Unmount the test file system after pre-test setup.
-    cout << "Unmounting test file system after pre-test setup" << endl;
-    logfile << "Unmounting test file system after pre-test setup" << endl;
-    if (test_harness.umount_device() != SUCCESS) {
-      test_harness.cleanup_harness();
-      return -1;
-    }
-
-    // Create snapshot of disk for testing.
-    cout << "Making new snapshot" << endl;
-    logfile << "Making new snapshot" << endl;
-    if (test_harness.clone_device() != SUCCESS) {
-      test_harness.cleanup_harness();
-      return -1;
-    }
+      /*************************************************************************
+       * Pre-test setup complete. Unmount the test file system and snapshot the
+       * disk for use in workload and tests.
+       ************************************************************************/
+      // Unmount the test file system after pre-test setup.
+      cout << "Unmounting test file system after pre-test setup" << endl;
+      logfile << "Unmounting test file system after pre-test setup" << endl;
+      if (test_harness.umount_device() != SUCCESS) {
+        test_harness.cleanup_harness();
+        return -1;
+      }
 
-    // If we're logging this test run then also save the snapshot.
-    if (!log_file_save.empty()) {
+      // Create snapshot of disk for testing.
+      cout << "Making new snapshot" << endl;
+      logfile << "Making new snapshot" << endl;
+      TraceSpan snapshot_span("snapshot", "base image");
+      if (test_harness.clone_device() != SUCCESS) {
+        test_harness.cleanup_harness();
+        return -1;
+      }
+      snapshot_span.End();
+
+      // If we're logging this test run then also save the snapshot.
+      if (!log_file_save.empty()) {
+        /***********************************************************************
+         * The -l flag specifies that we should save the information for this
+         * harness execution. Therefore, save the disk image we are using as the
+         * base image for our snapshots.
+         **********************************************************************/
+        cout << "Saving snapshot to log file" << endl;
+        logfile << "Saving snapshot to log file" << endl;
+        if (test_harness.log_snapshot_save(log_file_save + "_snap")
+            != SUCCESS) {
+          test_harness.cleanup_harness();
+          return -1;
+        }
+      }
+    } else {
       /*************************************************************************
-       * The -l flag specifies that we should save the information for this
-       * harness execution. Therefore, save the disk image we are using as the
-       * base image for our snapshots.
+       * The -r flag specifies that we should load information from the provided
+       * log file. Load the base disk image for snapshots here.
        ************************************************************************/
-      cout << "Saving snapshot to log file" << endl;
-      logfile << "Saving snapshot to log file" << endl;
-      if (test_harness.log_snapshot_save(log_file_save + "_snap")
-          != SUCCESS) {
+      // Load the snapshot in the log file and then write it to disk.
+      cout << "Loading saved snapshot" << endl;
+      logfile << "Loading saved snapshot" << endl;
+      if (test_harness.log_snapshot_load(log_file_load + "_snap") != SUCCESS) {
         test_harness.cleanup_harness();
         return -1;
       }
     }
-  } else {
-    /***************************************************************************
-     * The -r flag specifies that we should load information from the provided
-     * log file. Load the base disk image for snapshots here.
-     **************************************************************************/
-    // Load the snapshot in the log file and then write it to disk.
-    cout << "Loading saved snapshot" << endl;
-    logfile << "Loading saved snapshot" << endl;
-    if (test_harness.log_snapshot_load(log_file_load + "_snap") != SUCCESS) {
-      test_harness.cleanup_harness();
-      return -1;
-    }
-  }
+    base_image_span.End();
+    test_harness.SampleMemory("phase 1: base image");
 
 
-  /*****************************************************************************
-   * PHASE 2:
-   * Obtain a series of disk epochs to operate on in the test phase of the
-   * harness. Again, this could happen in one of several ways:
-   * 1. The -r flag specifies that there are log files which contain the disk
-   *    epochs. These will now be loaded from disk
-   * 2. The -b flag specifies that CrashMonkey is running as a "background"
-   *    process of sorts and should listen on its socket for commands from the
-   *    user telling it when to perform certain actions. The user is responsible
-   *    for running their own workload methods at the proper times
-   * 3. CrashMonkey is running as a standalone program. It will run the workload
-   *    methods defined in the test case static object it loaded
-   ****************************************************************************/
-
-  cout << endl << "========== PHASE 2: Recording user workload =========="
-    << endl;
-  logfile << endl << "========== PHASE 2: Recording user workload =========="
-    << endl;
-  // TODO(ashmrtn): Consider making a flag for this?
-  cout << "Clearing caches" << endl;
-  logfile << "Clearing caches" << endl;
-  if (test_harness.clear_caches() != SUCCESS) {
-    cerr << "Error clearing caches" << endl;
-    test_harness.cleanup_harness();
-    return -1;
-  }
-
-  // No log file given so run the test profile.
-  if (log_file_load.empty()) {
     /***************************************************************************
-     * Preparations for both background operation and standalone mode operation.
+     * PHASE 2:
+     * Obtain a series of disk epochs to operate on in the test phase of the
+     * harness. Again, this could happen in one of several ways:
+     * 1. The -r flag specifies that there are log files which contain the disk
+     *    epochs. These will now be loaded from disk
+     * 2. The -b flag specifies that CrashMonkey is running as a "background"
+     *    process of sorts and should listen on its socket for commands from the
+     *    user telling it when to perform certain actions. The user is
+     *    responsible for running their own workload methods at the proper times
+     * 3. CrashMonkey is running as a standalone program. It will run the
+     *    workload methods defined in the test case static object it loaded
      **************************************************************************/
 
-    // Insert the disk block wrapper into the kernel.
-    cout << "Inserting wrapper module into kernel" << endl;
-    logfile << "Inserting wrapper module into kernel" << endl;
-    if (test_harness.insert_wrapper() != SUCCESS) {
-      cerr << "Error inserting kernel wrapper module" << endl;
-      test_harness.cleanup_harness();
-      return -1;
-    }
-
-    // Get access to wrapper module ioctl functions via FD.
-    cout << "Getting wrapper device ioctl fd" << endl;
-    logfile << "Getting wrapper device ioctl fd" << endl;
-    if (test_harness.get_wrapper_ioctl() != SUCCESS) {
-      cerr << "Error opening device file" << endl;
+    cout << endl << "========== PHASE 2: Recording user workload =========="
+      << endl;
+    logfile << endl << "========== PHASE 2: Recording user workload =========="
+      << endl;
+    TraceSpan record_span("phase 2: record workload", "phase");
+    // TODO(ashmrtn): Consider making a flag for this?
+    cout << "Clearing caches" << endl;
+    logfile << "Clearing caches" << endl;
+    if (test_harness.clear_caches() != SUCCESS) {
+      cerr << "Error clearing caches" << endl;
       test_harness.cleanup_harness();
       return -1;
     }
 
-    // Clear wrapper module logs prior to test profiling.
-    cout << "Clearing wrapper device logs" << endl;
-    logfile << "Clearing wrapper device logs" << endl;
-    test_harness.clear_wrapper_log();
-    cout << "Enabling wrapper device logging" << endl;
-    logfile << "Enabling wrapper device logging" << endl;
-    test_harness.begin_wrapper_logging();
+    // No log file given so run the test profile.
+    if (log_file_load.empty()) {
+      /*************************************************************************
+       * Preparations for both background operation and standalone mode
+       * operation.
+       ************************************************************************/
 
-    // We also need to log the changes made by mount of the FS
-    // because the snapshot is taken after an unmount.
-    
-    // Mount the file system under the wrapper module for profiling.
-    cout << "Mounting wrapper file system" << endl;
-    if (test_harness.mount_wrapper_device(mount_opts.c_str()) != SUCCESS) {
-      cerr << "Error mounting wrapper file system" << endl;
-      test_harness.cleanup_harness();
-      return -1;
-    }
+      // Fan-out workers each record on their own disk_wrapper instance, but
+      // other capture backends can only record one of them at a time. The
+      // lock is dropped once the capture device is removed.
+      if (fan_out_idx >= 0 &&
+          capture_backend != fs_testing::DiskWrapperBackend::kName) {
+        cout << "Waiting for wrapper module" << endl;
+        logfile << "Waiting for wrapper module" << endl;
+        wrapper_lock = LockWrapper();
+        if (wrapper_lock < 0) {
+          cerr << "Error locking wrapper module" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
+      }
 
-    // TODO(ashmrtn): Can probably remove this...
-    /*
-    cout << "Sleeping after mount" << endl;
-    unsigned int to_sleep = MOUNT_DELAY;
-    do {
-      to_sleep = sleep(to_sleep);
-    } while (to_sleep > 0);
-    */
+      // Put the capture device between the file system and the disk.
+      cout << "Inserting " << capture_backend << " capture device" << endl;
+      logfile << "Inserting " << capture_backend << " capture device" << endl;
+      if (test_harness.insert_wrapper() != SUCCESS) {
+        cerr << "Error inserting " << capture_backend << " capture device" <<
+          endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
 
-    /***************************************************************************
-     * Run the actual workload that we will be testing.
-     **************************************************************************/
-    if (background) {
-      /************************************************************************
-       * Background mode user workload. Tell the user we have finished workload
-       * preparations and are ready for them to run the workload since we are
-       * now logging requests.
-       ***********************************************************************/
-      if (background_com->SendCommand(SocketMessage::kBeginLogDone) !=
-          SocketError::kNone) {
-        cerr << "Error telling user ready for workload" << endl;
-        delete background_com;
+      // Get access to wrapper module ioctl functions via FD.
+      cout << "Getting wrapper device ioctl fd" << endl;
+      logfile << "Getting wrapper device ioctl fd" << endl;
+      if (test_harness.get_wrapper_ioctl() != SUCCESS) {
+        cerr << "Error opening device file" << endl;
         test_harness.cleanup_harness();
         return -1;
       }
-      background_com->CloseClient();
 
-      cout << "+++++ Please run workload +++++" << endl;
-      logfile << "+++++ Please run workload +++++" << endl;
+      // Clear wrapper module logs prior to test profiling.
+      cout << "Clearing wrapper device logs" << endl;
+      logfile << "Clearing wrapper device logs" << endl;
+      test_harness.clear_wrapper_log();
+      cout << "Enabling wrapper device logging" << endl;
+      logfile << "Enabling wrapper device logging" << endl;
+      test_harness.begin_wrapper_logging();
 
-      // Wait for the user to tell us they are done with the workload.
-      SocketMessage command;
-      bool done = false;
+      // We also need to log the changes made by mount of the FS
+      // because the snapshot is taken after an unmount.
+    
+      // Mount the file system under the wrapper module for profiling.
+      cout << "Mounting wrapper file system" << endl;
+      if (test_harness.mount_wrapper_device(mount_opts.c_str()) != SUCCESS) {
+        cerr << "Error mounting wrapper file system" << endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
+
+      // TODO(ashmrtn): Can probably remove this...
+      /*
+      cout << "Sleeping after mount" << endl;
+      unsigned int to_sleep = MOUNT_DELAY;
       do {
-        if (background_com->WaitForMessage(&command) != SocketError::kNone) {
-          cerr << "Error getting command from socket" << endl;
+        to_sleep = sleep(to_sleep);
+      } while (to_sleep > 0);
+      */
+
+      /*************************************************************************
+       * Run the actual workload that we will be testing.
+       ************************************************************************/
+      if (background) {
+        /***********************************************************************
+         * Background mode user workload. Tell the user we have finished
+         * workload preparations and are ready for them to run the workload
+         * since we are now logging requests.
+         **********************************************************************/
+        if (background_com->SendCommand(SocketMessage::kBeginLogDone) !=
+            SocketError::kNone) {
+          cerr << "Error telling user ready for workload" << endl;
           delete background_com;
           test_harness.cleanup_harness();
           return -1;
         }
+        background_com->CloseClient();
+
+        cout << "+++++ Please run workload +++++" << endl;
+        logfile << "+++++ Please run workload +++++" << endl;
+
+        // Wait for the user to tell us they are done with the workload.
+        SocketMessage command;
+        bool done = false;
+        do {
+          if (background_com->WaitForMessage(&command) != SocketError::kNone) {
+            cerr << "Error getting command from socket" << endl;
+            delete background_com;
+            test_harness.cleanup_harness();
+            return -1;
+          }
 
-        switch (command.type) {
-          case SocketMessage::kEndLog:
-            done = true;
-            break;
-          case SocketMessage::kCheckpoint:
-            if (test_harness.CreateCheckpoint() == SUCCESS) {
-              if (background_com->SendCommand(SocketMessage::kCheckpointDone) !=
+          switch (command.type) {
+            case SocketMessage::kEndLog:
+              done = true;
+              break;
+            case SocketMessage::kCheckpoint:
+              if (test_harness.CreateCheckpoint() == SUCCESS) {
+                if (background_com->SendCommand(SocketMessage::kCheckpointDone,
+                      command.int_value) != SocketError::kNone) {
+                  cerr << "Error telling user done with checkpoint" << endl;
+                  delete background_com;
+                  test_harness.cleanup_harness();
+                  return -1;
+                }
+              } else {
+                if (background_com->SendCommand(
+                      SocketMessage::kCheckpointFailed, command.int_value) !=
+                    SocketError::kNone) {
+                  cerr << "Error telling user checkpoint failed" << endl;
+                  delete background_com;
+                  test_harness.cleanup_harness();
+                  return -1;
+                }
+              }
+              background_com->CloseClient();
+              break;
+            default:
+              if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
                   SocketError::kNone) {
-                cerr << "Error telling user done with checkpoint" << endl;
+                cerr << "Error sending response to client" << endl;
                 delete background_com;
                 test_harness.cleanup_harness();
                 return -1;
               }
-            } else {
-              if (background_com->SendCommand(SocketMessage::kCheckpointFailed)
-                  != SocketError::kNone) {
-                cerr << "Error telling user checkpoint failed" << endl;
+              background_com->CloseClient();
+              break;
+          }
+        } while (!done);
+      } else {
+        /***********************************************************************
+         * Standalone mode user workload. Fork off a new process and run test
+         * profiling. Forking makes it easier to handle making sure everything
+         * is taken care of in profiling and ensures that even if all file
+         * handles aren't closed in the process running the worload, the parent
+         * won't hang due to a busy mount point.
+         **********************************************************************/
+        cout << "Running test profile" << endl;
+        logfile << "Running test profile" << endl;
+        bool last_checkpoint = false;
+        int checkpoint = 0;
+        /***********************************************************************
+         * If automated_check_test is enabled, a snapshot is taken at every
+         * checkpoint in the run() workload. The first iteration is the complete
+         * execution of run() and is profiled. Subsequent iterations save
+         * snapshots at every checkpoint() present in the run() workload.
+         **********************************************************************/
+        do {
+          {
+            // SIGCHLD stays blocked while the workload runs so WaitForRun can
+            // pick it up with a signalfd.
+            sigset_t sigchld;
+            sigset_t old_mask;
+            sigemptyset(&sigchld);
+            sigaddset(&sigchld, SIGCHLD);
+            CheckpointDoorbell doorbell;
+            if (doorbell.Open() < 0) {
+              cerr << "Error making checkpoint doorbell" << endl;
+              doorbell.Close();
+              test_harness.cleanup_harness();
+              return -1;
+            }
+            TraceSpan run_span("run workload", "record");
+            sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+            const pid_t child = fork();
+            if (child < 0) {
+              cerr << "Error spinning off test process" << endl;
+              sigprocmask(SIG_SETMASK, &old_mask, NULL);
+              doorbell.Close();
+              test_harness.cleanup_harness();
+              return -1;
+            } else if (child != 0) {
+              int status = -1;
+              const int wait_res = WaitForRun(child, background_com, doorbell,
+                  test_harness, run_timeout, &status);
+              sigprocmask(SIG_SETMASK, &old_mask, NULL);
+              doorbell.Close();
+              if (wait_res < 0) {
                 delete background_com;
                 test_harness.cleanup_harness();
                 return -1;
               }
-            }
-            background_com->CloseClient();
-            break;
-          default:
-            if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
-                SocketError::kNone) {
-              cerr << "Error sending response to client" << endl;
-              delete background_com;
-              test_harness.cleanup_harness();
-              return -1;
-            }
-            background_com->CloseClient();
-            break;
-        }
-      } while (!done);
-    } else {
-      /*************************************************************************
-       * Standalone mode user workload. Fork off a new process and run test
-       * profiling. Forking makes it easier to handle making sure everything is
-       * taken care of in profiling and ensures that even if all file handles
-       * aren't closed in the process running the worload, the parent won't hang
-       * due to a busy mount point.
-       ************************************************************************/
-      cout << "Running test profile" << endl;
-      logfile << "Running test profile" << endl;
-      bool last_checkpoint = false;
-      int checkpoint = 0;
-      /*************************************************************************
-       * If automated_check_test is enabled, a snapshot is taken at every checkpoint
-       * in the run() workload. The first iteration is the complete execution of run()
-       * and is profiled. Subsequent iterations save snapshots at every checkpoint()
-       * present in the run() workload.
-       ************************************************************************/
-      do {
-        {
-          const pid_t child = fork();
-          if (child < 0) {
-            cerr << "Error spinning off test process" << endl;
-            test_harness.cleanup_harness();
-            return -1;
-          } else if (child != 0) {
-            pid_t status = -1;
-            pid_t wait_res = 0;
-            do {
-              SocketMessage m;
-              SocketError se;
-
-              se = background_com->TryForMessage(&m);
-
-              if (se == SocketError::kNone) {
-                if (m.type == SocketMessage::kCheckpoint) {
-                  if (test_harness.CreateCheckpoint() == SUCCESS) {
-                    if (background_com->SendCommand(
-                            SocketMessage::kCheckpointDone)
-                          != SocketError::kNone) {
-                        // TODO(ashmrtn): Handle better.
-                        cerr << "Error telling user done with checkpoint" << endl;
-                        delete background_com;
-                        test_harness.cleanup_harness();
-                        return -1;
-                    }
+              if (WIFEXITED(status) == 0) {
+                cerr << "Error terminating test_run process, status: " << status << endl;
+                test_harness.cleanup_harness();
+                return -1;
+              } else {
+                if (WEXITSTATUS(status) == 1) {
+                  last_checkpoint = true;
+                } else if (WEXITSTATUS(status) == 0) {
+                  if (checkpoint == 0) {
+                    cout << "Completely executed run process" << endl;
                   } else {
-                    if (background_com->SendCommand(
-                          SocketMessage::kCheckpointFailed)
-                        != SocketError::kNone) {
-                      // TODO(ashmrtn): Handle better.
-                      cerr << "Error telling user checkpoint failed" << endl;
-                      delete background_com;
-                      test_harness.cleanup_harness();
-                      return -1;
-                    }
+                    cout << "Run process hit checkpoint " << checkpoint << endl;
                   }
                 } else {
-                  if (background_com->SendCommand(
-                        SocketMessage::kInvalidCommand)
-                      != SocketError::kNone) {
-                    cerr << "Error sending response to client" << endl;
-                    delete background_com;
-                    test_harness.cleanup_harness();
-                    return -1;
-                  }
+                  cerr << "Error in test run, exits with status: " << status << endl;
+                  test_harness.cleanup_harness();
+                  return -1;
                 }
-                background_com->CloseClient();
               }
-              wait_res = waitpid(child, &status, WNOHANG);
-            } while (wait_res == 0);
-            if (WIFEXITED(status) == 0) {
-              cerr << "Error terminating test_run process, status: " << status << endl;
-              test_harness.cleanup_harness();
-              return -1;
             } else {
-              if (WEXITSTATUS(status) == 1) {
-                last_checkpoint = true;
-              } else if (WEXITSTATUS(status) == 0) {
-                if (checkpoint == 0) {
-                  cout << "Completely executed run process" << endl;
-                } else {
-                  cout << "Run process hit checkpoint " << checkpoint << endl;
+              // Forked process' stuff.
+              Tracer::Close();
+              sigprocmask(SIG_SETMASK, &old_mask, NULL);
+              doorbell.Export();
+              int change_fd;
+              if (checkpoint == 0) {
+                change_fd = open(change_path.c_str(),
+                    O_CREAT | O_WRONLY | O_TRUNC, S_IRUSR | S_IWUSR);
+                if (change_fd < 0) {
+                  return change_fd;
                 }
-              } else {
-                cerr << "Error in test run, exits with status: " << status << endl;
-                test_harness.cleanup_harness();
-                return -1;
-              }
-            }
-          } else {
-            // Forked process' stuff.
-            int change_fd;
-            if (checkpoint == 0) {
-              change_fd = open(kChangePath, O_CREAT | O_WRONLY | O_TRUNC,
-                S_IRUSR | S_IWUSR);
-              if (change_fd < 0) {
-                return change_fd;
               }
-            }
-            const int res = test_harness.test_run(change_fd, checkpoint);
+              const int res = test_harness.test_run(change_fd, checkpoint);
 
-            if (checkpoint == 0) {
-              close(change_fd);
+              if (checkpoint == 0) {
+                close(change_fd);
+              }
+              return res;
             }
-            return res;
-          }
-        }
-        // End wrapper logging for profiling the complete execution of run process
-        if (checkpoint == 0) {
-          cout << "Waiting for writeback delay" << endl;
-          logfile << "Waiting for writeback delay" << endl;
-          unsigned int sleep_time = test_harness.GetPostRunDelay();
-          while (sleep_time > 0) {
-            sleep_time = sleep(sleep_time);
-          }
-
-          cout << "Disabling wrapper device logging" << endl;
-          logfile << "Disabling wrapper device logging" << endl;
-          test_harness.end_wrapper_logging();
-          cout << "Getting wrapper data" << endl;
-          logfile << "Getting wrapper data" << endl;
-          if (test_harness.get_wrapper_log() != SUCCESS) {
-            test_harness.cleanup_harness();
-            return -1;
-          }
-
-          cout << "Unmounting wrapper file system after test profiling" << endl;
-          logfile << "Unmounting wrapper file system after test profiling" << endl;
-          if (test_harness.umount_device() != SUCCESS) {
-            cerr << "Error unmounting wrapper file system" << endl;
-            test_harness.cleanup_harness();
-            return -1;
-          }
-
-          cout << "Close wrapper ioctl fd" << endl;
-          logfile << "Close wrapper ioctl fd" << endl;
-          test_harness.put_wrapper_ioctl();
-          cout << "Removing wrapper module from kernel" << endl;
-          logfile << "Removing wrapper module from kernel" << endl;
-          if (test_harness.remove_wrapper() != SUCCESS) {
-            cerr << "Error cleaning up: remove wrapper module" << endl;
-            test_harness.cleanup_harness();
-            return -1;
           }
+          // End wrapper logging for profiling the complete execution of run
+          // process
+          if (checkpoint == 0) {
+            cout << "Waiting for writeback delay" << endl;
+            logfile << "Waiting for writeback delay" << endl;
+            TraceSpan writeback_span("writeback delay", "record");
+            unsigned int sleep_time = test_harness.GetPostRunDelay();
+            while (sleep_time > 0) {
+              sleep_time = sleep(sleep_time);
+            }
+            writeback_span.End();
+
+            cout << "Disabling wrapper device logging" << endl;
+            logfile << "Disabling wrapper device logging" << endl;
+            test_harness.end_wrapper_logging();
+            cout << "Getting wrapper data" << endl;
+            logfile << "Getting wrapper data" << endl;
+            if (test_harness.get_wrapper_log() != SUCCESS) {
+              test_harness.cleanup_harness();
+              return -1;
+            }
 
-          // Getting the tracking data
-          cout << "Getting change data" << endl;
-          logfile << "Getting change data" << endl;
-          const int change_fd = open(kChangePath, O_RDONLY);
-          if (change_fd < 0) {
-            cerr << "Error reading change data" << endl;
-            test_harness.cleanup_harness();
-            return -1;
-          }
+            cout << "Unmounting wrapper file system after test profiling" << endl;
+            logfile << "Unmounting wrapper file system after test profiling" << endl;
+            if (test_harness.umount_device() != SUCCESS) {
+              cerr << "Error unmounting wrapper file system" << endl;
+              test_harness.cleanup_harness();
+              return -1;
+            }
 
-          if (lseek(change_fd, 0, SEEK_SET) < 0) {
-            cerr << "Error reading change data" << endl;
-            test_harness.cleanup_harness();
-            return -1;
-          }
+            cout << "Close wrapper ioctl fd" << endl;
+            logfile << "Close wrapper ioctl fd" << endl;
+            test_harness.put_wrapper_ioctl();
+            // The next test in a batch profiles with the same wrapper module,
+            // so only remove it once all tests are done. Fan-out workers that
+            // take turns with it hand it to the next worker instead.
+            if (!batch || wrapper_lock >= 0) {
+              cout << "Removing wrapper module from kernel" << endl;
+              logfile << "Removing wrapper module from kernel" << endl;
+              if (test_harness.remove_wrapper() != SUCCESS) {
+                cerr << "Error cleaning up: remove wrapper module" << endl;
+                test_harness.cleanup_harness();
+                return -1;
+              }
+            }
+            if (wrapper_lock >= 0) {
+              close(wrapper_lock);
+              wrapper_lock = -1;
+            }
 
-          if (test_harness.GetChangeData(change_fd) != SUCCESS) {
-            test_harness.cleanup_harness();
-            return -1;
-          }
-        } 
+            // Getting the tracking data
+            cout << "Getting change data" << endl;
+            logfile << "Getting change data" << endl;
+            const int change_fd = open(change_path.c_str(), O_RDONLY);
+            if (change_fd < 0) {
+              cerr << "Error reading change data" << endl;
+              test_harness.cleanup_harness();
+              return -1;
+            }
 
-        if (automate_check_test) {
-          // Map snapshot of the disk to the current checkpoint and unmount the clone
-          test_harness.mapCheckpointToSnapshot(checkpoint);
-          if (checkpoint != 0) {
-            if (test_harness.umount_snapshot() != SUCCESS) {
+            if (lseek(change_fd, 0, SEEK_SET) < 0) {
+              cerr << "Error reading change data" << endl;
               test_harness.cleanup_harness();
               return -1;
             }
-          }
-          // get a new diskclone and mount it for next the checkpoint
-          test_harness.getNewDiskClone(checkpoint);
-          if (!last_checkpoint) {
-            if (test_harness.mount_snapshot() != SUCCESS) {
+
+            if (test_harness.GetChangeData(change_fd) != SUCCESS) {
               test_harness.cleanup_harness();
               return -1;
             }
+          } 
+
+          if (automate_check_test) {
+            // Map snapshot of the disk to the current checkpoint and unmount
+            // the clone
+            test_harness.mapCheckpointToSnapshot(checkpoint);
+            if (checkpoint != 0) {
+              if (test_harness.umount_snapshot() != SUCCESS) {
+                test_harness.cleanup_harness();
+                return -1;
+              }
+            }
+            // get a new diskclone and mount it for next the checkpoint
+            test_harness.getNewDiskClone(checkpoint);
+            if (!last_checkpoint) {
+              if (test_harness.mount_snapshot() != SUCCESS) {
+                test_harness.cleanup_harness();
+                return -1;
+              }
+            }
+          }
+          // reset the snapshot path if we completed all the executions
+          if (automate_check_test && last_checkpoint) {
+            test_harness.getCompleteRunDiskClone();
           }
+          // Increment the checkpoint at which run exits
+          checkpoint += 1;
+        } while (!last_checkpoint && automate_check_test);
+        test_harness.PrintCheckpointLatency(cout);
+        test_harness.PrintCheckpointLatency(logfile);
+      }
+
+      /*************************************************************************
+       * Worload complete, Clean up things and end logging.
+       ************************************************************************/
+
+      // Wait a small amount of time for writes to propogate to the block
+      // layer and then stop logging writes.
+      // TODO (P.S.) pull out the common code between the code path when
+      // checkpoint is zero above and if background mode is on here
+      if (background) {
+        cout << "Waiting for writeback delay" << endl;
+        logfile << "Waiting for writeback delay" << endl;
+        TraceSpan writeback_span("writeback delay", "record");
+        unsigned int sleep_time = test_harness.GetPostRunDelay();
+        while (sleep_time > 0) {
+          sleep_time = sleep(sleep_time);
         }
-        // reset the snapshot path if we completed all the executions
-        if (automate_check_test && last_checkpoint) {
-          test_harness.getCompleteRunDiskClone();
+        writeback_span.End();
+
+        cout << "Disabling wrapper device logging" << endl;
+        logfile << "Disabling wrapper device logging" << endl;
+        test_harness.end_wrapper_logging();
+        cout << "Getting wrapper data" << endl;
+        logfile << "Getting wrapper data" << endl;
+        if (test_harness.get_wrapper_log() != SUCCESS) {
+          test_harness.cleanup_harness();
+          return -1;
         }
-        // Increment the checkpoint at which run exits
-        checkpoint += 1;
-      } while (!last_checkpoint && automate_check_test);
-    }
 
-    /***************************************************************************
-     * Worload complete, Clean up things and end logging.
-     **************************************************************************/
+        cout << "Unmounting wrapper file system after test profiling" << endl;
+        logfile << "Unmounting wrapper file system after test profiling" << endl;
+        if (test_harness.umount_device() != SUCCESS) {
+          cerr << "Error unmounting wrapper file system" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
 
-    // Wait a small amount of time for writes to propogate to the block
-    // layer and then stop logging writes.
-    // TODO (P.S.) pull out the common code between the code path when
-    // checkpoint is zero above and if background mode is on here
-    if (background) {
-      cout << "Waiting for writeback delay" << endl;
-      logfile << "Waiting for writeback delay" << endl;
-      unsigned int sleep_time = test_harness.GetPostRunDelay();
-      while (sleep_time > 0) {
-        sleep_time = sleep(sleep_time);
-      }
+        cout << "Close wrapper ioctl fd" << endl;
+        logfile << "Close wrapper ioctl fd" << endl;
+        test_harness.put_wrapper_ioctl();
+        cout << "Removing wrapper module from kernel" << endl;
+        logfile << "Removing wrapper module from kernel" << endl;
+        if (test_harness.remove_wrapper() != SUCCESS) {
+          cerr << "Error cleaning up: remove wrapper module" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
 
-      cout << "Disabling wrapper device logging" << endl;
-      logfile << "Disabling wrapper device logging" << endl;
-      test_harness.end_wrapper_logging();
-      cout << "Getting wrapper data" << endl;
-      logfile << "Getting wrapper data" << endl;
-      if (test_harness.get_wrapper_log() != SUCCESS) {
-        test_harness.cleanup_harness();
-        return -1;
-      }
+        // Getting the tracking data
+        cout << "Getting change data" << endl;
+        logfile << "Getting change data" << endl;
+        const int change_fd = open(change_path.c_str(), O_RDONLY);
+        if (change_fd < 0) {
+          cerr << "Error reading change data" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
 
-      cout << "Unmounting wrapper file system after test profiling" << endl;
-      logfile << "Unmounting wrapper file system after test profiling" << endl;
-      if (test_harness.umount_device() != SUCCESS) {
-        cerr << "Error unmounting wrapper file system" << endl;
-        test_harness.cleanup_harness();
-        return -1;
-      }
+        if (lseek(change_fd, 0, SEEK_SET) < 0) {
+          cerr << "Error reading change data" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
 
-      cout << "Close wrapper ioctl fd" << endl;
-      logfile << "Close wrapper ioctl fd" << endl;
-      test_harness.put_wrapper_ioctl();
-      cout << "Removing wrapper module from kernel" << endl;
-      logfile << "Removing wrapper module from kernel" << endl;
-      if (test_harness.remove_wrapper() != SUCCESS) {
-        cerr << "Error cleaning up: remove wrapper module" << endl;
-        test_harness.cleanup_harness();
-        return -1;
+        if (test_harness.GetChangeData(change_fd) != SUCCESS) {
+          test_harness.cleanup_harness();
+          return -1;
+        }
       }
 
-      // Getting the tracking data
-      cout << "Getting change data" << endl;
-      logfile << "Getting change data" << endl;
-      const int change_fd = open(kChangePath, O_RDONLY);
-      if (change_fd < 0) {
-        cerr << "Error reading change data" << endl;
-        test_harness.cleanup_harness();
-        return -1;
+      logfile << endl << endl << "Recorded workload:" << endl;
+      test_harness.log_disk_write_data(logfile);
+      logfile << endl << endl;
+
+      // Write log data out to file if we're given a file.
+      if (!log_file_save.empty()) {
+        /***********************************************************************
+         * The -l flag specifies that we should save the information for this
+         * harness execution. Therefore, save the series of disk epochs we just
+         * logged so they can be reused later if the -r flag is given.
+         **********************************************************************/
+        cout << "Saving logged profile data to disk" << endl;
+        logfile << "Saving logged profile data to disk" << endl;
+        if (test_harness.log_profile_save(log_file_save + "_profile") != SUCCESS) {
+          cerr << "Error saving logged test file" << endl;
+          // TODO(ashmrtn): Remove this in later versions?
+          test_harness.cleanup_harness();
+          return -1;
+        }
       }
 
-      if (lseek(change_fd, 0, SEEK_SET) < 0) {
-        cerr << "Error reading change data" << endl;
-        test_harness.cleanup_harness();
-        return -1;
+      if (!export_bundle.empty()) {
+        const BundleManifest manifest = {test_name, fs_type, permuter,
+          sector_size, full_bio_replay, seed};
+        if (!WriteBundleManifest(export_bundle, manifest)) {
+          cerr << "Error writing work bundle manifest" << endl;
+          test_harness.cleanup_harness();
+          return -1;
+        }
+        cout << "Exported work bundle to " << export_bundle << endl;
+        logfile << "Exported work bundle to " << export_bundle << endl;
       }
 
-      if (test_harness.GetChangeData(change_fd) != SUCCESS) {
-        test_harness.cleanup_harness();
-        return -1;
+      /*************************************************************************
+       * Background mode. Tell the user we have finished logging and cleaning up
+       * and that, if they need to, they can do a bit of cleanup on their end
+       * before beginning testing.
+       ************************************************************************/
+      if (background) {
+        if (background_com->SendCommand(SocketMessage::kEndLogDone) !=
+            SocketError::kNone) {
+          cerr << "Error telling user done logging" << endl;
+          delete background_com;
+          test_harness.cleanup_harness();
+          return -1;
+        }
+        background_com->CloseClient();
       }
-    }
-
-    logfile << endl << endl << "Recorded workload:" << endl;
-    test_harness.log_disk_write_data(logfile);
-    logfile << endl << endl;
-
-    // Write log data out to file if we're given a file.
-    if (!log_file_save.empty()) {
+    } else {
       /*************************************************************************
-       * The -l flag specifies that we should save the information for this
-       * harness execution. Therefore, save the series of disk epochs we just
-       * logged so they can be reused later if the -r flag is given.
+       * The -r flag specifies that we should load information from the provided
+       * log file. Load the series of disk epochs which we will be operating on.
        ************************************************************************/
-      cout << "Saving logged profile data to disk" << endl;
-      logfile << "Saving logged profile data to disk" << endl;
-      if (test_harness.log_profile_save(log_file_save + "_profile") != SUCCESS) {
-        cerr << "Error saving logged test file" << endl;
-        // TODO(ashmrtn): Remove this in later versions?
+      cout << "Loading logged profile data from disk" << endl;
+      logfile << "Loading logged profile data from disk" << endl;
+      if (test_harness.log_profile_load(log_file_load + "_profile") != SUCCESS) {
+        cerr << "Error loading logged test file" << endl;
         test_harness.cleanup_harness();
         return -1;
       }
     }
+    record_span.End();
+    test_harness.SampleMemory("phase 2: record workload");
+
 
     /***************************************************************************
-     * Background mode. Tell the user we have finished logging and cleaning up
-     * and that, if they need to, they can do a bit of cleanup on their end
-     * before beginning testing.
+     * PHASE 3:
+     * Now that we have finished gathering data, run tests to see if we can find
+     * file system inconsistencies. Either:
+     * 1. The -b flag specifies that CrashMonkey is running as a "background"
+     *    process of sorts and should listen on its socket for the command
+     *    telling it to begin testing
+     * 2. CrashMonkey is running as a standalone program. It should immediately
+     *    begin testing
      **************************************************************************/
+
     if (background) {
-      if (background_com->SendCommand(SocketMessage::kEndLogDone) !=
-          SocketError::kNone) {
-        cerr << "Error telling user done logging" << endl;
-        delete background_com;
-        test_harness.cleanup_harness();
-        return -1;
-      }
-      background_com->CloseClient();
-    }
-  } else {
-    /***************************************************************************
-     * The -r flag specifies that we should load information from the provided
-     * log file. Load the series of disk epochs which we will be operating on.
-     **************************************************************************/
-    cout << "Loading logged profile data from disk" << endl;
-    logfile << "Loading logged profile data from disk" << endl;
-    if (test_harness.log_profile_load(log_file_load + "_profile") != SUCCESS) {
-      cerr << "Error loading logged test file" << endl;
-      test_harness.cleanup_harness();
-      return -1;
+      /*************************************************************************
+       * Background mode. Wait for the user to tell us to start testing.
+       ************************************************************************/
+      SocketMessage command;
+      do {
+        cout << "+++++ Ready to run tests, please confirm start +++++" << endl;
+        logfile << "+++++ Ready to run tests, please confirm start +++++" << endl;
+        if (background_com->WaitForMessage(&command) != SocketError::kNone) {
+          cerr << "Error getting command from socket" << endl;
+          delete background_com;
+          test_harness.cleanup_harness();
+          return -1;
+        }
+
+        if (command.type != SocketMessage::kRunTests) {
+          if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
+              SocketError::kNone) {
+            cerr << "Error sending response to client" << endl;
+            delete background_com;
+            test_harness.cleanup_harness();
+            return -1;
+          }
+          background_com->CloseClient();
+        }
+      } while (command.type != SocketMessage::kRunTests);
     }
-  }
 
+    cout << endl
+      << "========== PHASE 3: Running tests based on recorded data =========="
+      << endl;
+    logfile << endl
+      << "========== PHASE 3: Running tests based on recorded data =========="
+      << endl;
+    TraceSpan test_span("phase 3: test crash states", "phase");
 
-  /*****************************************************************************
-   * PHASE 3:
-   * Now that we have finished gathering data, run tests to see if we can find
-   * file system inconsistencies. Either:
-   * 1. The -b flag specifies that CrashMonkey is running as a "background"
-   *    process of sorts and should listen on its socket for the command telling
-   *    it to begin testing
-   * 2. CrashMonkey is running as a standalone program. It should immediately
-   *    begin testing
-   ****************************************************************************/
 
-  if (background) {
+    // Save each crash state so it can be rerun with --replay-state.
+    test_harness.set_crash_state_log(run_prefix + "-" + test_name + ".states");
+    test_harness.set_minimize_failures(minimize);
+    // Keep track of finished crash states so a run that dies partway through
+    // can be continued with --resume.
+    if (resume_journal.empty()) {
+      test_harness.set_progress_journal(
+          run_prefix + "-" + test_name + ".journal", false);
+    } else {
+      test_harness.set_progress_journal(resume_journal, true);
+    }
+
+    // TODO(ashmrtn): Fix the meaning of "dry-run". Right now it means do
+    // everything but run tests (i.e. run setup and profiling but not testing.)
     /***************************************************************************
-     * Background mode. Wait for the user to tell us to start testing.
+     * Run tests and print the results of said tests.
      **************************************************************************/
-    SocketMessage command;
-    do {
-      cout << "+++++ Ready to run tests, please confirm start +++++" << endl;
-      logfile << "+++++ Ready to run tests, please confirm start +++++" << endl;
-      if (background_com->WaitForMessage(&command) != SocketError::kNone) {
-        cerr << "Error getting command from socket" << endl;
-        delete background_com;
-        test_harness.cleanup_harness();
-        return -1;
+    if (permuted_order_replay) {
+      cout << "Writing profiled data to block device and checking with fsck" <<
+        endl;
+      logfile << "Writing profiled data to block device and checking with fsck" <<
+        endl;
+      // Log the seed so any crash state can be regenerated from its index.
+      cout << "Permuter seed: " << seed << endl;
+      logfile << "Permuter seed: " << seed << endl;
+      test_harness.set_permuter_seed(seed);
+      if (end_state != ~0ULL) {
+        cout << "Testing crash states [" << first_state << ", " << end_state <<
+          ")" << endl;
+        logfile << "Testing crash states [" << first_state << ", " <<
+          end_state << ")" << endl;
+        test_harness.set_state_range(first_state, end_state);
       }
+      // With the adaptive budget, --iterations is only an upper bound.
+      test_harness.set_adaptive_budget(adaptive);
+      test_harness.set_memory_limit(memory_limit * 1024 * 1024);
 
-      if (command.type != SocketMessage::kRunTests) {
-        if (background_com->SendCommand(SocketMessage::kInvalidCommand) !=
-            SocketError::kNone) {
-          cerr << "Error sending response to client" << endl;
-          delete background_com;
-          test_harness.cleanup_harness();
-          return -1;
-        }
-        background_com->CloseClient();
+      if (test_harness.test_check_random_permutations(full_bio_replay,
+            iterations, logfile) != SUCCESS) {
+        test_harness.cleanup_harness();
+        return -1;
       }
-    } while (command.type != SocketMessage::kRunTests);
-  }
-
-  cout << endl
-    << "========== PHASE 3: Running tests based on recorded data =========="
-    << endl;
-  logfile << endl
-    << "========== PHASE 3: Running tests based on recorded data =========="
-    << endl;
-
 
-  // TODO(ashmrtn): Fix the meaning of "dry-run". Right now it means do
-  // everything but run tests (i.e. run setup and profiling but not testing.)
-  /***************************************************************************
-   * Run tests and print the results of said tests.
-   **************************************************************************/
-  if (permuted_order_replay) {
-    cout << "Writing profiled data to block device and checking with fsck" <<
-      endl;
-    logfile << "Writing profiled data to block device and checking with fsck" <<
-      endl;
+      test_harness.PrintTimingStats(cout);
+      test_harness.PrintTimingStats(logfile);
+      // Full histograms, so timings can be compared between runs.
+      ofstream latency(run_prefix + "-" + test_name + ".latency");
+      test_harness.WriteTimingHistograms(latency);
+    }
 
-    test_harness.test_check_random_permutations(full_bio_replay, iterations,
-        logfile);
+    if (!replay_states.empty()) {
+      cout << "Rerunning saved crash states" << endl;
+      logfile << "Rerunning saved crash states" << endl;
+      test_harness.test_check_crash_states(replay_states, replay_tests, logfile);
+    }
 
-    for (unsigned int i = 0; i < Tester::NUM_TIME; ++i) {
-      cout << "\t" << (Tester::time_stats) i << ": " <<
-        test_harness.get_timing_stat((Tester::time_stats) i).count() <<
-        " ms" << endl;
+    if (in_order_replay) {
+      cout << endl << endl <<
+        "Writing data out to each Checkpoint and checking with fsck" << endl;
+      logfile << endl << endl <<
+        "Writing data out to each Checkpoint and checking with fsck" << endl;
+      test_harness.test_check_log_replay(logfile, automate_check_test);
     }
-  }
 
-  if (in_order_replay) {
-    cout << endl << endl <<
-      "Writing data out to each Checkpoint and checking with fsck" << endl;
-    logfile << endl << endl <<
-      "Writing data out to each Checkpoint and checking with fsck" << endl;
-    test_harness.test_check_log_replay(logfile, automate_check_test);
+    test_span.End();
+    test_harness.SampleMemory("phase 3: test crash states");
+    // Print before the next test clears out the profile and permuter.
+    cout << endl;
+    logfile << endl;
+    test_harness.PrintMemoryUsage(cout);
+    test_harness.PrintMemoryUsage(logfile);
+    test_harness.EndTestSuite();
   }
 
   cout << endl;
   logfile << endl;
   test_harness.PrintTestStats(cout);
   test_harness.PrintTestStats(logfile);
-  test_harness.EndTestSuite();
+  if (fan_out_pipe >= 0) {
+    // Hand the results to the fan-out parent for the combined summary.
+    std::ostringstream results;
+    test_harness.PrintTestStats(results);
+    const string summary = results.str();
+    unsigned int written = 0;
+    while (written < summary.size()) {
+      const int res = write(fan_out_pipe, summary.data() + written,
+          summary.size() - written);
+      if (res < 0) {
+        break;
+      }
+      written += res;
+    }
+  }
 
   cout << endl << "========== PHASE 4: Cleaning up ==========" << endl;
   logfile << endl << "========== PHASE 4: Cleaning up ==========" << endl;
+  TraceSpan cleanup_span("phase 4: clean up", "phase");
 
   /*****************************************************************************
    * PHASE 4:
@@ -1052,7 +2126,7 @@ int main(int argc, char** argv) {
    * testing if the -b flag was given and we are running in background mode.
    ****************************************************************************/
   logfile.close();
-  test_harness.remove_cow_brd();
+  test_harness.remove_snapshot_devices();
   test_harness.cleanup_harness();
 
   if (background) {
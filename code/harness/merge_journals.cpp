@@ -0,0 +1,92 @@
+/*
+ * Combine the progress journals written by CrashMonkey runs that each checked
+ * a different range of crash states (--states) from the same work bundle, for
+ * example on different machines. Writes one journal holding every crash state
+ * tested and prints the results for the whole set. Run as
+ *
+ *   merge_journals [-n test name] -o merged.journal shard.journal...
+ */
+
+#include <getopt.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../results/ProgressJournal.h"
+#include "../results/SingleTestInfo.h"
+#include "../results/TestSuiteResult.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using fs_testing::ProgressJournal;
+using fs_testing::SingleTestInfo;
+using fs_testing::TestSuiteResult;
+
+int main(int argc, char** argv) {
+  string out_path("");
+  string test_name("");
+  for (int c = getopt(argc, argv, "n:o:"); c != -1;
+      c = getopt(argc, argv, "n:o:")) {
+    switch (c) {
+      case 'n':
+        test_name = string(optarg);
+        break;
+      case 'o':
+        out_path = string(optarg);
+        break;
+      case '?':
+      default:
+        return -1;
+    }
+  }
+
+  const vector<string> journals(argv + optind, argv + argc);
+  if (out_path.empty() || journals.empty()) {
+    cerr << "Usage: " << argv[0] <<
+      " [-n test name] -o merged.journal shard.journal..." << endl;
+    return -1;
+  }
+
+  unsigned int total = 0;
+  for (const string &path : journals) {
+    ProgressJournal::Header header;
+    vector<SingleTestInfo> done;
+    if (!ProgressJournal::Read(path, header, done)) {
+      cerr << "Unable to read journal " << path << endl;
+      return -1;
+    }
+    cout << path << ": " << done.size() << " crash states, " <<
+      header.permuter << " seed " << header.seed << endl;
+    total += done.size();
+  }
+
+  ProgressJournal::Header header;
+  vector<SingleTestInfo> merged;
+  if (!ProgressJournal::Merge(journals, header, merged)) {
+    cerr << "Journals are from different profiles, permuters, seeds, or " <<
+      "replay modes" << endl;
+    return -1;
+  }
+  if (!ProgressJournal::Write(out_path, header, merged)) {
+    cerr << "Unable to write merged journal " << out_path << endl;
+    return -1;
+  }
+  cout << "Merged " << merged.size() << " crash states into " << out_path <<
+    ", dropped " << total - merged.size() << " tested more than once" <<
+    endl << endl;
+
+  TestSuiteResult suite;
+  suite.SetName(test_name);
+  for (SingleTestInfo &test_info : merged) {
+    if (test_info.GetTestResult() != SingleTestInfo::kPassed) {
+      test_info.PrintResults(cout);
+    }
+    suite.TallyReorderingResult(test_info);
+  }
+  suite.PrintResults(cout);
+  return 0;
+}
@@ -0,0 +1,262 @@
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <vector>
+
+#include "Permuter.h"
+#include "PartialOrderPermuter.h"
+
+namespace fs_testing {
+namespace permuter {
+using std::iota;
+using std::map;
+using std::vector;
+
+using fs_testing::utils::disk_write;
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+static const unsigned int kKernelSectorSize = 512;
+
+/*
+ * Set of disjoint [start, end) sector ranges keyed by start sector. Adjacent
+ * and overlapping ranges are merged on insertion.
+ */
+typedef map<unsigned long long, unsigned long long> RangeSet;
+
+bool RangeCovered(const RangeSet &ranges, unsigned long long start,
+    unsigned long long end) {
+  auto it = ranges.upper_bound(start);
+  if (it == ranges.begin()) {
+    return false;
+  }
+  --it;
+  return it->second >= end;
+}
+
+void RangeInsert(RangeSet &ranges, unsigned long long start,
+    unsigned long long end) {
+  auto it = ranges.upper_bound(start);
+  if (it != ranges.begin() && std::prev(it)->second >= start) {
+    --it;
+    start = it->first;
+  }
+  while (it != ranges.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = ranges.erase(it);
+  }
+  ranges[start] = end;
+}
+
+}  // namespace
+
+PartialOrderPermuter::PartialOrderPermuter(vector<disk_write> *data) {
+}
+
+void PartialOrderPermuter::init_data(vector<epoch> *data) {
+}
+
+CrashStateEstimate PartialOrderPermuter::EstimateCrashStates(bool full_bio) {
+  CrashStateEstimate res = Permuter::EstimateCrashStates(full_bio);
+  res.exact = false;
+  return res;
+}
+
+unsigned int PartialOrderPermuter::PickCrashPoint(unsigned int &num_requests,
+    PermuteTestResult &log_data) {
+  vector<epoch> *epochs = GetEpochs();
+  const unsigned int num_epochs = GetRandom().Uniform(1, epochs->size());
+  epoch *target = &epochs->at(num_epochs - 1);
+
+  num_requests = 0;
+  if (!target->ops.empty()) {
+    // Don't subtract 1 from this size so that we can send a complete epoch if
+    // we want.
+    num_requests = GetRandom().Uniform(1, target->ops.size());
+  }
+
+  // Same as RandomPermuter, the checkpoint only advances if the entire final
+  // epoch makes it into the crash state.
+  epoch *prev = NULL;
+  if (num_epochs > 1) {
+    prev = &epochs->at(num_epochs - 2);
+  }
+  if (num_requests != target->ops.size()) {
+    log_data.last_checkpoint = (prev) ? prev->checkpoint_epoch : 0;
+  } else {
+    log_data.last_checkpoint = target->checkpoint_epoch;
+  }
+
+  return num_epochs;
+}
+
+vector<unsigned int> PartialOrderPermuter::ReduceSubset(epoch &target,
+    const vector<unsigned int> &kept) {
+  const vector<OpDependencies> &deps = GetOpDependencies();
+  RangeSet covered;
+  vector<unsigned int> res;
+  res.reserve(kept.size());
+
+  // Walk backwards so that `covered` always holds the sectors written by kept
+  // ops that come after the current one.
+  for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+    epoch_op &op = target.ops.at(*it);
+    const disk_write &dw = op.op;
+    if (dw.metadata.size == 0) {
+      // Nothing from this op ends up on disk.
+      continue;
+    }
+    const unsigned long long start = dw.metadata.write_sector;
+    const unsigned long long end = start +
+      (dw.metadata.size + kKernelSectorSize - 1) / kKernelSectorSize;
+    // Ops that nothing later in the epoch writes over can never be shadowed,
+    // so skip the lookup for them.
+    if (deps.at(op.abs_index).overwritten_in_epoch &&
+        RangeCovered(covered, start, end)) {
+      continue;
+    }
+    RangeInsert(covered, start, end);
+    res.push_back(*it);
+  }
+
+  std::reverse(res.begin(), res.end());
+  return res;
+}
+
+bool PartialOrderPermuter::gen_one_state(vector<epoch_op>& res,
+    PermuteTestResult &log_data) {
+  res.clear();
+  // Return if there are no ops to permute and generate a crash state
+  if (GetEpochs()->size() == 0) {
+    return false;
+  }
+  vector<epoch> *epochs = GetEpochs();
+
+  unsigned int num_requests = 0;
+  const unsigned int num_epochs = PickCrashPoint(num_requests, log_data);
+  epoch &target = epochs->at(num_epochs - 1);
+
+  for (unsigned int i = 0; i < num_epochs - 1; ++i) {
+    res.insert(res.end(), epochs->at(i).ops.begin(), epochs->at(i).ops.end());
+  }
+
+  if (num_requests == target.ops.size()) {
+    // The whole epoch persisted, so there is nothing to reduce.
+    res.insert(res.end(), target.ops.begin(), target.ops.end());
+    return true;
+  }
+
+  // Allow any bio but the barrier (if present) to be dropped.
+  unsigned int slots = target.ops.size();
+  if (target.has_barrier) {
+    --slots;
+  }
+  vector<unsigned int> indices(slots);
+  iota(indices.begin(), indices.end(), 0);
+  GetRandom().Shuffle(indices);
+  indices.resize(num_requests);
+  // Keep the ops in the order they were issued.
+  std::sort(indices.begin(), indices.end());
+
+  const vector<unsigned int> reduced = ReduceSubset(target, indices);
+  if (reduced.size() != indices.size()) {
+    vector<unsigned int> pruned(1, num_epochs - 1);
+    for (const unsigned int index : indices) {
+      pruned.push_back(target.ops.at(index).abs_index);
+    }
+    RecordPrunedState(pruned);
+  }
+
+  for (const unsigned int index : reduced) {
+    res.push_back(target.ops.at(index));
+  }
+
+  return true;
+}
+
+bool PartialOrderPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
+    PermuteTestResult &log_data) {
+  res.clear();
+  // Return if there are no ops to work with.
+  if (GetEpochs()->size() == 0) {
+    return false;
+  }
+  vector<epoch> *epochs = GetEpochs();
+
+  unsigned int num_requests = 0;
+  const unsigned int num_epochs = PickCrashPoint(num_requests, log_data);
+  epoch &target = epochs->at(num_epochs - 1);
+
+  for (unsigned int i = 0; i < num_epochs - 1; ++i) {
+    for (epoch_op &op : epochs->at(i).ops) {
+      res.push_back(op.ToWriteData());
+    }
+  }
+
+  if (num_requests == target.ops.size() && target.has_barrier) {
+    // We picked the entire epoch and it has a barrier, so we can't drop
+    // anything.
+    for (epoch_op &op : target.ops) {
+      res.push_back(op.ToWriteData());
+    }
+    return true;
+  }
+
+  vector<EpochOpSector> final_epoch;
+  for (unsigned int i = 0; i < num_requests; ++i) {
+    vector<EpochOpSector> sectors = target.ops.at(i).ToSectors(sector_size_);
+    final_epoch.insert(final_epoch.end(), sectors.begin(), sectors.end());
+  }
+  if (final_epoch.empty()) {
+    return true;
+  }
+
+  // Unlike RandomPermuter, pick from every sector that was written (not just
+  // the most recent write to each disk location) so that crash states where a
+  // newer write is lost but an older one to the same place persists are still
+  // reachable.
+  const unsigned int num_sectors = GetRandom().Uniform(1, final_epoch.size());
+  vector<unsigned int> indices(final_epoch.size());
+  iota(indices.begin(), indices.end(), 0);
+  GetRandom().Shuffle(indices);
+  indices.resize(num_sectors);
+  std::sort(indices.begin(), indices.end());
+
+  vector<EpochOpSector> kept;
+  kept.reserve(indices.size());
+  for (const unsigned int index : indices) {
+    kept.push_back(final_epoch.at(index));
+  }
+
+  // Sectors that a later kept sector writes over are indistinguishable from
+  // sectors that were dropped.
+  vector<EpochOpSector> reduced = CoalesceSectors(kept);
+  if (reduced.size() != kept.size()) {
+    vector<unsigned int> pruned(1, num_epochs - 1);
+    for (const EpochOpSector &sector : kept) {
+      pruned.push_back(sector.parent->abs_index);
+      pruned.push_back(sector.parent_sector_index);
+    }
+    RecordPrunedState(pruned);
+  }
+
+  for (EpochOpSector &sector : reduced) {
+    res.push_back(sector.ToWriteData());
+  }
+
+  return true;
+}
+
+}  // namespace permuter
+}  // namespace fs_testing
+
+extern "C" fs_testing::permuter::Permuter* permuter_get_instance(
+    std::vector<fs_testing::utils::disk_write> *data) {
+  return new fs_testing::permuter::PartialOrderPermuter(data);
+}
+
+extern "C" void permuter_delete_instance(fs_testing::permuter::Permuter* p) {
+  delete p;
+}
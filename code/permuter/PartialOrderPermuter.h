@@ -0,0 +1,62 @@
+#ifndef PARTIAL_ORDER_PERMUTER_H
+#define PARTIAL_ORDER_PERMUTER_H
+
+#include <vector>
+
+#include "Permuter.h"
+#include "../utils/utils.h"
+#include "../results/PermuteTestResult.h"
+
+namespace fs_testing {
+namespace permuter {
+
+using fs_testing::PermuteTestResult;
+
+/*
+ * Randomly drops writes from the epoch a crash state ends in, like
+ * RandomPermuter, but only ever returns one crash state out of each group of
+ * crash states that produce the same disk image. Two subsets of an epoch are
+ * equivalent if they differ only in writes that are completely overwritten by
+ * later writes kept in the subset (or that write no data at all), so each
+ * subset is reduced to the writes that actually determine the disk contents
+ * before it is returned.
+ */
+class PartialOrderPermuter : public Permuter {
+ public:
+  PartialOrderPermuter();
+  PartialOrderPermuter(std::vector<fs_testing::utils::disk_write> *data);
+
+  /*
+   * Same counts as Permuter::EstimateCrashStates, but never exact since
+   * equivalent crash states are folded together and only returned once.
+   */
+  virtual CrashStateEstimate EstimateCrashStates(bool full_bio) override;
+
+ private:
+  virtual void init_data(std::vector<epoch> *data);
+  virtual bool gen_one_state(std::vector<epoch_op>& res,
+      PermuteTestResult &log_data);
+  virtual bool gen_one_sector_state(
+      std::vector<fs_testing::utils::DiskWriteData> &res,
+      PermuteTestResult &log_data) override;
+
+  /*
+   * Pick the epoch to crash in and the number of ops from it to consider, and
+   * fill in the checkpoint the crash state corresponds to. Returns the number
+   * of epochs (including the final, partial one) in the crash state.
+   */
+  unsigned int PickCrashPoint(unsigned int &num_requests,
+      PermuteTestResult &log_data);
+  /*
+   * Given the indices (in ascending order) of the ops in `target` that were
+   * kept in a crash state, remove the ones whose data would never be visible
+   * on disk because later kept ops overwrite all of it.
+   */
+  std::vector<unsigned int> ReduceSubset(epoch &target,
+      const std::vector<unsigned int> &kept);
+};
+
+}  // namespace permuter
+}  // namespace fs_testing
+
+#endif
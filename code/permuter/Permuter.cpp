@@ -1,8 +1,13 @@
 #include <cassert>
 
 #include <algorithm>
-#include <list>
+#include <cmath>
+#include <iomanip>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <sstream>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
@@ -12,20 +17,50 @@
 namespace fs_testing {
 namespace permuter {
 
-using std::list;
-using std::pair;
 using std::shared_ptr;
 using std::size_t;
+using std::string;
 using std::vector;
 
 using fs_testing::utils::disk_write;
 using fs_testing::utils::DiskWriteData;
+using fs_testing::utils::MemoryUsage;
 
 namespace {
 
 static const unsigned int kRetryMultiplier = 2;
 static const unsigned int kMinRetries = 1000;
 static const unsigned int kKernelSectorSize = 512;
+static const unsigned long long kGoldenGamma = 0x9e3779b97f4a7c15ULL;
+
+/*
+ * log2(2^a + 2^b) without leaving log space.
+ */
+double Log2Add(double a, double b) {
+  const double hi = std::max(a, b);
+  const double lo = std::min(a, b);
+  return hi + std::log2(1 + std::exp2(lo - hi));
+}
+
+/*
+ * log2(2^n - 1) for n >= 1.
+ */
+double Log2Pow2Minus1(double n) {
+  // Past this point the - 1 doesn't change the result.
+  if (n > 60) {
+    return n;
+  }
+  return std::log2(std::exp2(n) - 1);
+}
+
+/*
+ * SplitMix64 finalizer.
+ */
+unsigned long long Mix64(unsigned long long z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
 }  // namespace
 
@@ -68,7 +103,8 @@ vector<EpochOpSector> epoch_op::ToSectors(unsigned int sector_size) {
 
     res.at(i) =
       EpochOpSector(this, i,
-          (kKernelSectorSize * op.metadata.write_sector) + (i * sector_size),
+          (kKernelSectorSize * op.metadata.write_sector) +
+            ((unsigned long long) i * sector_size),
           size, sector_size);
   }
 
@@ -86,7 +122,8 @@ EpochOpSector::EpochOpSector() :
       size(0){ }
 
 EpochOpSector::EpochOpSector(epoch_op *parent, unsigned int parent_sector_index,
-    unsigned int disk_offset, unsigned int size, unsigned int max_sector_size) :
+    unsigned long long disk_offset, unsigned int size,
+    unsigned int max_sector_size) :
       parent(parent), parent_sector_index(parent_sector_index),
       disk_offset(disk_offset), max_sector_size(max_sector_size), size(size) { }
 
@@ -124,59 +161,136 @@ DiskWriteData EpochOpSector::ToWriteData() {
       (max_sector_size * parent_sector_index));
 }
 
-/*
- * Given a disk_write operation and a *sorted* list of already existing ranges,
- * determine if the current operation partially or completely overlaps any of
- * the operations already in the list.
- *
- * Returns false if the operation does not belong to any range.
- * Else, returns true.
- */
-bool Permuter::FindOverlapsAndInsert(disk_write &dw,
-    list<pair<unsigned int, unsigned int>> &ranges) const {
-
-  unsigned int start = dw.metadata.write_sector;
-  unsigned int end = start + dw.metadata.size - 1;
-  for (auto range_iter = ranges.begin(); range_iter != ranges.end();
-      range_iter++) {
-    if ((range_iter->first <= start && range_iter->second >= start) ||
-        (range_iter->first <= end && range_iter->second >= end) ||
-        (range_iter->first >= start && range_iter->second <= end)) {
-      // We need to extend our range to cover what we are looking at.
-      if (range_iter->first > dw.metadata.write_sector) {
-        range_iter->first = dw.metadata.write_sector;
-      }
-      unsigned int end =
-        dw.metadata.write_sector + dw.metadata.size - 1;
-      if (range_iter->second < end) {
-        range_iter->second = end;
-      }
-      return true;
-    } else if (range_iter->first > end) {
-      // We assume the list we are given is ordered. Therefore, if the next item
-      // in the list has a start that is greater than the end of the disk_write
-      // in question, we know we won't find anything else in the list this
-      // disk_write overlaps with. In this case, we should insert the
-      // disk_write in the list where we currently are.
-      ranges.insert(range_iter,
-          {dw.metadata.write_sector,
-          dw.metadata.write_sector + dw.metadata.size - 1});
-      return false;
+double CrashStateEstimate::Total() const {
+  return std::exp2(log2_total);
+}
+
+string CrashStateEstimate::Format(double log2_states) {
+  // Exactly representable as an integer in a double.
+  if (log2_states < 53) {
+    return std::to_string(std::llround(std::exp2(log2_states)));
+  }
+  std::ostringstream os;
+  os << std::fixed << std::setprecision(1) << "2^" << log2_states;
+  return os.str();
+}
+
+StateRandom::StateRandom(unsigned long long seed, unsigned long long stream) :
+    key_(Mix64(Mix64(seed + kGoldenGamma) ^ stream)), counter_(0) { }
+
+StateRandom::result_type StateRandom::operator()() {
+  ++counter_;
+  return Mix64(key_ + counter_ * kGoldenGamma);
+}
+
+unsigned int StateRandom::Uniform(unsigned int low, unsigned int high) {
+  assert(low <= high);
+  const unsigned long long range = (unsigned long long) high - low + 1;
+  // Scale the 64-bit value into the range with a multiply instead of a modulo.
+  // The bias this leaves is at most range / 2^64.
+  const unsigned __int128 scaled = (unsigned __int128) (*this)() * range;
+  return low + (unsigned int) (scaled >> 64);
+}
+
+void StateRandom::Shuffle(vector<unsigned int> &values) {
+  if (values.empty()) {
+    return;
+  }
+  for (unsigned int i = values.size() - 1; i > 0; --i) {
+    std::swap(values.at(i), values.at(Uniform(0, i)));
+  }
+}
+
+void WriteIndex::Clear() {
+  segments_.clear();
+}
+
+const std::map<unsigned long long, WriteIndex::Segment>&
+    WriteIndex::GetSegments() const {
+  return segments_;
+}
+
+bool WriteIndex::Insert(unsigned long long start, unsigned long long end,
+    unsigned int owner, unsigned int epoch, vector<unsigned int> &overwritten) {
+  bool same_epoch = false;
+  if (start >= end) {
+    return same_epoch;
+  }
+
+  // Find the first segment that could overlap [start, end). This is either the
+  // segment starting at or before `start` or the first one after it.
+  auto iter = segments_.upper_bound(start);
+  if (iter != segments_.begin()) {
+    auto prev = std::prev(iter);
+    if (prev->second.end > start) {
+      iter = prev;
     }
   }
 
-  // We reached the end of the list of ranges without finding anything starting
-  // after the end of what we are looking at.
-  ranges.emplace_back(dw.metadata.write_sector,
-      dw.metadata.write_sector + dw.metadata.size - 1);
-  return false;
+  while (iter != segments_.end() && iter->first < end) {
+    const unsigned long long seg_start = iter->first;
+    const Segment seg = iter->second;
+
+    if (std::find(overwritten.begin(), overwritten.end(), seg.owner) ==
+        overwritten.end()) {
+      overwritten.push_back(seg.owner);
+    }
+    if (seg.epoch == epoch) {
+      same_epoch = true;
+    }
+
+    iter = segments_.erase(iter);
+    // Keep the parts of the old segment that fall outside the new write.
+    if (seg_start < start) {
+      segments_.insert(iter, {seg_start, {start, seg.owner, seg.epoch}});
+    }
+    if (seg.end > end) {
+      iter = segments_.insert(iter, {end, {seg.end, seg.owner, seg.epoch}});
+      break;
+    }
+  }
+
+  segments_.insert(iter, {start, {end, owner, epoch}});
+  return same_epoch;
+}
+
+bool Permuter::RecordWrite(disk_write &dw, unsigned int abs_index,
+    unsigned int epoch_index) {
+  // write_sector is in units of kernel sectors while size is in bytes. Any
+  // partial kernel sector at the end still counts as written.
+  const unsigned long long start = dw.metadata.write_sector;
+  const unsigned long long end = start +
+    ((dw.metadata.size + (kKernelSectorSize - 1)) / kKernelSectorSize);
+
+  OpDependencies &deps = dependencies_.at(abs_index);
+  deps.epoch_index = epoch_index;
+  const unsigned int first_new = deps.overwrites.size();
+  const bool overlaps = write_index_.Insert(start, end, abs_index, epoch_index,
+      deps.overwrites);
+
+  if (overlaps) {
+    for (unsigned int i = first_new; i < deps.overwrites.size(); ++i) {
+      OpDependencies &prev = dependencies_.at(deps.overwrites.at(i));
+      // Ops are only ever overwritten by later ops, so anything in the same
+      // epoch must have been recorded after the epoch started.
+      if (prev.epoch_index == epoch_index) {
+        prev.overwritten_in_epoch = true;
+      }
+    }
+  }
+  return overlaps;
 }
 
 void Permuter::InitDataVector(unsigned int sector_size,
     vector<disk_write> &data) {
   sector_size_ = sector_size;
   epochs_.clear();
-  list<pair<unsigned int, unsigned int>> epoch_overlaps;
+  write_index_.Clear();
+  dependencies_.clear();
+  dependencies_.resize(data.size());
+  // Crash states from an earlier profile mean nothing for this one.
+  completed_permutations_.clear();
+  pruned_permutations_.clear();
   struct epoch *current_epoch = NULL;
   // Make sure that the first time we mark a checkpoint epoch, we start at 0 and
   // not 1.
@@ -189,9 +303,6 @@ void Permuter::InitDataVector(unsigned int sector_size,
     if (current_epoch == NULL) {
       epochs_.emplace_back();
       current_epoch = &epochs_.back();
-      // Overlaps are only searched for within the current epoch, not across
-      // epochs.
-      epoch_overlaps.clear();
       current_epoch->has_barrier = false;
       current_epoch->overlaps = false;
       current_epoch->checkpoint_epoch = curr_checkpoint_epoch;
@@ -216,8 +327,9 @@ void Permuter::InitDataVector(unsigned int sector_size,
       }
 
       // Check if the current operation overlaps anything we have seen already
-      // in this epoch.
-      if (FindOverlapsAndInsert(*curr_op, epoch_overlaps)) {
+      // in this epoch. Dependencies on ops in earlier epochs are recorded too,
+      // but only overlaps within this epoch set the flag.
+      if (RecordWrite(*curr_op, abs_index, epochs_.size() - 1)) {
         current_epoch->overlaps = true;
       }
 
@@ -270,14 +382,13 @@ void Permuter::InitDataVector(unsigned int sector_size,
         // Switch epochs.
         epochs_.emplace_back();
         current_epoch = &epochs_.back();
-        epoch_overlaps.clear();
         current_epoch->has_barrier = false;
         current_epoch->overlaps = false;
         current_epoch->checkpoint_epoch = curr_checkpoint_epoch;
         // We are adding a new operation to the new epoch, so we need to record
-        // it in the list of things to check for overlaps.
-        epoch_overlaps.emplace_back(data_half.metadata.write_sector,
-            data_half.metadata.write_sector + data_half.metadata.size - 1);
+        // it in the index of things to check for overlaps. It is the first op
+        // in the epoch so it can't overlap anything else in it.
+        RecordWrite(data_half, abs_index, epochs_.size() - 1);
 
         // Setup the rest of the data part of the operation.
         // TODO(ashmrtn): Find a better way to handle matching an index to a bio
@@ -290,7 +401,10 @@ void Permuter::InitDataVector(unsigned int sector_size,
         ++curr_op;
       } else {
         // This is just the case where we have a normal barrier operation ending
-        // the epoch.
+        // the epoch. FUA writes carry data, so they can overwrite things too.
+        if (RecordWrite(*curr_op, abs_index, epochs_.size() - 1)) {
+          current_epoch->overlaps = true;
+        }
         current_epoch->ops.push_back({abs_index, *curr_op});
         current_epoch->num_meta += curr_op->is_meta();
         current_epoch->has_barrier = true;
@@ -309,9 +423,163 @@ vector<epoch>* Permuter::GetEpochs() {
   return &epochs_;
 }
 
+const vector<OpDependencies>& Permuter::GetOpDependencies() const {
+  return dependencies_;
+}
+
+CrashStateEstimate Permuter::EstimateCrashStates(bool full_bio) {
+  CrashStateEstimate res;
+  // Only bio mode is counted exactly. Sector mode counts the subsets of every
+  // prefix of the final epoch separately even though they overlap.
+  res.exact = full_bio;
+  res.log2_total = -INFINITY;
+  for (epoch &e : epochs_) {
+    // An epoch with nothing in it (say, only a trailing checkpoint) adds no
+    // crash states of its own, since crashing in it looks the same as having
+    // finished the epoch before.
+    double log2_states = -INFINITY;
+    if (!e.ops.empty() && full_bio) {
+      if (e.has_barrier) {
+        // Any subset of the non-barrier ops, or the whole epoch.
+        log2_states = e.ops.size() - 1;
+      } else {
+        // Any non-empty subset.
+        log2_states = Log2Pow2Minus1(e.ops.size());
+      }
+    } else if (!e.ops.empty()) {
+      std::unordered_set<unsigned long long> offsets;
+      bool have_states = false;
+      for (unsigned int i = 0; i < e.ops.size(); ++i) {
+        for (EpochOpSector &sector : e.ops.at(i).ToSectors(sector_size_)) {
+          offsets.insert(sector.disk_offset);
+        }
+        double prefix_states = 0;
+        if (i == e.ops.size() - 1 && e.has_barrier) {
+          // The whole epoch, which is never split into sectors.
+          prefix_states = 0;
+        } else if (!offsets.empty()) {
+          prefix_states = Log2Pow2Minus1(offsets.size());
+        } else {
+          // Nothing but empty ops so far.
+          continue;
+        }
+        log2_states = have_states ? Log2Add(log2_states, prefix_states)
+                                  : prefix_states;
+        have_states = true;
+      }
+    }
+    res.log2_epoch_states.push_back(log2_states);
+    if (log2_states != -INFINITY) {
+      res.log2_total = Log2Add(res.log2_total, log2_states);
+    }
+  }
+  return res;
+}
+
+StateRandom& Permuter::GetRandom() {
+  return random_;
+}
+
+void Permuter::SetSeed(unsigned long long seed,
+    unsigned long long first_state) {
+  seed_ = seed;
+  next_state_ = first_state;
+}
+
+void Permuter::SetStateLimit(unsigned long long end_state) {
+  end_state_ = end_state;
+}
+
+unsigned long long Permuter::GetNextState() const {
+  return next_state_;
+}
+
+void Permuter::BeginState(unsigned long long state,
+    PermuteTestResult &log_data) {
+  random_ = StateRandom(seed_, state);
+  log_data.state_index = state;
+}
+
+bool Permuter::RegenerateCrashState(unsigned long long state, bool full_bio,
+    vector<DiskWriteData> &res, PermuteTestResult &log_data) {
+  BeginState(state, log_data);
+  bool new_state = false;
+  if (full_bio) {
+    vector<epoch_op> crash_state;
+    new_state = gen_one_state(crash_state, log_data);
+    res.resize(crash_state.size());
+    for (unsigned int i = 0; i < crash_state.size(); ++i) {
+      res.at(i) = crash_state.at(i).ToWriteData();
+    }
+  } else {
+    new_state = gen_one_sector_state(res, log_data);
+  }
+  log_data.crash_state = res;
+  return new_state;
+}
+
+void Permuter::MarkCompleted(const vector<DiskWriteData> &crash_state,
+    bool full_bio) {
+  // Same keys GenerateCrashState and GenerateSectorCrashState use.
+  vector<unsigned int> crash_state_hash;
+  crash_state_hash.reserve(crash_state.size() * (full_bio ? 1 : 2));
+  for (const DiskWriteData &dwd : crash_state) {
+    crash_state_hash.push_back(dwd.bio_index);
+    if (!full_bio) {
+      crash_state_hash.push_back((dwd.full_bio) ? 0 : dwd.bio_sector_index);
+    }
+  }
+  completed_permutations_.insert(crash_state_hash);
+}
+
+void Permuter::RecordPrunedState(const vector<unsigned int> &state) {
+  pruned_permutations_.insert(state);
+}
+
+unsigned long Permuter::GetNumPrunedStates() const {
+  return pruned_permutations_.size();
+}
+
+MemoryUsage Permuter::GetEpochMemoryUsage() const {
+  MemoryUsage res;
+  res.AddVector(epochs_);
+  for (const epoch &e : epochs_) {
+    res.AddVector(e.ops);
+  }
+  res.AddVector(dependencies_);
+  for (const OpDependencies &dep : dependencies_) {
+    res.payload += dep.overwrites.size() * sizeof(unsigned int);
+    res.overhead += (dep.overwrites.capacity() - dep.overwrites.size()) *
+      sizeof(unsigned int);
+  }
+  // Each map node holds the key and value plus the tree links.
+  const auto &segments = write_index_.GetSegments();
+  res.payload += segments.size() *
+    (sizeof(unsigned long long) + sizeof(WriteIndex::Segment));
+  res.overhead += segments.size() * 4 * sizeof(void *);
+  return res;
+}
+
+MemoryUsage Permuter::GetStateSetMemoryUsage() const {
+  MemoryUsage res;
+  for (const auto *states : {&completed_permutations_, &pruned_permutations_}) {
+    // Buckets plus, per state, a node with the next pointer and cached hash.
+    res.overhead += states->bucket_count() * sizeof(void *) +
+      states->size() * (sizeof(vector<unsigned int>) + 2 * sizeof(void *));
+    for (const vector<unsigned int> &state : *states) {
+      res.payload += state.size() * sizeof(unsigned int);
+      res.overhead += (state.capacity() - state.size()) * sizeof(unsigned int);
+    }
+  }
+  return res;
+}
+
 
 bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
     PermuteTestResult &log_data) {
+  if (next_state_ >= end_state_) {
+    return false;
+  }
   vector<epoch_op> crash_state;
   unsigned long retries = 0;
   unsigned int exists = 0;
@@ -323,6 +591,8 @@ bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
       ? kMinRetries
       : kRetryMultiplier * completed_permutations_.size();
   do {
+    BeginState(next_state_, log_data);
+    ++next_state_;
     new_state = gen_one_state(crash_state, log_data);
 
     crash_state_hash.clear();
@@ -341,7 +611,7 @@ bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
       // make unique permutations.
       break;
     }
-  } while (exists > 0);
+  } while (exists > 0 && next_state_ < end_state_);
 
   // Move the permuted crash state data over into the returned crash state
   // vector.
@@ -366,6 +636,9 @@ bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
 
 bool Permuter::GenerateSectorCrashState(std::vector<DiskWriteData> &res,
     PermuteTestResult &log_data) {
+  if (next_state_ >= end_state_) {
+    return false;
+  }
   unsigned long retries = 0;
   unsigned int exists = 0;
   bool new_state = true;
@@ -376,6 +649,8 @@ bool Permuter::GenerateSectorCrashState(std::vector<DiskWriteData> &res,
       ? kMinRetries
       : kRetryMultiplier * completed_permutations_.size();
   do {
+    BeginState(next_state_, log_data);
+    ++next_state_;
     new_state = gen_one_sector_state(res, log_data);
 
     crash_state_hash.clear();
@@ -398,7 +673,7 @@ bool Permuter::GenerateSectorCrashState(std::vector<DiskWriteData> &res,
       // make unique permutations.
       break;
     }
-  } while (exists > 0);
+  } while (exists > 0 && next_state_ < end_state_);
 
   // Move the permuted crash state data over into the returned crash state
   // vector.
@@ -423,7 +698,7 @@ vector<EpochOpSector> Permuter::CoalesceSectors(
   vector<EpochOpSector> res(sector_list.size());
   unsigned int num_unique_sectors = 0;
   // Place to store previously seen sectors for latere comparison.
-  std::unordered_set<unsigned int> sector_offsets;
+  std::unordered_set<unsigned long long> sector_offsets;
 
   // Iterate through the list of sectors backwards, adding any new sectors
   // encountered.
@@ -1,11 +1,13 @@
 #ifndef PERMUTER_H
 #define PERMUTER_H
 
-#include <list>
+#include <map>
+#include <string>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 
+#include "../utils/MemoryUsage.h"
 #include "../utils/utils.h"
 #include "../results/PermuteTestResult.h"
 
@@ -40,6 +42,101 @@ struct epoch {
   std::vector<struct epoch_op> ops;
 };
 
+/*
+ * Write dependency information for a single epoch_op, gathered when the log is
+ * split into epochs. Indexed by the abs_index of the op.
+ */
+struct OpDependencies {
+  // abs_index of the earlier ops (in this epoch or any prior epoch) whose data
+  // this op replaces on at least one sector. Only the most recent writer of
+  // each sector is recorded, so chains of overwrites must be followed
+  // transitively.
+  std::vector<unsigned int> overwrites;
+  // Index into the epochs vector of the epoch this op's data landed in.
+  unsigned int epoch_index = 0;
+  // Set if some later op in the same epoch writes over at least one sector of
+  // this op.
+  bool overwritten_in_epoch = false;
+};
+
+/*
+ * Tracks which op most recently wrote each range of disk sectors. Ranges are
+ * kept as non-overlapping [start, end) segments keyed by start sector so that
+ * finding everything a new write touches is logarithmic in the number of
+ * segments instead of linear in the number of ops seen.
+ */
+class WriteIndex {
+ public:
+  struct Segment {
+    unsigned long long end;
+    unsigned int owner;
+    unsigned int epoch;
+  };
+
+  void Clear();
+  /*
+   * Record that op `owner` in epoch `epoch` wrote the sectors [start, end).
+   * Every op that previously owned part of that range is appended (once) to
+   * `overwritten`. Returns true if any of those ops were in `epoch`.
+   */
+  bool Insert(unsigned long long start, unsigned long long end,
+      unsigned int owner, unsigned int epoch,
+      std::vector<unsigned int> &overwritten);
+  /*
+   * The current owner of every sector range written so far, keyed by start
+   * sector.
+   */
+  const std::map<unsigned long long, Segment>& GetSegments() const;
+
+ private:
+  std::map<unsigned long long, Segment> segments_;
+};
+
+/*
+ * Size of the crash state space a permuter draws from. Counts can be huge, so
+ * they are kept as base-2 logarithms.
+ */
+struct CrashStateEstimate {
+  // log2 of the number of distinct crash states that end in each epoch, or
+  // -infinity if none do.
+  std::vector<double> log2_epoch_states;
+  // log2 of the number of distinct crash states overall.
+  double log2_total = 0;
+  // False if the counts are only upper bounds.
+  bool exact = false;
+
+  // Total number of states, or infinity if it doesn't fit in a double.
+  double Total() const;
+  // Number of states as a string, either exact or as a power of two.
+  static std::string Format(double log2_states);
+};
+
+/*
+ * Counter-based random number generator (SplitMix64 applied to a counter). The
+ * n-th value drawn is a pure function of (seed, stream, n), so the randomness
+ * used for any crash state can be recreated without generating the crash
+ * states before it. Usable anywhere a UniformRandomBitGenerator is expected,
+ * though Uniform and Shuffle should be preferred because, unlike the standard
+ * library distributions, their results don't depend on the library version.
+ */
+class StateRandom {
+ public:
+  typedef unsigned long long result_type;
+
+  StateRandom(unsigned long long seed = 0, unsigned long long stream = 0);
+  result_type operator()();
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~0ULL; }
+
+  // Returns a value in [low, high].
+  unsigned int Uniform(unsigned int low, unsigned int high);
+  void Shuffle(std::vector<unsigned int> &values);
+
+ private:
+  unsigned long long key_;
+  unsigned long long counter_;
+};
+
 /*
  * Assumes that the starting sector of the epoch_op containing these sectors is
  * aligned to max_sector_size.
@@ -48,7 +145,7 @@ struct EpochOpSector {
  public:
   EpochOpSector();
   EpochOpSector(epoch_op *parent, unsigned int parent_sector_index,
-      unsigned int disk_offset, unsigned int size,
+      unsigned long long disk_offset, unsigned int size,
       unsigned int max_sector_size);
   bool operator==(const EpochOpSector &other) const;
   bool operator!=(const EpochOpSector &other) const;
@@ -57,7 +154,7 @@ struct EpochOpSector {
 
   epoch_op *parent;
   unsigned int parent_sector_index;
-  unsigned int disk_offset;
+  unsigned long long disk_offset;
   unsigned int max_sector_size;
   // Note that this could be less than the given sector size if the sector is
   // the last one for the bio and the sector size is not a multiple of the bio
@@ -75,9 +172,75 @@ class Permuter {
   bool GenerateSectorCrashState(
       std::vector<fs_testing::utils::DiskWriteData> &res,
       fs_testing::PermuteTestResult &log_data);
+  /*
+   * Set the seed for all randomness used to generate crash states. Each attempt
+   * at generating a crash state (including ones rejected as duplicates) gets
+   * its own index, starting at first_state, and draws only from the stream
+   * (seed, index). Distinct runs can therefore split up work by handing out
+   * disjoint ranges of indices.
+   */
+  void SetSeed(unsigned long long seed, unsigned long long first_state = 0);
+  /*
+   * Stop generating crash states once attempt end_state is reached so that a
+   * run only tests the indices [first_state, end_state).
+   */
+  void SetStateLimit(unsigned long long end_state);
+  // Index the next attempt at generating a crash state will get.
+  unsigned long long GetNextState() const;
+  /*
+   * Recreate the crash state generated for attempt `state` (see
+   * PermuteTestResult::state_index) without generating the states before it.
+   * Unlike the Generate* functions, this does not check for duplicates.
+   */
+  bool RegenerateCrashState(unsigned long long state, bool full_bio,
+      std::vector<fs_testing::utils::DiskWriteData> &res,
+      fs_testing::PermuteTestResult &log_data);
+  /*
+   * Record that a crash state returned by GenerateCrashState (full_bio) or
+   * GenerateSectorCrashState (!full_bio) in an earlier run was already tested
+   * so that it isn't generated again. Only bio_index and bio_sector_index of
+   * each entry are used.
+   */
+  void MarkCompleted(
+      const std::vector<fs_testing::utils::DiskWriteData> &crash_state,
+      bool full_bio);
+  /*
+   * Count how many distinct crash states GenerateCrashState (full_bio) or
+   * GenerateSectorCrashState (!full_bio) can produce from the data passed to
+   * InitDataVector. The default implementation matches the way RandomPermuter
+   * picks crash states: a random subset of the final epoch in bio mode, and a
+   * random subset of the sectors of a prefix of the final epoch in sector
+   * mode.
+   */
+  virtual CrashStateEstimate EstimateCrashStates(bool full_bio);
+  /*
+   * Number of distinct crash states the permuter recognized as equivalent to
+   * some other crash state and therefore never handed back to be tested.
+   */
+  unsigned long GetNumPrunedStates() const;
+  /*
+   * Memory held by the epochs built from the profile and by the indices of
+   * which ops write over which. Bio data is shared with the profile, so it
+   * isn't counted here.
+   */
+  fs_testing::utils::MemoryUsage GetEpochMemoryUsage() const;
+  // Memory held remembering the crash states already tested or pruned.
+  fs_testing::utils::MemoryUsage GetStateSetMemoryUsage() const;
 
  protected:
   std::vector<epoch>* GetEpochs();
+  const std::vector<OpDependencies>& GetOpDependencies() const;
+  /*
+   * Random number source for the crash state currently being generated. Only
+   * valid inside gen_one_state and gen_one_sector_state.
+   */
+  StateRandom& GetRandom();
+  /*
+   * Note that the crash state identified by `state` (in the same form as the
+   * hashes used to detect duplicate crash states) was folded into an
+   * equivalent crash state instead of being tested itself.
+   */
+  void RecordPrunedState(const std::vector<unsigned int> &state);
   /*
    * Given a vector of sectors ordered in time (i.e. the submission time of a
    * sector at a higher index in the vector is later than the submission time of
@@ -97,12 +260,30 @@ class Permuter {
       std::vector<fs_testing::utils::DiskWriteData> &res,
       fs_testing::PermuteTestResult &log_data) = 0;
 
-  bool FindOverlapsAndInsert(fs_testing::utils::disk_write &dw,
-      std::list<std::pair<unsigned int, unsigned int>> &ranges) const;
+  /*
+   * Add the data written by dw to write_index_, recording what it overwrites in
+   * dependencies_. Returns true if dw overlaps another op in the same epoch.
+   */
+  bool RecordWrite(fs_testing::utils::disk_write &dw, unsigned int abs_index,
+      unsigned int epoch_index);
+  /*
+   * Reset random_ to the stream for attempt `state` and record the attempt in
+   * log_data.
+   */
+  void BeginState(unsigned long long state,
+      fs_testing::PermuteTestResult &log_data);
 
   std::vector<epoch> epochs_;
+  std::vector<OpDependencies> dependencies_;
+  unsigned long long seed_ = 42;
+  unsigned long long next_state_ = 0;
+  unsigned long long end_state_ = ~0ULL;
+  StateRandom random_;
+  WriteIndex write_index_;
   std::unordered_set<std::vector<unsigned int>, BioVectorHash, BioVectorEqual>
     completed_permutations_;
+  std::unordered_set<std::vector<unsigned int>, BioVectorHash, BioVectorEqual>
+    pruned_permutations_;
 };
 
 typedef Permuter *permuter_create_t();
@@ -14,23 +14,12 @@ namespace permuter {
 using std::advance;
 using std::iota;
 using std::list;
-using std::mt19937;
-using std::uniform_int_distribution;
 using std::vector;
 
 using fs_testing::utils::disk_write;
 using fs_testing::utils::DiskWriteData;
 
-GenRandom::GenRandom() : rand(mt19937(42)) { }
-
-int GenRandom::operator()(int max) {
-  uniform_int_distribution<unsigned int> uid(0, max - 1);
-  return uid(rand);
-}
-
 RandomPermuter::RandomPermuter(vector<disk_write> *data) {
-  // TODO(ashmrtn): Make a flag to make it random or not.
-  rand = mt19937(42);
 }
 
 void RandomPermuter::init_data(vector<epoch> *data) {
@@ -44,17 +33,13 @@ bool RandomPermuter::gen_one_state(vector<epoch_op>& res,
   }
   unsigned int total_elements = 0;
   // Find how many elements we will be returning (randomly determined).
-  uniform_int_distribution<unsigned int> permute_epochs(1, GetEpochs()->size());
-  unsigned int num_epochs = permute_epochs(rand);
+  unsigned int num_epochs = GetRandom().Uniform(1, GetEpochs()->size());
+  unsigned int num_requests = 0;
   // Don't subtract 1 from this size so that we can send a complete epoch if we
-  // want.
-  uniform_int_distribution<unsigned int> permute_requests(1,
-      GetEpochs()->at(num_epochs - 1).ops.size());
-  unsigned int num_requests = permute_requests(rand);
-  // If the last epoch has zero ops, we set num_requests to zero instead of a 
-  // garbage value returned by permute_requests(rand)
-  if (GetEpochs()->at(num_epochs - 1).ops.size() == 0) {
-    num_requests = 0;
+  // want. If the last epoch has zero ops, leave num_requests at zero.
+  if (GetEpochs()->at(num_epochs - 1).ops.size() != 0) {
+    num_requests =
+      GetRandom().Uniform(1, GetEpochs()->at(num_epochs - 1).ops.size());
   }
   for (unsigned int i = 0; i < num_epochs - 1; ++i) {
     total_elements += GetEpochs()->at(i).ops.size();
@@ -124,19 +109,16 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
 
   // Pick the point in the sequence we will crash at.
   // Find how many elements we will be returning (randomly determined).
-  uniform_int_distribution<unsigned int> permute_epochs(1, epochs->size());
-  unsigned int num_epochs = permute_epochs(rand);
+  unsigned int num_epochs = GetRandom().Uniform(1, epochs->size());
   unsigned int num_requests = 0;
   if (!epochs->at(num_epochs - 1).ops.empty()) {
-    // It is not valid to call the random number generator with arguments (1, 0)
-    // (you get a large number if you do), so skip this if the epoch we crash in
-    // has no ops in it.
+    // It is not valid to ask for a random number in the range (1, 0), so skip
+    // this if the epoch we crash in has no ops in it.
 
     // Don't subtract 1 from this size so that we can send a complete epoch if
     // we want.
-    uniform_int_distribution<unsigned int> permute_requests(1,
-        epochs->at(num_epochs - 1).ops.size());
-    num_requests = permute_requests(rand);
+    num_requests =
+      GetRandom().Uniform(1, epochs->at(num_epochs - 1).ops.size());
   }
 
   // Tell CrashMonkey the most recently seen checkpoint for the crash state
@@ -193,14 +175,13 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
   // For this branch of execution, we are dropping some sectors from the final
   // epoch we are "crashing" in.
 
-  // Pick a number of sectors to keep. final_epoch.size() > 0 due to if block
-  // above, so no need to worry about getting an invalid range.
-  uniform_int_distribution<unsigned int> rand_num_sectors(1,
-      final_epoch.size());
-  const unsigned int num_sectors = rand_num_sectors(rand);
-
   final_epoch = CoalesceSectors(final_epoch);
 
+  // Pick a number of sectors to keep. final_epoch.size() > 0 due to if block
+  // above, so no need to worry about getting an invalid range. This has to
+  // come after coalescing, which drops sectors written more than once.
+  const unsigned int num_sectors = GetRandom().Uniform(1, final_epoch.size());
+
   // Result size is now a known quantity.
   res.resize(total_elements + num_sectors);
   // Add the requests not in the final epoch to the result.
@@ -211,8 +192,8 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
   // Randomly drop some sectors.
   vector<unsigned int> indices(final_epoch.size());
   iota(indices.begin(), indices.end(), 0);
-  // Use a known random generator function for repeatability.
-  std::random_shuffle(indices.begin(), indices.end(), subset_random_);
+  // Draw from the crash state's own random stream for repeatability.
+  GetRandom().Shuffle(indices);
 
   // Populate the bitmap to set req_set number of bios. This is required to keep
   // sectors in temporal order when we generate the crash state.
@@ -262,8 +243,8 @@ void RandomPermuter::subset_epoch(
 
   vector<unsigned int> indices(slots);
   iota(indices.begin(), indices.end(), 0);
-  // Use a known random generator function for repeatability.
-  std::random_shuffle(indices.begin(), indices.end(), subset_random_);
+  // Draw from the crash state's own random stream for repeatability.
+  GetRandom().Shuffle(indices);
 
   // Populate the bitmap to set req_set number of bios.
   for (int i = 0; i < req_size; i++) {
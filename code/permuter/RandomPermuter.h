@@ -1,7 +1,6 @@
 #ifndef RANDOM_PERMUTER_H
 #define RANDOM_PERMUTER_H
 
-#include <random>
 #include <vector>
 
 #include "Permuter.h"
@@ -13,15 +12,6 @@ namespace permuter {
 
 using fs_testing::PermuteTestResult;
 
-class GenRandom {
- public:
-  GenRandom();
-  int operator()(int max);
-
- private:
-  std::mt19937 rand;
-};
-
 class RandomPermuter : public Permuter {
  public:
   RandomPermuter();
@@ -46,9 +36,6 @@ class RandomPermuter : public Permuter {
       const std::vector<fs_testing::utils::DiskWriteData>::iterator &res_end,
       const std::vector<epoch>::iterator &start,
       const std::vector<epoch>::iterator &end);
-
-  std::mt19937 rand;
-  GenRandom subset_random_;
 };
 
 }  // namespace permuter
@@ -1,10 +1,58 @@
+#include <endian.h>
+#include <stdint.h>
+
 #include "PermuteTestResult.h"
 
 namespace fs_testing {
 
+using std::istream;
 using std::ostream;
+using std::shared_ptr;
 using std::to_string;
 
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+// "CMSD" followed by the format version.
+static const uint32_t kDescriptorMagic = 0x434d5344;
+static const uint32_t kDescriptorVersion = 2;
+// Sanity limit so a corrupt count doesn't make us allocate the world.
+static const uint32_t kMaxDescriptorEntries = 1 << 28;
+
+void WriteU32(ostream& os, uint32_t val) {
+  const uint32_t be = htobe32(val);
+  os.write((const char*) &be, sizeof(be));
+}
+
+void WriteU64(ostream& os, uint64_t val) {
+  const uint64_t be = htobe64(val);
+  os.write((const char*) &be, sizeof(be));
+}
+
+bool ReadU32(istream& is, uint32_t &val) {
+  uint32_t be;
+  if (!is.read((char*) &be, sizeof(be))) {
+    return false;
+  }
+  val = be32toh(be);
+  return true;
+}
+
+bool ReadU64(istream& is, uint64_t &val) {
+  uint64_t be;
+  if (!is.read((char*) &be, sizeof(be))) {
+    return false;
+  }
+  val = be64toh(be);
+  return true;
+}
+
+}  // namespace
+
+const unsigned int PermuteTestResult::kFullBioSector;
+const unsigned int PermuteTestResult::kNoDataSector;
+
 ostream& PermuteTestResult::PrintCrashStateSize(ostream& os) const {
   if (crash_state.empty()) {
     os << "0 bios/sectors";
@@ -36,4 +84,66 @@ ostream& PermuteTestResult::PrintCrashState(ostream& os) const {
   return os;
 }
 
+bool PermuteTestResult::WriteDescriptor(ostream& os,
+    unsigned long long profile_id, unsigned int test_num,
+    unsigned int sector_size) const {
+  WriteU32(os, kDescriptorMagic);
+  WriteU32(os, kDescriptorVersion);
+  WriteU64(os, profile_id);
+  WriteU64(os, state_index);
+  WriteU32(os, test_num);
+  WriteU32(os, last_checkpoint);
+  WriteU32(os, sector_size);
+  WriteU32(os, crash_state.size());
+  // Sector crash states still hold full bios for the epochs before the one the
+  // crash happened in, so each entry says which kind it is.
+  for (const DiskWriteData &dwd : crash_state) {
+    WriteU32(os, dwd.bio_index);
+    if (dwd.full_bio) {
+      WriteU32(os, (dwd.size == 0) ? kNoDataSector : kFullBioSector);
+    } else {
+      WriteU32(os, dwd.bio_sector_index);
+    }
+  }
+  return os.good();
+}
+
+bool PermuteTestResult::ReadDescriptor(istream& is,
+    unsigned long long &profile_id, unsigned int &test_num,
+    unsigned int &sector_size) {
+  uint32_t magic, version, checkpoint, sectors, num_entries, test;
+  uint64_t profile, state;
+  if (!ReadU32(is, magic) || magic != kDescriptorMagic ||
+      !ReadU32(is, version) || version != kDescriptorVersion ||
+      !ReadU64(is, profile) || !ReadU64(is, state) || !ReadU32(is, test) ||
+      !ReadU32(is, checkpoint) || !ReadU32(is, sectors) ||
+      !ReadU32(is, num_entries) ||
+      num_entries > kMaxDescriptorEntries) {
+    return false;
+  }
+
+  crash_state.clear();
+  crash_state.reserve(num_entries);
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    uint32_t bio_index, bio_sector_index;
+    if (!ReadU32(is, bio_index) || !ReadU32(is, bio_sector_index)) {
+      return false;
+    }
+    const bool full_bio = bio_sector_index == kFullBioSector ||
+      bio_sector_index == kNoDataSector;
+    if (bio_sector_index == kFullBioSector) {
+      bio_sector_index = 0;
+    }
+    crash_state.emplace_back(full_bio, bio_index, bio_sector_index, 0, 0,
+        shared_ptr<char>(), 0);
+  }
+
+  profile_id = profile;
+  state_index = state;
+  test_num = test;
+  last_checkpoint = checkpoint;
+  sector_size = sectors;
+  return true;
+}
+
 }  // namespace fs_testing
@@ -12,10 +12,38 @@ namespace fs_testing {
 
 class PermuteTestResult {
  public:
+  // Stored in descriptors in place of a sector index for full bios, and for
+  // full bios that carry no data (i.e. the flush half of a split flush
+  // operation).
+  static const unsigned int kFullBioSector = ~0U - 1;
+  static const unsigned int kNoDataSector = ~0U;
+
   std::ostream& PrintCrashStateSize(std::ostream& os) const;
   std::ostream& PrintCrashState(std::ostream& os) const;
+  /*
+   * Write a compact binary descriptor of this crash state: which profile it
+   * came from, the checkpoint it was cut at, and the (bio_index,
+   * bio_sector_index) of every write in it. Entries that are full bios store
+   * kFullBioSector, or kNoDataSector if they carry no data, in place of the
+   * sector index. No data is saved, so the same profile is needed to rebuild
+   * the crash state later. sector_size is the sector size the profile was
+   * split into sectors with.
+   */
+  bool WriteDescriptor(std::ostream& os, unsigned long long profile_id,
+      unsigned int test_num, unsigned int sector_size) const;
+  /*
+   * Read a descriptor written by WriteDescriptor. crash_state is filled with
+   * entries that have only full_bio, bio_index, and bio_sector_index set. Full
+   * bios without data have a bio_sector_index of kNoDataSector.
+   * Returns false at the end of the stream or if the descriptor is malformed.
+   */
+  bool ReadDescriptor(std::istream& is, unsigned long long &profile_id,
+      unsigned int &test_num, unsigned int &sector_size);
 
   unsigned int last_checkpoint;
+  // Index the permuter gave to the attempt that produced this crash state.
+  // Together with the permuter seed, this is enough to regenerate the state.
+  unsigned long long state_index = 0;
   std::vector<fs_testing::utils::DiskWriteData> crash_state;
 
 };
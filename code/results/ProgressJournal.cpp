@@ -0,0 +1,287 @@
+#include <endian.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include "ProgressJournal.h"
+
+namespace fs_testing {
+
+using std::ifstream;
+using std::ios;
+using std::istream;
+using std::ostream;
+using std::ostringstream;
+using std::set;
+using std::string;
+using std::vector;
+
+using fs_testing::tests::DataTestResult;
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+// "CMPJ" followed by the format version. Records are descriptors, so this also
+// changes whenever the descriptor version does.
+static const uint32_t kJournalMagic = 0x434d504a;
+static const uint32_t kJournalVersion = 3;
+// Sanity limit on the permuter name so a corrupt header isn't read as one.
+static const uint32_t kMaxPermuterLen = 4096;
+// Number of records buffered before they are written out and fsync'd.
+static const unsigned int kSyncInterval = 32;
+
+void WriteU32(ostream& os, uint32_t val) {
+  const uint32_t be = htobe32(val);
+  os.write((const char*) &be, sizeof(be));
+}
+
+void WriteU64(ostream& os, uint64_t val) {
+  const uint64_t be = htobe64(val);
+  os.write((const char*) &be, sizeof(be));
+}
+
+bool ReadU32(istream& is, uint32_t &val) {
+  uint32_t be;
+  if (!is.read((char*) &be, sizeof(be))) {
+    return false;
+  }
+  val = be32toh(be);
+  return true;
+}
+
+bool ReadU64(istream& is, uint64_t &val) {
+  uint64_t be;
+  if (!is.read((char*) &be, sizeof(be))) {
+    return false;
+  }
+  val = be64toh(be);
+  return true;
+}
+
+bool WriteAll(int fd, const string &data) {
+  unsigned int written = 0;
+  while (written < data.size()) {
+    const int res = write(fd, data.data() + written, data.size() - written);
+    if (res < 0) {
+      return false;
+    }
+    written += res;
+  }
+  return true;
+}
+
+}  // namespace
+
+ProgressJournal::~ProgressJournal() {
+  Close();
+}
+
+bool ProgressJournal::ReadFile(const string &path, Header &header,
+    vector<SingleTestInfo> &done, long long &valid_len) {
+  done.clear();
+  valid_len = 0;
+  ifstream is(path, ios::binary);
+  if (!is.is_open()) {
+    return false;
+  }
+  uint32_t magic, version, sectors, bio_mode, permuter_len;
+  uint64_t profile, seed;
+  if (!ReadU32(is, magic) || !ReadU32(is, version) || !ReadU64(is, profile) ||
+      !ReadU64(is, seed) || !ReadU32(is, sectors) || !ReadU32(is, bio_mode)) {
+    return false;
+  }
+  // Anything that got this far is treated as a journal, so it isn't written
+  // over even if it's one this version can't read.
+  valid_len = is.tellg();
+  if (magic != kJournalMagic || version != kJournalVersion ||
+      !ReadU32(is, permuter_len) || permuter_len > kMaxPermuterLen) {
+    return false;
+  }
+  string permuter(permuter_len, '\0');
+  if (!is.read(&permuter[0], permuter_len)) {
+    return false;
+  }
+  header.profile_id = profile;
+  header.permuter = permuter;
+  header.seed = seed;
+  header.sector_size = sectors;
+  header.full_bio = bio_mode != 0;
+  valid_len = is.tellg();
+
+  while (true) {
+    SingleTestInfo test_info;
+    unsigned long long record_profile;
+    unsigned int record_sectors;
+    uint32_t fs_error, data_error;
+    if (!test_info.permute_data.ReadDescriptor(is, record_profile,
+          test_info.test_num, record_sectors) ||
+        !ReadU32(is, fs_error) || !ReadU32(is, data_error)) {
+      break;
+    }
+    test_info.fs_test.SetError((FileSystemTestResult::ErrorType) fs_error);
+    test_info.data_test.SetError((DataTestResult::ErrorType) data_error);
+    done.push_back(test_info);
+    valid_len = is.tellg();
+  }
+  return true;
+}
+
+bool ProgressJournal::Read(const string &path, Header &header,
+    vector<SingleTestInfo> &done) {
+  long long valid_len;
+  return ReadFile(path, header, done, valid_len);
+}
+
+bool ProgressJournal::Merge(const vector<string> &paths, Header &header,
+    vector<SingleTestInfo> &merged) {
+  merged.clear();
+  for (unsigned int i = 0; i < paths.size(); ++i) {
+    Header other;
+    vector<SingleTestInfo> done;
+    if (!Read(paths.at(i), other, done)) {
+      return false;
+    }
+    if (i == 0) {
+      header = other;
+    } else if (other.profile_id != header.profile_id ||
+        other.permuter != header.permuter || other.seed != header.seed ||
+        other.sector_size != header.sector_size ||
+        other.full_bio != header.full_bio) {
+      return false;
+    }
+    merged.insert(merged.end(), done.begin(), done.end());
+  }
+
+  std::stable_sort(merged.begin(), merged.end(),
+      [](const SingleTestInfo &a, const SingleTestInfo &b) {
+        return a.permute_data.state_index < b.permute_data.state_index;
+      });
+  // Runs split up attempts, not crash states, so two of them can land on the
+  // same crash state.
+  set<vector<unsigned long long>> seen;
+  unsigned int kept = 0;
+  for (SingleTestInfo &test_info : merged) {
+    vector<unsigned long long> key;
+    key.push_back(test_info.permute_data.last_checkpoint);
+    for (const DiskWriteData &dwd : test_info.permute_data.crash_state) {
+      key.push_back(((unsigned long long) dwd.bio_index << 32) |
+          dwd.bio_sector_index);
+    }
+    if (!seen.insert(key).second) {
+      continue;
+    }
+    test_info.test_num = kept + 1;
+    merged.at(kept++) = test_info;
+  }
+  merged.resize(kept);
+  return true;
+}
+
+bool ProgressJournal::Write(const string &path, const Header &header,
+    const vector<SingleTestInfo> &records) {
+  unlink(path.c_str());
+  ProgressJournal journal;
+  unsigned long long seed = header.seed;
+  vector<SingleTestInfo> done;
+  if (!journal.Open(path, header.profile_id, header.permuter, header.full_bio,
+        header.sector_size, seed, done)) {
+    return false;
+  }
+  for (const SingleTestInfo &test_info : records) {
+    if (!journal.Append(test_info)) {
+      return false;
+    }
+  }
+  return journal.Sync();
+}
+
+bool ProgressJournal::Open(const string &path, unsigned long long profile_id,
+    const string &permuter, bool full_bio, unsigned int sector_size,
+    unsigned long long &seed, vector<SingleTestInfo> &done) {
+  Close();
+  profile_id_ = profile_id;
+  sector_size_ = sector_size;
+
+  // Length of the file up to the end of the last complete record. Anything
+  // after it was cut off when the previous run died.
+  long long valid_len = 0;
+  Header old;
+  if (ReadFile(path, old, done, valid_len)) {
+    if (old.profile_id != profile_id || old.permuter != permuter ||
+        old.sector_size != sector_size || old.full_bio != full_bio) {
+      done.clear();
+      return false;
+    }
+    seed = old.seed;
+  } else if (valid_len > 0) {
+    // Not a journal, so don't write over it.
+    done.clear();
+    return false;
+  }
+
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (fd_ < 0 || ftruncate(fd_, valid_len) < 0 ||
+      lseek(fd_, valid_len, SEEK_SET) < 0) {
+    Close();
+    return false;
+  }
+
+  if (valid_len == 0) {
+    ostringstream header;
+    WriteU32(header, kJournalMagic);
+    WriteU32(header, kJournalVersion);
+    WriteU64(header, profile_id);
+    WriteU64(header, seed);
+    WriteU32(header, sector_size);
+    WriteU32(header, full_bio);
+    WriteU32(header, permuter.size());
+    header << permuter;
+    if (!WriteAll(fd_, header.str()) || fsync(fd_) < 0) {
+      Close();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProgressJournal::Append(const SingleTestInfo &test_info) {
+  if (fd_ < 0) {
+    return false;
+  }
+  ostringstream record;
+  test_info.permute_data.WriteDescriptor(record, profile_id_,
+      test_info.test_num, sector_size_);
+  WriteU32(record, test_info.fs_test.GetError());
+  WriteU32(record, test_info.data_test.GetError());
+  pending_ += record.str();
+  if (++num_pending_ < kSyncInterval) {
+    return true;
+  }
+  return Sync();
+}
+
+bool ProgressJournal::Sync() {
+  if (fd_ < 0) {
+    return false;
+  }
+  const bool res = WriteAll(fd_, pending_) && fsync(fd_) == 0;
+  pending_.clear();
+  num_pending_ = 0;
+  return res;
+}
+
+void ProgressJournal::Close() {
+  if (fd_ < 0) {
+    return;
+  }
+  Sync();
+  close(fd_);
+  fd_ = -1;
+}
+
+}  // namespace fs_testing
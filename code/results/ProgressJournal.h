@@ -0,0 +1,86 @@
+#ifndef RESULTS_PROGRESS_JOURNAL_H
+#define RESULTS_PROGRESS_JOURNAL_H
+
+#include <string>
+#include <vector>
+
+#include "SingleTestInfo.h"
+
+namespace fs_testing {
+
+/*
+ * Append-only record of every crash state a run has finished testing, used to
+ * pick a run back up after the machine running it dies. The file starts with a
+ * header naming the profile, permuter, permuter seed, and replay mode, followed
+ * by one record per crash state: its descriptor (see
+ * PermuteTestResult::WriteDescriptor) and the verdict it got. Records are
+ * buffered and fsync'd in batches, so a crash loses at most a batch of them.
+ */
+class ProgressJournal {
+ public:
+  // What a journal's header says about the run that wrote it.
+  struct Header {
+    unsigned long long profile_id = 0;
+    // File name of the permuter library, without its directory.
+    std::string permuter;
+    unsigned long long seed = 0;
+    unsigned int sector_size = 0;
+    bool full_bio = false;
+  };
+
+  ~ProgressJournal();
+
+  /*
+   * Read the header and complete records of the journal at path without
+   * opening it for writing. Records are returned as Open returns them. Returns
+   * false if the file can't be read or has no header.
+   */
+  static bool Read(const std::string &path, Header &header,
+      std::vector<SingleTestInfo> &done);
+  /*
+   * Combine the journals written by runs that each tested a different range of
+   * crash states from the same profile and seed. A crash state tested by more
+   * than one run is only kept once, from the lowest state index. Records are
+   * ordered by state index and renumbered from 1. Returns false if a journal
+   * can't be read or belongs to a different run than the first one, including
+   * one that used a different permuter.
+   */
+  static bool Merge(const std::vector<std::string> &paths, Header &header,
+      std::vector<SingleTestInfo> &merged);
+  // Write a new journal at path holding records, replacing any file there.
+  static bool Write(const std::string &path, const Header &header,
+      const std::vector<SingleTestInfo> &records);
+
+  /*
+   * Open the journal at path, creating it if needed. If it already has
+   * records, they are returned in done with test_num, permute_data (only
+   * bio_index and bio_sector_index are set in the crash state), fs_test, and
+   * data_test errors filled in, and seed is set to the seed the run used. A
+   * partially written trailing record is discarded. Returns false if the file
+   * can't be opened or belongs to a different profile, permuter, or replay
+   * mode.
+   */
+  bool Open(const std::string &path, unsigned long long profile_id,
+      const std::string &permuter, bool full_bio, unsigned int sector_size,
+      unsigned long long &seed, std::vector<SingleTestInfo> &done);
+  bool Append(const SingleTestInfo &test_info);
+  // Write out and fsync all buffered records.
+  bool Sync();
+  void Close();
+
+ private:
+  // Like Read, but also returns how much of the file is header or complete
+  // records.
+  static bool ReadFile(const std::string &path, Header &header,
+      std::vector<SingleTestInfo> &done, long long &valid_len);
+
+  int fd_ = -1;
+  unsigned long long profile_id_ = 0;
+  unsigned int sector_size_ = 0;
+  std::string pending_;
+  unsigned int num_pending_ = 0;
+};
+
+}  // namespace fs_testing
+
+#endif  // RESULTS_PROGRESS_JOURNAL_H
@@ -45,6 +45,7 @@ void SingleTestInfo::PrintResults(ostream& os) const {
   os << "): ";
   permute_data.PrintCrashState(os) << endl;
   os << "\tlast checkpoint: " << permute_data.last_checkpoint << endl;
+  os << "\tcrash state index: " << permute_data.state_index << endl;
   os << "\tfsck result: ";
   fs_test.PrintErrors(os);
   os << endl;
@@ -75,7 +75,18 @@ unsigned int TestSuiteResult::GetCompleted() const {
   return GetTimingCompleted() + GetReorderingCompleted();
 }
 
+void TestSuiteResult::SetName(const string &name) {
+  name_ = name;
+}
+
+const string& TestSuiteResult::GetName() const {
+  return name_;
+}
+
 void TestSuiteResult::PrintResults(ostream& os) const {
+  if (!name_.empty()) {
+    os << "Results for " << name_ << ":" << endl;
+  }
   os << "Reordering tests ran " << GetReorderingCompleted() << " tests with" <<
     "\n\tpassed cleanly: " << reordering_results_.num_passed <<
     "\n\tpassed fixed: " << reordering_results_.num_passed_fixed <<
@@ -1,6 +1,7 @@
 #ifndef HARNESS_TEST_SUITE_RESULT_H
 #define HARNESS_TEST_SUITE_RESULT_H
 
+#include <string>
 #include <vector>
 
 #include <iostream>
@@ -34,8 +35,12 @@ class TestSuiteResult {
   unsigned int GetReorderingCompleted() const;
   unsigned int GetTimingCompleted() const;
   void PrintResults(std::ostream& os) const;
+  // Name of the test the results belong to. Printed before the results if set.
+  void SetName(const std::string &name);
+  const std::string& GetName() const;
 
  private:
+  std::string name_;
   ResultSet reordering_results_;
   ResultSet timing_results_;
 
@@ -0,0 +1,553 @@
+/*
+Runs a j-lang workload (the format ace.py writes to j-lang-files/) without
+compiling it into a test case of its own.
+
+The workload file is named by the J_LANG_FILE environment variable and is parsed
+when the test case is initialized. c_harness sets J_LANG_FILE and loads this
+test case for every test it is given that isn't a .so file.
+
+Each op is run the same way the code cmAdapter.py generates for it runs it, but
+goes through cm_ whenever CmFsOps has a matching call. "checkpoint N" makes a
+checkpoint and, if it is the checkpoint run() was asked to stop at, returns N.
+Failed ops return -errno instead of errno so that EPERM can't be mistaken for
+having reached the last checkpoint.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Header file was changed in 4.15 kernel.
+#ifdef NEW_XATTR_INC
+#include <sys/xattr.h>
+#else
+#include <attr/xattr.h>
+#endif
+
+#include "BaseTestCase.h"
+#include "../user_tools/api/workload.h"
+
+#define J_LANG_FILE_ENV "J_LANG_FILE"
+
+#define TEST_FILE_PERMS  ((mode_t) (S_IRWXU | S_IRWXG | S_IRWXO))
+
+using fs_testing::tests::DataTestResult;
+using fs_testing::user_tools::api::DefaultFsFns;
+using fs_testing::user_tools::api::PassthroughCmFsOps;
+using fs_testing::user_tools::api::WriteData;
+using std::cerr;
+using std::endl;
+using std::ifstream;
+using std::istringstream;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace fs_testing {
+namespace tests {
+
+namespace {
+
+enum OpType {
+  kOpen,
+  kOpendir,
+  kMknod,
+  kMkdir,
+  kClose,
+  kFsync,
+  kFdatasync,
+  kSync,
+  kCheckpoint,
+  kRename,
+  kLink,
+  kSymlink,
+  kRemove,
+  kUnlink,
+  kRmdir,
+  kTruncate,
+  kFalloc,
+  kWrite,
+  kDwrite,
+  kMmapwrite,
+  kFsetxattr,
+  kRemovexattr,
+  kNone,
+};
+
+/*
+ * Arguments each op takes, in order: 'f' is a file defined in the workload and
+ * 'n' is a number, possibly made of flags or'ed together.
+ */
+struct OpSpec {
+  const char *name;
+  OpType type;
+  const char *args;
+};
+
+static const OpSpec kOpSpecs[] = {
+  {"open", kOpen, "fnn"},
+  {"opendir", kOpendir, "fn"},
+  {"mknod", kMknod, "fnn"},
+  {"mkdir", kMkdir, "fn"},
+  {"close", kClose, "f"},
+  {"fsync", kFsync, "f"},
+  {"fdatasync", kFdatasync, "f"},
+  {"sync", kSync, ""},
+  {"checkpoint", kCheckpoint, "n"},
+  {"rename", kRename, "ff"},
+  {"link", kLink, "ff"},
+  {"symlink", kSymlink, "ff"},
+  {"remove", kRemove, "f"},
+  {"unlink", kUnlink, "f"},
+  {"rmdir", kRmdir, "f"},
+  {"truncate", kTruncate, "fn"},
+  {"falloc", kFalloc, "fnnn"},
+  {"write", kWrite, "fnn"},
+  {"dwrite", kDwrite, "fnn"},
+  {"mmapwrite", kMmapwrite, "fnn"},
+  {"fsetxattr", kFsetxattr, "f"},
+  {"removexattr", kRemovexattr, "f"},
+  {"none", kNone, ""},
+};
+
+// Names that can be used in place of numbers in workloads.
+static const map<string, long long> kSymbols = {
+  {"O_RDONLY", O_RDONLY},
+  {"O_WRONLY", O_WRONLY},
+  {"O_RDWR", O_RDWR},
+  {"O_CREAT", O_CREAT},
+  {"O_EXCL", O_EXCL},
+  {"O_TRUNC", O_TRUNC},
+  {"O_APPEND", O_APPEND},
+  {"O_DIRECT", O_DIRECT},
+  {"O_DIRECTORY", O_DIRECTORY},
+  {"O_SYNC", O_SYNC},
+  {"O_DSYNC", O_DSYNC},
+  {"FALLOC_FL_KEEP_SIZE", FALLOC_FL_KEEP_SIZE},
+  {"FALLOC_FL_PUNCH_HOLE", FALLOC_FL_PUNCH_HOLE},
+#ifdef FALLOC_FL_ZERO_RANGE
+  {"FALLOC_FL_ZERO_RANGE", FALLOC_FL_ZERO_RANGE},
+#endif
+#ifdef FALLOC_FL_COLLAPSE_RANGE
+  {"FALLOC_FL_COLLAPSE_RANGE", FALLOC_FL_COLLAPSE_RANGE},
+#endif
+#ifdef FALLOC_FL_INSERT_RANGE
+  {"FALLOC_FL_INSERT_RANGE", FALLOC_FL_INSERT_RANGE},
+#endif
+  {"S_IFREG", S_IFREG},
+  {"S_IFCHR", S_IFCHR},
+  {"S_IFBLK", S_IFBLK},
+  {"S_IFIFO", S_IFIFO},
+  {"S_IFSOCK", S_IFSOCK},
+  {"S_IRWXU", S_IRWXU},
+  {"S_IRWXG", S_IRWXG},
+  {"S_IRWXO", S_IRWXO},
+  {"TEST_FILE_PERMS", TEST_FILE_PERMS},
+};
+
+// Data the generated code fills direct and mmap writes with.
+static constexpr char kDwriteText[] = "ddddddddddklmnopqrstuvwxyz123456";
+static constexpr char kMmapwriteText[] = "mmmmmmmmmmklmnopqrstuvwxyz123456";
+static const unsigned int kTextSize = 32;
+
+static const char kXattrName[] = "user.xattr1";
+static const char kXattrValue[] = "val1 ";
+static const unsigned int kXattrSize = 4;
+
+bool ParseNumber(const string &token, long long &val) {
+  val = 0;
+  istringstream parts(token);
+  string part;
+  bool found = false;
+  while (std::getline(parts, part, '|')) {
+    found = true;
+    const auto symbol = kSymbols.find(part);
+    if (symbol != kSymbols.end()) {
+      val |= symbol->second;
+      continue;
+    }
+    char *end = NULL;
+    const long long num = strtoll(part.c_str(), &end, 0);
+    if (part.empty() || *end != '\0') {
+      return false;
+    }
+    val |= num;
+  }
+  return found;
+}
+
+void FillText(char *buf, const unsigned long long size, const char *text) {
+  for (unsigned long long offset = 0; offset < size; offset += kTextSize) {
+    const unsigned long long to_copy =
+      (size - offset < kTextSize) ? size - offset : kTextSize;
+    memcpy(buf + offset, text, to_copy);
+  }
+}
+
+int Failed() {
+  return (errno != 0) ? -errno : -1;
+}
+
+}  // namespace
+
+
+class JLangInterpreter: public BaseTestCase {
+ public:
+  virtual int init_values(string mount_dir, long filesys_size) override {
+    BaseTestCase::init_values(mount_dir, filesys_size);
+    loaded_ = false;
+    const char *workload = getenv(J_LANG_FILE_ENV);
+    if (workload == NULL) {
+      cerr << J_LANG_FILE_ENV << " does not name a j-lang workload" << endl;
+      return -1;
+    }
+    if (!Load(workload)) {
+      return -1;
+    }
+    loaded_ = true;
+    return 0;
+  }
+
+  virtual int setup() override {
+    if (!loaded_) {
+      return -1;
+    }
+    // Only run() is given cm_ by the harness.
+    DefaultFsFns default_fns;
+    PassthroughCmFsOps pcm(&default_fns);
+    cm_ = &pcm;
+    const int res = RunOps(setup_ops_, 0);
+    cm_ = NULL;
+    return res;
+  }
+
+  virtual int run(int checkpoint) override {
+    if (!loaded_) {
+      return -1;
+    }
+    return RunOps(run_ops_, checkpoint);
+  }
+
+  virtual int check_test(unsigned int last_checkpoint,
+      DataTestResult *test_result) override {
+    return 0;
+  }
+
+ private:
+  struct Op {
+    OpType type;
+    vector<string> files;
+    vector<long long> nums;
+  };
+
+  bool loaded_ = false;
+  // Path of each file the workload defines, keyed by the name ops use for it.
+  map<string, string> paths_;
+  vector<Op> setup_ops_;
+  vector<Op> run_ops_;
+  map<string, int> fds_;
+
+  bool Load(const string &workload) {
+    ifstream in(workload);
+    if (!in.is_open()) {
+      cerr << "Unable to open j-lang workload " << workload << endl;
+      return false;
+    }
+
+    paths_.clear();
+    setup_ops_.clear();
+    run_ops_.clear();
+    string section;
+    string line;
+    unsigned int line_num = 0;
+    while (std::getline(in, line)) {
+      ++line_num;
+      istringstream tokens(line);
+      vector<string> args;
+      string token;
+      while (tokens >> token) {
+        args.push_back(token);
+      }
+      if (args.empty()) {
+        continue;
+      }
+      // Section headers look like "# run".
+      if (args.front() == "#") {
+        section = args.back();
+        continue;
+      }
+
+      if (section == "define") {
+        // Ops name a file by its path with the '/'s taken out. "test" is the
+        // root of the file system.
+        string name;
+        for (const char c : args.front()) {
+          if (c != '/') {
+            name += c;
+          }
+        }
+        paths_[name] = (name == "test") ? mnt_dir_ :
+          mnt_dir_ + "/" + args.front();
+      } else if (section == "setup" || section == "run") {
+        Op op;
+        if (!ParseOp(args, op)) {
+          cerr << workload << ":" << line_num << ": bad op \"" << line <<
+            "\"" << endl;
+          return false;
+        }
+        if (section == "setup" && op.type == kCheckpoint) {
+          cerr << workload << ":" << line_num <<
+            ": checkpoints can't be made during setup" << endl;
+          return false;
+        }
+        ((section == "setup") ? setup_ops_ : run_ops_).push_back(op);
+      }
+      // Variables in the declare section only exist in generated code.
+    }
+    return true;
+  }
+
+  bool ParseOp(const vector<string> &args, Op &op) {
+    const OpSpec *spec = NULL;
+    for (const OpSpec &s : kOpSpecs) {
+      if (args.front() == s.name) {
+        spec = &s;
+        break;
+      }
+    }
+    if (spec == NULL || args.size() - 1 < strlen(spec->args)) {
+      return false;
+    }
+
+    op.type = spec->type;
+    for (unsigned int i = 0; spec->args[i] != '\0'; ++i) {
+      const string &arg = args.at(i + 1);
+      if (spec->args[i] == 'f') {
+        if (paths_.find(arg) == paths_.end()) {
+          return false;
+        }
+        op.files.push_back(arg);
+      } else {
+        long long num;
+        if (!ParseNumber(arg, num)) {
+          return false;
+        }
+        op.nums.push_back(num);
+      }
+    }
+    return true;
+  }
+
+  int Fd(const string &file) {
+    const auto fd = fds_.find(file);
+    return (fd == fds_.end()) ? -1 : fd->second;
+  }
+
+  int RunOps(const vector<Op> &ops, const int checkpoint) {
+    fds_.clear();
+    int local_checkpoint = 0;
+    for (const Op &op : ops) {
+      errno = 0;
+      const string path =
+        (op.files.empty()) ? string() : paths_.at(op.files.front());
+      const int fd = (op.files.empty()) ? -1 : Fd(op.files.front());
+      switch (op.type) {
+        case kOpen:
+        case kOpendir: {
+          const int flags =
+            (op.type == kOpendir) ? O_DIRECTORY : op.nums.at(0);
+          const int new_fd = cm_->CmOpen(path, flags, op.nums.back());
+          if (new_fd < 0) {
+            return Failed();
+          }
+          fds_[op.files.front()] = new_fd;
+          break;
+        }
+        case kMknod:
+          if (cm_->CmMknod(path, op.nums.at(0), op.nums.at(1)) < 0) {
+            return Failed();
+          }
+          break;
+        case kMkdir:
+          if (cm_->CmMkdir(path, op.nums.at(0)) < 0) {
+            return Failed();
+          }
+          break;
+        case kClose:
+          if (cm_->CmClose(fd) < 0) {
+            return Failed();
+          }
+          break;
+        case kFsync:
+          if (cm_->CmFsync(fd) < 0) {
+            return Failed();
+          }
+          break;
+        case kFdatasync:
+          if (cm_->CmFdatasync(fd) < 0) {
+            return Failed();
+          }
+          break;
+        case kSync:
+          cm_->CmSync();
+          break;
+        case kCheckpoint:
+          if (cm_->CmCheckpoint() < 0) {
+            return -1;
+          }
+          local_checkpoint += 1;
+          if (local_checkpoint == checkpoint) {
+            return op.nums.at(0);
+          }
+          break;
+        case kRename:
+          if (cm_->CmRename(path, paths_.at(op.files.at(1))) < 0) {
+            return Failed();
+          }
+          break;
+        case kLink:
+          if (link(path.c_str(), paths_.at(op.files.at(1)).c_str()) < 0) {
+            return Failed();
+          }
+          break;
+        case kSymlink:
+          if (symlink(path.c_str(), paths_.at(op.files.at(1)).c_str()) < 0) {
+            return Failed();
+          }
+          break;
+        case kRemove:
+          if (cm_->CmRemove(path) < 0) {
+            return Failed();
+          }
+          break;
+        case kUnlink:
+          if (cm_->CmUnlink(path) < 0) {
+            return Failed();
+          }
+          break;
+        case kRmdir:
+          if (rmdir(path.c_str()) < 0) {
+            return Failed();
+          }
+          break;
+        case kTruncate:
+          if (truncate(path.c_str(), op.nums.at(0)) < 0) {
+            return Failed();
+          }
+          break;
+        case kFalloc:
+          if (cm_->CmFallocate(fd, op.nums.at(0), op.nums.at(1),
+                op.nums.at(2)) < 0) {
+            return Failed();
+          }
+          break;
+        case kWrite:
+          if (WriteData(fd, op.nums.at(0), op.nums.at(1)) < 0) {
+            return Failed();
+          }
+          break;
+        case kDwrite: {
+          const int res = DirectWrite(op.files.front(), path, op.nums.at(0),
+              op.nums.at(1));
+          if (res < 0) {
+            return res;
+          }
+          break;
+        }
+        case kMmapwrite: {
+          const int res = MmapWrite(fd, op.nums.at(0), op.nums.at(1));
+          if (res < 0) {
+            return res;
+          }
+          break;
+        }
+        case kFsetxattr:
+          if (fsetxattr(fd, kXattrName, kXattrValue, kXattrSize, 0) < 0) {
+            return Failed();
+          }
+          break;
+        case kRemovexattr:
+          if (removexattr(path.c_str(), kXattrName) < 0) {
+            return Failed();
+          }
+          break;
+        case kNone:
+          break;
+      }
+    }
+    return 0;
+  }
+
+  /*
+   * Reopen the file with O_DIRECT and O_SYNC, write to it, and close it again,
+   * like the generated code does.
+   */
+  int DirectWrite(const string &file, const string &path,
+      const unsigned long long offset, const unsigned long long size) {
+    cm_->CmClose(Fd(file));
+    const int fd = cm_->CmOpen(path, O_RDWR | O_DIRECT | O_SYNC, 0777);
+    fds_[file] = fd;
+    if (fd < 0) {
+      return Failed();
+    }
+
+    void *data;
+    if (posix_memalign(&data, 4096, size) != 0) {
+      cm_->CmClose(fd);
+      return -1;
+    }
+    FillText((char *) data, size, kDwriteText);
+    const ssize_t res = cm_->CmPwrite(fd, data, size, offset);
+    free(data);
+    if (res < 0) {
+      const int err = Failed();
+      cm_->CmClose(fd);
+      return err;
+    }
+    cm_->CmClose(fd);
+    return 0;
+  }
+
+  int MmapWrite(const int fd, const unsigned long long offset,
+      const unsigned long long size) {
+    if (cm_->CmFallocate(fd, 0, offset, size) < 0) {
+      return Failed();
+    }
+    char *filep = (char *) cm_->CmMmap(NULL, offset + size,
+        PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    if (filep == MAP_FAILED) {
+      return -1;
+    }
+    FillText(filep + offset, size, kMmapwriteText);
+    if (cm_->CmMsync(filep + offset, size, MS_SYNC) < 0) {
+      cm_->CmMunmap(filep, offset + size);
+      return -1;
+    }
+    cm_->CmMunmap(filep, offset + size);
+    return 0;
+  }
+};
+
+}  // namespace tests
+}  // namespace fs_testing
+
+extern "C" fs_testing::tests::BaseTestCase *test_case_get_instance() {
+  return new fs_testing::tests::JLangInterpreter;
+}
+
+extern "C" void test_case_delete_instance(fs_testing::tests::BaseTestCase *tc) {
+  delete tc;
+}
@@ -0,0 +1,189 @@
+/*
+Writes that land more than 4GiB into the test device.
+
+1. (setup) Preallocate 4GiB for file foo and persist it
+2. Write 16K to foo at offset 4G + 64K, past the preallocated range
+3. fsync(foo) -> checkpoint 1
+4. Write 16K to foo at offset 4G - 16K, the tail of the preallocated range
+5. fsync(foo) -> checkpoint 2
+
+Both writes should end up more than 4GiB into the device, so recording,
+permuting, and replaying them exercises 64-bit device offsets. The device must
+be large enough to hold the preallocated range, so run this with something like
+`-e 6291456` (6GiB).
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <cstring>
+#include <errno.h>
+
+#include "BaseTestCase.h"
+#include "../user_tools/api/actions.h"
+
+#define TEST_FILE_FOO "foo"
+#define TEST_MNT "/mnt/snapshot"
+
+#define TEST_FILE_PERMS  ((mode_t) (S_IRWXU | S_IRWXG | S_IRWXO))
+
+using fs_testing::tests::DataTestResult;
+using fs_testing::user_tools::api::Checkpoint;
+using std::string;
+
+namespace fs_testing {
+namespace tests {
+
+namespace {
+
+static const unsigned long long kPreallocSize = 4ULL * 1024 * 1024 * 1024;
+static const unsigned int kWriteSize = 16 * 1024;
+static const unsigned long long kOffsets[] = {
+  kPreallocSize + 64 * 1024,
+  kPreallocSize - kWriteSize,
+};
+
+// Each write gets its own fill byte so a write that lands in the wrong place
+// is caught.
+char FillByte(unsigned int write_num) {
+  return 'a' + write_num;
+}
+
+}  // namespace
+
+
+class LargeOffset: public BaseTestCase {
+ public:
+  virtual int setup() override {
+    const int fd_foo = open(foo_path.c_str(), O_RDWR | O_CREAT,
+        TEST_FILE_PERMS);
+    if (fd_foo < 0) {
+      return -1;
+    }
+
+    if (fallocate(fd_foo, 0, 0, kPreallocSize) < 0) {
+      close(fd_foo);
+      return -2;
+    }
+
+    if (fsync(fd_foo) < 0) {
+      close(fd_foo);
+      return -3;
+    }
+
+    sync();
+    close(fd_foo);
+    return 0;
+  }
+
+  virtual int run(int checkpoint) override {
+    int local_checkpoint = 0;
+
+    const int fd_foo = open(foo_path.c_str(), O_RDWR);
+    if (fd_foo < 0) {
+      return -1;
+    }
+
+    char buf[kWriteSize];
+    for (unsigned int i = 0; i < sizeof(kOffsets) / sizeof(kOffsets[0]); ++i) {
+      memset(buf, FillByte(i), kWriteSize);
+      unsigned int written = 0;
+      while (written < kWriteSize) {
+        const int res = pwrite(fd_foo, buf + written, kWriteSize - written,
+            kOffsets[i] + written);
+        if (res < 0) {
+          close(fd_foo);
+          return -2;
+        }
+        written += res;
+      }
+
+      if (fsync(fd_foo) < 0) {
+        close(fd_foo);
+        return -3;
+      }
+
+      if (Checkpoint() < 0) {
+        close(fd_foo);
+        return -4;
+      }
+      local_checkpoint += 1;
+      if (local_checkpoint == checkpoint) {
+        close(fd_foo);
+        return 1;
+      }
+    }
+
+    close(fd_foo);
+    return 0;
+  }
+
+  virtual int check_test(unsigned int last_checkpoint,
+      DataTestResult *test_result) override {
+    struct stat stats;
+    if (stat(foo_path.c_str(), &stats) < 0) {
+      test_result->SetError(DataTestResult::kFileMissing);
+      test_result->error_description = " : Missing file " + foo_path;
+      return 0;
+    }
+
+    // The first write extends the file.
+    const unsigned long long expected_size = kOffsets[0] + kWriteSize;
+    if (last_checkpoint >= 1 &&
+        (unsigned long long) stats.st_size < expected_size) {
+      test_result->SetError(DataTestResult::kFileMetadataCorrupted);
+      test_result->error_description = " : Expected file of size " +
+        std::to_string(expected_size) + " but found " +
+        std::to_string(stats.st_size);
+      return 0;
+    }
+
+    const int fd_foo = open(foo_path.c_str(), O_RDONLY);
+    if (fd_foo < 0) {
+      test_result->SetError(DataTestResult::kOther);
+      test_result->error_description = " : Unable to open " + foo_path;
+      return 0;
+    }
+
+    char buf[kWriteSize];
+    for (unsigned int i = 0; i < last_checkpoint &&
+        i < sizeof(kOffsets) / sizeof(kOffsets[0]); ++i) {
+      if (pread(fd_foo, buf, kWriteSize, kOffsets[i]) !=
+          (ssize_t) kWriteSize) {
+        test_result->SetError(DataTestResult::kFileDataCorrupted);
+        test_result->error_description = " : Short read at offset " +
+          std::to_string(kOffsets[i]);
+        close(fd_foo);
+        return 0;
+      }
+      for (unsigned int j = 0; j < kWriteSize; ++j) {
+        if (buf[j] != FillByte(i)) {
+          test_result->SetError(DataTestResult::kFileDataCorrupted);
+          test_result->error_description = " : Wrong data at offset " +
+            std::to_string(kOffsets[i] + j);
+          close(fd_foo);
+          return 0;
+        }
+      }
+    }
+
+    close(fd_foo);
+    return 0;
+  }
+
+ private:
+  const string foo_path = TEST_MNT "/" TEST_FILE_FOO;
+};
+
+}  // namespace tests
+}  // namespace fs_testing
+
+extern "C" fs_testing::tests::BaseTestCase *test_case_get_instance() {
+  return new fs_testing::tests::LargeOffset;
+}
+
+extern "C" void test_case_delete_instance(fs_testing::tests::BaseTestCase *tc) {
+  delete tc;
+}
@@ -7,11 +7,11 @@ namespace api {
 
 // Write size bytes of known data at offset in the file specified by fd. Returns
 // 0 on success and -1 on error.
-int WriteData(int fd, unsigned int offset, unsigned int size);
+int WriteData(int fd, unsigned long long offset, unsigned int size);
 
 // Use mmap and msync to write size bytes of known data at offset in the file
 // specified by fd. Returns 0 on success and -1 on error.
-int WriteDataMmap(int fd, unsigned int offset, unsigned int size);
+int WriteDataMmap(int fd, unsigned long long offset, unsigned int size);
 
 } // fs_testing
 } // user_tools
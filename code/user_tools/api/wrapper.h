@@ -8,10 +8,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "../../utils/DiskMod.h"
@@ -137,6 +141,12 @@ class CmFsOps {
 /*
  * Provides an interface that will record all the changes the user makes to the
  * file system.
+ *
+ * Operations may be called from several threads at once. Each thread records
+ * into its own buffer and every mod is tagged with a sequence number taken
+ * when the operation finishes, so operations that race with each other are
+ * ordered by when they returned. Serialize merges the buffers back into one
+ * total order and should only be called once the threads are done.
  */
 class RecordCmFsOps : public CmFsOps {
  public:
@@ -176,14 +186,56 @@ class RecordCmFsOps : public CmFsOps {
 
   // Protected for testing purposes.
  protected:
+  /*
+   * Map from file descriptor to pathname, split into shards that each have
+   * their own lock so threads working on different files rarely contend.
+   */
+  class FdMap {
+   public:
+    // Does nothing if fd is already mapped.
+    void Insert(const int fd, const std::string &pathname);
+    // Throws std::out_of_range if fd isn't mapped.
+    std::string At(const int fd);
+    // Returns an empty string if fd isn't mapped.
+    std::string Get(const int fd);
+    void Erase(const int fd);
+    // Point every fd open on old_path, or on a file below it, at new_path.
+    void Rename(const std::string &old_path, const std::string &new_path);
+    std::unordered_map<int, std::string> Snapshot();
+
+   private:
+    static const unsigned int kNumShards = 16;
+
+    struct Shard {
+      std::mutex lock;
+      std::unordered_map<int, std::string> fds;
+    };
+
+    Shard &ShardFor(const int fd);
+
+    Shard shards_[kNumShards];
+  };
+
+  // Mods recorded by one thread along with their sequence numbers.
+  struct ModBuffer {
+    std::mutex lock;
+    std::vector<std::pair<unsigned long long, fs_testing::utils::DiskMod>>
+      mods;
+  };
+
+  // Tag mod with the next sequence number and add it to this thread's buffer.
+  void RecordMod(fs_testing::utils::DiskMod &mod);
+  // Every mod recorded so far, in sequence number order.
+  std::vector<fs_testing::utils::DiskMod> CollectMods();
+
   // So that things that require fd can be mapped to pathnames.
-  std::unordered_map<int, std::string> fd_map_;
+  FdMap fd_map_;
 
   // So that mmap pointers can be mapped to pathnames and mmap offset and
-  // length.
+  // length. Guarded by mmap_lock_.
+  std::mutex mmap_lock_;
   std::unordered_map<long long,
     std::tuple<std::string, unsigned long long, unsigned long long>> mmap_map_;
-  std::vector<fs_testing::utils::DiskMod> mods_;
 
   // Set of functions to call for different file system operations. Tracked as a
   // set of function pointers so that this class can be tested in a somewhat
@@ -203,6 +255,19 @@ class RecordCmFsOps : public CmFsOps {
    */
   int WriteWhole(const int fd, const unsigned long long size,
       std::shared_ptr<char> data);
+
+  // Buffer the calling thread records into, made on its first mod.
+  ModBuffer *GetModBuffer();
+
+  // Tells this recorder apart from others in the per-thread buffer cache.
+  const unsigned long long id_;
+  std::atomic<unsigned long long> next_seq_;
+
+  // Guards buffers_ and thread_buffers_, which only change when a thread
+  // records its first mod.
+  std::mutex buffers_lock_;
+  std::vector<std::unique_ptr<ModBuffer>> buffers_;
+  std::unordered_map<std::thread::id, ModBuffer *> thread_buffers_;
 };
 
 /*
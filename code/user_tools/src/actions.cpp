@@ -1,19 +1,133 @@
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
 #include "../api/actions.h"
 
-#include "../../utils/communication/ClientCommandSender.h"
+#include "../../utils/communication/ClientSocket.h"
+#include "../../utils/communication/SocketUtils.h"
 
 namespace fs_testing {
 namespace user_tools {
 namespace api {
 
-using fs_testing::utils::communication::ClientCommandSender;
+using fs_testing::utils::communication::ClientSocket;
+using fs_testing::utils::communication::kCheckpointDoorbellEnv;
+using fs_testing::utils::communication::kDoorbellCheckpointDone;
 using fs_testing::utils::communication::kSocketNameOutbound;
+using fs_testing::utils::communication::kSocketPathEnv;
+using fs_testing::utils::communication::SocketError;
 using fs_testing::utils::communication::SocketMessage;
+using std::lock_guard;
+using std::mutex;
+
+namespace {
+
+// Checkpoints may be taken from several threads of a workload, but only one
+// request is in flight at a time.
+mutex checkpoint_lock;
+
+// Doorbell the harness gave this process, if any. Looked up on the first
+// checkpoint and ignored in any children the process forks.
+bool doorbell_checked = false;
+int doorbell_request_fd = -1;
+int doorbell_reply_fd = -1;
+pid_t doorbell_pid = -1;
+
+// Connection to the harness that is kept open across checkpoints. Tagged with
+// the pid that opened it so a forked child doesn't share its parent's
+// connection.
+ClientSocket *session = NULL;
+pid_t session_pid = -1;
+int next_request_id = 1;
+
+void FindDoorbell() {
+  doorbell_checked = true;
+  const char *doorbell = getenv(kCheckpointDoorbellEnv);
+  int request_fd;
+  int reply_fd;
+  int pid;
+  if (doorbell == NULL ||
+      sscanf(doorbell, "%d,%d,%d", &request_fd, &reply_fd, &pid) != 3 ||
+      pid != getpid()) {
+    return;
+  }
+  doorbell_request_fd = request_fd;
+  doorbell_reply_fd = reply_fd;
+  doorbell_pid = pid;
+}
+
+// Returns -1 if the doorbell can't be used so the caller can fall back to the
+// socket.
+int RingDoorbell() {
+  uint64_t val = 1;
+  if (write(doorbell_request_fd, &val, sizeof(val)) != sizeof(val)) {
+    doorbell_request_fd = -1;
+    return -1;
+  }
+  if (read(doorbell_reply_fd, &val, sizeof(val)) != sizeof(val)) {
+    return -2;
+  }
+  return !(val == kDoorbellCheckpointDone);
+}
+
+int OpenSession() {
+  delete session;
+  const char *socket_path = getenv(kSocketPathEnv);
+  session = new ClientSocket((socket_path == NULL) ?
+      kSocketNameOutbound : socket_path);
+  session_pid = getpid();
+  return session->Init();
+}
+
+int SendCheckpoint() {
+  if (session == NULL || session_pid != getpid()) {
+    if (OpenSession() < 0) {
+      return -1;
+    }
+  }
+
+  SocketMessage m;
+  m.type = SocketMessage::kCheckpoint;
+  m.size = 0;
+  m.int_value = next_request_id++;
+  if (session->SendMessage(m) != SocketError::kNone) {
+    // The harness may have closed the connection after the last request (it
+    // does in background mode), so try once more on a new connection.
+    if (OpenSession() < 0 || session->SendMessage(m) != SocketError::kNone) {
+      return -2;
+    }
+  }
+
+  SocketMessage ret;
+  if (session->WaitForMessage(&ret) != SocketError::kNone) {
+    session->CloseClient();
+    return -3;
+  }
+  if (ret.int_value != m.int_value) {
+    session->CloseClient();
+    return -3;
+  }
+  return !(ret.type == SocketMessage::kCheckpointDone);
+}
+
+}  // namespace
 
 int Checkpoint() {
-  ClientCommandSender c(kSocketNameOutbound, SocketMessage::kCheckpoint,
-      SocketMessage::kCheckpointDone);
-  return c.Run();
+  lock_guard<mutex> lock(checkpoint_lock);
+  if (!doorbell_checked) {
+    FindDoorbell();
+  }
+  if (doorbell_request_fd >= 0 && doorbell_pid == getpid()) {
+    const int res = RingDoorbell();
+    if (res != -1) {
+      return res;
+    }
+  }
+  return SendCheckpoint();
 }
 
 } // fs_testing
@@ -40,10 +40,10 @@ static constexpr char kTestDataBlock[kTestDataSize + 1] =
 
 }  // namespace
 
-int WriteData(int fd, unsigned int offset, unsigned int size) {
+int WriteData(int fd, unsigned long long offset, unsigned int size) {
   // Offset into a data block to start working at.
-  const unsigned int rounded_offset =
-    (offset + (kTestDataSize - 1)) & (~(kTestDataSize - 1));
+  const unsigned long long rounded_offset =
+    (offset + (kTestDataSize - 1)) & (~((unsigned long long) kTestDataSize - 1));
   // Round down size to 4k for number of full pages to write.
   
   const unsigned int aligned_size = (size >= kTestDataSize) ?
@@ -111,7 +111,7 @@ int WriteData(int fd, unsigned int offset, unsigned int size) {
   return 0;
 }
 
-int WriteDataMmap(int fd, unsigned int offset, unsigned int size) {
+int WriteDataMmap(int fd, unsigned long long offset, unsigned int size) {
   const unsigned int map_size = size + (offset & ((1 << 12) - 1));
   char *filep = (char *) mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_SHARED,
       fd, offset & ~((1 << 12) - 1));
@@ -121,7 +121,8 @@ int WriteDataMmap(int fd, unsigned int offset, unsigned int size) {
 
   // Offset into a data block to start working at.
   const unsigned int rounded_offset_diff =
-    ((offset + (kTestDataSize - 1)) & (~(kTestDataSize - 1))) - offset;
+    ((offset + (kTestDataSize - 1)) &
+     (~((unsigned long long) kTestDataSize - 1))) - offset;
 
   // The start of the write range is not aligned with our data blocks.
   // Therefore, we should write out part of a data block for this segment,
@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <stdexcept>
 #include <utility>
 
 
@@ -19,10 +21,14 @@ namespace fs_testing {
 namespace user_tools {
 namespace api {
 
+using std::atomic;
+using std::lock_guard;
+using std::mutex;
 using std::pair;
 using std::shared_ptr;
 using std::string;
 using std::tuple;
+using std::unique_ptr;
 using std::unordered_map;
 using std::vector;
 
@@ -132,10 +138,130 @@ int DefaultFsFns::CmCheckpoint() {
 }
 
 
-RecordCmFsOps::RecordCmFsOps(FsFns *functions) {
+namespace {
+
+// Hands out the ids RecordCmFsOps instances use to find their buffer in the
+// per-thread cache below.
+atomic<unsigned long long> next_recorder_id(1);
+
+// Last buffer the thread recorded into and the id of the recorder it belongs
+// to, so most mods skip the lookup in thread_buffers_.
+thread_local unsigned long long cached_recorder_id = 0;
+thread_local void *cached_buffer = NULL;
+
+}  // namespace
+
+void RecordCmFsOps::FdMap::Insert(const int fd, const string &pathname) {
+  Shard &shard = ShardFor(fd);
+  lock_guard<mutex> lock(shard.lock);
+  shard.fds.insert({fd, pathname});
+}
+
+string RecordCmFsOps::FdMap::At(const int fd) {
+  Shard &shard = ShardFor(fd);
+  lock_guard<mutex> lock(shard.lock);
+  return shard.fds.at(fd);
+}
+
+string RecordCmFsOps::FdMap::Get(const int fd) {
+  Shard &shard = ShardFor(fd);
+  lock_guard<mutex> lock(shard.lock);
+  const auto it = shard.fds.find(fd);
+  return (it == shard.fds.end()) ? string() : it->second;
+}
+
+void RecordCmFsOps::FdMap::Erase(const int fd) {
+  Shard &shard = ShardFor(fd);
+  lock_guard<mutex> lock(shard.lock);
+  shard.fds.erase(fd);
+}
+
+void RecordCmFsOps::FdMap::Rename(const string &old_path,
+    const string &new_path) {
+  for (Shard &shard : shards_) {
+    lock_guard<mutex> lock(shard.lock);
+    for (auto it = shard.fds.begin(); it != shard.fds.end(); it++) {
+      string& open_fd_old_path = it->second;
+      if (open_fd_old_path.compare(old_path) == 0) {
+        open_fd_old_path = new_path;
+        continue;
+      }
+      // if we are renaming a directory that is open; we want to
+      // change the mapping of the open files in that directory
+      auto found = open_fd_old_path.find(old_path);
+      if ( found != std::string::npos) {
+        open_fd_old_path.replace(found, old_path.length(), new_path);
+      }
+    }
+  }
+}
+
+unordered_map<int, string> RecordCmFsOps::FdMap::Snapshot() {
+  unordered_map<int, string> res;
+  for (Shard &shard : shards_) {
+    lock_guard<mutex> lock(shard.lock);
+    res.insert(shard.fds.begin(), shard.fds.end());
+  }
+  return res;
+}
+
+RecordCmFsOps::FdMap::Shard &RecordCmFsOps::FdMap::ShardFor(const int fd) {
+  return shards_[(unsigned int) fd % kNumShards];
+}
+
+RecordCmFsOps::RecordCmFsOps(FsFns *functions) :
+    id_(next_recorder_id.fetch_add(1)), next_seq_(0) {
   fns_ = functions;
 }
 
+RecordCmFsOps::ModBuffer *RecordCmFsOps::GetModBuffer() {
+  if (cached_recorder_id == id_) {
+    return (ModBuffer *) cached_buffer;
+  }
+
+  lock_guard<mutex> lock(buffers_lock_);
+  ModBuffer *&buffer = thread_buffers_[std::this_thread::get_id()];
+  if (buffer == NULL) {
+    buffers_.emplace_back(new ModBuffer);
+    buffer = buffers_.back().get();
+  }
+  cached_recorder_id = id_;
+  cached_buffer = buffer;
+  return buffer;
+}
+
+void RecordCmFsOps::RecordMod(DiskMod &mod) {
+  ModBuffer *buffer = GetModBuffer();
+  const unsigned long long seq = next_seq_.fetch_add(1);
+  lock_guard<mutex> lock(buffer->lock);
+  buffer->mods.emplace_back(seq, std::move(mod));
+}
+
+vector<DiskMod> RecordCmFsOps::CollectMods() {
+  vector<pair<unsigned long long, DiskMod>> tagged;
+  {
+    lock_guard<mutex> lock(buffers_lock_);
+    for (const unique_ptr<ModBuffer> &buffer : buffers_) {
+      lock_guard<mutex> buffer_lock(buffer->lock);
+      tagged.insert(tagged.end(), buffer->mods.begin(), buffer->mods.end());
+    }
+  }
+
+  // Each buffer is already in order, so this only interleaves them.
+  std::stable_sort(tagged.begin(), tagged.end(),
+      [](const pair<unsigned long long, DiskMod> &a,
+        const pair<unsigned long long, DiskMod> &b) {
+        return a.first < b.first;
+      });
+
+  vector<DiskMod> res;
+  res.reserve(tagged.size());
+  for (pair<unsigned long long, DiskMod> &mod : tagged) {
+    res.push_back(std::move(mod.second));
+  }
+  return res;
+}
+
 int RecordCmFsOps::CmMknod(const string &pathname, const mode_t mode,
     const dev_t dev) {
   return fns_->FnMknod(pathname.c_str(), mode, dev);
@@ -153,14 +279,14 @@ int RecordCmFsOps::CmMkdir(const string &pathname, const mode_t mode) {
   mod.mod_type = DiskMod::kCreateMod;
   mod.mod_opts = DiskMod::kNoneOpt;
 
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return res;
 }
 
 void RecordCmFsOps::CmOpenCommon(const int fd, const string &pathname,
     const bool exists, const int flags) {
-  fd_map_.insert({fd, pathname});
+  fd_map_.Insert(fd, pathname);
 
   if (!exists || (flags & O_TRUNC)) {
     // We only want to record this op if we changed something on the file
@@ -189,7 +315,7 @@ void RecordCmFsOps::CmOpenCommon(const int fd, const string &pathname,
 
     mod.path = pathname;
 
-    mods_.push_back(mod);
+    RecordMod(mod);
   }
 }
 
@@ -233,9 +359,10 @@ int RecordCmFsOps::CmWrite(const int fd, const void *buf, const size_t count) {
   // Get current file position and size. If stat fails, then assume lseek will
   // fail too and just bail out.
   struct stat pre_stat_buf;
+  const string path = fd_map_.At(fd);
   // This could be an fstat(), but I don't see a reason to add another call that
   // does only reads to the already large interface of FsFns.
-  int res = fns_->FnStat(fd_map_.at(fd), &pre_stat_buf);
+  int res = fns_->FnStat(path, &pre_stat_buf);
   if (res < 0) {
     return res;
   }
@@ -257,9 +384,9 @@ int RecordCmFsOps::CmWrite(const int fd, const void *buf, const size_t count) {
     // Copy over as much data as was written and see what the new file size is.
     // This will determine how we set the type of the DiskMod.
     mod.file_mod_len = write_res;
-    mod.path = fd_map_.at(fd);
+    mod.path = path;
 
-    res = fns_->FnStat(fd_map_.at(fd), &mod.post_mod_stats);
+    res = fns_->FnStat(path, &mod.post_mod_stats);
     if (res < 0) {
       return write_res;
     }
@@ -276,7 +403,7 @@ int RecordCmFsOps::CmWrite(const int fd, const void *buf, const size_t count) {
     }
   }
 
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return write_res;
 }
@@ -288,9 +415,10 @@ ssize_t RecordCmFsOps::CmPwrite(const int fd, const void *buf,
   // Get current file position and size. If stat fails, then assume lseek will
   // fail too and just bail out.
   struct stat pre_stat_buf;
+  const string path = fd_map_.At(fd);
   // This could be an fstat(), but I don't see a reason to add another call that
   // does only reads to the already large interface of FsFns.
-  int res = fns_->FnStat(fd_map_.at(fd), &pre_stat_buf);
+  int res = fns_->FnStat(path, &pre_stat_buf);
   if (res < 0) {
     return res;
   }
@@ -308,9 +436,9 @@ ssize_t RecordCmFsOps::CmPwrite(const int fd, const void *buf,
     // This will determine how we set the type of the DiskMod.
     mod.file_mod_location = offset;
     mod.file_mod_len = write_res;
-    mod.path = fd_map_.at(fd);
+    mod.path = path;
 
-    res = fns_->FnStat(fd_map_.at(fd), &mod.post_mod_stats);
+    res = fns_->FnStat(path, &mod.post_mod_stats);
     if (res < 0) {
       return write_res;
     }
@@ -327,7 +455,7 @@ ssize_t RecordCmFsOps::CmPwrite(const int fd, const void *buf,
     }
   }
 
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return write_res;
   return fns_->FnPwrite(fd, buf, count, offset);
@@ -350,9 +478,11 @@ void * RecordCmFsOps::CmMmap(void *addr, const size_t length, const int prot,
 
   // All other cases we actually need to keep track of the fact that we mmap-ed
   // this region.
+  const string path = fd_map_.At(fd);
+  lock_guard<mutex> lock(mmap_lock_);
   mmap_map_.insert({(long long) res,
-      tuple<string, unsigned int, unsigned int>(
-          fd_map_.at(fd), offset, length)});
+      tuple<string, unsigned long long, unsigned long long>(path, offset,
+        length)});
   return res;
 }
 
@@ -364,32 +494,43 @@ int RecordCmFsOps::CmMsync(void *addr, const size_t length, const int flags) {
 
   // Check which file this belongs to. We need to do a search because they may
   // not have passed the address that was returned in mmap.
-  for (const pair<long long, tuple<string, unsigned int, unsigned int>> &kv :
-      mmap_map_) {
-    if (addr >= (void*) kv.first &&
-        addr < (void*) (kv.first + std::get<2>(kv.second))) {
-      // This is the mapping you're looking for.
-      DiskMod mod;
-      mod.mod_type = DiskMod::kDataMod;
-      mod.mod_opts = (flags & MS_ASYNC) ?
-        DiskMod::kMsAsyncOpt : DiskMod::kMsSyncOpt;
-      mod.path = std::get<0>(kv.second);
-      // Offset into the file is the offset given in mmap plus the how far addr
-      // is from the pointer returned by mmap.
-      mod.file_mod_location =
-        std::get<1>(kv.second) + ((long long) addr - kv.first);
-      mod.file_mod_len = length;
-
-      // Copy over the data that is being sync-ed. We don't know how it is
-      // different than what was there to start with, but we'll have it!
-      mod.file_mod_data.reset(new char[length], [](char* c) {delete[] c;});
-      memcpy(mod.file_mod_data.get(), addr, length);
-
-      mods_.push_back(mod);
-      break;
+  bool found = false;
+  long long mmap_addr;
+  tuple<string, unsigned long long, unsigned long long> mmap_info;
+  {
+    lock_guard<mutex> lock(mmap_lock_);
+    for (const auto &kv : mmap_map_) {
+      if (addr >= (void*) kv.first &&
+          addr < (void*) (kv.first + std::get<2>(kv.second))) {
+        // This is the mapping you're looking for.
+        found = true;
+        mmap_addr = kv.first;
+        mmap_info = kv.second;
+        break;
+      }
     }
   }
 
+  if (found) {
+    DiskMod mod;
+    mod.mod_type = DiskMod::kDataMod;
+    mod.mod_opts = (flags & MS_ASYNC) ?
+      DiskMod::kMsAsyncOpt : DiskMod::kMsSyncOpt;
+    mod.path = std::get<0>(mmap_info);
+    // Offset into the file is the offset given in mmap plus the how far addr
+    // is from the pointer returned by mmap.
+    mod.file_mod_location =
+      std::get<1>(mmap_info) + ((long long) addr - mmap_addr);
+    mod.file_mod_len = length;
+
+    // Copy over the data that is being sync-ed. We don't know how it is
+    // different than what was there to start with, but we'll have it!
+    mod.file_mod_data.reset(new char[length], [](char* c) {delete[] c;});
+    memcpy(mod.file_mod_data.get(), addr, length);
+
+    RecordMod(mod);
+  }
+
   return res;
 }
 
@@ -403,6 +544,7 @@ int RecordCmFsOps::CmMunmap(void *addr, const size_t length) {
   // length that we mmap-ed with. May not actually remove anything if the
   // mapping was not something that caused writes to be reflected in the
   // underlying file (i.e. the key wasn't present to begin with).
+  lock_guard<mutex> lock(mmap_lock_);
   mmap_map_.erase((long long int) addr);
 
   return res;
@@ -410,8 +552,9 @@ int RecordCmFsOps::CmMunmap(void *addr, const size_t length) {
 
 int RecordCmFsOps::CmFallocate(const int fd, const int mode, const off_t offset,
     off_t len) {
+  const string path = fd_map_.Get(fd);
   struct stat pre_stat;
-  const int pre_stat_res = fns_->FnStat(fd_map_[fd].c_str(), &pre_stat);
+  const int pre_stat_res = fns_->FnStat(path.c_str(), &pre_stat);
   if (pre_stat_res < 0) {
     return pre_stat_res;
   }
@@ -422,7 +565,7 @@ int RecordCmFsOps::CmFallocate(const int fd, const int mode, const off_t offset,
   }
 
   struct stat post_stat;
-  const int post_stat_res = fns_->FnStat(fd_map_[fd].c_str(), &post_stat);
+  const int post_stat_res = fns_->FnStat(path.c_str(), &post_stat);
   if (post_stat_res < 0) {
     return post_stat_res;
   }
@@ -436,7 +579,7 @@ int RecordCmFsOps::CmFallocate(const int fd, const int mode, const off_t offset,
     mod.mod_type = DiskMod::kDataMod;
   }
 
-  mod.path = fd_map_[fd];
+  mod.path = path;
   mod.file_mod_location = offset;
   mod.file_mod_len = len;
 
@@ -465,7 +608,7 @@ int RecordCmFsOps::CmFallocate(const int fd, const int mode, const off_t offset,
     mod.mod_opts = DiskMod::kFallocateOpt;
   }
 
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return res;
 }
@@ -477,7 +620,7 @@ int RecordCmFsOps::CmClose(const int fd) {
     return res;
   }
 
-  fd_map_.erase(fd);
+  fd_map_.Erase(fd);
 
   return res;
 }
@@ -485,19 +628,7 @@ int RecordCmFsOps::CmClose(const int fd) {
 int RecordCmFsOps::CmRename(const string &old_path, const string &new_path) {
   // check if there are any open files with the old path
   // change the file descriptors to point to the new path
-  for (auto it = fd_map_.begin(); it != fd_map_.end(); it++) {
-    string& open_fd_old_path = it->second;
-    if (open_fd_old_path.compare(old_path) == 0) {
-      fd_map_[it->first] = new_path;
-      continue;
-    }
-    // if we are renaming a directory that is open; we want to
-    // change the mapping of the open files in that directory
-    auto found = open_fd_old_path.find(old_path);
-    if ( found != std::string::npos) {
-      fd_map_[it->first].replace(found, old_path.length(), new_path);
-    }
-  }
+  fd_map_.Rename(old_path, new_path);
   return fns_->FnRename(old_path, new_path);
 }
 
@@ -511,7 +642,7 @@ int RecordCmFsOps::CmUnlink(const string &pathname) {
   mod.mod_type = DiskMod::kRemoveMod;
   mod.mod_opts = DiskMod::kNoneOpt;
   mod.path = pathname;
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return res;
 }
@@ -526,7 +657,7 @@ int RecordCmFsOps::CmRemove(const string &pathname) {
   mod.mod_type = DiskMod::kRemoveMod;
   mod.mod_opts = DiskMod::kNoneOpt;
   mod.path = pathname;
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return res;
 }
@@ -540,8 +671,8 @@ int RecordCmFsOps::CmFsync(const int fd) {
   DiskMod mod;
   mod.mod_type = DiskMod::kFsyncMod;
   mod.mod_opts = DiskMod::kNoneOpt;
-  mod.path = fd_map_.at(fd);
-  mods_.push_back(mod);
+  mod.path = fd_map_.At(fd);
+  RecordMod(mod);
 
   return res;
 }
@@ -555,8 +686,8 @@ int RecordCmFsOps::CmFdatasync(const int fd) {
   DiskMod mod;
   mod.mod_type = DiskMod::kFsyncMod;
   mod.mod_opts = DiskMod::kNoneOpt;
-  mod.path = fd_map_.at(fd);
-  mods_.push_back(mod);
+  mod.path = fd_map_.At(fd);
+  RecordMod(mod);
 
   return res;
 }
@@ -567,7 +698,7 @@ void RecordCmFsOps::CmSync() {
   DiskMod mod;
   mod.mod_type = DiskMod::kSyncMod;
   mod.mod_opts = DiskMod::kNoneOpt;
-  mods_.push_back(mod);
+  RecordMod(mod);
 }
 
 // int RecordCmFsOps::CmSyncfs(const int fd) {
@@ -580,8 +711,8 @@ void RecordCmFsOps::CmSync() {
 //   // Or should probably have a kSyncMod type with filepath (?)
 //   mod.mod_type = DiskMod::kFsyncMod;
 //   mod.mod_opts = DiskMod::kNoneOpt;
-//   mod.path = fd_map_.at(fd);
-//   mods_.push_back(mod);
+//   mod.path = fd_map_.At(fd);
+//   RecordMod(mod);
 
 //   return res;
 // }
@@ -596,15 +727,15 @@ int RecordCmFsOps::CmSyncFileRange(const int fd, size_t offset, size_t nbytes,
   DiskMod mod;
   mod.mod_type = DiskMod::kSyncFileRangeMod;
   mod.mod_opts = DiskMod::kNoneOpt;
-  mod.path = fd_map_.at(fd);
-  const int post_stat_res = fns_->FnStat(fd_map_.at(fd), &mod.post_mod_stats);
+  mod.path = fd_map_.At(fd);
+  const int post_stat_res = fns_->FnStat(mod.path, &mod.post_mod_stats);
   if (post_stat_res < 0) {
     // TODO(ashmrtn): Some sort of warning here?
     return post_stat_res;
   }
   mod.file_mod_location = offset;
   mod.file_mod_len = nbytes;
-  mods_.push_back(mod);
+  RecordMod(mod);
   return res;
 }
 
@@ -617,7 +748,7 @@ int RecordCmFsOps::CmCheckpoint() {
   DiskMod mod;
   mod.mod_type = DiskMod::kCheckpointMod;
   mod.mod_opts = DiskMod::kNoneOpt;
-  mods_.push_back(mod);
+  RecordMod(mod);
 
   return res;
 }
@@ -637,7 +768,7 @@ int RecordCmFsOps::WriteWhole(const int fd, const unsigned long long size,
 }
 
 int RecordCmFsOps::Serialize(const int fd) {
-  for (auto &mod : mods_) {
+  for (auto &mod : CollectMods()) {
     unsigned long long size;
     shared_ptr<char> serial_mod = DiskMod::Serialize(mod, &size);
     if (serial_mod == nullptr) {
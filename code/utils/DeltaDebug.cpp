@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <map>
+
+#include "DeltaDebug.h"
+
+namespace fs_testing {
+namespace utils {
+
+using std::function;
+using std::map;
+using std::vector;
+
+namespace {
+
+/*
+ * Split `items` into `n` contiguous chunks whose sizes differ by at most one.
+ */
+vector<vector<unsigned int>> Split(const vector<unsigned int> &items,
+    unsigned int n) {
+  vector<vector<unsigned int>> res(n);
+  unsigned int start = 0;
+  for (unsigned int i = 0; i < n; ++i) {
+    const unsigned int len = (items.size() - start) / (n - i);
+    res.at(i).assign(items.begin() + start, items.begin() + start + len);
+    start += len;
+  }
+  return res;
+}
+
+}  // namespace
+
+vector<unsigned int> DeltaDebug(const vector<unsigned int> &items,
+    const function<bool(const vector<unsigned int>&)> &fails,
+    unsigned int max_checks, unsigned int *num_checks) {
+  map<vector<unsigned int>, bool> results;
+  unsigned int checks = 0;
+  // Subsets we don't have the budget to check are treated as passing so that
+  // we stop shrinking.
+  auto check = [&](const vector<unsigned int> &subset) {
+    auto prev = results.find(subset);
+    if (prev != results.end()) {
+      return prev->second;
+    }
+    if (checks >= max_checks) {
+      return false;
+    }
+    ++checks;
+    const bool res = fails(subset);
+    results[subset] = res;
+    return res;
+  };
+
+  vector<unsigned int> current(items);
+  if (!current.empty() && check(vector<unsigned int>())) {
+    current.clear();
+  }
+
+  unsigned int n = 2;
+  while (current.size() >= 2 && checks < max_checks) {
+    const vector<vector<unsigned int>> chunks = Split(current, n);
+    bool reduced = false;
+
+    // Reduce to subset.
+    for (const vector<unsigned int> &chunk : chunks) {
+      if (check(chunk)) {
+        current = chunk;
+        n = 2;
+        reduced = true;
+        break;
+      }
+    }
+
+    // Reduce to complement. With two chunks the complements are the chunks
+    // themselves, which were just checked.
+    if (!reduced && n > 2) {
+      for (unsigned int i = 0; i < n; ++i) {
+        vector<unsigned int> complement;
+        for (unsigned int j = 0; j < n; ++j) {
+          if (j != i) {
+            complement.insert(complement.end(), chunks.at(j).begin(),
+                chunks.at(j).end());
+          }
+        }
+        if (check(complement)) {
+          current = complement;
+          n = std::max(n - 1, 2U);
+          reduced = true;
+          break;
+        }
+      }
+    }
+
+    if (!reduced) {
+      if (n >= current.size()) {
+        // Every single item has been removed on its own, so we're 1-minimal.
+        break;
+      }
+      n = std::min<unsigned int>(n * 2, current.size());
+    }
+  }
+
+  if (num_checks != NULL) {
+    *num_checks = checks;
+  }
+  return current;
+}
+
+}  // namespace utils
+}  // namespace fs_testing
@@ -0,0 +1,28 @@
+#ifndef UTILS_DELTA_DEBUG_H
+#define UTILS_DELTA_DEBUG_H
+
+#include <functional>
+#include <vector>
+
+namespace fs_testing {
+namespace utils {
+
+/*
+ * Shrink `items` with the ddmin delta debugging algorithm (Zeller and
+ * Hildebrandt). `fails` is assumed to return true for `items` itself. The
+ * result is a subset of `items`, in the same order, for which `fails` still
+ * returns true and from which no single item can be removed without `fails`
+ * returning false. No subset is checked more than once.
+ *
+ * If `fails` has been called max_checks times, the smallest failing subset
+ * found so far is returned instead, which may not be 1-minimal. *num_checks,
+ * if given, is set to the number of calls made.
+ */
+std::vector<unsigned int> DeltaDebug(const std::vector<unsigned int> &items,
+    const std::function<bool(const std::vector<unsigned int>&)> &fails,
+    unsigned int max_checks, unsigned int *num_checks = NULL);
+
+}  // namespace utils
+}  // namespace fs_testing
+
+#endif  // UTILS_DELTA_DEBUG_H
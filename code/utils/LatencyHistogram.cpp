@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "LatencyHistogram.h"
+
+namespace fs_testing {
+namespace utils {
+
+using std::chrono::nanoseconds;
+using std::endl;
+using std::ostream;
+using std::ostringstream;
+using std::string;
+
+namespace {
+
+// Each power of two is split into 1 << kSubBucketBits buckets.
+static const unsigned int kSubBucketBits = 4;
+static const unsigned int kSubBuckets = 1 << kSubBucketBits;
+// Values below kSubBuckets get one bucket each, then there is a group of
+// kSubBuckets buckets for each of the remaining powers of two up to 2^63.
+static const unsigned int kNumBuckets =
+  kSubBuckets + (64 - kSubBucketBits) * kSubBuckets;
+
+}  // namespace
+
+LatencyHistogram::LatencyHistogram() : buckets_(kNumBuckets, 0) {
+  Reset();
+}
+
+unsigned int LatencyHistogram::BucketIndex(unsigned long long ns) {
+  if (ns < kSubBuckets) {
+    return ns;
+  }
+  const unsigned int msb = 63 - __builtin_clzll(ns);
+  const unsigned int group = msb - kSubBucketBits + 1;
+  const unsigned int sub = (ns >> (msb - kSubBucketBits)) & (kSubBuckets - 1);
+  return group * kSubBuckets + sub;
+}
+
+unsigned long long LatencyHistogram::BucketLow(unsigned int index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  const unsigned int group = index / kSubBuckets;
+  const unsigned long long sub = index % kSubBuckets;
+  return (kSubBuckets + sub) << (group - 1);
+}
+
+unsigned long long LatencyHistogram::BucketHigh(unsigned int index) {
+  if (index + 1 >= kNumBuckets) {
+    return ~0ULL;
+  }
+  return BucketLow(index + 1) - 1;
+}
+
+void LatencyHistogram::Record(nanoseconds elapsed) {
+  const unsigned long long ns = (elapsed.count() < 0) ? 0 : elapsed.count();
+  ++buckets_.at(BucketIndex(ns));
+  ++count_;
+  total_ns_ += ns;
+  min_ns_ = std::min(min_ns_, ns);
+  max_ns_ = std::max(max_ns_, ns);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other) {
+  for (unsigned int i = 0; i < kNumBuckets; ++i) {
+    buckets_.at(i) += other.buckets_.at(i);
+  }
+  count_ += other.count_;
+  total_ns_ += other.total_ns_;
+  min_ns_ = std::min(min_ns_, other.min_ns_);
+  max_ns_ = std::max(max_ns_, other.max_ns_);
+}
+
+void LatencyHistogram::Reset() {
+  std::fill(buckets_.begin(), buckets_.end(), 0);
+  count_ = 0;
+  total_ns_ = 0;
+  min_ns_ = ~0ULL;
+  max_ns_ = 0;
+}
+
+unsigned long long LatencyHistogram::Count() const {
+  return count_;
+}
+
+nanoseconds LatencyHistogram::Total() const {
+  return nanoseconds(total_ns_);
+}
+
+nanoseconds LatencyHistogram::Min() const {
+  return nanoseconds((count_ == 0) ? 0 : min_ns_);
+}
+
+nanoseconds LatencyHistogram::Max() const {
+  return nanoseconds(max_ns_);
+}
+
+nanoseconds LatencyHistogram::Percentile(double percent) const {
+  if (count_ == 0) {
+    return nanoseconds(0);
+  }
+  const unsigned long long rank = std::max(1.0,
+      std::ceil(count_ * std::min(percent, 100.0) / 100));
+  unsigned long long seen = 0;
+  for (unsigned int i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_.at(i);
+    if (seen >= rank) {
+      return nanoseconds(std::min(BucketHigh(i), max_ns_));
+    }
+  }
+  return nanoseconds(max_ns_);
+}
+
+void LatencyHistogram::PrintSummary(ostream &os) const {
+  os << "count " << count_;
+  if (count_ == 0) {
+    return;
+  }
+  os << ", p50 " << Format(Percentile(50)) <<
+    ", p90 " << Format(Percentile(90)) <<
+    ", p99 " << Format(Percentile(99)) <<
+    ", max " << Format(Max());
+}
+
+void LatencyHistogram::Write(ostream &os, const string &name) const {
+  os << name << " count " << count_ << " total_ns " << total_ns_ <<
+    " min_ns " << Min().count() << " max_ns " << max_ns_ << endl;
+  for (unsigned int i = 0; i < kNumBuckets; ++i) {
+    if (buckets_.at(i) > 0) {
+      os << name << " " << BucketLow(i) << " " << BucketHigh(i) << " " <<
+        buckets_.at(i) << endl;
+    }
+  }
+}
+
+string LatencyHistogram::Format(nanoseconds elapsed) {
+  static const char *kUnits[] = {"ns", "us", "ms", "s"};
+  double val = elapsed.count();
+  unsigned int unit = 0;
+  while (val >= 1000 && unit < 3) {
+    val /= 1000;
+    ++unit;
+  }
+  ostringstream res;
+  res << std::fixed << std::setprecision((unit == 0) ? 0 : 1) << val << " " <<
+    kUnits[unit];
+  return res.str();
+}
+
+}  // namespace utils
+}  // namespace fs_testing
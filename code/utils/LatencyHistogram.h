@@ -0,0 +1,66 @@
+#ifndef UTILS_LATENCY_HISTOGRAM_H
+#define UTILS_LATENCY_HISTOGRAM_H
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace fs_testing {
+namespace utils {
+
+/*
+ * Histogram of durations in nanoseconds with log-linear buckets: values below
+ * 16 ns get a bucket each, and every power of two above that is split into 16
+ * equal buckets. Any value is therefore placed in a bucket at most 1/16 of its
+ * size wide, and percentiles read from the histogram are within about 6% of the
+ * real ones no matter how far apart the fastest and slowest samples are.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram();
+
+  void Record(std::chrono::nanoseconds elapsed);
+  void Merge(const LatencyHistogram &other);
+  void Reset();
+
+  unsigned long long Count() const;
+  std::chrono::nanoseconds Total() const;
+  std::chrono::nanoseconds Min() const;
+  std::chrono::nanoseconds Max() const;
+  /*
+   * Smallest bucket bound that at least percent of the samples are at or
+   * below, capped at the largest sample. Returns 0 if there are no samples.
+   */
+  std::chrono::nanoseconds Percentile(double percent) const;
+
+  // "count 12, p50 1.2 ms, p90 3.4 ms, p99 9.9 ms, max 10.1 ms".
+  void PrintSummary(std::ostream &os) const;
+  /*
+   * Write the histogram one line per non-empty bucket as
+   * "<name> <bucket low ns> <bucket high ns> <count>", after a line of the form
+   * "<name> count <n> total_ns <t> min_ns <m> max_ns <m>". Every histogram uses
+   * the same bucket bounds, so dumps from different runs can be diffed line by
+   * line.
+   */
+  void Write(std::ostream &os, const std::string &name) const;
+
+  // Duration with a unit picked to keep the number readable.
+  static std::string Format(std::chrono::nanoseconds elapsed);
+
+ private:
+  static unsigned int BucketIndex(unsigned long long ns);
+  static unsigned long long BucketLow(unsigned int index);
+  static unsigned long long BucketHigh(unsigned int index);
+
+  std::vector<unsigned long long> buckets_;
+  unsigned long long count_;
+  unsigned long long total_ns_;
+  unsigned long long min_ns_;
+  unsigned long long max_ns_;
+};
+
+}  // namespace utils
+}  // namespace fs_testing
+
+#endif  // UTILS_LATENCY_HISTOGRAM_H
@@ -0,0 +1,97 @@
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "MemoryUsage.h"
+
+namespace fs_testing {
+namespace utils {
+
+using std::endl;
+using std::ifstream;
+using std::ostream;
+using std::ostringstream;
+using std::string;
+
+void MemoryReport::Add(const string &name, const MemoryUsage &usage) {
+  structures_.push_back({name, usage});
+}
+
+void MemoryReport::SamplePhase(const string &phase) {
+  const unsigned long long rss = CurrentRss();
+  phases_.push_back({phase, rss, std::max(PeakRss(), rss)});
+}
+
+void MemoryReport::Clear() {
+  structures_.clear();
+  phases_.clear();
+}
+
+void MemoryReport::Print(ostream &os) const {
+  MemoryUsage total;
+  for (const auto &structure : structures_) {
+    total += structure.second;
+  }
+  os << "Memory held: " << Format(total.Total()) << endl;
+  for (const auto &structure : structures_) {
+    const MemoryUsage &usage = structure.second;
+    os << "\t" << std::left << std::setw(28) << structure.first + ":" <<
+      std::right << Format(usage.Total()) << " (" << Format(usage.payload) <<
+      " data, " << Format(usage.overhead) << " overhead)";
+    if (total.Total() > 0) {
+      os << ", " << usage.Total() * 100 / total.Total() << "%";
+    }
+    os << endl;
+  }
+  if (phases_.empty()) {
+    return;
+  }
+  os << "Resident set size:" << endl;
+  for (const PhaseSample &sample : phases_) {
+    os << "\t" << std::left << std::setw(28) << sample.phase + ":" <<
+      std::right << Format(sample.rss) << " (peak " <<
+      Format(sample.peak_rss) << ")" << endl;
+  }
+}
+
+unsigned long long MemoryReport::CurrentRss() {
+  // Second field is the number of resident pages.
+  ifstream statm("/proc/self/statm");
+  unsigned long long size = 0;
+  unsigned long long resident = 0;
+  if (!(statm >> size >> resident)) {
+    return 0;
+  }
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+unsigned long long MemoryReport::PeakRss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0) {
+    return CurrentRss();
+  }
+  // Reported in kilobytes. The kernel only updates it now and then, so it can
+  // lag behind what statm already shows.
+  return std::max((unsigned long long) usage.ru_maxrss * 1024, CurrentRss());
+}
+
+string MemoryReport::Format(unsigned long long bytes) {
+  static const char *kUnits[] = {"B", "KB", "MB", "GB", "TB"};
+  double val = bytes;
+  unsigned int unit = 0;
+  while (val >= 1024 && unit < 4) {
+    val /= 1024;
+    ++unit;
+  }
+  ostringstream res;
+  res << std::fixed << std::setprecision((unit == 0) ? 0 : 1) << val << " " <<
+    kUnits[unit];
+  return res.str();
+}
+
+}  // namespace utils
+}  // namespace fs_testing
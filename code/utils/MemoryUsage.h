@@ -0,0 +1,78 @@
+#ifndef UTILS_MEMORY_USAGE_H
+#define UTILS_MEMORY_USAGE_H
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace fs_testing {
+namespace utils {
+
+/*
+ * Bytes held by a structure, split into the data it exists to hold and what it
+ * costs to hold that data (structs around it, container nodes and spare
+ * capacity). Worked out from sizes and capacities, so allocator overhead isn't
+ * included.
+ */
+struct MemoryUsage {
+  unsigned long long payload = 0;
+  unsigned long long overhead = 0;
+
+  unsigned long long Total() const {
+    return payload + overhead;
+  }
+
+  MemoryUsage& operator+=(const MemoryUsage &other) {
+    payload += other.payload;
+    overhead += other.overhead;
+    return *this;
+  }
+
+  // Count a vector's buffer, all of it overhead, as elements are counted by
+  // the caller.
+  template <typename T>
+  void AddVector(const std::vector<T> &v) {
+    overhead += sizeof(v) + v.capacity() * sizeof(T);
+  }
+};
+
+/*
+ * Where the memory of a run goes: the bytes held by each major structure, and
+ * the resident set size of the process at the end of each phase.
+ */
+class MemoryReport {
+ public:
+  void Add(const std::string &name, const MemoryUsage &usage);
+  // Note the current and peak resident set size at the end of phase.
+  void SamplePhase(const std::string &phase);
+  void Clear();
+  /*
+   * One line per structure with its share of the total, then one line per
+   * phase sampled.
+   */
+  void Print(std::ostream &os) const;
+
+  // Resident set size of this process in bytes, or 0 if it can't be read.
+  static unsigned long long CurrentRss();
+  // Largest resident set size this process has had, in bytes. Never less than
+  // CurrentRss.
+  static unsigned long long PeakRss();
+  // Size with a unit picked to keep the number readable.
+  static std::string Format(unsigned long long bytes);
+
+ private:
+  struct PhaseSample {
+    std::string phase;
+    unsigned long long rss;
+    unsigned long long peak_rss;
+  };
+
+  std::vector<std::pair<std::string, MemoryUsage>> structures_;
+  std::vector<PhaseSample> phases_;
+};
+
+}  // namespace utils
+}  // namespace fs_testing
+
+#endif  // UTILS_MEMORY_USAGE_H
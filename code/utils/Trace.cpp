@@ -0,0 +1,103 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstdio>
+
+#include "Trace.h"
+
+namespace fs_testing {
+namespace utils {
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::string;
+
+int Tracer::fd_ = -1;
+unsigned int Tracer::worker_ = 0;
+
+namespace {
+
+// Trace timestamps are in microseconds. Keep the nanoseconds as decimals.
+string Micros(nanoseconds ns) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%lld.%03lld", (long long) ns.count() / 1000,
+      (long long) ns.count() % 1000);
+  return buf;
+}
+
+// Names come from the harness itself, but keep the JSON valid regardless.
+string Escape(const string &str) {
+  string res;
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      res += '\\';
+    }
+    res += (c < ' ') ? ' ' : c;
+  }
+  return res;
+}
+
+}  // namespace
+
+bool Tracer::Open(const string &path) {
+  Close();
+  // Workers forked later share this fd rather than opening the file again, so
+  // only a new run gets here and it starts the trace over.
+  fd_ = open(path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+  Write("[\n");
+  SetWorker(0, "c_harness");
+  return true;
+}
+
+void Tracer::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void Tracer::SetWorker(unsigned int id, const string &name) {
+  worker_ = id;
+  if (!Enabled()) {
+    return;
+  }
+  Write("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" +
+      std::to_string(getpid()) + ",\"args\":{\"name\":\"" + Escape(name) +
+      "\"}},\n");
+}
+
+void Tracer::Complete(const char *name, const char *category,
+    steady_clock::time_point start, steady_clock::time_point end,
+    long long state) {
+  if (!Enabled()) {
+    return;
+  }
+  string event = "{\"name\":\"" + Escape(name) + "\",\"cat\":\"" +
+    Escape(category) + "\",\"ph\":\"X\",\"ts\":" +
+    Micros(duration_cast<nanoseconds>(start.time_since_epoch())) +
+    ",\"dur\":" + Micros(duration_cast<nanoseconds>(end - start)) +
+    ",\"pid\":" + std::to_string(getpid()) +
+    ",\"tid\":" + std::to_string(worker_) +
+    ",\"args\":{\"worker\":" + std::to_string(worker_);
+  if (state >= 0) {
+    event += ",\"state\":" + std::to_string(state);
+  }
+  event += "}},\n";
+  Write(event);
+}
+
+void Tracer::Write(const string &event) {
+  // One write per event so that events from different processes appending to
+  // the file don't interleave.
+  if (write(fd_, event.data(), event.size()) < 0) {
+    Close();
+  }
+}
+
+}  // namespace utils
+}  // namespace fs_testing
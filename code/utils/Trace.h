@@ -0,0 +1,84 @@
+#ifndef UTILS_TRACE_H
+#define UTILS_TRACE_H
+
+#include <chrono>
+#include <string>
+
+namespace fs_testing {
+namespace utils {
+
+/*
+ * Writes spans of time to a file in Chrome's trace event format so a run can
+ * be loaded in chrome://tracing or Perfetto. Every process appends to the same
+ * file with one write per event, so workers forked after Open share it. The
+ * closing ']' is never written, which the format allows, so a trace is usable
+ * even if the run dies.
+ *
+ * Tracing is off until Open is called. While it is off, a TraceSpan costs a
+ * check of a flag when it starts and one when it ends.
+ */
+class Tracer {
+ public:
+  // Start a new trace at path, replacing any file there.
+  static bool Open(const std::string &path);
+  // Stop writing events from this process.
+  static void Close();
+  static bool Enabled() {
+    return fd_ >= 0;
+  }
+  /*
+   * Label the events this process writes from now on with a worker id, and
+   * name the process in the trace.
+   */
+  static void SetWorker(unsigned int id, const std::string &name);
+  /*
+   * Add a span from start to end. state is the crash state the span belongs
+   * to, or -1 if it isn't for a single crash state.
+   */
+  static void Complete(const char *name, const char *category,
+      std::chrono::steady_clock::time_point start,
+      std::chrono::steady_clock::time_point end, long long state);
+
+ private:
+  static void Write(const std::string &event);
+
+  static int fd_;
+  static unsigned int worker_;
+};
+
+/*
+ * Adds a span to the trace covering from when it is made until End is called
+ * or it goes out of scope, whichever is first.
+ */
+class TraceSpan {
+ public:
+  TraceSpan(const char *name, const char *category, long long state = -1)
+      : name_(name), category_(category), state_(state),
+        active_(Tracer::Enabled()) {
+    if (active_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~TraceSpan() {
+    End();
+  }
+  void End() {
+    if (active_) {
+      active_ = false;
+      Tracer::Complete(name_, category_, start_,
+          std::chrono::steady_clock::now(), state_);
+    }
+  }
+
+ private:
+  const char *name_;
+  const char *category_;
+  const long long state_;
+  bool active_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace utils
+}  // namespace fs_testing
+
+#endif  // UTILS_TRACE_H
@@ -40,11 +40,23 @@ int BaseSocket::ReadMessageFromSocket(int socket, SocketMessage *m) {
     case SocketMessage::kEndLogDone:
     case SocketMessage::kRunTests:
     case SocketMessage::kRunTestsDone:
+      // Somebody sent us extra data anyway. Gobble it up and throw it away.
+      if (m->size != 0) {
+        res = GobbleData(socket, m->size);
+      }
+      break;
+    // These messages carry a request id, though older clients may leave it
+    // out.
     case SocketMessage::kCheckpoint:
     case SocketMessage::kCheckpointDone:
     case SocketMessage::kCheckpointFailed:
-      // Somebody sent us extra data anyway. Gobble it up and throw it away.
-      if (m->size != 0) {
+      m->int_value = 0;
+      if (m->size >= sizeof(int32_t)) {
+        res = ReadIntFromSocket(socket, &m->int_value);
+        if (res == 0 && m->size > sizeof(int32_t)) {
+          res = GobbleData(socket, m->size - sizeof(int32_t));
+        }
+      } else if (m->size != 0) {
         res = GobbleData(socket, m->size);
       }
       break;
@@ -74,9 +86,6 @@ int BaseSocket::WriteMessageToSocket(int socket, SocketMessage &m) {
     case SocketMessage::kEndLogDone:
     case SocketMessage::kRunTests:
     case SocketMessage::kRunTestsDone:
-    case SocketMessage::kCheckpoint:
-    case SocketMessage::kCheckpointDone:
-    case SocketMessage::kCheckpointFailed:
       // By default, always send the proper size of the message and no other,
       // extra data.
       res = WriteIntToSocket(socket, 0);
@@ -84,6 +93,15 @@ int BaseSocket::WriteMessageToSocket(int socket, SocketMessage &m) {
         return res;
       }
       break;
+    case SocketMessage::kCheckpoint:
+    case SocketMessage::kCheckpointDone:
+    case SocketMessage::kCheckpointFailed:
+      res = WriteIntToSocket(socket, sizeof(int32_t));
+      if (res < 0) {
+        return res;
+      }
+      res = WriteIntToSocket(socket, m.int_value);
+      break;
     default:
       res = -1;
   }
@@ -95,7 +113,7 @@ int BaseSocket::GobbleData(int socket, unsigned int len) {
   char tmp[len];
   do {
     int res = recv(socket, tmp + bytes_read, sizeof(tmp) - bytes_read, 0);
-    if (res < 0) {
+    if (res <= 0) {
       return -1;
     }
     bytes_read += res;
@@ -108,7 +126,8 @@ int BaseSocket::ReadIntFromSocket(int socket, int* data) {
   int32_t d;
   do {
     int res = recv(socket, (char*) &d + bytes_read, sizeof(d) - bytes_read, 0);
-    if (res < 0) {
+    // The other end hung up if recv returns 0.
+    if (res <= 0) {
       return -1;
     }
     bytes_read += res;
@@ -123,8 +142,9 @@ int BaseSocket::WriteIntToSocket(int socket, int data) {
   int32_t d = htonl(data);
   int bytes_written = 0;
   do {
+    // Report a closed connection as an error instead of dying from SIGPIPE.
     int res = send(socket, (char*) &d + bytes_written,
-        sizeof(d) - bytes_written, 0);
+        sizeof(d) - bytes_written, MSG_NOSIGNAL);
     if (res < 0) {
       return -1;
     }
@@ -147,7 +167,7 @@ int BaseSocket::ReadStringFromSocket(int socket, unsigned int len,
   char read_string[len];
   do {
     int res = recv(socket, read_string + bytes_read, len - bytes_read, 0);
-    if (res < 0) {
+    if (res <= 0) {
       return -1;
     }
     bytes_read += res;
@@ -186,7 +206,8 @@ int BaseSocket::WriteStringToSocket(int socket, string &data) {
   // Send string itself.
   int bytes_written = 0;
   do {
-    int res = send(socket, send_data + bytes_written, len - bytes_written, 0);
+    int res = send(socket, send_data + bytes_written, len - bytes_written,
+        MSG_NOSIGNAL);
     if (res < 0) {
       return -1;
     }
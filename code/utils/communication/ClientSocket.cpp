@@ -19,7 +19,7 @@ ClientSocket::~ClientSocket() {
 }
 
 int ClientSocket::Init() {
-  socket_fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+  socket_fd = socket(PF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
   if (socket_fd < 0) {
     return -1;
   }
@@ -29,6 +29,7 @@ int ClientSocket::Init() {
 
   if (connect(socket_fd, (struct sockaddr*) &socket_info,
         sizeof(socket_info)) < 0) {
+    CloseClient();
     return -1;
   }
   return 0;
@@ -38,6 +39,7 @@ SocketError ClientSocket::SendCommand(SocketMessage::CmCommand c) {
   SocketMessage m;
   m.type = c;
   m.size = 0;
+  m.int_value = 0;
   return SendMessage(m);
 }
 
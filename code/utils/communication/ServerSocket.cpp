@@ -47,10 +47,12 @@ int ServerSocket::Init(unsigned int queue_depth) {
   return 0;
 }
 
-SocketError ServerSocket::SendCommand(SocketMessage::CmCommand c) {
+SocketError ServerSocket::SendCommand(SocketMessage::CmCommand c,
+    int request_id) {
   SocketMessage m;
   m.type = c;
   m.size = 0;
+  m.int_value = request_id;
   return SendMessage(m);
 }
 
@@ -134,6 +136,29 @@ void ServerSocket::CloseClient() {
   client_socket = -1;
 }
 
+int ServerSocket::GetFd() const {
+  return server_socket;
+}
+
+int ServerSocket::AcceptClient() {
+  // For now, don't care about getting the client address.
+  return accept4(server_socket, NULL, NULL, SOCK_CLOEXEC);
+}
+
+SocketError ServerSocket::ReadFromClient(int client, SocketMessage *m) {
+  if (BaseSocket::ReadMessageFromSocket(client, m) < 0) {
+    return SocketError::kSyscall;
+  }
+  return SocketError::kNone;
+}
+
+SocketError ServerSocket::SendToClient(int client, SocketMessage &m) {
+  if (BaseSocket::WriteMessageToSocket(client, m) < 0) {
+    return SocketError::kSyscall;
+  }
+  return SocketError::kNone;
+}
+
 void ServerSocket::CloseServer() {
   close(client_socket);
   client_socket = -1;
@@ -19,13 +19,23 @@ class ServerSocket {
   ServerSocket(std::string address);
   ~ServerSocket();
   int Init(unsigned int queue_depth);
-  // Shorthand for SendMessage with the proper options.
-  SocketError SendCommand(SocketMessage::CmCommand c);
+  // Shorthand for SendMessage with the proper options. request_id is echoed
+  // back in replies to checkpoint requests.
+  SocketError SendCommand(SocketMessage::CmCommand c, int request_id = 0);
   SocketError SendMessage(SocketMessage &m);
   SocketError WaitForMessage(SocketMessage *m);
   SocketError TryForMessage(SocketMessage *m);
   void CloseClient();
   void CloseServer();
+  // The listening socket, which becomes readable when a client connects. Lets
+  // callers wait for messages alongside other events.
+  int GetFd() const;
+  // Accept a client that keeps its connection open for several messages. The
+  // caller owns the returned file descriptor and reads and replies on it with
+  // ReadFromClient and SendToClient. Returns -1 on error.
+  int AcceptClient();
+  SocketError ReadFromClient(int client, SocketMessage *m);
+  SocketError SendToClient(int client, SocketMessage &m);
  private:
   int server_socket = -1;
   int client_socket = -1;
@@ -1,6 +1,7 @@
 #ifndef UTILS_COMMUNICATION_SOCKET_UTILS_H
 #define UTILS_COMMUNICATION_SOCKET_UTILS_H
 
+#include <cstdint>
 #include <string>
 
 namespace fs_testing {
@@ -13,6 +14,17 @@ const char kSocketDir[] = "/tmp";
 // make sure that the path below matches the path above (with the exception of
 // the appended "crash_monkey_harness" part).
 const char kSocketNameOutbound[] = "/tmp/crash_monkey_harness";
+// Set by the harness when it listens somewhere other than kSocketNameOutbound,
+// as each worker does when several file systems are tested at once.
+const char kSocketPathEnv[] = "CM_SOCKET_PATH";
+// Set by the harness in the workload process it forks. Holds
+// "<request fd>,<reply fd>,<pid>" for a pair of eventfds that process can use
+// to ask for checkpoints without going through the socket. Only the process
+// with the given pid may use them.
+const char kCheckpointDoorbellEnv[] = "CM_CHECKPOINT_DOORBELL";
+// Values the harness writes to the reply eventfd of the checkpoint doorbell.
+const uint64_t kDoorbellCheckpointDone = 1;
+const uint64_t kDoorbellCheckpointFailed = 2;
 
 /*******************************************************************************
  * Basic information about the layout of messages sent and received by
@@ -27,6 +39,10 @@ const char kSocketNameOutbound[] = "/tmp/crash_monkey_harness";
  *       any data that may have been sent in a message but that was not needed
  *         ex. sending a string along with a control message
  * * the data returned to callers depends on the type of a message
+ * * checkpoint messages carry a request id in int_value that the harness
+ *   echoes back in its reply. Clients may keep one connection open for many
+ *   requests and send more than one before reading the replies, which come
+ *   back in order.
  ******************************************************************************/
 
 
@@ -301,7 +301,7 @@ DiskWriteData::DiskWriteData() :
 }
 
 DiskWriteData::DiskWriteData(bool full_bio, unsigned int bio_index,
-    unsigned int bio_sector_index ,unsigned int disk_offset,
+    unsigned int bio_sector_index, unsigned long long disk_offset,
     unsigned int size, std::shared_ptr<char> data_base,
     unsigned int data_offset) :
       full_bio(full_bio), bio_index(bio_index),
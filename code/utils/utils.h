@@ -72,7 +72,7 @@ struct DiskWriteData {
  public:
   DiskWriteData();
   DiskWriteData(bool full_bio, unsigned int bio_index,
-      unsigned int bio_sector_index ,unsigned int disk_offset,
+      unsigned int bio_sector_index, unsigned long long disk_offset,
       unsigned int size, std::shared_ptr<char> data_base,
       unsigned int data_offset);
 
@@ -84,7 +84,9 @@ struct DiskWriteData {
   // If this is a single sector in the epoch_op, which sector in that epoch_op
   // is it?
   unsigned int bio_sector_index;
-  unsigned int disk_offset;
+  // Byte offset on the device. Sizes are still bounded by the kernel's 32-bit
+  // bio size.
+  unsigned long long disk_offset;
   unsigned int size;
 
  private:
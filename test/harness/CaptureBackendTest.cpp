@@ -0,0 +1,264 @@
+#include <endian.h>
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../code/harness/CaptureBackend.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::string;
+using std::stringstream;
+using std::vector;
+
+namespace {
+
+// Flags from the dm-log-writes on-disk format.
+static const unsigned long long kFlush = 1 << 0;
+static const unsigned long long kFua = 1 << 1;
+static const unsigned long long kDiscard = 1 << 2;
+static const unsigned long long kMark = 1 << 3;
+
+struct Entry {
+  disk_write_op_meta meta;
+  string data;
+  bool has_data;
+};
+
+/*
+ * Lays out a log the way dm-log-writes writes it to the log device. Sectors are
+ * in units of the log's sector_size. Only the first nr_entries entries are
+ * counted in the superblock.
+ */
+class LogBuilder {
+ public:
+  LogBuilder(const unsigned int sector_size) : sector_size_(sector_size) { }
+
+  void Write(const unsigned long long sector, const string &data,
+      const unsigned long long flags = 0) {
+    AddEntry(sector, data.size() / sector_size_, flags, 0, "");
+    string padded(data);
+    padded.resize((data.size() + sector_size_ - 1) / sector_size_ *
+        sector_size_, 0);
+    entries_ += padded;
+  }
+
+  void Flush(const unsigned long long flags) {
+    AddEntry(0, 0, flags, 0, "");
+  }
+
+  void Discard(const unsigned long long sector,
+      const unsigned long long nr_sectors) {
+    AddEntry(sector, nr_sectors, kDiscard, 0, "");
+  }
+
+  void Mark(const string &mark) {
+    AddEntry(0, 0, kMark, mark.size(), mark);
+  }
+
+  string Build(unsigned long long nr_entries = ~0ULL) {
+    nr_entries = std::min(nr_entries, nr_entries_);
+    string super(sector_size_, 0);
+    PutLe64(super, 0, 0x6a736677736872ULL);
+    PutLe64(super, 8, 1);
+    PutLe64(super, 16, nr_entries);
+    const unsigned int size = htole32(sector_size_);
+    super.replace(24, sizeof(size), (const char *) &size, sizeof(size));
+    return super + entries_;
+  }
+
+ private:
+  static void PutLe64(string &buf, const unsigned int offset,
+      const unsigned long long val) {
+    const unsigned long long le = htole64(val);
+    buf.replace(offset, sizeof(le), (const char *) &le, sizeof(le));
+  }
+
+  void AddEntry(const unsigned long long sector,
+      const unsigned long long nr_sectors, const unsigned long long flags,
+      const unsigned long long data_len, const string &mark) {
+    string header(sector_size_, 0);
+    PutLe64(header, 0, sector);
+    PutLe64(header, 8, nr_sectors);
+    PutLe64(header, 16, flags);
+    PutLe64(header, 24, data_len);
+    header.replace(32, mark.size(), mark);
+    entries_ += header;
+    ++nr_entries_;
+  }
+
+  const unsigned int sector_size_;
+  string entries_;
+  unsigned long long nr_entries_ = 0;
+};
+
+bool Read(const string &log, vector<Entry> &entries, unsigned int &marks) {
+  stringstream in(log);
+  return DmLogWritesBackend::ReadLog(in, 1000,
+      [&entries](const disk_write_op_meta &meta, const char *data) {
+        entries.push_back({meta, (data == NULL) ? "" : string(data, meta.size),
+            data != NULL});
+      }, marks);
+}
+
+void ExpectCheckpoint(const Entry &entry, const unsigned int checkpoint) {
+  EXPECT_EQ(entry.meta.bi_rw, HWM_CHECKPOINT_FLAG);
+  EXPECT_EQ(entry.meta.write_sector, checkpoint);
+  EXPECT_FALSE(entry.has_data);
+}
+
+}  // namespace
+
+/*
+ * Only writes between the begin and end marks are kept, but every checkpoint
+ * is, and the log starts with checkpoint 0 like disk_wrapper's does.
+ */
+TEST(DmLogWritesBackend, KeepsWritesBetweenBeginAndEnd) {
+  LogBuilder builder(512);
+  builder.Write(0, string(512, 'x'));
+  builder.Mark("crashmonkey_begin");
+  builder.Write(8, string(1024, 'a'));
+  builder.Flush(kFlush | kFua);
+  builder.Mark("crashmonkey_checkpoint");
+  builder.Write(16, string(512, 'b'), kFua);
+  builder.Mark("crashmonkey_end");
+  builder.Write(24, string(512, 'y'));
+  builder.Mark("crashmonkey_checkpoint");
+
+  vector<Entry> entries;
+  unsigned int marks = 0;
+  ASSERT_TRUE(Read(builder.Build(), entries, marks));
+  EXPECT_EQ(marks, 4);
+  ASSERT_EQ(entries.size(), 6);
+  ExpectCheckpoint(entries.at(0), 0);
+
+  EXPECT_EQ(entries.at(1).meta.bi_rw, HWM_WRITE_FLAG);
+  EXPECT_EQ(entries.at(1).meta.write_sector, 8);
+  EXPECT_EQ(entries.at(1).meta.size, 1024);
+  EXPECT_EQ(entries.at(1).data, string(1024, 'a'));
+
+  EXPECT_EQ(entries.at(2).meta.bi_rw,
+      HWM_WRITE_FLAG | HWM_FLUSH_FLAG | HWM_FUA_FLAG);
+  EXPECT_EQ(entries.at(2).meta.size, 0);
+  EXPECT_FALSE(entries.at(2).has_data);
+
+  ExpectCheckpoint(entries.at(3), 1);
+  EXPECT_EQ(entries.at(4).meta.bi_rw, HWM_WRITE_FLAG | HWM_FUA_FLAG);
+  EXPECT_EQ(entries.at(4).data, string(512, 'b'));
+  ExpectCheckpoint(entries.at(5), 2);
+
+  // Entries are timed in log order.
+  for (unsigned int i = 1; i < entries.size(); ++i) {
+    EXPECT_LT(entries.at(i - 1).meta.time_ns, entries.at(i).meta.time_ns);
+  }
+}
+
+/*
+ * Entry headers take a whole sector of the log device's size and ranges are in
+ * its sectors, discards have no data in the log and come back as zeros, and
+ * with no callback only the marks are counted.
+ */
+TEST(DmLogWritesBackend, LargeSectorsAndDiscards) {
+  LogBuilder builder(4096);
+  builder.Mark("crashmonkey_begin");
+  builder.Write(8, string(4096, 'c'));
+  builder.Discard(16, 2);
+  builder.Write(9, string(4096, 'd'));
+  const string log = builder.Build();
+
+  vector<Entry> entries;
+  unsigned int marks = 0;
+  ASSERT_TRUE(Read(log, entries, marks));
+  ASSERT_EQ(entries.size(), 4);
+  // Sectors come back in 512 byte units.
+  EXPECT_EQ(entries.at(1).meta.write_sector, 64);
+  EXPECT_EQ(entries.at(1).data, string(4096, 'c'));
+  EXPECT_EQ(entries.at(2).meta.bi_rw, HWM_WRITE_FLAG | HWM_DISCARD_FLAG);
+  EXPECT_EQ(entries.at(2).meta.write_sector, 128);
+  EXPECT_EQ(entries.at(2).data, string(16 * 512, 0));
+  EXPECT_EQ(entries.at(3).meta.write_sector, 72);
+  EXPECT_EQ(entries.at(3).data, string(4096, 'd'));
+
+  stringstream in(log);
+  marks = 0;
+  EXPECT_TRUE(DmLogWritesBackend::ReadLog(in, 0,
+        CaptureBackend::LogCallback(), marks));
+  EXPECT_EQ(marks, 1);
+}
+
+/*
+ * Entries the superblock doesn't count yet are left alone, and anything that
+ * isn't a whole log is rejected.
+ */
+TEST(DmLogWritesBackend, OnlyReadsCountedEntries) {
+  LogBuilder builder(512);
+  builder.Mark("crashmonkey_begin");
+  builder.Write(8, string(512, 'e'));
+  builder.Mark("crashmonkey_end");
+
+  vector<Entry> entries;
+  unsigned int marks = 0;
+  ASSERT_TRUE(Read(builder.Build(2), entries, marks));
+  EXPECT_EQ(marks, 1);
+  EXPECT_EQ(entries.size(), 2);
+
+  // Counted entries that aren't there.
+  string log = builder.Build();
+  entries.clear();
+  EXPECT_FALSE(Read(log.substr(0, log.size() - 512), entries, marks));
+
+  // A zeroed superblock, as the log device is left before anything is logged.
+  log.replace(0, 512, string(512, 0));
+  entries.clear();
+  EXPECT_FALSE(Read(log, entries, marks));
+  EXPECT_TRUE(entries.empty());
+}
+
+/*
+ * Percentiles of the capture latency are bounded by the bucket they fall in,
+ * but never above the slowest bio.
+ */
+TEST(DiskWrapperBackend, WritesStats) {
+  disk_wrapper_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  stringstream empty;
+  DiskWrapperBackend::WriteStats(empty, stats);
+  EXPECT_EQ(empty.str(),
+      "captured 0 bios, 0 bytes, 0 allocation failures\n");
+
+  // 99 bios in [1024, 2048) ns and one slow one.
+  stats.bios = 100;
+  stats.bytes = 409600;
+  stats.alloc_failures = 2;
+  stats.latency_buckets[10] = 99;
+  stats.latency_buckets[16] = 1;
+  stats.latency_max_ns = 70000;
+  stats.latency_total_ns = 99 * 1500 + 70000;
+  stringstream out;
+  DiskWrapperBackend::WriteStats(out, stats);
+  EXPECT_EQ(out.str(), "captured 100 bios, 409600 bytes, 2 allocation "
+      "failures, capture latency mean 2.2 us, p50 2.0 us, p99 2.0 us, max "
+      "70.0 us\n");
+
+  stats.latency_buckets[10] = 98;
+  stats.latency_buckets[16] = 2;
+  stringstream slow;
+  DiskWrapperBackend::WriteStats(slow, stats);
+  EXPECT_NE(slow.str().find("p99 70.0 us"), string::npos);
+}
+
+// Each instance has its own device node.
+TEST(DiskWrapperBackend, InstanceDevicePath) {
+  DiskWrapperBackend backend(false);
+  EXPECT_EQ(backend.GetDevicePath(), "/dev/hwm0");
+  backend.SetInstance(3);
+  EXPECT_EQ(backend.GetDevicePath(), "/dev/hwm3");
+  // Nothing to remove if it was never added.
+  EXPECT_TRUE(backend.Remove());
+}
+
+}  // namespace test
+}  // namespace fs_testing
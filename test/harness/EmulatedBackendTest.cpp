@@ -0,0 +1,117 @@
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include "../../code/harness/SnapshotBackend.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::string;
+using std::vector;
+
+using fs_testing::utils::MemoryUsage;
+
+namespace {
+
+// 64 KB disk.
+static const unsigned long long kDiskSize = 64;
+static const unsigned int kPage = EmulatedBackend::kPageSize;
+
+vector<char> Read(EmulatedBackend &backend, const int fd,
+    const unsigned long long offset, const unsigned int size) {
+  vector<char> res(size, 'x');
+  EXPECT_TRUE(backend.DeviceRead(fd, offset, res.data(), size));
+  return res;
+}
+
+}  // namespace
+
+/*
+ * Writes to the disk are read back, including ones that straddle pages, and
+ * everything else reads as zeros.
+ */
+TEST(EmulatedBackend, ReadsBackWrites) {
+  EmulatedBackend backend(kDiskSize, false);
+  ASSERT_TRUE(backend.Insert());
+  const int fd = backend.DeviceOpen(backend.GetBasePath(), O_WRONLY);
+  ASSERT_EQ(fd, 0);
+  EXPECT_EQ(backend.DeviceOpen("/dev/nope", O_WRONLY), -1);
+
+  const vector<char> data(kPage, 'a');
+  EXPECT_TRUE(backend.DeviceWrite(fd, kPage - 100, data.data(), data.size()));
+  EXPECT_EQ(Read(backend, fd, kPage - 100, kPage), data);
+  EXPECT_EQ(Read(backend, fd, 0, kPage - 100),
+      vector<char>(kPage - 100, 0));
+  EXPECT_EQ(Read(backend, fd, 2 * kPage - 100, 100), vector<char>(100, 0));
+
+  // Nothing past the end of the disk.
+  EXPECT_FALSE(backend.DeviceWrite(fd, kDiskSize * 1024 - 1, data.data(), 2));
+}
+
+/*
+ * After Snapshot the disk is read-only and each snapshot starts out as a copy
+ * of it. Writes to one snapshot don't show up anywhere else and are dropped by
+ * Restore.
+ */
+TEST(EmulatedBackend, SnapshotsCopyOnWrite) {
+  EmulatedBackend backend(kDiskSize, false);
+  ASSERT_TRUE(backend.Insert());
+  const int disk_fd = backend.DeviceOpen(backend.GetBasePath(), O_WRONLY);
+  const vector<char> base(2 * kPage, 'b');
+  ASSERT_TRUE(backend.DeviceWrite(disk_fd, 0, base.data(), base.size()));
+  ASSERT_TRUE(backend.Snapshot());
+  EXPECT_FALSE(backend.DeviceWrite(disk_fd, 0, base.data(), 1));
+
+  const int first = backend.DeviceOpen(backend.GetSnapshotPath(1), O_WRONLY);
+  const int second = backend.DeviceOpen(backend.GetSnapshotPath(2), O_WRONLY);
+  ASSERT_EQ(first, 1);
+  ASSERT_EQ(second, 2);
+  EXPECT_EQ(Read(backend, first, 0, base.size()), base);
+
+  // Only part of the page is written, so the rest still comes from the disk.
+  const vector<char> data(512, 'c');
+  ASSERT_TRUE(backend.DeviceWrite(first, 512, data.data(), data.size()));
+  vector<char> expected(base);
+  std::fill(expected.begin() + 512, expected.begin() + 1024, 'c');
+  EXPECT_EQ(Read(backend, first, 0, base.size()), expected);
+  EXPECT_EQ(Read(backend, second, 0, base.size()), base);
+  EXPECT_EQ(Read(backend, disk_fd, 0, base.size()), base);
+
+  ASSERT_TRUE(backend.Restore(backend.GetSnapshotPath(1), first));
+  EXPECT_EQ(Read(backend, first, 0, base.size()), base);
+}
+
+/*
+ * Pages are only held for data that isn't zeros on top of zeros, and Wipe
+ * drops them all and makes the disk writable again.
+ */
+TEST(EmulatedBackend, MemoryAndWipe) {
+  EmulatedBackend backend(kDiskSize, false);
+  ASSERT_TRUE(backend.Insert());
+  const int disk_fd = backend.DeviceOpen(backend.GetBasePath(), O_WRONLY);
+  const vector<char> zeros(4 * kPage, 0);
+  ASSERT_TRUE(backend.DeviceWrite(disk_fd, 0, zeros.data(), zeros.size()));
+  EXPECT_EQ(backend.GetMemoryUsage().payload, 0);
+
+  const vector<char> data(kPage, 'd');
+  ASSERT_TRUE(backend.DeviceWrite(disk_fd, 0, data.data(), data.size()));
+  ASSERT_TRUE(backend.Snapshot());
+  const int fd = backend.DeviceOpen(backend.GetSnapshotPath(1), O_WRONLY);
+  // Zeros over data have to be kept.
+  ASSERT_TRUE(backend.DeviceWrite(fd, 0, zeros.data(), kPage));
+  EXPECT_EQ(Read(backend, fd, 0, kPage), vector<char>(kPage, 0));
+  EXPECT_EQ(backend.GetMemoryUsage().payload, 2 * kPage);
+
+  // Freed pages are kept around to be reused, but no longer hold data.
+  ASSERT_TRUE(backend.Wipe());
+  const MemoryUsage usage = backend.GetMemoryUsage();
+  EXPECT_EQ(usage.payload, 0);
+  EXPECT_GE(usage.overhead, 2 * kPage);
+  EXPECT_EQ(Read(backend, disk_fd, 0, kPage), vector<char>(kPage, 0));
+  EXPECT_TRUE(backend.DeviceWrite(disk_fd, 0, data.data(), data.size()));
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -0,0 +1,457 @@
+/*
+ * Measures Tester's crash state pipeline on EmulatedBackend, so it runs as any
+ * user without the kernel modules. A synthetic bio log is loaded as the
+ * profile on top of a base image, and test_check_random_permutations and
+ * test_check_log_replay are run with an ImageChecker that only makes sure the
+ * image's first page wasn't touched, in place of mount, fsck and the test
+ * case. After that the pieces are timed on their own: writing pages to a
+ * snapshot, restoring it, reading it back, and fingerprinting crash states to
+ * spot duplicate disk images. Run from this directory after building the
+ * permuters as
+ *
+ *   EmulatedReplayBench [-e epochs] [-o ops per epoch] [-p payload bytes]
+ *       [-n crash states] [-r ops per microbenchmark] [-s seed]
+ *       [-l permuter library]
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "../../code/disk_wrapper_ioctl.h"
+#include "../../code/harness/ImageChecker.h"
+#include "../../code/harness/SnapshotBackend.h"
+#include "../../code/harness/Tester.h"
+#include "../../code/results/PermuteTestResult.h"
+#include "../../code/utils/utils.h"
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+using fs_testing::tests::DataTestResult;
+using fs_testing::EmulatedBackend;
+using fs_testing::ImageChecker;
+using fs_testing::PermuteTestResult;
+using fs_testing::SingleTestInfo;
+using fs_testing::SnapshotBackend;
+using fs_testing::Tester;
+using fs_testing::permuter::Permuter;
+using fs_testing::utils::disk_write;
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+static const unsigned int kSectorSize = 512;
+static const unsigned int kPageSize = EmulatedBackend::kPageSize;
+// The log never writes below this, so the first page of the image is the same
+// in every crash state.
+static const unsigned long long kHeaderBytes = 1024 * 1024;
+// Pages written to a snapshot between restores in the microbenchmarks.
+static const unsigned int kBatchPages = 256;
+// Crash states fingerprinted over and over in the dedup microbenchmark.
+static const unsigned int kFingerprintStates = 1024;
+
+std::atomic<unsigned long long> allocations(0);
+
+struct LogShape {
+  unsigned int epochs = 50;
+  unsigned int ops_per_epoch = 20;
+  unsigned int payload = 4096;
+};
+
+/*
+ * A log as the wrapper module would record it: a leading checkpoint, then each
+ * epoch's writes ended by a flush and a checkpoint. Writes go one after the
+ * other past the header.
+ */
+vector<disk_write> MakeLog(const LogShape &shape) {
+  vector<disk_write> log;
+  struct disk_write_op_meta meta = {};
+  meta.bi_flags = HWM_CHECKPOINT_FLAG;
+  meta.bi_rw = HWM_CHECKPOINT_FLAG;
+  log.emplace_back(meta, (const char *) NULL);
+
+  unsigned long long offset = kHeaderBytes;
+  for (unsigned int e = 0; e < shape.epochs; ++e) {
+    const vector<char> payload(shape.payload, 'a' + e % 26);
+    for (unsigned int i = 0; i < shape.ops_per_epoch; ++i) {
+      meta = {};
+      meta.bi_rw = HWM_WRITE_FLAG;
+      meta.size = shape.payload;
+      meta.write_sector = offset / kSectorSize;
+      log.emplace_back(meta, payload.data());
+      offset += (shape.payload + kSectorSize - 1) / kSectorSize * kSectorSize;
+    }
+    meta = {};
+    meta.bi_rw = HWM_FLUSH_FLAG | HWM_WRITE_FLAG;
+    log.emplace_back(meta, (const char *) NULL);
+    meta = {};
+    meta.bi_flags = HWM_CHECKPOINT_FLAG;
+    meta.bi_rw = HWM_CHECKPOINT_FLAG;
+    meta.write_sector = e + 1;
+    log.emplace_back(meta, (const char *) NULL);
+  }
+  return log;
+}
+
+// Stands in for mount, fsck and the test case.
+class HeaderChecker : public ImageChecker {
+ public:
+  HeaderChecker(const vector<char> &header) :
+    header_(header), buf_(header.size()) { }
+
+  virtual void Check(SnapshotBackend &backend, const string &snapshot_path,
+      const unsigned int, SingleTestInfo &test_info) {
+    ++checks;
+    const int fd = backend.DeviceOpen(snapshot_path, O_RDONLY);
+    if (fd < 0 || !backend.DeviceRead(fd, 0, buf_.data(), buf_.size()) ||
+        buf_ != header_) {
+      test_info.data_test.SetError(DataTestResult::kFileDataCorrupted);
+      ++failures;
+    }
+    if (fd >= 0) {
+      backend.DeviceClose(fd);
+    }
+  }
+
+  unsigned int checks = 0;
+  unsigned int failures = 0;
+
+ private:
+  const vector<char> header_;
+  vector<char> buf_;
+};
+
+struct BenchResult {
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+template <typename Fn>
+BenchResult Run(const unsigned long long ops, Fn fn) {
+  const unsigned long long start_allocs = allocations.load();
+  const steady_clock::time_point start = steady_clock::now();
+  fn();
+  const nanoseconds elapsed =
+    duration_cast<nanoseconds>(steady_clock::now() - start);
+  const unsigned long long allocs = allocations.load() - start_allocs;
+  return {(double) elapsed.count() / std::max(ops, 1ULL),
+      (double) allocs / std::max(ops, 1ULL)};
+}
+
+void Report(const string &name, const string &unit,
+    const BenchResult &res) {
+  cout << std::left << std::setw(28) << name << std::setw(12) << unit <<
+    std::right << std::fixed << std::setprecision(1) << std::setw(14) <<
+    res.ns_per_op << std::setprecision(2) << std::setw(14) <<
+    res.allocs_per_op << endl;
+}
+
+}  // namespace
+
+/*
+ * Replacing the global allocator counts every allocation made, including the
+ * ones inside the standard library.
+ */
+void * operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *res = malloc((size == 0) ? 1 : size);
+  if (res == NULL) {
+    throw std::bad_alloc();
+  }
+  return res;
+}
+
+void * operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+// Kept out of line so GCC doesn't pair the free() with the operator new calls
+// it was inlined next to and warn about mismatched allocation functions.
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+  operator delete(ptr);
+}
+
+namespace fs_testing {
+namespace test {
+
+// Reaches the loaded permuter and the fingerprint used to spot duplicates.
+class TestTester {
+ public:
+  static Permuter* GetPermuter(Tester &tester) {
+    return tester.permuter_loader.get_instance();
+  }
+
+  static unsigned long long Fingerprint(Tester &tester,
+      const vector<DiskWriteData> &crash_state) {
+    return tester.get_image_fingerprint(crash_state);
+  }
+};
+
+}  // namespace test
+}  // namespace fs_testing
+
+int main(int argc, char **argv) {
+  LogShape shape;
+  unsigned int crash_states = 10000;
+  unsigned long long micro_ops = 1000000;
+  unsigned long long seed = 42;
+  string permuter_path = "../build/permuter/RandomPermuter.so";
+  for (int c = getopt(argc, argv, "e:o:p:n:r:s:l:"); c != -1;
+      c = getopt(argc, argv, "e:o:p:n:r:s:l:")) {
+    switch (c) {
+      case 'e':
+        shape.epochs = strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        shape.ops_per_epoch = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        shape.payload = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        crash_states = strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        micro_ops = strtoull(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'l':
+        permuter_path = optarg;
+        break;
+      case '?':
+      default:
+        return -1;
+    }
+  }
+  if (shape.epochs == 0 || shape.ops_per_epoch == 0 || shape.payload == 0) {
+    cerr << "Epochs, ops per epoch, and payload size must be positive" << endl;
+    return -1;
+  }
+
+  vector<disk_write> log = MakeLog(shape);
+  const unsigned long long log_bytes = (unsigned long long) shape.epochs *
+    shape.ops_per_epoch *
+    ((shape.payload + kSectorSize - 1) / kSectorSize * kSectorSize);
+  // In 1 KB blocks, rounded up to a whole MB.
+  const unsigned long long disk_size =
+    (kHeaderBytes + log_bytes + (1 << 20) - 1) / (1 << 20) * 1024;
+
+  string dir = (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+  dir += "/EmulatedReplayBenchXXXXXX";
+  if (mkdtemp(&dir[0]) == NULL) {
+    cerr << "Unable to make a scratch directory" << endl;
+    return -1;
+  }
+  const string profile_path = dir + "/profile";
+  const string image_path = dir + "/image";
+  {
+    ofstream profile(profile_path, std::ios::binary);
+    for (const disk_write &dw : log) {
+      disk_write::serialize(profile, dw);
+    }
+    // The header page stands in for a superblock, everything else is zeros.
+    ofstream image(image_path, std::ios::binary);
+    const vector<char> header(kPageSize, 'H');
+    const vector<char> zeros(kPageSize, 0);
+    image.write(header.data(), header.size());
+    for (unsigned long long i = 1; i < disk_size * 1024 / kPageSize; ++i) {
+      image.write(zeros.data(), zeros.size());
+    }
+  }
+
+  Tester tester(disk_size, kSectorSize, false);
+  HeaderChecker checker(vector<char>(kPageSize, 'H'));
+  tester.set_image_checker(&checker);
+  tester.set_permuter_seed(seed);
+  int res = SUCCESS;
+  if (!tester.set_snapshot_backend(EmulatedBackend::kName, "") ||
+      tester.insert_snapshot_devices() != SUCCESS ||
+      tester.log_profile_load(profile_path) != SUCCESS ||
+      tester.log_snapshot_load(image_path) != SUCCESS ||
+      tester.permuter_load_class(permuter_path.c_str()) != SUCCESS) {
+    cerr << "Unable to set up the tester" << endl;
+    res = -1;
+  }
+  unlink(profile_path.c_str());
+  unlink(image_path.c_str());
+  rmdir(dir.c_str());
+  if (res != SUCCESS) {
+    return -1;
+  }
+
+  cout << shape.epochs << " epochs of " << shape.ops_per_epoch << " ops, " <<
+    shape.payload << " byte payloads (" << log.size() <<
+    " log entries) on a " << disk_size / 1024 << " MB disk" << endl << endl;
+
+  ofstream results("/dev/null");
+  tester.StartTestSuite("random permutations");
+  steady_clock::time_point start = steady_clock::now();
+  tester.test_check_random_permutations(true, crash_states, results);
+  const unsigned int permuted = checker.checks;
+  const nanoseconds permute_time =
+    duration_cast<nanoseconds>(steady_clock::now() - start);
+  tester.EndTestSuite();
+
+  tester.StartTestSuite("log replay");
+  start = steady_clock::now();
+  tester.test_check_log_replay(results, false);
+  const unsigned int replayed = checker.checks - permuted;
+  const nanoseconds replay_time =
+    duration_cast<nanoseconds>(steady_clock::now() - start);
+  tester.EndTestSuite();
+
+  cout << endl << permuted << " crash states in " <<
+    duration_cast<std::chrono::milliseconds>(permute_time).count() <<
+    " ms (" << permute_time.count() / std::max(permuted, 1U) <<
+    " ns each), " << replayed << " checkpoints replayed in " <<
+    duration_cast<std::chrono::milliseconds>(replay_time).count() <<
+    " ms (" << replay_time.count() / std::max(replayed, 1U) << " ns each)" <<
+    endl;
+  tester.PrintTimingStats(cout);
+  tester.PrintTestStats(cout);
+
+  cout << std::left << std::setw(28) << "benchmark" << std::setw(12) <<
+    "per" << std::right << std::setw(14) << "ns/op" << std::setw(14) <<
+    "allocs/op" << endl;
+
+  // Each batch dirties kBatchPages pages of a snapshot and restores it.
+  EmulatedBackend backend(disk_size, false);
+  backend.Insert();
+  const int disk_fd = backend.DeviceOpen(backend.GetBasePath(), O_WRONLY);
+  const vector<char> page(kPageSize, 'b');
+  for (unsigned long long i = 0; i < disk_size * 1024 / kPageSize; ++i) {
+    backend.DeviceWrite(disk_fd, i * kPageSize, page.data(), page.size());
+  }
+  backend.Snapshot();
+  const string snapshot_path = backend.GetSnapshotPath(1);
+  const int fd = backend.DeviceOpen(snapshot_path, O_WRONLY);
+  const unsigned long long disk_pages = disk_size * 1024 / kPageSize;
+  const unsigned long long batches =
+    std::max(micro_ops / kBatchPages, 1ULL);
+  const vector<char> data(kPageSize, 'c');
+  vector<char> buf(kPageSize);
+  unsigned long long next = 0;
+  nanoseconds write_time(0);
+  nanoseconds read_time(0);
+  nanoseconds restore_time(0);
+  unsigned long long write_allocs = 0;
+  unsigned long long read_allocs = 0;
+  unsigned long long restore_allocs = 0;
+  bool ok = true;
+  for (unsigned long long b = 0; b < batches; ++b) {
+    const unsigned long long first = next;
+    BenchResult batch = Run(kBatchPages, [&]() {
+      for (unsigned int i = 0; i < kBatchPages; ++i) {
+        ok &= backend.DeviceWrite(fd, (next++ % disk_pages) * kPageSize,
+            data.data(), data.size());
+      }
+    });
+    write_time += nanoseconds((long long) (batch.ns_per_op * kBatchPages));
+    write_allocs += batch.allocs_per_op * kBatchPages;
+    batch = Run(kBatchPages, [&]() {
+      for (unsigned int i = 0; i < kBatchPages; ++i) {
+        ok &= backend.DeviceRead(fd, ((first + i) % disk_pages) * kPageSize,
+            buf.data(), buf.size());
+      }
+    });
+    read_time += nanoseconds((long long) (batch.ns_per_op * kBatchPages));
+    read_allocs += batch.allocs_per_op * kBatchPages;
+    batch = Run(1, [&]() {
+      ok &= backend.Restore(snapshot_path, fd);
+    });
+    restore_time += nanoseconds((long long) batch.ns_per_op);
+    restore_allocs += batch.allocs_per_op;
+  }
+  const unsigned long long pages = batches * kBatchPages;
+  Report("DeviceWrite", "page",
+      {(double) write_time.count() / pages, (double) write_allocs / pages});
+  Report("DeviceRead", "page",
+      {(double) read_time.count() / pages, (double) read_allocs / pages});
+  Report("Restore", "dirty page",
+      {(double) restore_time.count() / pages,
+      (double) restore_allocs / pages});
+  Report("Restore", "call",
+      {(double) restore_time.count() / batches,
+      (double) restore_allocs / batches});
+
+  // Fingerprint the same crash states over and over, as the adaptive budget
+  // does for every crash state tested. A crash state costs about as much as
+  // the bios in it, so the ops here are bios.
+  Permuter *p = fs_testing::test::TestTester::GetPermuter(tester);
+  vector<vector<DiskWriteData>> states;
+  unsigned long long state_bios = 0;
+  for (unsigned int i = 0; i < kFingerprintStates; ++i) {
+    vector<DiskWriteData> state;
+    PermuteTestResult state_data;
+    if (p->RegenerateCrashState(i, true, state, state_data)) {
+      state_bios += state.size();
+      states.push_back(std::move(state));
+    }
+  }
+  if (state_bios > 0) {
+    std::unordered_set<unsigned long long> images;
+    const unsigned long long rounds = std::max(micro_ops / state_bios, 1ULL);
+    Report("get_image_fingerprint", "bio", Run(rounds * state_bios, [&]() {
+      for (unsigned long long r = 0; r < rounds; ++r) {
+        for (const vector<DiskWriteData> &state : states) {
+          images.insert(
+              fs_testing::test::TestTester::Fingerprint(tester, state));
+        }
+      }
+    }));
+    cout << states.size() << " crash states of " <<
+      state_bios / states.size() << " bios on average, " << images.size() <<
+      " distinct images" << endl;
+  }
+  backend.DeviceClose(fd);
+  backend.DeviceClose(disk_fd);
+  backend.Remove();
+  tester.remove_snapshot_devices();
+  tester.permuter_unload_class();
+
+  if (!ok) {
+    cerr << "Emulated backend microbenchmark failed" << endl;
+    return -1;
+  }
+  if (checker.checks == 0 || checker.failures > 0) {
+    cerr << checker.failures << " of " << checker.checks <<
+      " crash states had a changed header" << endl;
+    return -1;
+  }
+  return 0;
+}
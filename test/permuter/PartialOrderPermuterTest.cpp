@@ -0,0 +1,148 @@
+#include <set>
+#include <vector>
+
+#include "../../code/disk_wrapper_ioctl.h"
+#include "../../code/permuter/PartialOrderPermuter.h"
+#include "../../code/results/PermuteTestResult.h"
+#include "../../code/utils/utils.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::set;
+using std::vector;
+
+using fs_testing::permuter::CrashStateEstimate;
+using fs_testing::permuter::PartialOrderPermuter;
+using fs_testing::utils::disk_write;
+using fs_testing::utils::DiskWriteData;
+
+/*
+ * Log with a single, unterminated epoch of four writes where the second write
+ * completely overwrites the first:
+ *    abs_index 1: sectors [0, 8)
+ *    abs_index 2: sectors [0, 8)
+ *    abs_index 3: sectors [64, 72)
+ *    abs_index 4: sectors [128, 136)
+ */
+static vector<disk_write> MakeShadowedLog() {
+  vector<disk_write> log;
+
+  disk_write checkpoint;
+  checkpoint.metadata.write_sector = 0;
+  checkpoint.metadata.bi_flags = HWM_CHECKPOINT_FLAG;
+  checkpoint.metadata.bi_rw = HWM_CHECKPOINT_FLAG;
+  checkpoint.metadata.size = 0;
+  checkpoint.metadata.time_ns = 0;
+  log.push_back(checkpoint);
+
+  const unsigned int sectors[] = {0, 0, 64, 128};
+  for (const unsigned int sector : sectors) {
+    disk_write write;
+    write.metadata.write_sector = sector;
+    write.metadata.size = 4096;
+    write.metadata.bi_rw = HWM_WRITE_FLAG;
+    log.push_back(write);
+  }
+
+  return log;
+}
+
+/*
+ * A crash state that keeps both the first write and the write that covers it
+ * looks the same on disk as one that drops the first write, so only the latter
+ * should be generated. The one exception is the crash state with the entire
+ * epoch, which is always returned as-is.
+ */
+TEST(PartialOrderPermuter, BioStatesSkipShadowedWrites) {
+  vector<disk_write> log = MakeShadowedLog();
+  PartialOrderPermuter p(&log);
+  p.InitDataVector(512, log);
+
+  vector<DiskWriteData> res;
+  PermuteTestResult log_data;
+  unsigned int num_states = 0;
+  while (p.GenerateCrashState(res, log_data)) {
+    ++num_states;
+    set<unsigned int> kept;
+    for (const DiskWriteData &dwd : res) {
+      kept.insert(dwd.bio_index);
+    }
+    if (kept.count(1) && kept.count(2)) {
+      EXPECT_EQ(res.size(), 4);
+    }
+  }
+
+  // Proper subsets fall into 3 * 2 * 2 - 1 classes depending on which of the
+  // first two writes (if any) is visible and whether each of the other two
+  // writes is present. The full epoch adds one more.
+  EXPECT_EQ(num_states, 12);
+  EXPECT_GT(p.GetNumPrunedStates(), 0);
+
+  // The estimate counts every non-empty subset, folded or not.
+  const CrashStateEstimate estimate = p.EstimateCrashStates(true);
+  EXPECT_FALSE(estimate.exact);
+  EXPECT_DOUBLE_EQ(estimate.Total(), 15);
+}
+
+/*
+ * Sector crash states never need to keep two sectors for the same disk
+ * location since only the later one is visible.
+ */
+TEST(PartialOrderPermuter, SectorStatesSkipShadowedSectors) {
+  vector<disk_write> log = MakeShadowedLog();
+  PartialOrderPermuter p(&log);
+  p.InitDataVector(2048, log);
+
+  vector<DiskWriteData> res;
+  PermuteTestResult log_data;
+  unsigned int num_states = 0;
+  while (p.GenerateSectorCrashState(res, log_data)) {
+    ++num_states;
+    set<unsigned int> offsets;
+    for (const DiskWriteData &dwd : res) {
+      EXPECT_TRUE(offsets.insert(dwd.disk_offset).second);
+    }
+  }
+
+  EXPECT_GT(num_states, 0);
+  EXPECT_GT(p.GetNumPrunedStates(), 0);
+}
+
+/*
+ * Any crash state can be recreated from its index alone, without generating
+ * the states before it.
+ */
+TEST(PartialOrderPermuter, RegenerateCrashState) {
+  vector<disk_write> log = MakeShadowedLog();
+  PartialOrderPermuter p(&log);
+  p.InitDataVector(512, log);
+  p.SetSeed(1234);
+
+  vector<vector<DiskWriteData>> states;
+  vector<unsigned long long> indices;
+  vector<DiskWriteData> res;
+  PermuteTestResult log_data;
+  while (p.GenerateCrashState(res, log_data)) {
+    states.push_back(res);
+    indices.push_back(log_data.state_index);
+  }
+  ASSERT_FALSE(states.empty());
+
+  PartialOrderPermuter fresh(&log);
+  fresh.InitDataVector(512, log);
+  fresh.SetSeed(1234);
+  // Go backwards so nothing depends on the order states are asked for.
+  for (unsigned int i = states.size(); i > 0; --i) {
+    ASSERT_TRUE(fresh.RegenerateCrashState(indices.at(i - 1), true, res,
+          log_data));
+    EXPECT_EQ(log_data.state_index, indices.at(i - 1));
+    ASSERT_EQ(res.size(), states.at(i - 1).size());
+    for (unsigned int j = 0; j < res.size(); ++j) {
+      EXPECT_EQ(res.at(j).bio_index, states.at(i - 1).at(j).bio_index);
+    }
+  }
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -0,0 +1,350 @@
+/*
+ * Measures the parts of CrashMonkey that work on recorded logs without needing
+ * root or the kernel modules. A synthetic bio log is made up with the given
+ * shape and fed to the permuter, the log serialization code, DiskMod
+ * serialization, and the DiskContents directory scan (on a tree in /dev/shm if
+ * it exists, else /tmp). Each line gives the time and heap allocations per
+ * operation. Run as
+ *
+ *   SyntheticLogBench [-e epochs] [-o ops per epoch] [-v overlap percent]
+ *       [-p payload bytes] [-n crash states] [-s seed]
+ */
+
+#include <ftw.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../../code/disk_wrapper_ioctl.h"
+#include "../../code/harness/DiskContents.h"
+#include "../../code/permuter/RandomPermuter.h"
+#include "../../code/results/PermuteTestResult.h"
+#include "../../code/utils/DiskMod.h"
+#include "../../code/utils/utils.h"
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+using fs_testing::DiskContents;
+using fs_testing::PermuteTestResult;
+using fs_testing::permuter::epoch_op;
+using fs_testing::permuter::EpochOpSector;
+using fs_testing::permuter::RandomPermuter;
+using fs_testing::utils::disk_write;
+using fs_testing::utils::DiskMod;
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+static const unsigned int kSectorSize = 512;
+// Times to repeat the cheaper benchmarks so they run long enough to time.
+static const unsigned int kReps = 20;
+static const unsigned int kTreeDirs = 16;
+static const unsigned int kTreeFilesPerDir = 16;
+
+std::atomic<unsigned long long> allocations(0);
+
+struct LogShape {
+  unsigned int epochs = 50;
+  unsigned int ops_per_epoch = 20;
+  unsigned int overlap_percent = 10;
+  unsigned int payload = 4096;
+};
+
+/*
+ * A log as the wrapper module would record it: a leading checkpoint, then each
+ * epoch's writes ended by a flush. overlap_percent of the writes go to the
+ * sectors of an earlier write instead of a new spot on the disk.
+ */
+vector<disk_write> MakeLog(const LogShape &shape, std::mt19937_64 &rand) {
+  const unsigned int payload_sectors =
+    (shape.payload + kSectorSize - 1) / kSectorSize;
+  const vector<char> payload(shape.payload, 'a');
+  vector<disk_write> log;
+  vector<unsigned long long> sectors;
+
+  struct disk_write_op_meta meta = {};
+  meta.bi_flags = HWM_CHECKPOINT_FLAG;
+  meta.bi_rw = HWM_CHECKPOINT_FLAG;
+  log.emplace_back(meta, (const char *) NULL);
+
+  for (unsigned int e = 0; e < shape.epochs; ++e) {
+    for (unsigned int i = 0; i < shape.ops_per_epoch; ++i) {
+      meta = {};
+      meta.bi_rw = HWM_WRITE_FLAG;
+      meta.size = shape.payload;
+      if (!sectors.empty() && rand() % 100 < shape.overlap_percent) {
+        meta.write_sector = sectors.at(rand() % sectors.size());
+      } else {
+        meta.write_sector = sectors.size() * payload_sectors;
+      }
+      sectors.push_back(meta.write_sector);
+      log.emplace_back(meta, payload.data());
+    }
+    meta = {};
+    meta.bi_rw = HWM_FLUSH_FLAG | HWM_WRITE_FLAG;
+    log.emplace_back(meta, (const char *) NULL);
+  }
+  return log;
+}
+
+// Exposes CoalesceSectors, which is only meant for permuter implementations.
+class BenchPermuter : public RandomPermuter {
+ public:
+  BenchPermuter(vector<disk_write> *data) : RandomPermuter(data) { }
+  using RandomPermuter::CoalesceSectors;
+};
+
+struct BenchResult {
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+template <typename Fn>
+BenchResult Run(const unsigned long long ops, Fn fn) {
+  const unsigned long long start_allocs = allocations.load();
+  const steady_clock::time_point start = steady_clock::now();
+  fn();
+  const nanoseconds elapsed =
+    duration_cast<nanoseconds>(steady_clock::now() - start);
+  const unsigned long long allocs = allocations.load() - start_allocs;
+  return {(double) elapsed.count() / std::max(ops, 1ULL),
+      (double) allocs / std::max(ops, 1ULL)};
+}
+
+void Report(const string &name, const string &unit,
+    const BenchResult &res) {
+  cout << std::left << std::setw(28) << name << std::setw(12) << unit <<
+    std::right << std::fixed << std::setprecision(1) << std::setw(14) <<
+    res.ns_per_op << std::setprecision(2) << std::setw(14) <<
+    res.allocs_per_op << endl;
+}
+
+int RemoveEntry(const char *path, const struct stat *, int, struct FTW *) {
+  return remove(path);
+}
+
+}  // namespace
+
+/*
+ * Replacing the global allocator counts every allocation made, including the
+ * ones inside the standard library.
+ */
+void * operator new(std::size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  void *res = malloc((size == 0) ? 1 : size);
+  if (res == NULL) {
+    throw std::bad_alloc();
+  }
+  return res;
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+namespace fs_testing {
+namespace test {
+
+// Reaches the directory scan DiskContents does before comparing two disks.
+class TestDiskContents {
+ public:
+  static unsigned int Scan(DiskContents &contents, const string &path) {
+    contents.set_mount_point(path);
+    contents.contents.clear();
+    contents.get_contents(path.c_str());
+    return contents.contents.size();
+  }
+};
+
+}  // namespace test
+}  // namespace fs_testing
+
+int main(int argc, char **argv) {
+  LogShape shape;
+  unsigned int crash_states = 10000;
+  unsigned long long seed = 42;
+  for (int c = getopt(argc, argv, "e:o:v:p:n:s:"); c != -1;
+      c = getopt(argc, argv, "e:o:v:p:n:s:")) {
+    switch (c) {
+      case 'e':
+        shape.epochs = strtoul(optarg, NULL, 0);
+        break;
+      case 'o':
+        shape.ops_per_epoch = strtoul(optarg, NULL, 0);
+        break;
+      case 'v':
+        shape.overlap_percent = strtoul(optarg, NULL, 0);
+        break;
+      case 'p':
+        shape.payload = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        crash_states = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case '?':
+      default:
+        return -1;
+    }
+  }
+  if (shape.epochs == 0 || shape.ops_per_epoch == 0 || shape.payload == 0) {
+    cerr << "Epochs, ops per epoch, and payload size must be positive" << endl;
+    return -1;
+  }
+
+  std::mt19937_64 rand(seed);
+  vector<disk_write> log = MakeLog(shape, rand);
+  cout << shape.epochs << " epochs of " << shape.ops_per_epoch << " ops, " <<
+    shape.overlap_percent << "% overlapping, " << shape.payload <<
+    " byte payloads (" << log.size() << " log entries)" << endl << endl;
+  cout << std::left << std::setw(28) << "benchmark" << std::setw(12) <<
+    "per" << std::right << std::setw(14) << "ns/op" << std::setw(14) <<
+    "allocs/op" << endl;
+
+  Report("InitDataVector", "log entry", Run(log.size() * kReps, [&]() {
+    for (unsigned int i = 0; i < kReps; ++i) {
+      RandomPermuter p(&log);
+      p.InitDataVector(kSectorSize, log);
+    }
+  }));
+
+  BenchPermuter permuter(&log);
+  permuter.InitDataVector(kSectorSize, log);
+  permuter.SetSeed(seed);
+  vector<DiskWriteData> res;
+  PermuteTestResult log_data;
+  Report("GenerateCrashState", "call", Run(crash_states, [&]() {
+    for (unsigned int i = 0; i < crash_states; ++i) {
+      permuter.GenerateCrashState(res, log_data);
+    }
+  }));
+
+  BenchPermuter sector_permuter(&log);
+  sector_permuter.InitDataVector(kSectorSize, log);
+  sector_permuter.SetSeed(seed);
+  Report("GenerateSectorCrashState", "call", Run(crash_states, [&]() {
+    for (unsigned int i = 0; i < crash_states; ++i) {
+      sector_permuter.GenerateSectorCrashState(res, log_data);
+    }
+  }));
+
+  // Every sector of the log in order, as the sector permuters build them.
+  vector<epoch_op> ops;
+  for (unsigned int i = 0; i < log.size(); ++i) {
+    if (log.at(i).metadata.size > 0) {
+      ops.push_back({i, log.at(i)});
+    }
+  }
+  vector<EpochOpSector> sectors;
+  for (epoch_op &op : ops) {
+    const vector<EpochOpSector> op_sectors = op.ToSectors(kSectorSize);
+    sectors.insert(sectors.end(), op_sectors.begin(), op_sectors.end());
+  }
+  Report("CoalesceSectors", "sector", Run(sectors.size() * kReps, [&]() {
+    for (unsigned int i = 0; i < kReps; ++i) {
+      vector<EpochOpSector> copy(sectors);
+      permuter.CoalesceSectors(copy);
+    }
+  }));
+
+  string dir = (access("/dev/shm", W_OK) == 0) ? "/dev/shm" : "/tmp";
+  dir += "/SyntheticLogBenchXXXXXX";
+  if (mkdtemp(&dir[0]) == NULL) {
+    cerr << "Unable to make a scratch directory" << endl;
+    return -1;
+  }
+
+  const string log_path = dir + "/log";
+  Report("disk_write::serialize", "log entry", Run(log.size(), [&]() {
+    ofstream out(log_path, std::ios::binary);
+    for (const disk_write &dw : log) {
+      disk_write::serialize(out, dw);
+    }
+  }));
+  Report("disk_write::deserialize", "log entry", Run(log.size(), [&]() {
+    ifstream in(log_path, std::ios::binary);
+    for (unsigned int i = 0; i < log.size(); ++i) {
+      disk_write::deserialize(in);
+    }
+  }));
+
+  // One data write per logged write, like a workload that only writes files.
+  vector<DiskMod> mods(ops.size());
+  const vector<char> payload(shape.payload, 'a');
+  for (unsigned int i = 0; i < mods.size(); ++i) {
+    DiskMod &mod = mods.at(i);
+    mod.path = "/mnt/snapshot/dir" + std::to_string(i % kTreeDirs) + "/file" +
+      std::to_string(i);
+    mod.mod_type = DiskMod::kDataMod;
+    mod.file_mod_location = (unsigned long long) i * shape.payload;
+    mod.file_mod_len = shape.payload;
+    mod.file_mod_data.reset(new char[shape.payload],
+        [](char *c) {delete[] c;});
+    memcpy(mod.file_mod_data.get(), payload.data(), shape.payload);
+  }
+  vector<std::shared_ptr<char>> serialized(mods.size());
+  Report("DiskMod::Serialize", "mod", Run(mods.size(), [&]() {
+    for (unsigned int i = 0; i < mods.size(); ++i) {
+      unsigned long long size = 0;
+      serialized.at(i) = DiskMod::Serialize(mods.at(i), &size);
+    }
+  }));
+  Report("DiskMod::Deserialize", "mod", Run(mods.size(), [&]() {
+    DiskMod mod;
+    for (unsigned int i = 0; i < serialized.size(); ++i) {
+      DiskMod::Deserialize(serialized.at(i), mod);
+    }
+  }));
+
+  // A tree of small files like the ones workloads leave behind.
+  const string tree = dir + "/tree";
+  mkdir(tree.c_str(), 0777);
+  for (unsigned int d = 0; d < kTreeDirs; ++d) {
+    const string sub = tree + "/dir" + std::to_string(d);
+    mkdir(sub.c_str(), 0777);
+    for (unsigned int f = 0; f < kTreeFilesPerDir; ++f) {
+      ofstream file(sub + "/file" + std::to_string(f));
+      file.write(payload.data(), payload.size());
+    }
+  }
+  DiskContents contents(tree, "tmpfs");
+  unsigned int entries = 0;
+  const BenchResult scan = Run(kTreeDirs * (kTreeFilesPerDir + 1), [&]() {
+    entries = fs_testing::test::TestDiskContents::Scan(contents, tree);
+  });
+  Report("DiskContents scan", "entry", scan);
+
+  nftw(dir.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+  if (entries != kTreeDirs * (kTreeFilesPerDir + 1)) {
+    cerr << "DiskContents found " << entries << " entries, expected " <<
+      kTreeDirs * (kTreeFilesPerDir + 1) << endl;
+    return -1;
+  }
+  return 0;
+}
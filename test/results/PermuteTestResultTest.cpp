@@ -0,0 +1,105 @@
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include "../../code/results/PermuteTestResult.h"
+#include "../../code/utils/utils.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::shared_ptr;
+using std::stringstream;
+using std::vector;
+
+using fs_testing::PermuteTestResult;
+using fs_testing::utils::DiskWriteData;
+
+/*
+ * A sector crash state survives a trip through a descriptor with everything
+ * needed to identify its writes intact. Sector crash states start with the full
+ * bios of the epochs before the crash.
+ */
+TEST(PermuteTestResult, DescriptorRoundTripSectors) {
+  PermuteTestResult written;
+  written.last_checkpoint = 3;
+  written.state_index = 8123;
+  for (unsigned int i = 0; i < 2; ++i) {
+    written.crash_state.emplace_back(true, i + 1, 0, 4096 * i, 4096,
+        shared_ptr<char>(), 0);
+  }
+  for (unsigned int i = 0; i < 5; ++i) {
+    written.crash_state.emplace_back(false, i + 10, i % 2, 4096 * i, 512,
+        shared_ptr<char>(), 0);
+  }
+
+  stringstream ss;
+  ASSERT_TRUE(written.WriteDescriptor(ss, 0xdeadbeefcafeULL, 42, 512));
+
+  PermuteTestResult read;
+  unsigned long long profile_id;
+  unsigned int test_num;
+  unsigned int sector_size;
+  ASSERT_TRUE(read.ReadDescriptor(ss, profile_id, test_num, sector_size));
+  EXPECT_EQ(profile_id, 0xdeadbeefcafeULL);
+  EXPECT_EQ(test_num, 42);
+  EXPECT_EQ(sector_size, 512);
+  EXPECT_EQ(read.last_checkpoint, 3);
+  EXPECT_EQ(read.state_index, 8123);
+  ASSERT_EQ(read.crash_state.size(), written.crash_state.size());
+  for (unsigned int i = 0; i < read.crash_state.size(); ++i) {
+    EXPECT_EQ(read.crash_state.at(i).full_bio,
+        written.crash_state.at(i).full_bio);
+    EXPECT_EQ(read.crash_state.at(i).bio_index,
+        written.crash_state.at(i).bio_index);
+    EXPECT_EQ(read.crash_state.at(i).bio_sector_index,
+        written.crash_state.at(i).bio_sector_index);
+  }
+
+  // Nothing left in the stream.
+  EXPECT_FALSE(read.ReadDescriptor(ss, profile_id, test_num, sector_size));
+}
+
+/*
+ * Full bios without data (the flush half of a split flush) are marked so they
+ * aren't rebuilt with the data of the bio they share an index with.
+ */
+TEST(PermuteTestResult, DescriptorFullBioNoData) {
+  PermuteTestResult written;
+  written.last_checkpoint = 0;
+  written.crash_state.emplace_back(true, 1, 0, 0, 4096, shared_ptr<char>(),
+      0);
+  written.crash_state.emplace_back(true, 2, 0, 0, 0, shared_ptr<char>(), 0);
+
+  stringstream ss;
+  ASSERT_TRUE(written.WriteDescriptor(ss, 1, 1, 512));
+  ASSERT_TRUE(written.WriteDescriptor(ss, 1, 2, 512));
+
+  PermuteTestResult read;
+  unsigned long long profile_id;
+  unsigned int test_num;
+  unsigned int sector_size;
+  for (unsigned int i = 1; i <= 2; ++i) {
+    ASSERT_TRUE(read.ReadDescriptor(ss, profile_id, test_num, sector_size));
+    EXPECT_EQ(test_num, i);
+    EXPECT_EQ(sector_size, 512);
+    ASSERT_EQ(read.crash_state.size(), 2);
+    EXPECT_TRUE(read.crash_state.at(0).full_bio);
+    EXPECT_EQ(read.crash_state.at(0).bio_sector_index, 0);
+    EXPECT_TRUE(read.crash_state.at(1).full_bio);
+    EXPECT_EQ(read.crash_state.at(1).bio_sector_index,
+        PermuteTestResult::kNoDataSector);
+  }
+}
+
+TEST(PermuteTestResult, DescriptorRejectsGarbage) {
+  stringstream ss("definitely not a crash state descriptor");
+  PermuteTestResult read;
+  unsigned long long profile_id;
+  unsigned int test_num;
+  unsigned int sector_size;
+  EXPECT_FALSE(read.ReadDescriptor(ss, profile_id, test_num, sector_size));
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../../code/results/ProgressJournal.h"
+#include "../../code/results/SingleTestInfo.h"
+#include "../../code/utils/utils.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+using fs_testing::ProgressJournal;
+using fs_testing::SingleTestInfo;
+using fs_testing::tests::DataTestResult;
+using fs_testing::utils::DiskWriteData;
+
+static const unsigned long long kProfileId = 0x1234abcdULL;
+static const string kPermuter = "RandomPermuter.so";
+
+static string TempJournalPath() {
+  char path[] = "/tmp/ProgressJournalTestXXXXXX";
+  const int fd = mkstemp(path);
+  close(fd);
+  unlink(path);
+  return path;
+}
+
+static SingleTestInfo MakeTestInfo(unsigned int test_num) {
+  SingleTestInfo test_info;
+  test_info.test_num = test_num;
+  test_info.permute_data.last_checkpoint = 1;
+  test_info.permute_data.state_index = test_num * 3;
+  for (unsigned int i = 0; i < test_num; ++i) {
+    test_info.permute_data.crash_state.emplace_back(true, i + 1, 0, 4096 * i,
+        4096, shared_ptr<char>(), 0);
+  }
+  if (test_num % 2) {
+    test_info.fs_test.SetError(FileSystemTestResult::kFixed);
+    test_info.data_test.SetError(DataTestResult::kFileMissing);
+  }
+  return test_info;
+}
+
+/*
+ * Records survive closing the journal, and reopening it hands back the seed
+ * the run was started with instead of the one passed in.
+ */
+TEST(ProgressJournal, ReopenReturnsRecords) {
+  const string path = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 77;
+    ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, true, 512,
+          seed, done));
+    EXPECT_TRUE(done.empty());
+    for (unsigned int i = 1; i <= 40; ++i) {
+      EXPECT_TRUE(journal.Append(MakeTestInfo(i)));
+    }
+  }
+
+  ProgressJournal journal;
+  vector<SingleTestInfo> done;
+  unsigned long long seed = 5;
+  ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, true, 512, seed, done));
+  EXPECT_EQ(seed, 77);
+  ASSERT_EQ(done.size(), 40);
+  for (unsigned int i = 0; i < done.size(); ++i) {
+    const SingleTestInfo expected = MakeTestInfo(i + 1);
+    EXPECT_EQ(done.at(i).test_num, expected.test_num);
+    EXPECT_EQ(done.at(i).permute_data.state_index,
+        expected.permute_data.state_index);
+    EXPECT_EQ(done.at(i).permute_data.crash_state.size(), i + 1);
+    EXPECT_EQ(done.at(i).fs_test.GetError(), expected.fs_test.GetError());
+    EXPECT_EQ(done.at(i).data_test.GetError(), expected.data_test.GetError());
+    EXPECT_EQ(done.at(i).GetTestResult(), expected.GetTestResult());
+  }
+  journal.Close();
+  unlink(path.c_str());
+}
+
+/*
+ * A record cut off partway through is dropped and overwritten by the next one.
+ */
+TEST(ProgressJournal, TornRecordDiscarded) {
+  const string path = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 1;
+    ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, false, 512,
+          seed, done));
+    EXPECT_TRUE(journal.Append(MakeTestInfo(1)));
+    EXPECT_TRUE(journal.Append(MakeTestInfo(2)));
+  }
+  FILE *f = fopen(path.c_str(), "r+");
+  ASSERT_NE(f, nullptr);
+  fseek(f, 0, SEEK_END);
+  ASSERT_EQ(ftruncate(fileno(f), ftell(f) - 6), 0);
+  fclose(f);
+
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 1;
+    ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, false, 512,
+          seed, done));
+    ASSERT_EQ(done.size(), 1);
+    EXPECT_TRUE(journal.Append(MakeTestInfo(3)));
+  }
+
+  ProgressJournal journal;
+  vector<SingleTestInfo> done;
+  unsigned long long seed = 1;
+  ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, false, 512,
+        seed, done));
+  ASSERT_EQ(done.size(), 2);
+  EXPECT_EQ(done.at(1).test_num, 3);
+  journal.Close();
+  unlink(path.c_str());
+}
+
+/*
+ * A journal from a different profile, permuter, or replay mode can't be
+ * continued.
+ */
+TEST(ProgressJournal, MismatchedRunRejected) {
+  const string path = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 1;
+    ASSERT_TRUE(journal.Open(path, kProfileId, kPermuter, true, 512,
+          seed, done));
+  }
+
+  ProgressJournal journal;
+  vector<SingleTestInfo> done;
+  unsigned long long seed = 1;
+  EXPECT_FALSE(journal.Open(path, kProfileId + 1, kPermuter, true, 512,
+        seed, done));
+  EXPECT_FALSE(journal.Open(path, kProfileId, kPermuter, false, 512,
+        seed, done));
+  EXPECT_FALSE(journal.Open(path, kProfileId, kPermuter, true, 4096,
+        seed, done));
+  EXPECT_FALSE(journal.Open(path, kProfileId, "PartialOrderPermuter.so", true,
+        512, seed, done));
+  unlink(path.c_str());
+}
+
+/*
+ * Journals from runs over different ranges of crash states merge into one list
+ * ordered by state index. A crash state both runs tested is kept once.
+ */
+TEST(ProgressJournal, MergeShards) {
+  const string first = TempJournalPath();
+  const string second = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 3;
+    ASSERT_TRUE(journal.Open(first, kProfileId, kPermuter, true, 512,
+          seed, done));
+    for (unsigned int i = 1; i <= 3; ++i) {
+      EXPECT_TRUE(journal.Append(MakeTestInfo(i)));
+    }
+  }
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 3;
+    ASSERT_TRUE(journal.Open(second, kProfileId, kPermuter, true, 512,
+          seed, done));
+    // Same crash state as test 2 of the first journal, from a later attempt.
+    SingleTestInfo dup = MakeTestInfo(2);
+    dup.permute_data.state_index = 100;
+    EXPECT_TRUE(journal.Append(dup));
+    EXPECT_TRUE(journal.Append(MakeTestInfo(4)));
+  }
+
+  ProgressJournal::Header header;
+  vector<SingleTestInfo> merged;
+  ASSERT_TRUE(ProgressJournal::Merge({second, first}, header, merged));
+  EXPECT_EQ(header.profile_id, kProfileId);
+  EXPECT_EQ(header.permuter, kPermuter);
+  EXPECT_EQ(header.seed, 3);
+  EXPECT_TRUE(header.full_bio);
+  ASSERT_EQ(merged.size(), 4);
+  for (unsigned int i = 0; i < merged.size(); ++i) {
+    EXPECT_EQ(merged.at(i).test_num, i + 1);
+    EXPECT_EQ(merged.at(i).permute_data.state_index, (i + 1) * 3);
+    EXPECT_EQ(merged.at(i).permute_data.crash_state.size(), i + 1);
+  }
+
+  // The merged journal reads back the same way.
+  const string out = TempJournalPath();
+  ASSERT_TRUE(ProgressJournal::Write(out, header, merged));
+  ProgressJournal::Header out_header;
+  vector<SingleTestInfo> out_records;
+  ASSERT_TRUE(ProgressJournal::Read(out, out_header, out_records));
+  EXPECT_EQ(out_header.permuter, kPermuter);
+  EXPECT_EQ(out_header.seed, 3);
+  ASSERT_EQ(out_records.size(), 4);
+  EXPECT_EQ(out_records.at(3).permute_data.state_index, 12);
+  unlink(out.c_str());
+
+  // A journal from another seed can't be merged in.
+  const string other = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 4;
+    ASSERT_TRUE(journal.Open(other, kProfileId, kPermuter, true, 512,
+          seed, done));
+  }
+  EXPECT_FALSE(ProgressJournal::Merge({first, other}, header, merged));
+
+  // Nor can one from another permuter with the same seed.
+  const string other_permuter = TempJournalPath();
+  {
+    ProgressJournal journal;
+    vector<SingleTestInfo> done;
+    unsigned long long seed = 3;
+    ASSERT_TRUE(journal.Open(other_permuter, kProfileId,
+          "PartialOrderPermuter.so", true, 512, seed, done));
+  }
+  EXPECT_FALSE(ProgressJournal::Merge({first, other_permuter}, header,
+        merged));
+  unlink(first.c_str());
+  unlink(second.c_str());
+  unlink(other.c_str());
+  unlink(other_permuter.c_str());
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -3,8 +3,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
@@ -190,12 +192,16 @@ class TestCmFsOps : public RecordCmFsOps {
  public:
   TestCmFsOps(FsFns *functions) : RecordCmFsOps(functions) { }
 
+  // The recorder keeps mods in per-thread buffers and fds in a sharded map, so
+  // these return snapshots taken at the time of the call.
   vector<DiskMod> * GetMods() {
+    mods_ = CollectMods();
     return &mods_;
   }
 
   unordered_map<int, string> * GetFdMap() {
-    return &fd_map_;
+    fds_ = fd_map_.Snapshot();
+    return &fds_;
   }
 
   unordered_map<long long,
@@ -208,7 +214,7 @@ class TestCmFsOps : public RecordCmFsOps {
    * stat operations.
    */
   void AddFdMapping(const int fd, const string &pathname) {
-    fd_map_.insert({fd, pathname});
+    fd_map_.Insert(fd, pathname);
   }
 
   /*
@@ -221,6 +227,27 @@ class TestCmFsOps : public RecordCmFsOps {
         tuple<string, unsigned long long, unsigned long long>(pathname, offset,
             length)});
   }
+
+ private:
+  vector<DiskMod> mods_;
+  unordered_map<int, string> fds_;
+};
+
+/*
+ * Hands out a new fd for every open so that threads opening files at the same
+ * time don't share fds.
+ */
+class ConcurrentFakeFsFns : public FakeFsFns {
+ public:
+  ConcurrentFakeFsFns() : next_fd_(3) { }
+
+  virtual int FnOpen2(const std::string &pathname, int flags,
+      mode_t mode) override {
+    return next_fd_.fetch_add(1);
+  }
+
+ private:
+  std::atomic<int> next_fd_;
 };
 
 // For parameterized tests.
@@ -900,6 +927,57 @@ TEST_P(TestCmFsOpsMmapAdd, ShouldStore) {
   EXPECT_EQ(std::get<2>(mmap_value), length);
 }
 
+/*
+ * Test that recording from several threads at once
+ *    - records every operation from every thread
+ *    - keeps the operations of each thread in the order they were made
+ *    - leaves no fds mapped once every thread has closed its file.
+ */
+TEST(CmFsOps, ConcurrentRecord) {
+  const unsigned int num_threads = 8;
+  const unsigned int writes_per_thread = 200;
+
+  ConcurrentFakeFsFns fake;
+  TestCmFsOps ops(&fake);
+
+  vector<std::thread> threads;
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&ops, i, writes_per_thread]() {
+      const string pathname = "/mnt/snapshot/file" + std::to_string(i);
+      const int fd = ops.CmOpen(pathname, O_CREAT | O_RDWR, 0777);
+      for (unsigned int j = 0; j < writes_per_thread; ++j) {
+        ops.CmPwrite(fd, kTestData, kTestDataSize, j * kTestDataSize);
+      }
+      ops.CmFsync(fd);
+      ops.CmClose(fd);
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  vector<DiskMod> *mods = ops.GetMods();
+  // Create, writes, and fsync for each thread.
+  EXPECT_EQ(mods->size(), num_threads * (writes_per_thread + 2));
+
+  // Number of mods seen so far for each thread's file.
+  unordered_map<string, unsigned int> seen;
+  for (const DiskMod &mod : *mods) {
+    const unsigned int num = seen[mod.path]++;
+    if (num == 0) {
+      EXPECT_EQ(mod.mod_type, DiskMod::kCreateMod);
+    } else if (num <= writes_per_thread) {
+      EXPECT_EQ(mod.mod_type, DiskMod::kDataMod);
+      EXPECT_EQ(mod.file_mod_location, (num - 1) * kTestDataSize);
+    } else {
+      EXPECT_EQ(mod.mod_type, DiskMod::kFsyncMod);
+    }
+  }
+  EXPECT_EQ(seen.size(), num_threads);
+
+  EXPECT_TRUE(ops.GetFdMap()->empty());
+}
+
 INSTANTIATE_TEST_CASE_P(WriteSizes, TestCmFsOpsParameterized,
     ::testing::Values(
       kTestDataSize,
@@ -0,0 +1,189 @@
+/*
+ * Measures how much RecordCmFsOps adds to each file system operation when
+ * several threads record at once. File system calls go to a set of functions
+ * that do nothing, so the times are all recorder overhead. Run as
+ *
+ *   RecordCmFsOpsBench [writes per thread]
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../code/user_tools/api/wrapper.h"
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using fs_testing::user_tools::api::CmFsOps;
+using fs_testing::user_tools::api::FsFns;
+using fs_testing::user_tools::api::PassthroughCmFsOps;
+using fs_testing::user_tools::api::RecordCmFsOps;
+
+namespace {
+
+static const unsigned int kDefaultWrites = 10000;
+static const unsigned int kThreadCounts[] = {1, 8, 32};
+// Every write is copied into the recorded mod, so keep these small.
+static const unsigned int kWriteSize = 512;
+
+class NullFsFns : public FsFns {
+ public:
+  NullFsFns() : next_fd_(3) { }
+
+  virtual int FnMknod(const string &pathname, mode_t mode,
+      dev_t dev) override {
+    return 0;
+  }
+  virtual int FnMkdir(const string &pathname, mode_t mode) override {
+    return 0;
+  }
+  virtual int FnOpen(const string &pathname, int flags) override {
+    return next_fd_.fetch_add(1);
+  }
+  virtual int FnOpen2(const string &pathname, int flags,
+      mode_t mode) override {
+    return next_fd_.fetch_add(1);
+  }
+  virtual off_t FnLseek(int fd, off_t offset, int whence) override {
+    return 0;
+  }
+  virtual ssize_t FnWrite(int fd, const void *buf, size_t count) override {
+    return count;
+  }
+  virtual ssize_t FnPwrite(int fd, const void *buf, size_t count,
+      off_t offset) override {
+    return count;
+  }
+  virtual void * FnMmap(void *addr, size_t length, int prot, int flags, int fd,
+      off_t offset) override {
+    return (void*) -1;
+  }
+  virtual int FnMsync(void *addr, size_t length, int flags) override {
+    return 0;
+  }
+  virtual int FnMunmap(void *addr, size_t length) override {
+    return 0;
+  }
+  virtual int FnFallocate(int fd, int mode, off_t offset, off_t len) override {
+    return 0;
+  }
+  virtual int FnClose(int fd) override {
+    return 0;
+  }
+  virtual int FnRename(const string &old_path,
+      const string &new_path) override {
+    return 0;
+  }
+  virtual int FnUnlink(const string &pathname) override {
+    return 0;
+  }
+  virtual int FnRemove(const string &pathname) override {
+    return 0;
+  }
+  virtual int FnStat(const string &pathname, struct stat *buf) override {
+    memset(buf, 0, sizeof(struct stat));
+    buf->st_mode = S_IFREG;
+    return 0;
+  }
+  virtual bool FnPathExists(const string &pathname) override {
+    return false;
+  }
+  virtual int FnFsync(const int fd) override {
+    return 0;
+  }
+  virtual int FnFdatasync(const int fd) override {
+    return 0;
+  }
+  virtual void FnSync() override {
+  }
+  virtual int FnSyncFileRange(const int fd, size_t offset, size_t nbytes,
+      unsigned int flags) override {
+    return 0;
+  }
+  virtual int CmCheckpoint() override {
+    return 0;
+  }
+
+ private:
+  std::atomic<int> next_fd_;
+};
+
+// Each thread opens its own file, writes to it, and fsyncs after every 16
+// writes. Returns the wall clock time per operation over all threads, which
+// only drops as threads are added if they don't contend with each other.
+double RunThreads(CmFsOps &ops, const unsigned int num_threads,
+    const unsigned int writes) {
+  vector<std::thread> threads;
+  const steady_clock::time_point start = steady_clock::now();
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    threads.emplace_back([&ops, i, writes]() {
+      char buf[kWriteSize];
+      memset(buf, 'a' + (i % 26), kWriteSize);
+      const string path = "/mnt/snapshot/file" + std::to_string(i);
+      const int fd = ops.CmOpen(path, O_CREAT | O_RDWR, 0777);
+      for (unsigned int j = 0; j < writes; ++j) {
+        ops.CmPwrite(fd, buf, kWriteSize, (off_t) j * kWriteSize);
+        if (j % 16 == 15) {
+          ops.CmFsync(fd);
+        }
+      }
+      ops.CmClose(fd);
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+  const nanoseconds elapsed =
+    duration_cast<nanoseconds>(steady_clock::now() - start);
+
+  // open, close, writes, and the fsyncs.
+  const unsigned long long ops_per_thread = 2 + writes + writes / 16;
+  return (double) elapsed.count() / (ops_per_thread * num_threads);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const unsigned int writes = (argc > 1) ? atoi(argv[1]) : kDefaultWrites;
+
+  // Warm up the allocator so the first row doesn't pay for faulting in the
+  // heap.
+  {
+    NullFsFns fns;
+    RecordCmFsOps record(&fns);
+    RunThreads(record, 1, writes);
+  }
+
+  cout << "threads  passthrough ns/op  record ns/op  overhead ns/op" << endl;
+  for (const unsigned int num_threads : kThreadCounts) {
+    NullFsFns fns;
+    PassthroughCmFsOps passthrough(&fns);
+    const double base = RunThreads(passthrough, num_threads, writes);
+
+    RecordCmFsOps *record = new RecordCmFsOps(&fns);
+    const double recorded = RunThreads(*record, num_threads, writes);
+
+    cout << std::setw(7) << num_threads
+      << std::fixed << std::setprecision(1)
+      << std::setw(19) << base
+      << std::setw(14) << recorded
+      << std::setw(16) << recorded - base << endl;
+    delete record;
+  }
+  return 0;
+}
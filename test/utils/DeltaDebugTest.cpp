@@ -0,0 +1,83 @@
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include "../../code/utils/DeltaDebug.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::vector;
+
+using fs_testing::utils::DeltaDebug;
+
+static bool Contains(const vector<unsigned int> &items, unsigned int val) {
+  return std::find(items.begin(), items.end(), val) != items.end();
+}
+
+/*
+ * The failure needs two specific items out of many, so that's all that should
+ * be left.
+ */
+TEST(DeltaDebug, FindsPair) {
+  vector<unsigned int> items(100);
+  std::iota(items.begin(), items.end(), 0);
+
+  unsigned int num_checks = 0;
+  vector<unsigned int> res = DeltaDebug(items,
+      [](const vector<unsigned int> &subset) {
+        return Contains(subset, 17) && Contains(subset, 83);
+      }, 1000, &num_checks);
+
+  EXPECT_EQ(res, vector<unsigned int>({17, 83}));
+  EXPECT_GT(num_checks, 0);
+  EXPECT_LE(num_checks, 1000);
+}
+
+/*
+ * If the failure happens with nothing at all, the result is empty.
+ */
+TEST(DeltaDebug, AlwaysFails) {
+  vector<unsigned int> items = {4, 5, 6};
+  unsigned int num_checks = 0;
+  vector<unsigned int> res = DeltaDebug(items,
+      [](const vector<unsigned int> &) {
+        return true;
+      }, 1000, &num_checks);
+
+  EXPECT_TRUE(res.empty());
+  EXPECT_EQ(num_checks, 1);
+}
+
+/*
+ * Every item is required, so nothing can be removed.
+ */
+TEST(DeltaDebug, AllRequired) {
+  vector<unsigned int> items = {1, 2, 3, 4, 5, 6, 7};
+  vector<unsigned int> res = DeltaDebug(items,
+      [&items](const vector<unsigned int> &subset) {
+        return subset.size() == items.size();
+      }, 1000);
+
+  EXPECT_EQ(res, items);
+}
+
+/*
+ * Running out of checks still gives back something that fails.
+ */
+TEST(DeltaDebug, CheckBudget) {
+  vector<unsigned int> items(64);
+  std::iota(items.begin(), items.end(), 0);
+  auto fails = [](const vector<unsigned int> &subset) {
+    return Contains(subset, 3) && Contains(subset, 40) && Contains(subset, 41);
+  };
+
+  unsigned int num_checks = 0;
+  vector<unsigned int> res = DeltaDebug(items, fails, 5, &num_checks);
+  EXPECT_LE(num_checks, 5);
+  EXPECT_TRUE(fails(res));
+  EXPECT_TRUE(std::is_sorted(res.begin(), res.end()));
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -0,0 +1,100 @@
+#include <chrono>
+#include <sstream>
+#include <string>
+
+#include "../../code/utils/LatencyHistogram.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::string;
+
+using fs_testing::utils::LatencyHistogram;
+
+/*
+ * Percentiles come out within one bucket (1/16) of the real value, even with
+ * samples spread over several orders of magnitude.
+ */
+TEST(LatencyHistogram, Percentiles) {
+  LatencyHistogram h;
+  for (unsigned int i = 1; i <= 1000; ++i) {
+    h.Record(microseconds(i));
+  }
+  EXPECT_EQ(h.Count(), 1000);
+  EXPECT_EQ(h.Min(), microseconds(1));
+  EXPECT_EQ(h.Max(), microseconds(1000));
+  EXPECT_EQ(h.Total(), microseconds(500500));
+
+  const double expected[] = {50, 90, 99};
+  for (const double p : expected) {
+    const double real = p * 10 * 1000;
+    const double got = h.Percentile(p).count();
+    EXPECT_GE(got, real);
+    EXPECT_LE(got, real * 17 / 16);
+  }
+  EXPECT_EQ(h.Percentile(100), microseconds(1000));
+}
+
+/*
+ * A few slow samples show up at the tail instead of vanishing in the average.
+ */
+TEST(LatencyHistogram, Outliers) {
+  LatencyHistogram h;
+  for (unsigned int i = 0; i < 995; ++i) {
+    h.Record(nanoseconds(700));
+  }
+  for (unsigned int i = 0; i < 5; ++i) {
+    h.Record(milliseconds(40));
+  }
+  EXPECT_LE(h.Percentile(50).count(), 800);
+  EXPECT_LE(h.Percentile(99).count(), 800);
+  EXPECT_GE(h.Percentile(99.9), milliseconds(40));
+  EXPECT_EQ(h.Max(), milliseconds(40));
+}
+
+TEST(LatencyHistogram, MergeAndReset) {
+  LatencyHistogram a;
+  LatencyHistogram b;
+  a.Record(nanoseconds(3));
+  b.Record(nanoseconds(5000));
+  b.Record(nanoseconds(0));
+  a.Merge(b);
+  EXPECT_EQ(a.Count(), 3);
+  EXPECT_EQ(a.Min(), nanoseconds(0));
+  EXPECT_EQ(a.Max(), nanoseconds(5000));
+
+  a.Reset();
+  EXPECT_EQ(a.Count(), 0);
+  EXPECT_EQ(a.Min(), nanoseconds(0));
+  EXPECT_EQ(a.Percentile(50), nanoseconds(0));
+}
+
+/*
+ * The dump has a summary line and one line per non-empty bucket, and each
+ * sample's bucket contains it.
+ */
+TEST(LatencyHistogram, Write) {
+  LatencyHistogram h;
+  h.Record(nanoseconds(7));
+  h.Record(nanoseconds(1000));
+  h.Record(nanoseconds(1001));
+  std::ostringstream os;
+  h.Write(os, "fsck_time");
+  EXPECT_EQ(os.str(),
+      "fsck_time count 3 total_ns 2008 min_ns 7 max_ns 1001\n"
+      "fsck_time 7 7 1\n"
+      "fsck_time 992 1023 2\n");
+}
+
+TEST(LatencyHistogram, Format) {
+  EXPECT_EQ(LatencyHistogram::Format(nanoseconds(512)), "512 ns");
+  EXPECT_EQ(LatencyHistogram::Format(nanoseconds(1500)), "1.5 us");
+  EXPECT_EQ(LatencyHistogram::Format(milliseconds(42)), "42.0 ms");
+  EXPECT_EQ(LatencyHistogram::Format(milliseconds(2500)), "2.5 s");
+}
+
+}  // namespace test
+}  // namespace fs_testing
@@ -0,0 +1,65 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../../code/utils/MemoryUsage.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+using fs_testing::utils::MemoryReport;
+using fs_testing::utils::MemoryUsage;
+
+TEST(MemoryUsage, AddVector) {
+  vector<unsigned int> v(10);
+  v.reserve(20);
+  MemoryUsage usage;
+  usage.payload = 5;
+  usage.AddVector(v);
+  EXPECT_EQ(usage.payload, 5);
+  EXPECT_EQ(usage.overhead, sizeof(v) + v.capacity() * sizeof(unsigned int));
+
+  MemoryUsage sum;
+  sum += usage;
+  sum += usage;
+  EXPECT_EQ(sum.Total(), 2 * usage.Total());
+}
+
+/*
+ * Each structure is listed with its share of the total, and each sampled phase
+ * with the resident set size at the time.
+ */
+TEST(MemoryReport, Print) {
+  MemoryReport report;
+  MemoryUsage big;
+  big.payload = 3 * 1024 * 1024;
+  big.overhead = 1024 * 1024;
+  MemoryUsage small;
+  small.payload = 1024 * 1024;
+  report.Add("big", big);
+  report.Add("small", small);
+  report.SamplePhase("phase 0");
+
+  ostringstream out;
+  report.Print(out);
+  const string res = out.str();
+  EXPECT_NE(res.find("Memory held: 5.0 MB"), string::npos);
+  EXPECT_NE(res.find("4.0 MB (3.0 MB data, 1.0 MB overhead), 80%"),
+      string::npos);
+  EXPECT_NE(res.find("1.0 MB (1.0 MB data, 0 B overhead), 20%"),
+      string::npos);
+  EXPECT_NE(res.find("phase 0:"), string::npos);
+
+  const unsigned long long rss = MemoryReport::CurrentRss();
+  EXPECT_GT(rss, 0);
+  EXPECT_GE(MemoryReport::PeakRss(), rss);
+  EXPECT_EQ(MemoryReport::Format(512), "512 B");
+  EXPECT_EQ(MemoryReport::Format(1536), "1.5 KB");
+}
+
+}  // namespace test
+}  // namespace fs_testing
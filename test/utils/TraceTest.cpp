@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "../../code/utils/Trace.h"
+#include "gtest/gtest.h"
+
+namespace fs_testing {
+namespace test {
+using std::ifstream;
+using std::string;
+using std::vector;
+
+using fs_testing::utils::Tracer;
+using fs_testing::utils::TraceSpan;
+
+namespace {
+
+vector<string> ReadLines(const string &path) {
+  ifstream in(path);
+  vector<string> lines;
+  for (string line; std::getline(in, line);) {
+    lines.push_back(line);
+  }
+  return lines;
+}
+
+string TempPath() {
+  char path[] = "/tmp/TraceTestXXXXXX";
+  const int fd = mkstemp(path);
+  close(fd);
+  return path;
+}
+
+}  // namespace
+
+/*
+ * Each span is one complete event on its own line, after the opening bracket
+ * and the event naming the process.
+ */
+TEST(Trace, WritesSpans) {
+  const string path = TempPath();
+  ASSERT_TRUE(Tracer::Open(path));
+  Tracer::SetWorker(2, "ext4");
+  {
+    TraceSpan outer("phase", "test");
+    TraceSpan inner("mount", "crash state", 7);
+    inner.End();
+    // Ending twice only adds the span once.
+    inner.End();
+  }
+  Tracer::Close();
+
+  const vector<string> lines = ReadLines(path);
+  unlink(path.c_str());
+  ASSERT_EQ(lines.size(), 5);
+  EXPECT_EQ(lines.at(0), "[");
+  EXPECT_NE(lines.at(2).find("\"name\":\"ext4\""), string::npos);
+  EXPECT_NE(lines.at(3).find("\"name\":\"mount\""), string::npos);
+  EXPECT_NE(lines.at(3).find("\"ph\":\"X\""), string::npos);
+  EXPECT_NE(lines.at(3).find("\"tid\":2"), string::npos);
+  EXPECT_NE(lines.at(3).find("\"state\":7"), string::npos);
+  EXPECT_NE(lines.at(4).find("\"name\":\"phase\""), string::npos);
+  EXPECT_EQ(lines.at(4).find("\"state\""), string::npos);
+  for (unsigned int i = 1; i < lines.size(); ++i) {
+    EXPECT_EQ(lines.at(i).back(), ',');
+  }
+}
+
+/*
+ * Opening a trace left by an earlier run starts it over instead of adding a
+ * second run's events after the first's, and nothing is written while tracing
+ * is off.
+ */
+TEST(Trace, RestartsAndStops) {
+  const string path = TempPath();
+  ASSERT_TRUE(Tracer::Open(path));
+  {
+    TraceSpan span("old run", "test");
+  }
+  Tracer::Close();
+  EXPECT_FALSE(Tracer::Enabled());
+  {
+    TraceSpan span("ignored", "test");
+  }
+  ASSERT_TRUE(Tracer::Open(path));
+  Tracer::Close();
+
+  const vector<string> lines = ReadLines(path);
+  unlink(path.c_str());
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines.at(0), "[");
+  EXPECT_NE(lines.at(1).find("process_name"), string::npos);
+}
+
+}  // namespace test
+}  // namespace fs_testing